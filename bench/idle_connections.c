@@ -0,0 +1,132 @@
+//
+// Idle connection footprint benchmark.
+//
+// Opens n idle connections to a running server, and reports the servers
+// resident set size before and after. Build and run with
+//
+//     gcc -O2 -o idle_connections bench/idle_connections.c
+//     ./idle_connections <ip> <port> <server pid> [n_connections]
+//
+// Both processes need RLIMIT_NOFILE above n_connections, loopback runs past
+// ~28k connections also need a wider net.ipv4.ip_local_port_range.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_N_CONNECTIONS 100000
+#define SETTLE_MS 500 // time for the server to accept every connection
+
+/** @brief Reads resident set size of a process.
+ *
+ *  @param pid : Process id.
+ *  @return VmRSS in KiB, -1 on error.
+ */
+static long read_rss_kib(pid_t pid);
+
+/** @brief Sleeps for a number of milliseconds.
+ *
+ *  @param ms : Milliseconds.
+ */
+static void sleep_ms(long ms);
+
+static long read_rss_kib(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmRSS:", 6)) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+    return;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <ip> <port> <server pid> [n_connections]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid ip %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    pid_t server_pid = atoi(argv[3]);
+    size_t n_connections = argc > 4 ? strtoul(argv[4], NULL, 10) :
+            DEFAULT_N_CONNECTIONS;
+
+    // leave room for stdio
+    struct rlimit fd_limit;
+    getrlimit(RLIMIT_NOFILE, &fd_limit);
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+    if (fd_limit.rlim_cur < n_connections + 16) {
+        fprintf(stderr, "fd limit %lu too low, using %lu connections\n",
+                (unsigned long) fd_limit.rlim_cur,
+                (unsigned long) fd_limit.rlim_cur - 16);
+        n_connections = fd_limit.rlim_cur - 16;
+    }
+
+    long rss_before = read_rss_kib(server_pid);
+    if (rss_before < 0) {
+        fprintf(stderr, "unable to read rss of %d\n", (int) server_pid);
+        return EXIT_FAILURE;
+    }
+
+    int *fds = malloc(sizeof(int) * n_connections);
+    size_t n_open = 0;
+    for (; n_open < n_connections; ++n_open) {
+        fds[n_open] = socket(AF_INET, SOCK_STREAM, 0);
+        if (fds[n_open] < 0 || connect(fds[n_open], (struct sockaddr *) &addr,
+                sizeof(addr)) < 0) {
+            fprintf(stderr, "connection %zu failed: %s\n", n_open,
+                    strerror(errno));
+            if (fds[n_open] >= 0) {
+                close(fds[n_open]);
+            }
+            break;
+        }
+    }
+    sleep_ms(SETTLE_MS);
+
+    long rss_after = read_rss_kib(server_pid);
+    long delta = rss_after - rss_before;
+    printf("{\"connections\": %zu, \"rss_before_kib\": %ld, "
+           "\"rss_after_kib\": %ld, \"bytes_per_connection\": %.1f}\n",
+            n_open, rss_before, rss_after,
+            n_open ? (double) delta * 1024 / n_open : 0.0);
+
+    for (size_t i = 0; i < n_open; ++i) {
+        close(fds[i]);
+    }
+    free(fds);
+    return EXIT_SUCCESS;
+}
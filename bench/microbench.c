@@ -0,0 +1,623 @@
+//
+// Microbenchmarks of the codec, bit vector and request framing. Each target
+// runs over generated text, binary and directory listing corpora at payload
+// sizes from 16 B up to 64 MiB, and results are printed as JSON, one result
+// per line in a fixed order, so runs of two builds can be diffed. Build and
+// run from the repository root, where compression.dict is read from, with
+//
+//     gcc -O2 -pthread -o microbench bench/microbench.c $(find . -name '*.c'
+//             -not -path './bench/*' -not -path './tools/*' -not -name main.c)
+//             -lm
+//     ./microbench [-t targets] [-c corpora] [-m max_bytes] [-T min_ms]
+//             [-r repeats] [-o out.json]
+//
+// Targets and corpora are comma separated filters. Each result is the median
+// of the repeats, each running the target for at least min_ms. Corpora are
+// generated from a fixed seed, so inputs are identical across runs.
+//
+// Allocations per call are counted three ways. heap counts malloc, calloc
+// and realloc calls (glibc only, -1 elsewhere), buffer counts buffers handed
+// out by the buffer pool and slab counts slab blocks, the pool and slab are
+// bound to the benchmark thread as they are to a handler.
+//
+// Bytes per call are the payload bytes, uncompressed for both compress and
+// decompress. request_read includes writing the frame into the socket pair
+// it is read from. write_metadata writes the 9 metadata bytes, and the
+// dictionary targets read or build from the 256 entry dictionary.
+//
+
+#include "../handler/request.h"
+#include "../handler/responce.h"
+#include "../data_structures/bit_vector/bit_vector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+#define DEFAULT_MIN_MS 200
+#define DEFAULT_REPEATS 5
+#define MAX_REPEATS 31
+#define MIN_BYTES 16
+#define SIZE_STEP 4 // payload sizes are 16 B, 64 B, 256 B, ... 64 MiB
+#define CORPUS_SEED 0x6a78736572766572ULL
+#define SOCKET_BUFFER_BYTES (4 * 1024 * 1024)
+#define SCHEMA_VERSION 1
+
+enum Corpus {
+    TextCorpus,
+    BinaryCorpus,
+    ListingCorpus,
+    N_CORPORA
+};
+
+enum Target {
+    CompressTarget,
+    DecompressTarget,
+    BitVectorPushTarget,
+    RequestReadTarget,
+    WriteMetadataTarget,
+    InitDecompressionTreeTarget,
+    ParseCompressionDictionaryTarget,
+    N_TARGETS
+};
+
+static const char *corpus_names[N_CORPORA] = {
+        "text", "binary", "listing"
+};
+
+static const char *target_names[N_TARGETS] = {
+        "compress", "decompress", "bit_vector_push", "request_read",
+        "write_metadata", "init_decompression_tree",
+        "parse_compression_dictionary"
+};
+
+// targets with a corpus, the rest have a fixed input
+static const bool target_sized[N_TARGETS] = {
+        true, true, true, true, false, false, false
+};
+
+static const char *words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "server", "request", "file", "session", "payload", "compression",
+        "handler", "thread", "buffer", "directory", "connection", "byte",
+        "length", "offset", "response", "client", "protocol", "header"
+};
+
+static const char *name_parts[] = {
+        "report", "img", "data", "notes", "backup", "log", "draft", "final",
+        "photo", "archive", "index", "summary"
+};
+
+static const char *name_extensions[] = {
+        ".txt", ".png", ".jpg", ".bin", ".tar.gz", ".csv", ".md", ""
+};
+
+typedef struct {
+    CompressionSegment *dict;
+    DecompressionTreeNode *tree;
+    BufferPool *buffer_pool;
+    SlabAllocator *slab;
+    int sockets[2]; // request_read reads from 0 what is written to 1
+    uint8_t *input; // corpus prefix of the current size
+    uint8_t *compressed; // input compressed, for decompress
+    uint64_t compressed_n;
+    uint8_t *frame; // request frame of the input, for request_read
+    size_t size;
+} Bench;
+
+typedef struct {
+    uint64_t iterations; // calls per repeat
+    double ns_per_call; // median of the repeats
+    double heap_allocs;
+    double buffer_allocs;
+    double slab_allocs;
+} Result;
+
+#ifdef __GLIBC__
+// calls into the allocator itself, so every caller is counted
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static uint64_t n_heap_allocs = 0;
+
+void *malloc(size_t size) {
+    ++n_heap_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    ++n_heap_allocs;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *p, size_t size) {
+    ++n_heap_allocs;
+    return __libc_realloc(p, size);
+}
+
+#define HEAP_ALLOCS_COUNTED 1
+#else
+static uint64_t n_heap_allocs = 0;
+#endif
+
+/** @brief Prints usage and exits with EXIT_FAILURE.
+ *
+ *  @param name : Program name.
+ */
+static void usage(const char *name);
+
+/** @brief Parses a comma separated filter of names.
+ *
+ *  @param list : Names, modified.
+ *  @param names : Known names.
+ *  @param n_names : Number of known names.
+ *  @param selected : Set for each name in the list.
+ *  @return 0 on success, -1 if a name is unknown.
+ */
+static int parse_filter(char *list, const char **names, size_t n_names,
+        bool *selected);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+/** @brief Returns the next number of a xorshift64* generator.
+ *
+ *  @param state : Generator state.
+ *  @return random number.
+ */
+static uint64_t next_random(uint64_t *state);
+
+/** @brief Fills a buffer with a corpus.
+ *
+ *  Text is words, punctuation and line breaks. Binary is uniformly random
+ *  bytes. Listing is null terminated file names, as ListDir responces are.
+ *
+ *  @param corpus : Corpus to generate.
+ *  @param dest : Buffer to fill.
+ *  @param n : Bytes to fill.
+ */
+static void generate_corpus(enum Corpus corpus, uint8_t *dest, size_t n);
+
+/** @brief Prepares inputs of sized targets for a corpus prefix.
+ *
+ *  @param b : Bench instance.
+ *  @param size : Bytes of the corpus used.
+ */
+static void prepare_inputs(Bench *b, size_t size);
+
+/** @brief Runs a target once.
+ *
+ *  @param b : Bench instance.
+ *  @param target : Target to run.
+ */
+static void run_once(Bench *b, enum Target target);
+
+/** @brief Times a target.
+ *
+ *  Calls per repeat are calibrated to last at least min_ms while warming
+ *  up. Allocations are averaged over every timed call.
+ *
+ *  @param b : Bench instance.
+ *  @param target : Target to time.
+ *  @param min_ms : Minimum duration of a repeat.
+ *  @param repeats : Number of repeats.
+ *  @param result : Set to the result.
+ */
+static void measure(Bench *b, enum Target target, uint64_t min_ms,
+        size_t repeats, Result *result);
+
+/** @brief Returns buffers and slab blocks allocated by the calling thread.
+ *
+ *  @param b : Bench instance.
+ *  @param slab_allocs : Set to slab blocks allocated.
+ *  @return buffers allocated.
+ */
+static uint64_t pool_allocs(Bench *b, uint64_t *slab_allocs);
+
+/** @brief Prints a result as one line of JSON.
+ *
+ *  @param out : Stream.
+ *  @param first : Whether this is the first result.
+ *  @param target : Target timed.
+ *  @param corpus : Corpus name.
+ *  @param bytes : Bytes per call.
+ *  @param r : Result.
+ */
+static void print_result(FILE *out, bool first, enum Target target,
+        const char *corpus, uint64_t bytes, Result *r);
+
+/** @brief Compares doubles, for qsort.
+ *
+ *  @param a : First double.
+ *  @param b : Second double.
+ *  @return order.
+ */
+static int compare_doubles(const void *a, const void *b);
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t targets] [-c corpora] [-m max_bytes] "
+            "[-T min_ms] [-r repeats] [-o out.json]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_filter(char *list, const char **names, size_t n_names,
+        bool *selected) {
+    memset(selected, 0, n_names * sizeof(bool));
+    char *save = NULL;
+    for (char *name = strtok_r(list, ",", &save); name;
+            name = strtok_r(NULL, ",", &save)) {
+        size_t i = 0;
+        while (i < n_names && strcmp(name, names[i])) {
+            ++i;
+        }
+        if (i == n_names) {
+            fprintf(stderr, "unknown name %s\n", name);
+            return -1;
+        }
+        selected[i] = true;
+    }
+    return 0;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void generate_corpus(enum Corpus corpus, uint8_t *dest, size_t n) {
+    uint64_t state = CORPUS_SEED + corpus;
+    size_t i = 0;
+    if (corpus == BinaryCorpus) {
+        while (i < n) {
+            uint64_t r = next_random(&state);
+            for (size_t j = 0; j < 8 && i < n; ++j, ++i) {
+                dest[i] = r >> (8 * j);
+            }
+        }
+        return;
+    }
+
+    char item[64];
+    while (i < n) {
+        uint64_t r = next_random(&state);
+        int len = 0;
+        if (corpus == TextCorpus) {
+            const char *word = words[r % (sizeof(words) / sizeof(char *))];
+            const char *sep = (r >> 32) % 12 == 0 ? ".\n" :
+                    (r >> 32) % 7 == 0 ? ", " : " ";
+            len = snprintf(item, sizeof(item), "%s%s", word, sep);
+        } else {
+            // names end in a null byte, which is copied with them
+            len = snprintf(item, sizeof(item), "%s_%04lu%s",
+                    name_parts[r % (sizeof(name_parts) / sizeof(char *))],
+                    (unsigned long) ((r >> 16) % 10000),
+                    name_extensions[(r >> 40) %
+                            (sizeof(name_extensions) / sizeof(char *))]) + 1;
+        }
+        size_t take = (size_t) len < n - i ? (size_t) len : n - i;
+        memcpy(dest + i, item, take);
+        i += take;
+    }
+    return;
+}
+
+static void prepare_inputs(Bench *b, size_t size) {
+    b->size = size;
+    buffer_release(b->compressed);
+    jx_compress(b->dict, b->input, size, &b->compressed, &b->compressed_n, 0);
+
+    free(b->frame);
+    b->frame = safe_malloc(REQUEST_METADATA_SIZE + size);
+    b->frame[0] = EchoReq << 4;
+    for (size_t i = 0; i < PAYLOAD_LEN_SIZE; ++i) {
+        b->frame[1 + i] = (uint64_t) size >> ((PAYLOAD_LEN_SIZE - 1 - i) * 8);
+    }
+    memcpy(b->frame + REQUEST_METADATA_SIZE, b->input, size);
+    return;
+}
+
+static void run_once(Bench *b, enum Target target) {
+    uint8_t *out = NULL;
+    uint64_t out_n = 0;
+    switch (target) {
+        case CompressTarget:
+            jx_compress(b->dict, b->input, b->size, &out, &out_n, 0);
+            buffer_release(out);
+            break;
+        case DecompressTarget:
+            jx_decompress(b->tree, b->compressed, b->compressed_n, &out,
+                    &out_n);
+            buffer_release(out);
+            break;
+        case BitVectorPushTarget: {
+            BitVector *bv = init_bit_vector(b->size);
+            for (size_t i = 0; i < b->size; ++i) {
+                for (int bit = 7; bit >= 0; --bit) {
+                    bit_vector_push(bv, (b->input[i] >> bit) & 0x1);
+                }
+            }
+            destroy_bit_vector(bv);
+            break;
+        }
+        case RequestReadTarget: {
+            RequestData rd;
+            init_request_data(&rd);
+            size_t frame_len = REQUEST_METADATA_SIZE + b->size;
+            size_t n_written = 0;
+            int ret = 0;
+            // writes as much as the socket takes, then reads it back
+            while (ret == 0) {
+                if (n_written < frame_len) {
+                    ssize_t n = write(b->sockets[1], b->frame + n_written,
+                            frame_len - n_written);
+                    n_written += n > 0 ? n : 0;
+                }
+                ret = request_read(&rd, b->sockets[0]);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "request_read failed\n");
+                exit(EXIT_FAILURE);
+            }
+            destroy_reading_data(&rd);
+            break;
+        }
+        case WriteMetadataTarget: {
+            uint8_t metadata[REQUEST_METADATA_SIZE];
+            write_metadata(metadata, EchoRsp, false, b->size);
+            // keeps the stores from being optimised out
+            __asm__ volatile("" : : "r" (metadata) : "memory");
+            break;
+        }
+        case InitDecompressionTreeTarget:
+            destroy_decompression_tree(init_decompression_tree(b->dict));
+            break;
+        case ParseCompressionDictionaryTarget:
+            destroy_compression_dict(parse_compression_dictionary());
+            break;
+        default:
+            break;
+    }
+    return;
+}
+
+static void measure(Bench *b, enum Target target, uint64_t min_ms,
+        size_t repeats, Result *result) {
+    // warm up caches, pools and slabs, doubling the calls until a tenth of
+    // a repeat has passed
+    uint64_t min_ns = min_ms * 1000000;
+    uint64_t n_calls = 1;
+    uint64_t elapsed = 0;
+    uint64_t start = 0;
+    while (1) {
+        start = monotonic_ns();
+        for (uint64_t i = 0; i < n_calls; ++i) {
+            run_once(b, target);
+        }
+        elapsed = monotonic_ns() - start;
+        if (elapsed >= min_ns / 10) {
+            break;
+        }
+        n_calls *= 2;
+    }
+    result->iterations = elapsed < min_ns ?
+            (uint64_t) ((double) min_ns * n_calls / elapsed) + 1 : n_calls;
+
+    double ns_per_call[MAX_REPEATS];
+    uint64_t slab_start = 0;
+    uint64_t buffer_start = pool_allocs(b, &slab_start);
+    uint64_t heap_start = n_heap_allocs;
+    for (size_t r = 0; r < repeats; ++r) {
+        start = monotonic_ns();
+        for (uint64_t i = 0; i < result->iterations; ++i) {
+            run_once(b, target);
+        }
+        ns_per_call[r] = (double) (monotonic_ns() - start) /
+                result->iterations;
+    }
+    uint64_t slab_end = 0;
+    uint64_t buffer_end = pool_allocs(b, &slab_end);
+    double n_timed = (double) result->iterations * repeats;
+
+    qsort(ns_per_call, repeats, sizeof(double), compare_doubles);
+    result->ns_per_call = ns_per_call[repeats / 2];
+#ifdef HEAP_ALLOCS_COUNTED
+    result->heap_allocs = (n_heap_allocs - heap_start) / n_timed;
+#else
+    (void) heap_start;
+    result->heap_allocs = -1;
+#endif
+    result->buffer_allocs = (buffer_end - buffer_start) / n_timed;
+    result->slab_allocs = (slab_end - slab_start) / n_timed;
+    return;
+}
+
+static uint64_t pool_allocs(Bench *b, uint64_t *slab_allocs) {
+    // the stats are allocated, so are kept out of the heap count
+    uint64_t heap = n_heap_allocs;
+    BufferPoolStats *stats = safe_malloc(sizeof(BufferPoolStats));
+    buffer_pool_stats(b->buffer_pool, stats);
+    uint64_t n = 0;
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        n += stats->classes[i].n_allocs;
+    }
+    free(stats);
+    n_heap_allocs = heap;
+    *slab_allocs = b->slab->n_allocs;
+    return n;
+}
+
+static void print_result(FILE *out, bool first, enum Target target,
+        const char *corpus, uint64_t bytes, Result *r) {
+    double seconds = r->ns_per_call / 1e9;
+    fprintf(out, "%s    {\"target\": \"%s\", \"corpus\": \"%s\", "
+            "\"bytes\": %lu, \"iterations\": %lu, \"ns_per_call\": %.1f, "
+            "\"ns_per_byte\": %.4f, \"mb_per_s\": %.2f, "
+            "\"heap_allocs_per_call\": %.2f, "
+            "\"buffer_allocs_per_call\": %.2f, "
+            "\"slab_allocs_per_call\": %.2f}", first ? "" : ",\n",
+            target_names[target], corpus, (unsigned long) bytes,
+            (unsigned long) r->iterations, r->ns_per_call,
+            r->ns_per_call / bytes, seconds ? bytes / seconds / 1e6 : 0,
+            r->heap_allocs, r->buffer_allocs, r->slab_allocs);
+    fflush(out);
+    return;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    bool targets[N_TARGETS];
+    bool corpora[N_CORPORA];
+    memset(targets, 1, sizeof(targets));
+    memset(corpora, 1, sizeof(corpora));
+    size_t max_bytes = DEFAULT_MAX_BYTES;
+    uint64_t min_ms = DEFAULT_MIN_MS;
+    size_t repeats = DEFAULT_REPEATS;
+    FILE *out = stdout;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:c:m:T:r:o:")) != -1) {
+        switch (c) {
+            case 't':
+                if (parse_filter(optarg, target_names, N_TARGETS, targets)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (parse_filter(optarg, corpus_names, N_CORPORA, corpora)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'm': max_bytes = strtoull(optarg, NULL, 10); break;
+            case 'T': min_ms = strtoull(optarg, NULL, 10); break;
+            case 'r': repeats = strtoul(optarg, NULL, 10); break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (!out) {
+                    perror("unable to open output");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !repeats || repeats > MAX_REPEATS ||
+        max_bytes < MIN_BYTES) {
+        usage(argv[0]);
+    }
+
+    // pools and slabs bound as on a handler thread
+    Bench b;
+    memset(&b, 0, sizeof(Bench));
+    b.buffer_pool = init_buffer_pool();
+    buffer_cache_bind_thread(b.buffer_pool);
+    b.slab = init_slab_allocator();
+    slab_bind_thread(b.slab);
+    b.dict = parse_compression_dictionary();
+    b.tree = init_decompression_tree(b.dict);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, b.sockets)) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        int size = SOCKET_BUFFER_BYTES;
+        setsockopt(b.sockets[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(b.sockets[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        fcntl(b.sockets[i], F_SETFL, fcntl(b.sockets[i], F_GETFL) |
+                O_NONBLOCK);
+    }
+
+    fprintf(out, "{\n  \"schema\": %d,\n", SCHEMA_VERSION);
+#ifdef __VERSION__
+    fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+#ifdef __OPTIMIZE__
+    fprintf(out, "  \"optimized\": true,\n");
+#else
+    fprintf(out, "  \"optimized\": false,\n");
+#endif
+    fprintf(out, "  \"min_ms\": %lu,\n  \"repeats\": %zu,\n"
+            "  \"results\": [\n", (unsigned long) min_ms, repeats);
+
+    bool first = true;
+    Result r;
+    bool any_sized = false;
+    for (size_t t = 0; t < N_TARGETS; ++t) {
+        any_sized |= targets[t] && target_sized[t];
+    }
+    b.input = any_sized ? safe_malloc(max_bytes) : NULL;
+    for (size_t cp = 0; cp < N_CORPORA && any_sized; ++cp) {
+        if (!corpora[cp]) {
+            continue;
+        }
+        generate_corpus(cp, b.input, max_bytes);
+        for (size_t size = MIN_BYTES; size <= max_bytes; size *= SIZE_STEP) {
+            prepare_inputs(&b, size);
+            for (size_t t = 0; t < N_TARGETS; ++t) {
+                if (!targets[t] || !target_sized[t]) {
+                    continue;
+                }
+                measure(&b, t, min_ms, repeats, &r);
+                print_result(out, first, t, corpus_names[cp], size, &r);
+                first = false;
+            }
+        }
+    }
+
+    // sized by the dictionary alone
+    struct stat st;
+    uint64_t dict_bytes = stat(COMPRESSION_DICT_FILE_NAME, &st) ? 0 :
+            st.st_size;
+    for (size_t t = 0; t < N_TARGETS; ++t) {
+        if (!targets[t] || target_sized[t]) {
+            continue;
+        }
+        b.size = max_bytes;
+        measure(&b, t, min_ms, repeats, &r);
+        if (t == WriteMetadataTarget) {
+            print_result(out, first, t, "none", REQUEST_METADATA_SIZE, &r);
+        } else {
+            print_result(out, first, t, "dictionary", dict_bytes, &r);
+        }
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    close(b.sockets[0]);
+    close(b.sockets[1]);
+    buffer_release(b.compressed);
+    free(b.frame);
+    free(b.input);
+    destroy_decompression_tree(b.tree);
+    destroy_compression_dict(b.dict);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#include "dir_watcher.h"
+
+/** @brief Watcher thread.
+ *
+ *  Blocks reading inotify events, dispatching each to all listeners.
+ *
+ *  @param arg : DirWatcher instance.
+ */
+static void *watch_dir(void *arg);
+
+/** @brief Dispatches event to all listeners.
+ *
+ *  @param dw : DirWatcher instance.
+ *  @param name : Changed entry name, or NULL.
+ *  @param mask : inotify event mask.
+ */
+static void dispatch(DirWatcher *dw, char *name, uint32_t mask);
+
+DirWatcher *init_dir_watcher(char *dir) {
+    DirWatcher *dw = safe_malloc(sizeof(DirWatcher));
+    dw->n_listeners = 0;
+    dw->started = false;
+
+    dw->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (dw->inotify_fd < 0) {
+        perror("inotify init failed");
+        exit(EXIT_FAILURE);
+    }
+    dw->wd = inotify_add_watch(dw->inotify_fd, dir, DIR_WATCHER_MASK);
+    if (dw->wd < 0) {
+        perror("inotify watch failed");
+        exit(EXIT_FAILURE);
+    }
+    return dw;
+}
+
+int dir_watcher_add_listener(DirWatcher *dw, dir_watch_callback callback,
+        void *ctx) {
+    if (!dw || !callback || dw->started ||
+        dw->n_listeners >= DIR_WATCHER_MAX_LISTENERS) {
+        return -1;
+    }
+
+    dw->listeners[dw->n_listeners].callback = callback;
+    dw->listeners[dw->n_listeners].ctx = ctx;
+    dw->n_listeners++;
+    return 0;
+}
+
+int dir_watcher_start(DirWatcher *dw) {
+    if (!dw || dw->started) {
+        return -1;
+    }
+
+    if (pthread_create(&dw->thread, NULL, watch_dir, dw)) {
+        return -1;
+    }
+    dw->started = true;
+    return 0;
+}
+
+static void dispatch(DirWatcher *dw, char *name, uint32_t mask) {
+    for (size_t i = 0; i < dw->n_listeners; ++i) {
+        dw->listeners[i].callback(dw->listeners[i].ctx, name, mask);
+    }
+    return;
+}
+
+static void *watch_dir(void *arg) {
+    DirWatcher *dw = (DirWatcher *) arg;
+
+    // inotify events are aligned to struct inotify_event
+    char buff[DIR_WATCHER_EVENT_BUFF_SIZE]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        // cancellation point
+        ssize_t n = read(dw->inotify_fd, buff, sizeof(buff));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("inotify read failed");
+            break;
+        }
+
+        int old_state;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+        for (char *p = buff; p < buff + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events lost
+                dispatch(dw, NULL, ev->mask);
+            } else if (ev->len) {
+                dispatch(dw, ev->name, ev->mask);
+            } else {
+                // event on the directory itself
+                dispatch(dw, NULL, ev->mask);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_setcancelstate(old_state, NULL);
+    }
+    return NULL;
+}
+
+void destroy_dir_watcher(DirWatcher *dw) {
+    if (!dw) {
+        return;
+    }
+
+    if (dw->started) {
+        pthread_cancel(dw->thread);
+        pthread_join(dw->thread, NULL);
+    }
+    close(dw->inotify_fd);
+    free(dw);
+    return;
+}
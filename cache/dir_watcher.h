@@ -0,0 +1,86 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_DIR_WATCHER_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_DIR_WATCHER_H
+
+#include "../memory/memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#define DIR_WATCHER_MAX_LISTENERS 4
+#define DIR_WATCHER_EVENT_BUFF_SIZE 65536
+#define DIR_WATCHER_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+        IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | \
+        IN_MOVE_SELF)
+
+/** @brief Directory change callback.
+ *
+ *  Called from the watcher thread. name is the entry that changed, or NULL
+ *  if events were lost (queue overflow) and all state must be rebuilt.
+ *
+ *  @param ctx : Listener context.
+ *  @param name : Changed entry name, or NULL.
+ *  @param mask : inotify event mask.
+ */
+typedef void (*dir_watch_callback)(void *ctx, char *name, uint32_t mask);
+
+typedef struct {
+    dir_watch_callback callback;
+    void *ctx;
+} DirWatchListener;
+
+typedef struct {
+    int inotify_fd;
+    int wd;
+    bool started;
+    pthread_t thread;
+    DirWatchListener listeners[DIR_WATCHER_MAX_LISTENERS];
+    size_t n_listeners;
+} DirWatcher;
+
+/** @brief Initialises inotify watch on a directory.
+ *
+ *  Only direct entries of dir are watched. Watcher is not started until
+ *  dir_watcher_start is called. If inotify cannot be initialised, error
+ *  message is printed and program exits with status EXIT_FAILURE.
+ *
+ *  @param dir : Directory path.
+ *  @return DirWatcher instance.
+ */
+DirWatcher *init_dir_watcher(char *dir);
+
+/** @brief Registers a listener.
+ *
+ *  Must be called before dir_watcher_start. If dw is NULL or the listener
+ *  table is full, -1 is returned.
+ *
+ *  @param dw : DirWatcher instance.
+ *  @param callback : Function called for every event.
+ *  @param ctx : Passed to callback.
+ *  @return status, -1 on error, 0 otherwise.
+ */
+int dir_watcher_add_listener(DirWatcher *dw, dir_watch_callback callback,
+        void *ctx);
+
+/** @brief Starts watcher thread.
+ *
+ *  Events are dispatched to every listener, in registration order.
+ *
+ *  @param dw : DirWatcher instance.
+ *  @return status, -1 on error, 0 otherwise.
+ */
+int dir_watcher_start(DirWatcher *dw);
+
+/** @brief Destroys directory watcher.
+ *
+ *  Watcher thread is cancelled and joined, and the inotify fd closed. Must be
+ *  destroyed before any of its listeners.
+ *
+ *  @param dw : DirWatcher instance.
+ */
+void destroy_dir_watcher(DirWatcher *dw);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_DIR_WATCHER_H
@@ -0,0 +1,301 @@
+#include "listing_cache.h"
+
+/** @brief FNV-1a hash of a NULL terminated string.
+ *
+ *  @param name : String to be hashed.
+ *  @return 64 bit hash.
+ */
+static uint64_t hash_name(char *name);
+
+/** @brief Checks if a directory entry is a regular file.
+ *
+ *  Symbolic links are followed, matching stat.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param name : Entry name.
+ *  @return True if regular.
+ */
+static bool is_regular_entry(ListingCache *lc, char *name);
+
+/** @brief Adds name to set. Caller must hold the cache lock.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param name : File name.
+ */
+static void insert_name(ListingCache *lc, char *name);
+
+/** @brief Removes name from set. Caller must hold the cache lock.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param name : File name.
+ */
+static void remove_name(ListingCache *lc, char *name);
+
+/** @brief Removes all names. Caller must hold the cache lock.
+ *
+ *  @param lc : ListingCache instance.
+ */
+static void clear_names(ListingCache *lc);
+
+/** @brief Reads all regular files of the directory into the set.
+ *
+ *  Caller must hold the cache lock.
+ *
+ *  @param lc : ListingCache instance.
+ */
+static void scan_dir(ListingCache *lc);
+
+/** @brief Marks published snapshots stale. Caller must hold the cache lock.
+ *
+ *  @param lc : ListingCache instance.
+ */
+static void invalidate_snapshots(ListingCache *lc);
+
+/** @brief Directory watcher callback, patches the name set.
+ *
+ *  @param ctx : ListingCache instance.
+ *  @param name : Changed entry, NULL if the directory must be rescanned.
+ *  @param mask : inotify event mask.
+ */
+static void on_dir_event(void *ctx, char *name, uint32_t mask);
+
+ListingCache *init_listing_cache(int dir_fd, DirWatcher *dw) {
+    ListingCache *lc = safe_malloc(sizeof(ListingCache));
+    lc->dir_fd = dir_fd;
+    lc->buckets = safe_calloc(LISTING_CACHE_INIT_BUCKETS, sizeof(ListingEntry *));
+    lc->n_buckets = LISTING_CACHE_INIT_BUCKETS;
+    lc->n_entries = 0;
+    lc->names_len = 0;
+    lc->version = 0;
+    lc->uncompressed = NULL;
+    lc->compressed = NULL;
+    pthread_mutex_init(&lc->lock, NULL);
+
+    // register before scanning, so no event is missed
+    dir_watcher_add_listener(dw, on_dir_event, lc);
+    scan_dir(lc);
+    return lc;
+}
+
+static uint64_t hash_name(char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; ++name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool is_regular_entry(ListingCache *lc, char *name) {
+    struct stat st;
+    if (fstatat(lc->dir_fd, name, &st, 0) < 0) {
+        return false;
+    }
+    return S_ISREG(st.st_mode);
+}
+
+static void insert_name(ListingCache *lc, char *name) {
+    uint64_t hash = hash_name(name);
+    ListingEntry *e = lc->buckets[hash % lc->n_buckets];
+    while (e) {
+        if (e->hash == hash && !strcmp(e->name, name)) {
+            return;
+        }
+        e = e->next;
+    }
+
+    // grow
+    if (lc->n_entries >= lc->n_buckets * LISTING_CACHE_LOAD_FACTOR) {
+        size_t n_buckets = lc->n_buckets * ARRAY_GROWTH_RATE;
+        ListingEntry **buckets = safe_calloc(n_buckets, sizeof(ListingEntry *));
+        for (size_t i = 0; i < lc->n_buckets; ++i) {
+            e = lc->buckets[i];
+            while (e) {
+                ListingEntry *next = e->next;
+                e->next = buckets[e->hash % n_buckets];
+                buckets[e->hash % n_buckets] = e;
+                e = next;
+            }
+        }
+        free(lc->buckets);
+        lc->buckets = buckets;
+        lc->n_buckets = n_buckets;
+    }
+
+    e = safe_malloc(sizeof(ListingEntry));
+    e->name_len = strlen(name);
+    e->name = safe_malloc(e->name_len + 1);
+    memcpy(e->name, name, e->name_len + 1);
+    e->hash = hash;
+    e->next = lc->buckets[hash % lc->n_buckets];
+    lc->buckets[hash % lc->n_buckets] = e;
+    lc->n_entries++;
+    lc->names_len += e->name_len + 1;
+    invalidate_snapshots(lc);
+    return;
+}
+
+static void remove_name(ListingCache *lc, char *name) {
+    uint64_t hash = hash_name(name);
+    ListingEntry **link = &lc->buckets[hash % lc->n_buckets];
+    while (*link) {
+        ListingEntry *e = *link;
+        if (e->hash == hash && !strcmp(e->name, name)) {
+            *link = e->next;
+            lc->n_entries--;
+            lc->names_len -= e->name_len + 1;
+            free(e->name);
+            free(e);
+            invalidate_snapshots(lc);
+            return;
+        }
+        link = &e->next;
+    }
+    return;
+}
+
+static void clear_names(ListingCache *lc) {
+    for (size_t i = 0; i < lc->n_buckets; ++i) {
+        ListingEntry *e = lc->buckets[i];
+        while (e) {
+            ListingEntry *next = e->next;
+            free(e->name);
+            free(e);
+            e = next;
+        }
+        lc->buckets[i] = NULL;
+    }
+    lc->n_entries = 0;
+    lc->names_len = 0;
+    invalidate_snapshots(lc);
+    return;
+}
+
+static void scan_dir(ListingCache *lc) {
+    // readdir stream needs its own descriptor
+    int fd = openat(lc->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd < 0 ? NULL : fdopendir(fd);
+    if (!d) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct dirent *ent = NULL;
+    while ((ent = readdir(d))) {
+        // d_type avoids a stat for everything but links and unknown types
+        if (ent->d_type == DT_REG ||
+            ((ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) &&
+             is_regular_entry(lc, ent->d_name))) {
+            insert_name(lc, ent->d_name);
+        }
+    }
+    closedir(d);
+    return;
+}
+
+static void invalidate_snapshots(ListingCache *lc) {
+    lc->version++;
+    listing_snapshot_release(lc->uncompressed);
+    listing_snapshot_release(lc->compressed);
+    lc->uncompressed = NULL;
+    lc->compressed = NULL;
+    return;
+}
+
+static void on_dir_event(void *ctx, char *name, uint32_t mask) {
+    ListingCache *lc = (ListingCache *) ctx;
+
+    // stat outside of lock, requests are not stalled by the filesystem
+    bool regular = name && !(mask & (IN_DELETE | IN_MOVED_FROM)) &&
+            is_regular_entry(lc, name);
+
+    pthread_mutex_lock(&lc->lock);
+    if (!name) {
+        clear_names(lc);
+        scan_dir(lc);
+    } else if (regular) {
+        insert_name(lc, name);
+    } else {
+        remove_name(lc, name);
+    }
+    pthread_mutex_unlock(&lc->lock);
+    return;
+}
+
+ListingSnapshot *listing_cache_acquire(ListingCache *lc, bool compressed) {
+    if (!lc) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lc->lock);
+    ListingSnapshot *snapshot = compressed ? lc->compressed : lc->uncompressed;
+    if (snapshot) {
+        atomic_fetch_add(&snapshot->reference_count, 1);
+    }
+    pthread_mutex_unlock(&lc->lock);
+    return snapshot;
+}
+
+uint8_t *listing_cache_serialise(ListingCache *lc, size_t offset, size_t *len,
+        uint64_t *version) {
+    pthread_mutex_lock(&lc->lock);
+    *len = offset + lc->names_len;
+    *version = lc->version;
+    uint8_t *buff = buffer_alloc(*len);
+
+    size_t n = offset;
+    for (size_t i = 0; i < lc->n_buckets; ++i) {
+        for (ListingEntry *e = lc->buckets[i]; e; e = e->next) {
+            memcpy(buff + n, e->name, e->name_len + 1);
+            n += e->name_len + 1;
+        }
+    }
+    pthread_mutex_unlock(&lc->lock);
+    return buff;
+}
+
+ListingSnapshot *listing_cache_publish(ListingCache *lc, bool compressed,
+        uint8_t *data, size_t len, uint64_t version) {
+    ListingSnapshot *snapshot = safe_malloc(sizeof(ListingSnapshot));
+    snapshot->data = data;
+    snapshot->len = len;
+    // callers reference
+    atomic_init(&snapshot->reference_count, 1);
+
+    pthread_mutex_lock(&lc->lock);
+    if (version == lc->version) {
+        ListingSnapshot **slot = compressed ? &lc->compressed : &lc->uncompressed;
+        listing_snapshot_release(*slot);
+        // caches reference
+        atomic_fetch_add(&snapshot->reference_count, 1);
+        *slot = snapshot;
+    }
+    pthread_mutex_unlock(&lc->lock);
+    return snapshot;
+}
+
+void listing_snapshot_release(ListingSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+
+    if (atomic_fetch_sub(&snapshot->reference_count, 1) == 1) {
+        buffer_release(snapshot->data);
+        free(snapshot);
+    }
+    return;
+}
+
+void destroy_listing_cache(ListingCache *lc) {
+    if (!lc) {
+        return;
+    }
+
+    clear_names(lc);
+    free(lc->buckets);
+    pthread_mutex_destroy(&lc->lock);
+    free(lc);
+    return;
+}
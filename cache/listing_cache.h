@@ -0,0 +1,122 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_LISTING_CACHE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_LISTING_CACHE_H
+
+#include "../memory/memory.h"
+#include "../memory/buffer_pool.h"
+#include "dir_watcher.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define LISTING_CACHE_INIT_BUCKETS 1024
+#define LISTING_CACHE_LOAD_FACTOR 1
+
+typedef struct {
+    atomic_size_t reference_count;
+    uint8_t *data; // pooled serialised responce, ready to be written
+    size_t len;
+} ListingSnapshot;
+
+typedef struct listing_entry {
+    char *name;
+    size_t name_len;
+    uint64_t hash;
+    struct listing_entry *next;
+} ListingEntry;
+
+typedef struct {
+    int dir_fd; // not owned
+    // set of regular file names
+    ListingEntry **buckets;
+    size_t n_buckets;
+    size_t n_entries;
+    size_t names_len; // serialised size of all names, including null bytes
+    uint64_t version; // bumped whenever the set changes
+    // serialised snapshots of the current version, NULL until built
+    ListingSnapshot *uncompressed;
+    ListingSnapshot *compressed;
+    pthread_mutex_t lock;
+} ListingCache;
+
+/** @brief Initialises directory listing cache.
+ *
+ *  Regular files directly inside the directory are read once, and the set is
+ *  then patched from events of the provided directory watcher.
+ *
+ *  @param dir_fd : Directory fd (not owned, must outlive the cache).
+ *  @param dw : DirWatcher watching the directory, not yet started.
+ *  @return ListingCache instance.
+ */
+ListingCache *init_listing_cache(int dir_fd, DirWatcher *dw);
+
+/** @brief Retrieves serialised listing of the current directory state.
+ *
+ *  Returned snapshot is referenced, and must be released with
+ *  listing_snapshot_release. If no snapshot has been published for the
+ *  current state, NULL is returned.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param compressed : Compressed or uncompressed snapshot.
+ *  @return ListingSnapshot instance or NULL.
+ */
+ListingSnapshot *listing_cache_acquire(ListingCache *lc, bool compressed);
+
+/** @brief Serialises file names of the current directory state.
+ *
+ *  Names are null terminated and concatenated, beginning offset bytes into
+ *  the allocated buffer. Buffer is allocated with buffer_alloc, and the
+ *  caller holds its reference.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param offset : Bytes reserved at the front of the buffer.
+ *  @param len : Set to total buffer length.
+ *  @param version : Set to the state version serialised.
+ *  @return Allocated buffer.
+ */
+uint8_t *listing_cache_serialise(ListingCache *lc, size_t offset, size_t *len,
+        uint64_t *version);
+
+/** @brief Publishes a serialised responce for a listing version.
+ *
+ *  Reference to data, allocated with buffer_alloc, is taken. Responces may
+ *  retain data beyond the snapshot. If version is still current, the snapshot
+ *  is stored and served to later requests, otherwise it is only returned to
+ *  the caller. Returned snapshot is referenced.
+ *
+ *  @param lc : ListingCache instance.
+ *  @param compressed : Snapshot holds a compressed responce.
+ *  @param data : Serialised responce.
+ *  @param len : Length of data.
+ *  @param version : Version returned by listing_cache_serialise.
+ *  @return ListingSnapshot instance.
+ */
+ListingSnapshot *listing_cache_publish(ListingCache *lc, bool compressed,
+        uint8_t *data, size_t len, uint64_t version);
+
+/** @brief Releases a reference to a snapshot.
+ *
+ *  Snapshot is destroyed once unreferenced. If snapshot is NULL, nothing
+ *  is done.
+ *
+ *  @param snapshot : ListingSnapshot instance.
+ */
+void listing_snapshot_release(ListingSnapshot *snapshot);
+
+/** @brief Destroys listing cache.
+ *
+ *  Directory watcher must be destroyed first. Published snapshots still
+ *  referenced by responces remain valid until released.
+ *
+ *  @param lc : ListingCache instance.
+ */
+void destroy_listing_cache(ListingCache *lc);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_LISTING_CACHE_H
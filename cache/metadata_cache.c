@@ -0,0 +1,283 @@
+#include "metadata_cache.h"
+
+/** @brief FNV-1a hash of a NULL terminated string.
+ *
+ *  @param name : String to be hashed.
+ *  @return 64 bit hash.
+ */
+static uint64_t hash_name(char *name);
+
+/** @brief Finds entry for name.
+ *
+ *  Caller must hold the cache lock.
+ *
+ *  @param mc : MetadataCache instance.
+ *  @param name : File name.
+ *  @param hash : Hash of name.
+ *  @return Entry, or NULL if not cached.
+ */
+static MetadataCacheEntry *find_entry(MetadataCache *mc, char *name,
+        uint64_t hash);
+
+/** @brief Doubles bucket array, rehashing all entries.
+ *
+ *  Caller must hold the cache write lock.
+ *
+ *  @param mc : MetadataCache instance.
+ */
+static void grow_buckets(MetadataCache *mc);
+
+/** @brief Inserts an entry for name.
+ *
+ *  Negative entries replace the oldest negative entry once
+ *  METADATA_CACHE_MAX_NEGATIVE are cached. Entries of existing files are
+ *  dropped once METADATA_CACHE_MAX_ENTRIES are cached. Caller must hold the
+ *  cache write lock.
+ *
+ *  @param mc : MetadataCache instance.
+ *  @param name : File name, not cached yet.
+ *  @param hash : Hash of name.
+ *  @param md : Metadata of the file.
+ */
+static void insert_entry(MetadataCache *mc, char *name, uint64_t hash,
+        FileMetadata *md);
+
+/** @brief Unlinks and releases an entry.
+ *
+ *  Caller must hold the cache write lock.
+ *
+ *  @param mc : MetadataCache instance.
+ *  @param e : Cached entry.
+ */
+static void remove_entry(MetadataCache *mc, MetadataCacheEntry *e);
+
+/** @brief Directory watcher callback, invalidates changed entries.
+ *
+ *  @param ctx : MetadataCache instance.
+ *  @param name : Changed entry, NULL if all entries must be dropped.
+ *  @param mask : inotify event mask.
+ */
+static void on_dir_event(void *ctx, char *name, uint32_t mask);
+
+MetadataCache *init_metadata_cache(int dir_fd, DirWatcher *dw) {
+    MetadataCache *mc = safe_malloc(sizeof(MetadataCache));
+    mc->dir_fd = dir_fd;
+    mc->buckets = safe_calloc(METADATA_CACHE_INIT_BUCKETS,
+            sizeof(MetadataCacheEntry *));
+    mc->n_buckets = METADATA_CACHE_INIT_BUCKETS;
+    mc->n_entries = 0;
+    mc->negatives = safe_calloc(METADATA_CACHE_MAX_NEGATIVE,
+            sizeof(MetadataCacheEntry *));
+    mc->next_negative = 0;
+    mc->n_negative = 0;
+    atomic_init(&mc->generation, 0);
+    for (size_t i = 0; i < METADATA_CACHE_GENERATION_SLOTS; ++i) {
+        atomic_init(&mc->name_generations[i], 0);
+    }
+    pthread_rwlock_init(&mc->lock, NULL);
+
+    dir_watcher_add_listener(dw, on_dir_event, mc);
+    return mc;
+}
+
+static uint64_t hash_name(char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; ++name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static MetadataCacheEntry *find_entry(MetadataCache *mc, char *name,
+        uint64_t hash) {
+    MetadataCacheEntry *e = mc->buckets[hash % mc->n_buckets];
+    while (e) {
+        if (e->hash == hash && !strcmp(e->name, name)) {
+            return e;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void grow_buckets(MetadataCache *mc) {
+    size_t n_buckets = mc->n_buckets * ARRAY_GROWTH_RATE;
+    MetadataCacheEntry **buckets = safe_calloc(n_buckets,
+            sizeof(MetadataCacheEntry *));
+
+    for (size_t i = 0; i < mc->n_buckets; ++i) {
+        MetadataCacheEntry *e = mc->buckets[i];
+        while (e) {
+            MetadataCacheEntry *next = e->next;
+            e->next = buckets[e->hash % n_buckets];
+            buckets[e->hash % n_buckets] = e;
+            e = next;
+        }
+    }
+
+    free(mc->buckets);
+    mc->buckets = buckets;
+    mc->n_buckets = n_buckets;
+    return;
+}
+
+static void insert_entry(MetadataCache *mc, char *name, uint64_t hash,
+        FileMetadata *md) {
+    if (md->exists && mc->n_entries - mc->n_negative >=
+            METADATA_CACHE_MAX_ENTRIES) {
+        return;
+    }
+    if (!md->exists && mc->negatives[mc->next_negative]) {
+        // oldest negative entry makes room
+        remove_entry(mc, mc->negatives[mc->next_negative]);
+    }
+    if (mc->n_entries >= mc->n_buckets * METADATA_CACHE_LOAD_FACTOR) {
+        grow_buckets(mc);
+    }
+
+    MetadataCacheEntry *e = safe_malloc(sizeof(MetadataCacheEntry));
+    e->name = safe_malloc(strlen(name) + 1);
+    memcpy(e->name, name, strlen(name) + 1);
+    e->hash = hash;
+    e->md = *md;
+    e->next = mc->buckets[hash % mc->n_buckets];
+    mc->buckets[hash % mc->n_buckets] = e;
+    mc->n_entries++;
+    if (!md->exists) {
+        e->negative_slot = mc->next_negative;
+        mc->negatives[mc->next_negative] = e;
+        mc->next_negative = (mc->next_negative + 1) %
+                METADATA_CACHE_MAX_NEGATIVE;
+        mc->n_negative++;
+    }
+    return;
+}
+
+static void remove_entry(MetadataCache *mc, MetadataCacheEntry *e) {
+    MetadataCacheEntry **link = &mc->buckets[e->hash % mc->n_buckets];
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    if (!e->md.exists) {
+        mc->negatives[e->negative_slot] = NULL;
+        mc->n_negative--;
+    }
+    mc->n_entries--;
+    free(e->name);
+    free(e);
+    return;
+}
+
+int metadata_cache_lookup(MetadataCache *mc, char *name, FileMetadata *md) {
+    if (!mc || !name || !md) {
+        return -1;
+    }
+
+    bool cacheable = is_direct_entry(name);
+    uint64_t hash = 0;
+    if (cacheable) {
+        hash = hash_name(name);
+        pthread_rwlock_rdlock(&mc->lock);
+        MetadataCacheEntry *e = find_entry(mc, name, hash);
+        if (e) {
+            *md = e->md;
+            pthread_rwlock_unlock(&mc->lock);
+            stats_count_lookup(StatsMetadataLookup, true);
+            return md->exists ? 0 : -1;
+        }
+        pthread_rwlock_unlock(&mc->lock);
+    }
+    // counted per thread, lookups are made by every handler
+    stats_count_lookup(StatsMetadataLookup, false);
+
+    // events after this point make the stat result stale
+    atomic_uint_fast64_t *name_generation =
+            &mc->name_generations[hash % METADATA_CACHE_GENERATION_SLOTS];
+    uint64_t generation = atomic_load(&mc->generation);
+    uint64_t slot_generation = atomic_load(name_generation);
+
+    struct stat st;
+    if (stat_beneath(mc->dir_fd, name, &st) < 0) {
+        md->exists = false;
+    } else {
+        md->exists = true;
+        md->is_regular = S_ISREG(st.st_mode);
+        md->size = (uint64_t) st.st_size;
+        md->mtime = st.st_mtim;
+        md->ino = st.st_ino;
+    }
+
+    if (!cacheable) {
+        return md->exists ? 0 : -1;
+    }
+
+    pthread_rwlock_wrlock(&mc->lock);
+    if (atomic_load(&mc->generation) == generation &&
+        atomic_load(name_generation) == slot_generation &&
+        !find_entry(mc, name, hash)) {
+        insert_entry(mc, name, hash, md);
+    }
+    pthread_rwlock_unlock(&mc->lock);
+
+    return md->exists ? 0 : -1;
+}
+
+void metadata_cache_invalidate(MetadataCache *mc, char *name) {
+    if (!mc) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&mc->lock);
+    if (name) {
+        uint64_t hash = hash_name(name);
+        atomic_fetch_add(&mc->name_generations[hash %
+                METADATA_CACHE_GENERATION_SLOTS], 1);
+        MetadataCacheEntry *e = find_entry(mc, name, hash);
+        if (e) {
+            remove_entry(mc, e);
+        }
+    } else {
+        atomic_fetch_add(&mc->generation, 1);
+        for (size_t i = 0; i < mc->n_buckets; ++i) {
+            MetadataCacheEntry *e = mc->buckets[i];
+            while (e) {
+                MetadataCacheEntry *next = e->next;
+                free(e->name);
+                free(e);
+                e = next;
+            }
+            mc->buckets[i] = NULL;
+        }
+        mc->n_entries = 0;
+        memset(mc->negatives, 0, METADATA_CACHE_MAX_NEGATIVE *
+                sizeof(MetadataCacheEntry *));
+        mc->next_negative = 0;
+        mc->n_negative = 0;
+    }
+    pthread_rwlock_unlock(&mc->lock);
+    return;
+}
+
+static void on_dir_event(void *ctx, char *name, uint32_t mask) {
+    if (!name && (mask & IN_MOVE_SELF)) {
+        // lookups are relative to the directory fd, which follows the move
+        return;
+    }
+    metadata_cache_invalidate((MetadataCache *) ctx, name);
+    return;
+}
+
+void destroy_metadata_cache(MetadataCache *mc) {
+    if (!mc) {
+        return;
+    }
+
+    metadata_cache_invalidate(mc, NULL);
+    pthread_rwlock_destroy(&mc->lock);
+    free(mc->buckets);
+    free(mc->negatives);
+    free(mc);
+    return;
+}
@@ -0,0 +1,106 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METADATA_CACHE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METADATA_CACHE_H
+
+#include "../memory/memory.h"
+#include "dir_watcher.h"
+#include "../io/path_resolve.h"
+#include "../stats/stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define METADATA_CACHE_INIT_BUCKETS 1024
+#define METADATA_CACHE_MAX_ENTRIES 1000000 // files that exist
+// missing files, oldest evicted first. bounded apart from existing files, so
+// lookups of made up names cannot fill the cache
+#define METADATA_CACHE_MAX_NEGATIVE 4096
+#define METADATA_CACHE_LOAD_FACTOR 1
+// names hashing to the same slot share a generation, so an event only holds
+// back inserts of names in its slot
+#define METADATA_CACHE_GENERATION_SLOTS 256
+
+typedef struct {
+    bool exists; // false for negative entries
+    bool is_regular;
+    uint64_t size;
+    struct timespec mtime;
+    ino_t ino;
+} FileMetadata;
+
+typedef struct metadata_cache_entry {
+    char *name;
+    uint64_t hash;
+    FileMetadata md;
+    size_t negative_slot; // index into negatives, negative entries only
+    struct metadata_cache_entry *next;
+} MetadataCacheEntry;
+
+typedef struct {
+    int dir_fd;
+    MetadataCacheEntry **buckets;
+    size_t n_buckets;
+    size_t n_entries; // existing and missing files
+    // negative entries in insertion order, NULL where invalidated
+    MetadataCacheEntry **negatives;
+    size_t next_negative; // slot the next negative entry replaces
+    size_t n_negative;
+    // bumped when every entry is dropped
+    atomic_uint_fast64_t generation;
+    // bumped when a name of the slot is invalidated. along with generation,
+    // guards inserts racing with events
+    atomic_uint_fast64_t name_generations[METADATA_CACHE_GENERATION_SLOTS];
+    pthread_rwlock_t lock;
+} MetadataCache;
+
+/** @brief Initialises metadata cache for a directory.
+ *
+ *  Cache maps names of entries directly inside dir to their metadata.
+ *  Entries are invalidated by the provided directory watcher, so no expiry
+ *  is required. Lookups of missing files are cached as negative entries, at
+ *  most METADATA_CACHE_MAX_NEGATIVE of them, evicting the oldest.
+ *
+ *  @param dir_fd : Directory fd (not owned, must outlive the cache).
+ *  @param dw : DirWatcher watching the directory, not yet started.
+ *  @return MetadataCache instance.
+ */
+MetadataCache *init_metadata_cache(int dir_fd, DirWatcher *dw);
+
+/** @brief Retrieves metadata of a file in the cached directory.
+ *
+ *  On a miss the file is stat'd relative to the directory fd and the result
+ *  cached. Names which do not refer to a direct entry of the directory ('.',
+ *  '..' or containing '/') are stat'd beneath the directory without being
+ *  cached. If mc, name or md is NULL, -1 is
+ *  returned.
+ *
+ *  @param mc : MetadataCache instance.
+ *  @param name : NULL terminated file name.
+ *  @param md : Address to store metadata.
+ *  @return 0 if file exists, -1 otherwise.
+ */
+int metadata_cache_lookup(MetadataCache *mc, char *name, FileMetadata *md);
+
+/** @brief Drops cached entry for name.
+ *
+ *  If name is NULL, all entries are dropped.
+ *
+ *  @param mc : MetadataCache instance.
+ *  @param name : File name or NULL.
+ */
+void metadata_cache_invalidate(MetadataCache *mc, char *name);
+
+/** @brief Destroys metadata cache.
+ *
+ *  All entries are released. Directory watcher must be destroyed first.
+ *
+ *  @param mc : MetadataCache instance.
+ */
+void destroy_metadata_cache(MetadataCache *mc);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METADATA_CACHE_H
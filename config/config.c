@@ -9,6 +9,21 @@
  */
 static char *read_string(FILE *f, size_t n_bytes);
 
+/** @brief Reads a byte count from the environment.
+ *
+ *  @param name : Environment variable.
+ *  @param fallback : Value used if unset or invalid.
+ *  @return byte count.
+ */
+static size_t read_env_size(const char *name, size_t fallback);
+
+/** @brief Reads the metrics segment name from the environment.
+ *
+ *  @param port : Server port, network byte order.
+ *  @return heap allocated name, NULL if metrics are not published.
+ */
+static char *read_env_metrics_segment(uint16_t port);
+
 Config *load_config(char *config_path) {
     if (access(config_path, F_OK)) {
         printf("unable to load configuration file | does not exist\n");
@@ -30,11 +45,63 @@ Config *load_config(char *config_path) {
     // read and null terminate directory path
     size_t str_size = file_size - sizeof(config->port) - sizeof(config->ip_addr.s_addr);
     config->dir = read_string(config_file, str_size);
+    config->dir_fd = open(config->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (config->dir_fd < 0) {
+        printf("unable to open %s\n", config->dir);
+        exit(EXIT_FAILURE);
+    }
+
+    config->handler_memory_budget = read_env_size("JX_HANDLER_MEMORY_BUDGET",
+            MEMORY_BUDGET_HANDLER_DEFAULT);
+    config->connection_memory_budget = read_env_size(
+            "JX_CONNECTION_MEMORY_BUDGET", MEMORY_BUDGET_CONNECTION_DEFAULT);
+    config->metrics_segment = read_env_metrics_segment(config->port);
+    config->profile = read_env_size("JX_PROFILE", 0) != 0;
+    config->slow_request_us = read_env_size("JX_SLOW_REQUEST_US", 0);
+    char *slow_request_log = getenv("JX_SLOW_REQUEST_LOG");
+    config->slow_request_log = strdup(slow_request_log && *slow_request_log ?
+            slow_request_log : CONFIG_SLOW_REQUEST_LOG);
+    char *capture = getenv("JX_CAPTURE");
+    config->capture = capture && *capture ? strdup(capture) : NULL;
+    config->capture_sample = read_env_size("JX_CAPTURE_SAMPLE", 1);
+    config->capture_max_payload = read_env_size("JX_CAPTURE_MAX_PAYLOAD",
+            CONFIG_CAPTURE_MAX_PAYLOAD);
 
     fclose(config_file);
     return config;
 }
 
+static size_t read_env_size(const char *name, size_t fallback) {
+    char *value = getenv(name);
+    if (!value || !*value) {
+        return fallback;
+    }
+
+    char *end = NULL;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (*end || !n) {
+        printf("ignoring invalid %s\n", name);
+        return fallback;
+    }
+    return (size_t) n;
+}
+
+static char *read_env_metrics_segment(uint16_t port) {
+    char *value = getenv("JX_METRICS_SEGMENT");
+    if (value && !*value) {
+        return NULL;
+    }
+
+    char *name = safe_malloc(CONFIG_METRICS_SEGMENT_NAME_LEN);
+    if (value) {
+        snprintf(name, CONFIG_METRICS_SEGMENT_NAME_LEN, "%s", value);
+    } else {
+        snprintf(name, CONFIG_METRICS_SEGMENT_NAME_LEN, "/jxserver.%u",
+                (unsigned) ntohs(port));
+    }
+    return name;
+}
+
 static char *read_string(FILE *f, size_t n_bytes) {
     char *string = safe_calloc((n_bytes + 1), sizeof(char *));
     string[n_bytes] = '\0';
@@ -48,7 +115,11 @@ void destroy_config(Config *config) {
         return;
     }
 
+    close(config->dir_fd);
     free(config->dir);
+    free(config->metrics_segment);
+    free(config->slow_request_log);
+    free(config->capture);
     free(config);
     return;
 }
\ No newline at end of file
@@ -2,21 +2,50 @@
 #define COMP2017_ASSIGNMENT_3_CONFIG_H
 
 #include "../memory/memory.h"
+#include "../memory/memory_budget.h"
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+
+#define CONFIG_METRICS_SEGMENT_NAME_LEN 64
+#define CONFIG_SLOW_REQUEST_LOG "jxserver.slow.log"
+#define CONFIG_CAPTURE_MAX_PAYLOAD 65536
 
 typedef struct {
     struct in_addr ip_addr;
     uint16_t port;
     char *dir;
+    int dir_fd; // served directory, all lookups are relative to it
+    size_t handler_memory_budget; // JX_HANDLER_MEMORY_BUDGET, bytes
+    size_t connection_memory_budget; // JX_CONNECTION_MEMORY_BUDGET, bytes
+    char *metrics_segment; // JX_METRICS_SEGMENT, shared memory name, or NULL
+    bool profile; // JX_PROFILE, time each phase of a request
+    uint64_t slow_request_us; // JX_SLOW_REQUEST_US, 0 if none are logged
+    char *slow_request_log; // JX_SLOW_REQUEST_LOG, file slow requests are logged to
+    char *capture; // JX_CAPTURE, trace file requests are recorded to, or NULL
+    uint64_t capture_sample; // JX_CAPTURE_SAMPLE, one in this many connections
+    size_t capture_max_payload; // JX_CAPTURE_MAX_PAYLOAD, bytes kept per request
 } Config;
 
 /** @brief Reads configuration file.
  *
  *  Reads config binary. Data is stored in Config instance and returned.
+ *  Served directory is opened, if it cannot be opened error message is
+ *  printed and program exits with status EXIT_FAILURE. Memory budgets are
+ *  read from the environment, falling back to their defaults. Metrics are
+ *  published to the shared memory segment named by JX_METRICS_SEGMENT, by
+ *  default /jxserver.<port>, and not published if it is set but empty.
+ *  Requests are profiled if JX_PROFILE is set to a non zero number. Requests
+ *  slower than JX_SLOW_REQUEST_US microseconds are logged to
+ *  JX_SLOW_REQUEST_LOG, by default CONFIG_SLOW_REQUEST_LOG. If JX_CAPTURE is
+ *  set, requests of one in every JX_CAPTURE_SAMPLE connections (by default
+ *  all) are recorded to it, keeping at most JX_CAPTURE_MAX_PAYLOAD bytes of
+ *  each payload (by default CONFIG_CAPTURE_MAX_PAYLOAD).
  *
  * @param config_path : Configuration file path.
  * @param Config data parsed from file.
@@ -25,7 +54,7 @@ Config *load_config(char *config_path);
 
 /** @brief Destroys config instance.
  *
- *  All dynamically allocated memory is released.
+ *  All dynamically allocated memory is released. Directory fd is closed.
  *
  * @param config : Config instance.
  */
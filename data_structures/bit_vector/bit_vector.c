@@ -1,9 +1,11 @@
 #include "bit_vector.h"
 
 BitVector *init_bit_vector(size_t init_size) {
-    BitVector *bv = safe_malloc(sizeof(BitVector));
-    bv->vector = safe_calloc(init_size, 1);
-    bv->vector_len = init_size;
+    BitVector *bv = slab_alloc(sizeof(BitVector));
+    // never empty, so growth always makes progress
+    bv->vector_len = init_size ? init_size : 1;
+    bv->vector = slab_alloc(bv->vector_len);
+    memset(bv->vector, 0, bv->vector_len);
     bv->n_bits = 0;
 
     return bv;
@@ -19,7 +21,7 @@ void bit_vector_push(BitVector *bv, uint8_t bit) {
 
     // expand if full
     if (byte_index >= bv->vector_len) {
-        bv->vector = safe_realloc(bv->vector, bv->vector_len *
+        bv->vector = slab_realloc(bv->vector, bv->vector_len *
                             VECTOR_GROWTH_RATE);
         // initialise remaining to 0
         memset(bv->vector + bv->vector_len, 0, bv->vector_len);
@@ -39,7 +41,7 @@ void destroy_bit_vector(BitVector *bv) {
         return;
     }
 
-    free(bv->vector);
-    free(bv);
+    slab_free(bv->vector);
+    slab_free(bv);
     return;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_BIT_VECTOR_H
 
 #include "../../memory/memory.h"
+#include "../../memory/slab.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -16,7 +17,7 @@ typedef struct {
 
 /** @brief Initialises bit vector.
  *
- *  Allocates vector to to init_size.
+ *  Allocates vector to to init_size, from the calling threads slab.
  *
  *  @param init_size : Init bit vector length (in bytes).
  *  @return Bit vector instance.
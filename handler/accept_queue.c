@@ -0,0 +1,78 @@
+#include "accept_queue.h"
+
+AcceptQueue *init_accept_queue() {
+    AcceptQueue *aq = safe_malloc(sizeof(AcceptQueue));
+    atomic_init(&aq->head, NULL);
+    aq->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (aq->event_fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    return aq;
+}
+
+int accept_queue_push(AcceptQueue *aq, int fd) {
+    if (!aq) {
+        return -1;
+    }
+
+    AcceptedClient *client = safe_malloc(sizeof(AcceptedClient));
+    client->fd = fd;
+    AcceptedClient *head = atomic_load_explicit(&aq->head,
+            memory_order_relaxed);
+    do {
+        client->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&aq->head, &head, client,
+            memory_order_release, memory_order_relaxed));
+
+    // wake the consumer, only needed on the empty to non empty transition.
+    // client may already have been taken, so only the local head is read
+    if (!head) {
+        uint64_t count = 1;
+        if (write(aq->event_fd, &count, sizeof(count)) < 0) {
+            perror("accept queue signal failed");
+        }
+    }
+    return 0;
+}
+
+AcceptedClient *accept_queue_drain(AcceptQueue *aq) {
+    if (!aq) {
+        return NULL;
+    }
+
+    // reset counter before taking the stack, so later pushes signal again
+    uint64_t count = 0;
+    if (read(aq->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("accept queue read failed");
+    }
+
+    AcceptedClient *stack = atomic_exchange_explicit(&aq->head, NULL,
+            memory_order_acquire);
+    // stack is newest first, reverse into acceptance order
+    AcceptedClient *clients = NULL;
+    while (stack) {
+        AcceptedClient *next = stack->next;
+        stack->next = clients;
+        clients = stack;
+        stack = next;
+    }
+    return clients;
+}
+
+void destroy_accept_queue(AcceptQueue *aq) {
+    if (!aq) {
+        return;
+    }
+
+    AcceptedClient *client = accept_queue_drain(aq);
+    while (client) {
+        AcceptedClient *next = client->next;
+        close(client->fd);
+        free(client);
+        client = next;
+    }
+    close(aq->event_fd);
+    free(aq);
+    return;
+}
@@ -0,0 +1,68 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ACCEPT_QUEUE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ACCEPT_QUEUE_H
+
+#include "../memory/memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+typedef struct accepted_client {
+    int fd; // accepted, non blocking socket
+    struct accepted_client *next;
+} AcceptedClient;
+
+// multi producer, single consumer. producers push onto a lock free stack,
+// the consumer takes the whole stack at once, so nodes are never reused
+// while a producer may still observe them
+typedef struct {
+    _Atomic(AcceptedClient *) head; // most recently pushed
+    int event_fd; // readable while clients are queued
+} AcceptQueue;
+
+/** @brief Initialises accept queue.
+ *
+ *  The event_fd field can be watched with epoll to be notified of queued
+ *  clients. If the eventfd cannot be created, error message is printed and
+ *  program exits with status EXIT_FAILURE.
+ *
+ *  @return AcceptQueue instance.
+ */
+AcceptQueue *init_accept_queue();
+
+/** @brief Hands an accepted socket over to the queue owner.
+ *
+ *  Lock free, safe to call from any thread. The event fd is only signalled
+ *  when the queue was empty, a consumer that has not yet drained is already
+ *  due to wake. If aq is NULL, nothing is done and -1 is returned.
+ *
+ *  @param aq : AcceptQueue instance.
+ *  @param fd : Accepted socket.
+ *  @return 0 on success, -1 on error.
+ */
+int accept_queue_push(AcceptQueue *aq, int fd);
+
+/** @brief Removes all queued clients.
+ *
+ *  Must only be called by the queue owner. Event fd is reset. Returned
+ *  clients are linked through their next field, in order of acceptance, and
+ *  must be released with free by the caller. If aq is NULL or empty, NULL is
+ *  returned.
+ *
+ *  @param aq : AcceptQueue instance.
+ *  @return Linked list of accepted clients.
+ */
+AcceptedClient *accept_queue_drain(AcceptQueue *aq);
+
+/** @brief Destroys accept queue.
+ *
+ *  Sockets still queued are closed, and the event fd is closed.
+ *
+ *  @param aq : AcceptQueue instance.
+ */
+void destroy_accept_queue(AcceptQueue *aq);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ACCEPT_QUEUE_H
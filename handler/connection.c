@@ -1,92 +1,161 @@
 #include "connection.h"
 
+/** @brief Closes connection and releases its embedded state.
+ *
+ *  @param ac : ActiveConnection instance.
+ */
+static void release_connection(ActiveConnection *ac);
+
+/** @brief Allocates a new segment of free slots.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @return 0 on success, -1 if the segment table is full.
+ */
+static int grow_connections(ConnectionManager *cm);
+
 ConnectionManager *init_connection_manager() {
     ConnectionManager *cm = safe_malloc(sizeof(ConnectionManager));
-    cm->occupied_connections = NULL;
-    cm->unused_connections = NULL;
-    pthread_mutex_init(&cm->lock, NULL);
+    cm->n_segments = 0;
+    cm->free_head = CONNECTION_ID_NONE;
+    cm->n_active = 0;
     return cm;
 }
 
+static int grow_connections(ConnectionManager *cm) {
+    if (cm->n_segments >= CONNECTION_MAX_SEGMENTS) {
+        return -1;
+    }
+
+    ActiveConnection *segment = safe_malloc(sizeof(ActiveConnection) *
+            CONNECTION_SEGMENT_LEN);
+    uint32_t first_id = cm->n_segments * CONNECTION_SEGMENT_LEN;
+    // link in id order, lowest ids are issued first
+    for (uint32_t i = 0; i < CONNECTION_SEGMENT_LEN; ++i) {
+        segment[i].fd = -1;
+        segment[i].id = first_id + i;
+        segment[i].next_free = i + 1 < CONNECTION_SEGMENT_LEN ?
+                first_id + i + 1 : cm->free_head;
+    }
+    cm->generations[cm->n_segments] = safe_calloc(CONNECTION_SEGMENT_LEN,
+            sizeof(uint32_t));
+    cm->segments[cm->n_segments++] = segment;
+    cm->free_head = first_id;
+    return 0;
+}
+
 ActiveConnection *new_active_connection(ConnectionManager *cm, int fd,
         enum ConnectionStatus status) {
     if (!cm) {
         return NULL;
     }
 
-    pthread_mutex_lock(&cm->lock);
-
-    // new instance
-    ActiveConnection *new_ac = NULL;
-    if (!cm->unused_connections) {
-        new_ac = safe_malloc(sizeof(ActiveConnection));
-    } else {
-        new_ac = cm->unused_connections;
-        cm->unused_connections = new_ac->next;
-        if (new_ac->next) {
-            cm->unused_connections->prev = NULL;
-        }
+    if (cm->free_head == CONNECTION_ID_NONE && grow_connections(cm) < 0) {
+        return NULL;
     }
 
-    // unlink
-    new_ac->next = NULL;
-    new_ac->prev = NULL;
-
-    // insert into occupied list
-    if (cm->occupied_connections) {
-        new_ac->next = cm->occupied_connections;
-        cm->occupied_connections->prev = new_ac;
-    }
-    cm->occupied_connections = new_ac;
+    // pop free slot
+    ActiveConnection *new_ac = connection_from_id(cm, cm->free_head);
+    cm->free_head = new_ac->next_free;
+    new_ac->next_free = CONNECTION_ID_NONE;
+    cm->n_active++;
 
     // init
     new_ac->stat = status;
     new_ac->fd = fd;
-    new_ac->data = init_request_data();
-
-    pthread_mutex_unlock(&cm->lock);
+    init_request_data(&new_ac->request);
     return new_ac;
 }
 
-void destroy_active_connection(ConnectionManager *cm, ActiveConnection *ac) {
-    if (!ac || !cm) {
-        return;
-    }
+ActiveConnection *connection_from_id(ConnectionManager *cm, uint32_t id) {
+    return &cm->segments[id / CONNECTION_SEGMENT_LEN]
+            [id % CONNECTION_SEGMENT_LEN];
+}
 
-    pthread_mutex_lock(&cm->lock);
+uint64_t connection_epoll_data(ConnectionManager *cm, ActiveConnection *ac) {
+    uint32_t generation = cm->generations[ac->id / CONNECTION_SEGMENT_LEN]
+            [ac->id % CONNECTION_SEGMENT_LEN];
+    return (uint64_t) generation << 32 | ac->id;
+}
 
-    // remove from linked list
-    if (ac->prev) {
-        ac->prev->next = ac->next;
-    } else {
-        cm->occupied_connections = ac->next;
+ActiveConnection *connection_from_epoll_data(ConnectionManager *cm,
+        uint64_t data) {
+    uint32_t id = (uint32_t) data;
+    ActiveConnection *ac = connection_from_id(cm, id);
+    if (ac->fd < 0 || cm->generations[id / CONNECTION_SEGMENT_LEN]
+            [id % CONNECTION_SEGMENT_LEN] != (uint32_t) (data >> 32)) {
+        return NULL;
     }
-    if (ac->next) {
-        ac->next->prev = ac->prev;
+    return ac;
+}
+
+size_t connection_capacity(ConnectionManager *cm) {
+    return cm->n_segments * CONNECTION_SEGMENT_LEN;
+}
+
+size_t connection_footprint(ActiveConnection *ac) {
+    if (ac->stat == Request) {
+        return buffer_capacity(ac->request.payload_block);
+    } else if (ac->stat == Stream) {
+        return 0;
     }
 
-    // unlink
-    ac->next = NULL;
-    ac->prev = NULL;
+    size_t n_bytes = buffer_capacity(ac->responce.write_buffer);
+    if (ac->responce.type == RetFileRsp) {
+        FileStream *fs = (FileStream *) ac->responce.ptr;
+        for (size_t i = 0; i < RET_FILE_READ_AHEAD; ++i) {
+            n_bytes += buffer_capacity(fs->chunks[i].buffer);
+        }
+    }
+    return n_bytes;
+}
 
-    // release unused memory
+static void release_connection(ActiveConnection *ac) {
     close(ac->fd);
     if (ac->stat == Request) {
-        destroy_reading_data(ac->data);
+        destroy_reading_data(&ac->request);
+    } else if (ac->stat == Responce) {
+        destroy_responce_data(&ac->responce);
     } else {
-        destroy_responce_data(ac->data);
+        destroy_echo_stream(&ac->stream);
     }
+    ac->fd = -1;
+    return;
+}
 
-    // add to unused
-    ac->next = cm->unused_connections;
-    if (cm->unused_connections) {
-        ac->next->prev = ac;
+void destroy_active_connection(ConnectionManager *cm, ActiveConnection *ac) {
+    if (!ac || !cm) {
+        return;
     }
-    cm->unused_connections = ac;
 
-    pthread_mutex_unlock(&cm->lock);
+    // release unused memory
+    release_connection(ac);
+
+    // push free slot, events still queued for it are stale
+    cm->generations[ac->id / CONNECTION_SEGMENT_LEN]
+            [ac->id % CONNECTION_SEGMENT_LEN]++;
+    ac->next_free = cm->free_head;
+    cm->free_head = ac->id;
+    cm->n_active--;
     return;
+}
 
+int detach_active_connection(ConnectionManager *cm, ActiveConnection *ac) {
+    if (!ac || !cm || ac->stat != Request) {
+        return -1;
+    }
+
+    // socket is kept open for its new owner
+    int fd = ac->fd;
+    destroy_reading_data(&ac->request);
+    ac->fd = -1;
+
+    // push free slot, events still queued for it are stale
+    cm->generations[ac->id / CONNECTION_SEGMENT_LEN]
+            [ac->id % CONNECTION_SEGMENT_LEN]++;
+    ac->next_free = cm->free_head;
+    cm->free_head = ac->id;
+    cm->n_active--;
+    return fd;
 }
 
 void destroy_connection_manager(ConnectionManager *cm) {
@@ -94,33 +163,17 @@ void destroy_connection_manager(ConnectionManager *cm) {
         return;
     }
 
-    pthread_mutex_lock(&cm->lock);
-
-    // release all occupied
-    ActiveConnection *ac = cm->occupied_connections;
-    ActiveConnection *prev = NULL;
-    while (ac) {
-        close(ac->fd);
-        if (ac->stat == Request) {
-            destroy_reading_data(ac->data);
-        } else {
-            destroy_responce_data(ac->data);
+    // release all occupied slots, then their segments
+    for (size_t i = 0; i < cm->n_segments; ++i) {
+        for (size_t j = 0; j < CONNECTION_SEGMENT_LEN; ++j) {
+            if (cm->segments[i][j].fd >= 0) {
+                release_connection(&cm->segments[i][j]);
+            }
         }
-        prev = ac;
-        ac = ac->next;
-        free(prev);
+        free(cm->segments[i]);
+        free(cm->generations[i]);
     }
 
-    // release all unused
-    ac = cm->unused_connections;
-    prev = NULL;
-    while (ac) {
-        prev = ac;
-        ac = ac->next;
-        free(prev);
-    }
-
-    pthread_mutex_unlock(&cm->lock);
     free(cm);
     return;
-}
\ No newline at end of file
+}
@@ -4,35 +4,56 @@
 #include "../memory/memory.h"
 #include "request.h"
 #include "responce.h"
+#include "echo_stream.h"
 
-#include <pthread.h>
+#include <stdint.h>
 
-#define INIT_NUM_UNUSED_CONNECTIONS 10
+#define CONNECTION_SEGMENT_LEN 1024 // slots allocated at a time
+#define CONNECTION_MAX_SEGMENTS 1024 // at most 1M connections per handler
+#define CONNECTION_ID_NONE UINT32_MAX
 
 enum ConnectionStatus {
     Request = 0,
-    Responce = 1
+    Responce = 1,
+    Stream = 2 // payload relayed straight back, see echo_stream.h
 };
 
-typedef struct active_connection {
+// fixed size slot, request and responce state are embedded so an idle
+// connection costs one 64 byte slot of user memory (plus the kernels socket
+// and epoll item). payload and write buffers only exist while in use
+typedef struct {
+    int fd; // client file descriptor, -1 if slot is free
+    uint32_t id; // index into the handlers slots, used as epoll data
     enum ConnectionStatus stat;
-    int fd; // client file descriptor
-    void *data; // cast based on stat
-    struct active_connection *next;
-    struct active_connection *prev;
+    uint32_t next_free; // free slot link, only valid while free
+    union {
+        RequestData request; // stat == Request
+        ResponceData responce; // stat == Responce
+        EchoStream stream; // stat == Stream
+    };
 } ActiveConnection;
 
+_Static_assert(sizeof(ActiveConnection) <= 64,
+        "idle connection footprint exceeds a cache line");
+
+// owned by a single handler thread, accepted sockets are handed over through
+// its accept queue, so no locking is required
 typedef struct {
-    ActiveConnection *occupied_connections;
-    ActiveConnection *unused_connections;
-    pthread_mutex_t lock;
+    // slots never move once allocated, segment table is never resized
+    ActiveConnection *segments[CONNECTION_MAX_SEGMENTS];
+    // generation of each slot, bumped each time it is freed. kept aside as
+    // slots are a cache line each
+    uint32_t *generations[CONNECTION_MAX_SEGMENTS];
+    size_t n_segments;
+    uint32_t free_head; // CONNECTION_ID_NONE if every slot is used
+    size_t n_active;
 } ConnectionManager;
 
 /** @brief Initialises connection manager.
  *
- *  Connection manager maintains a resource pool of ActiveConnection
- *  instances. If no unused instances are available, a new instance
- *  will be allocated.
+ *  Connection manager maintains an array of fixed size ActiveConnection
+ *  slots, indexed by connection id. Slots are allocated in segments of
+ *  CONNECTION_SEGMENT_LEN, freed slots are reused first.
  *
  *  @return ConnectionManager instance.
  */
@@ -40,9 +61,9 @@ ConnectionManager *init_connection_manager();
 
 /** @brief Returns a new active connection instance.
  *
- *  Instance is retrieved from unused instance pool if possible.
- *  Otherwise, new instance is allocated. If cm is NULL, nothing is done
- *  and NULL is returned. Prev and Next fields of returned Instance are NULL.
+ *  A free slot is reused if possible, otherwise a new segment of slots is
+ *  allocated. If cm is NULL, or CONNECTION_MAX_SEGMENTS are full, nothing is
+ *  done and NULL is returned. Embedded request is initialised.
  *
  *  @param cm : ConnectionManager instance.
  *  @param fd : client file descriptor.
@@ -52,21 +73,86 @@ ConnectionManager *init_connection_manager();
 ActiveConnection *new_active_connection(ConnectionManager *cm, int fd,
         enum ConnectionStatus status);
 
+/** @brief Retrieves an active connection by id.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @param id : Connection id.
+ *  @return ActiveConnection instance.
+ */
+ActiveConnection *connection_from_id(ConnectionManager *cm, uint32_t id);
+
+/** @brief Returns the epoll data of an active connection.
+ *
+ *  Data holds the slot id and its generation, so events still queued for a
+ *  released connection are told apart from those of a later connection
+ *  reusing the slot.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @param ac : ActiveConnection instance.
+ *  @return epoll data.
+ */
+uint64_t connection_epoll_data(ConnectionManager *cm, ActiveConnection *ac);
+
+/** @brief Retrieves an active connection by epoll data.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @param data : Epoll data returned by connection_epoll_data.
+ *  @return ActiveConnection instance, NULL if the connection has been
+ *  released since.
+ */
+ActiveConnection *connection_from_epoll_data(ConnectionManager *cm,
+        uint64_t data);
+
+/** @brief Returns the number of connection slots allocated.
+ *
+ *  Every id below the returned count addresses a slot, free slots have a
+ *  negative fd.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @return number of slots.
+ */
+size_t connection_capacity(ConnectionManager *cm);
+
+/** @brief Returns bytes of buffers a connection currently holds.
+ *
+ *  Counts the request payload, or the responce write buffer and any file
+ *  stream chunk buffers. Streamed echoes hold no user memory.
+ *
+ *  @param ac : ActiveConnection instance.
+ *  @return bytes held.
+ */
+size_t connection_footprint(ActiveConnection *ac);
+
 /** @brief Releases an active connection instance from use.
  *
- *  Instance is not always released instantaeously. If not released, instance
- *  is marked as unused, and will be issued to new active connections.
+ *  Socket is closed and embedded request or responce is released. Slot is
+ *  marked as free, and will be issued to new active connections. If ac or cm
+ *  are NULL, nothing is done.
  *
- *  @return ActiveConnection instance.
+ *  @param cm : ConnectionManager instance.
+ *  @param ac : ActiveConnection instance.
  */
 void destroy_active_connection(ConnectionManager *cm, ActiveConnection *ac);
 
+/** @brief Releases an active connection instance without closing its socket.
+ *
+ *  Used to hand a connection over to another handler between requests. Any
+ *  partially read request is released and the slot is marked as free. If ac
+ *  or cm are NULL, or the connection is not reading a request, -1 is
+ *  returned.
+ *
+ *  @param cm : ConnectionManager instance.
+ *  @param ac : ActiveConnection instance, reading a request.
+ *  @return socket file descriptor, -1 on error.
+ */
+int detach_active_connection(ConnectionManager *cm, ActiveConnection *ac);
+
 /** @brief Destroys ConnectionManager instance.
  *
- *  If ac or cm are NULL, nothing is done. All tracked ActiveConnection
- *  instances are released from memory, including data fields.
+ *  If cm is NULL, nothing is done. All open connections are closed and
+ *  released, and all slots are released from memory.
  *
- *  @param cm : ActiveConnection instance.
+ *  @param cm : ConnectionManager instance.
  */
 void destroy_connection_manager(ConnectionManager *cm);
 
@@ -0,0 +1,143 @@
+#include "echo_stream.h"
+
+/** @brief Splices from the client into the pipe without blocking.
+ *
+ *  @param fd_in : Client descriptor.
+ *  @param fd_out : Destination descriptor.
+ *  @param len : Maximum bytes moved.
+ *  @return bytes moved, 0 if either side would block, -1 on error or EOF.
+ */
+static ssize_t splice_some(int fd_in, int fd_out, uint64_t len);
+
+bool echo_stream_eligible(RequestData *rd) {
+    if (!request_payload_unread(rd) || rd->payload_len < ECHO_STREAM_THRESHOLD) {
+        return false;
+    }
+
+    uint8_t header = rd->metadata_buffer[0];
+    bool compressed = header & MSG_HEADER_COMPRESSION_MASK;
+    bool req_compression = header & MSG_HEADER_REQ_COMPRESSION_MASK;
+    // payload needing compression is not echoed unchanged
+    return ((header & MSG_HEADER_TYPE_MASK) >> 4) == EchoReq &&
+            (compressed || !req_compression);
+}
+
+int init_echo_stream(EchoStream *es, RequestData *rd) {
+    if (!es || !rd) {
+        return -1;
+    }
+
+    if (pipe2(es->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+    // larger pipes mean fewer wakeups, default capacity otherwise
+    fcntl(es->pipe_fds[1], F_SETPIPE_SZ, ECHO_STREAM_PIPE_SIZE);
+    int pipe_size = fcntl(es->pipe_fds[1], F_GETPIPE_SZ);
+    es->pipe_size = pipe_size > 0 ? pipe_size : 65536;
+
+    // same payload length, echo type, compression flag preserved
+    memcpy(es->metadata_buffer, rd->metadata_buffer, REQUEST_METADATA_SIZE);
+    es->metadata_buffer[0] = (EchoRsp << 4) |
+            (rd->metadata_buffer[0] & MSG_HEADER_COMPRESSION_MASK);
+    es->metadata_n = 0;
+    es->pipe_full = false;
+
+    es->events = EPOLLIN;
+    es->n_unread = rd->payload_len;
+    es->n_buffered = 0;
+    return 0;
+}
+
+static ssize_t splice_some(int fd_in, int fd_out, uint64_t len) {
+    errno = 0;
+    ssize_t n = splice(fd_in, NULL, fd_out, NULL, len,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    stats_count_syscall(StatsSocketRead, n < 0 && errno == EAGAIN);
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    // client closed before sending the full payload
+    return n > 0 ? n : -1;
+}
+
+int echo_stream_advance(EchoStream *es, int fd) {
+    if (!es) {
+        return -1;
+    }
+
+    // header first
+    if (es->metadata_n < REQUEST_METADATA_SIZE) {
+        errno = 0;
+        ssize_t n = write(fd, es->metadata_buffer + es->metadata_n,
+                REQUEST_METADATA_SIZE - es->metadata_n);
+        stats_count_syscall(StatsSocketWrite, n < 0 && errno == EWOULDBLOCK);
+        if (n <= 0 && errno != EWOULDBLOCK) {
+            return -1;
+        } else if (n < 0) {
+            return 0;
+        }
+        es->metadata_n += n;
+        if (es->metadata_n < REQUEST_METADATA_SIZE) {
+            return 0;
+        }
+    }
+
+    // alternate until neither side makes progress
+    ssize_t n_in = 0;
+    ssize_t n_out = 0;
+    do {
+        n_in = 0;
+        if (es->n_unread && es->n_buffered < es->pipe_size) {
+            uint64_t len = es->pipe_size - es->n_buffered;
+            n_in = splice_some(fd, es->pipe_fds[1],
+                    len < es->n_unread ? len : es->n_unread);
+            if (n_in < 0) {
+                return -1;
+            }
+            // pipe slots hold partial pages, it may fill below pipe_size
+            es->pipe_full = !n_in && es->n_buffered;
+            es->n_unread -= n_in;
+            es->n_buffered += n_in;
+        }
+
+        n_out = 0;
+        if (es->n_buffered) {
+            errno = 0;
+            n_out = splice(es->pipe_fds[0], NULL, fd, NULL, es->n_buffered,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            stats_count_syscall(StatsSocketWrite, n_out < 0 && errno == EAGAIN);
+            if (n_out < 0 && errno != EAGAIN) {
+                return -1;
+            } else if (n_out < 0) {
+                n_out = 0;
+            }
+            es->n_buffered -= n_out;
+            if (n_out) {
+                es->pipe_full = false;
+            }
+        }
+    } while (n_in > 0 || n_out > 0);
+
+    return !es->n_unread && !es->n_buffered;
+}
+
+uint32_t echo_stream_events(EchoStream *es) {
+    uint32_t events = 0;
+    if (es->n_unread && es->n_buffered < es->pipe_size && !es->pipe_full) {
+        events |= EPOLLIN;
+    }
+    if (es->metadata_n < REQUEST_METADATA_SIZE || es->n_buffered) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+void destroy_echo_stream(EchoStream *es) {
+    if (!es) {
+        return;
+    }
+
+    close(es->pipe_fds[0]);
+    close(es->pipe_fds[1]);
+    return;
+}
@@ -0,0 +1,90 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ECHO_STREAM_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ECHO_STREAM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "request.h"
+#include "responce.h"
+#include "header_masks.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#define ECHO_STREAM_THRESHOLD 65536 // smaller echoes are stored and forwarded
+#define ECHO_STREAM_PIPE_SIZE (256 * 1024) // requested pipe capacity
+
+// payload relayed socket -> pipe -> socket, embedded in its connection
+typedef struct {
+    uint8_t metadata_buffer[REQUEST_METADATA_SIZE]; // responce header
+    uint8_t metadata_n; // header bytes written
+    bool pipe_full; // pipe refused data, wait for it to drain
+    int pipe_fds[2];
+    uint32_t pipe_size;
+    uint32_t events; // epoll events currently watched
+    uint64_t n_unread; // payload bytes still to be read from the client
+    uint64_t n_buffered; // payload bytes held by the pipe
+} EchoStream;
+
+/** @brief Checks if an echo request should be streamed.
+ *
+ *  Request must have its metadata read and no payload read yet. Only echoes
+ *  sent back unchanged (no compression required of an uncompressed payload)
+ *  of at least ECHO_STREAM_THRESHOLD bytes are streamed.
+ *
+ *  @param rd : RequestData instance.
+ *  @return True if payload should be streamed.
+ */
+bool echo_stream_eligible(RequestData *rd);
+
+/** @brief Initialises echo stream.
+ *
+ *  Responce header is built from the request metadata, and a pipe is
+ *  created to relay the payload with splice. Payload never enters user
+ *  memory, and at most a pipe of data is held per connection. Stream starts
+ *  watching EPOLLIN.
+ *
+ *  The client must read the responce while sending the payload, once the
+ *  pipe and socket buffers fill the payload is no longer read.
+ *
+ *  @param es : EchoStream instance.
+ *  @param rd : RequestData instance, eligible for streaming.
+ *  @return 0 on success, -1 if no pipe could be created.
+ */
+int init_echo_stream(EchoStream *es, RequestData *rd);
+
+/** @brief Relays as much of the payload as possible.
+ *
+ *  Writes any unsent header, splices available payload into the pipe, and
+ *  the pipe into the socket. All operations are NON BLOCKING.
+ *
+ *  @param es : EchoStream instance.
+ *  @param fd : Client file descriptor.
+ *  @return status, -1 (error), 0 (unfinished), 1 (finished).
+ */
+int echo_stream_advance(EchoStream *es, int fd);
+
+/** @brief Returns the epoll events a stream needs to make progress.
+ *
+ *  EPOLLIN while payload is unread and the pipe has room, EPOLLOUT while
+ *  header or piped payload is unsent.
+ *
+ *  @param es : EchoStream instance.
+ *  @return epoll event mask.
+ */
+uint32_t echo_stream_events(EchoStream *es);
+
+/** @brief Releases echo stream.
+ *
+ *  Pipe is closed. If es is NULL, nothing is done.
+ *
+ *  @param es : EchoStream instance.
+ */
+void destroy_echo_stream(EchoStream *es);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_ECHO_STREAM_H
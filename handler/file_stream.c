@@ -0,0 +1,132 @@
+#include "file_stream.h"
+
+FileStream *init_file_stream(OpenFileInstance *ofi, bool req_compression) {
+    if (!ofi) {
+        return NULL;
+    }
+
+    FileStream *fs = slab_alloc(sizeof(FileStream));
+    fs->ofi = ofi;
+    fs->req_compression = req_compression;
+    fs->next_chunk = 0;
+    fs->n_pending = 0;
+    fs->waiting = true;
+    fs->orphaned = false;
+    fs->owner = NULL;
+
+    for (size_t i = 0; i < RET_FILE_READ_AHEAD; ++i) {
+        fs->chunks[i].state = ChunkEmpty;
+        fs->chunks[i].buffer = NULL;
+        fs->chunks[i].file_offset = 0;
+        fs->chunks[i].n_bytes = 0;
+    }
+    return fs;
+}
+
+size_t file_stream_schedule_reads(FileStream *fs, IOPool *pool,
+        IOCompletionQueue *cq, void *ctx) {
+    if (!fs || !pool || !cq) {
+        return 0;
+    }
+
+    size_t n_submitted = 0;
+    for (size_t i = 0; i < RET_FILE_READ_AHEAD; ++i) {
+        FileChunk *chunk = &fs->chunks[(fs->next_chunk + i) % RET_FILE_READ_AHEAD];
+        if (chunk->state != ChunkEmpty) {
+            continue;
+        }
+
+        uint64_t start = 0;
+        uint64_t n_bytes = open_file_claim(fs->ofi, RET_FILE_CHUNK_SIZE, &start);
+        if (!n_bytes) {
+            // range completely claimed
+            break;
+        }
+
+        if (!chunk->buffer) {
+            chunk->buffer = buffer_alloc(RET_FILE_HEADROOM + RET_FILE_CHUNK_SIZE);
+        }
+        chunk->state = ChunkPending;
+        chunk->file_offset = start;
+        chunk->n_bytes = 0;
+        chunk->job.fd = fs->ofi->fd;
+        chunk->job.buffer = chunk->buffer + RET_FILE_HEADROOM;
+        chunk->job.len = n_bytes;
+        chunk->job.offset = start;
+        chunk->job.ctx = ctx;
+        chunk->job.cq = cq;
+        if (io_pool_submit(pool, &chunk->job) < 0) {
+            // pool is stopping, the stream is dropped with its handler
+            chunk->state = ChunkEmpty;
+            break;
+        }
+        fs->n_pending++;
+        n_submitted++;
+    }
+
+    if (n_submitted) {
+        open_file_prefetch(fs->ofi, (uint64_t) RET_FILE_PREFETCH_CHUNKS *
+                RET_FILE_CHUNK_SIZE);
+    }
+    return n_submitted;
+}
+
+void file_stream_complete_read(FileStream *fs, IOJob *job) {
+    if (!fs || !job) {
+        return;
+    }
+
+    for (size_t i = 0; i < RET_FILE_READ_AHEAD; ++i) {
+        FileChunk *chunk = &fs->chunks[i];
+        if (&chunk->job == job) {
+            chunk->state = ChunkReady;
+            chunk->n_bytes = job->n_read < 0 ? 0 : (uint64_t) job->n_read;
+            fs->n_pending--;
+            break;
+        }
+    }
+    return;
+}
+
+FileChunk *file_stream_next_chunk(FileStream *fs) {
+    if (!fs) {
+        return NULL;
+    }
+
+    FileChunk *chunk = &fs->chunks[fs->next_chunk];
+    return chunk->state == ChunkReady ? chunk : NULL;
+}
+
+void file_stream_release_chunk(FileStream *fs) {
+    if (!fs) {
+        return;
+    }
+
+    fs->chunks[fs->next_chunk].state = ChunkEmpty;
+    fs->next_chunk = (fs->next_chunk + 1) % RET_FILE_READ_AHEAD;
+    return;
+}
+
+bool file_stream_finished(FileStream *fs) {
+    if (!fs) {
+        return true;
+    }
+
+    // chunks are filled in send order, so an empty next chunk means
+    // nothing follows it
+    return fs->chunks[fs->next_chunk].state == ChunkEmpty;
+}
+
+void destroy_file_stream(FileStream *fs) {
+    if (!fs) {
+        return;
+    }
+
+    open_file_release(fs->ofi);
+
+    for (size_t i = 0; i < RET_FILE_READ_AHEAD; ++i) {
+        buffer_release(fs->chunks[i].buffer);
+    }
+    slab_free(fs);
+    return;
+}
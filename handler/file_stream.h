@@ -0,0 +1,122 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_FILE_STREAM_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_FILE_STREAM_H
+
+#include "../memory/memory.h"
+#include "../memory/slab.h"
+#include "../memory/buffer_pool.h"
+#include "../io/io_pool.h"
+#include "open_file_instance.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define RET_FILE_READ_AHEAD 2
+#define RET_FILE_PREFIX_SIZE 20 // session id, offset, length
+// responce header, payload length and prefix, ahead of file data
+#define RET_FILE_HEADROOM (9 + RET_FILE_PREFIX_SIZE)
+// chunk buffers fill a 64 KiB pool class exactly
+#define RET_FILE_CHUNK_SIZE (65536 - RET_FILE_HEADROOM)
+#define RET_FILE_PREFETCH_CHUNKS 16 // chunks kept warm in page cache
+
+enum FileChunkState {
+    ChunkEmpty = 0,
+    ChunkPending = 1,
+    ChunkReady = 2
+};
+
+typedef struct {
+    enum FileChunkState state;
+    // RET_FILE_HEADROOM bytes reserved ahead of file data, pooled, NULL
+    // once handed to a responce until the chunk is reused
+    uint8_t *buffer;
+    uint64_t file_offset; // absolute offset of first byte
+    uint64_t n_bytes; // number of file bytes held
+    IOJob job;
+} FileChunk;
+
+typedef struct {
+    OpenFileInstance *ofi;
+    bool req_compression;
+    // ring buffer of chunks, sent in order starting at next_chunk
+    FileChunk chunks[RET_FILE_READ_AHEAD];
+    size_t next_chunk;
+    size_t n_pending; // reads in flight
+    bool waiting; // owner is not armed for writing
+    bool orphaned; // owner closed while reads were in flight
+    void *owner; // ActiveConnection streaming the file
+} FileStream;
+
+/** @brief Initialises file stream.
+ *
+ *  File stream reads the byte range of an open file instance in chunks, ahead
+ *  of the responce currently being written. If ofi is NULL, nothing is done
+ *  and NULL is returned. Stream starts in waiting state with no reads queued.
+ *
+ *  @param ofi : OpenFileInstance being streamed.
+ *  @param req_compression : Responce chunks require compression.
+ *  @return FileStream instance.
+ */
+FileStream *init_file_stream(OpenFileInstance *ofi, bool req_compression);
+
+/** @brief Keeps read ahead window full.
+ *
+ *  Each empty chunk, in send order, claims the next range of the open file
+ *  instance and is submitted to the IO pool. Chunks without a buffer are
+ *  given a new one from the buffer pool. Scheduling stops once the file
+ *  range has been completely claimed. Kernel readahead is kept
+ *  RET_FILE_PREFETCH_CHUNKS chunks beyond the claimed ranges, so chunk reads
+ *  are served from page cache while earlier chunks are on the wire.
+ *
+ *  @param fs : FileStream instance.
+ *  @param pool : IOPool instance.
+ *  @param cq : Completion queue of the owning handler.
+ *  @param ctx : Context attached to submitted jobs.
+ *  @return number of reads submitted.
+ */
+size_t file_stream_schedule_reads(FileStream *fs, IOPool *pool,
+        IOCompletionQueue *cq, void *ctx);
+
+/** @brief Marks chunk read as complete.
+ *
+ *  Chunk owning the job becomes ready to be sent.
+ *
+ *  @param fs : FileStream instance.
+ *  @param job : Completed job, drained from completion queue.
+ */
+void file_stream_complete_read(FileStream *fs, IOJob *job);
+
+/** @brief Retrieves the next chunk to be sent.
+ *
+ *  If next chunk has not yet been read, NULL is returned.
+ *
+ *  @param fs : FileStream instance.
+ *  @return FileChunk instance or NULL.
+ */
+FileChunk *file_stream_next_chunk(FileStream *fs);
+
+/** @brief Releases next chunk once its data has been consumed.
+ *
+ *  Chunk is emptied, and the following chunk becomes the next chunk.
+ *
+ *  @param fs : FileStream instance.
+ */
+void file_stream_release_chunk(FileStream *fs);
+
+/** @brief Checks if stream has nothing left to send.
+ *
+ *  @param fs : FileStream instance.
+ *  @return True if no chunks are pending or ready.
+ */
+bool file_stream_finished(FileStream *fs);
+
+/** @brief Destroys file stream.
+ *
+ *  Chunk buffers are released and open file instance reference count is
+ *  decremented. Must not be called while reads are in flight.
+ *
+ *  @param fs : FileStream instance.
+ */
+void destroy_file_stream(FileStream *fs);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_FILE_STREAM_H
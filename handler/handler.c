@@ -4,9 +4,10 @@
  *
  *  Handles requests by routing RequestData to appropriate handler
  *  (echo, error, etc...). If request type is unknown, request will be routed
- *  to error handler. ResponceData instance with loaded write buffer is created
- *  and returned.
+ *  to error handler. ResponceData instance is initialised with a loaded write
+ *  buffer. If no responce is sent (shutdown), -1 is returned.
  *
+ *  @param rsp : ResponceData instance to initialise.
  *  @param rd : RequestData instance.
  *  @param fd : client file descriptor.
  *  @param h : Handler instance.
@@ -15,13 +16,110 @@
  *  @param decomp_tree : Decompression tree.
  *  @param ofis : OpenFileInstances.
  *  @param main_thread : main thread id.
- *  @return ResponceData instance.
+ *  @return 0 on success, -1 if no responce was created.
  */
-static ResponceData *handle_request(RequestData *rd, int fd,  Handler *h,
-        Config *config, CompressionSegment *comp_dict,
+static int handle_request(ResponceData *rsp, RequestData *rd, int fd,
+        Handler *h, Config *config, CompressionSegment *comp_dict,
         DecompressionTreeNode *decomp_tree, OpenFileInstances *ofis,
         pthread_t main_thread);
 
+/** @brief Takes a snapshot of server metrics.
+ *
+ *  Counters of every thread are merged, and reported with the state of the
+ *  handler group and shared resources (see get_stats for the layout).
+ *
+ *  @param h : Handler instance.
+ *  @param ofis : OpenFileInstances.
+ *  @param len : Set to snapshot length, excluding headroom.
+ *  @return pooled buffer, snapshot follows REQUEST_PAYLOAD_HEADROOM bytes.
+ */
+static uint8_t *snapshot_stats(Handler *h, OpenFileInstances *ofis,
+        size_t *len);
+
+/** @brief Records the latency of a responce reaching a milestone.
+ *
+ *  Latency is measured from the read of its request. Untimed responces are
+ *  ignored (see stats_record_latency). Responces that are timed but not
+ *  sampled only take the last byte milestone, for the slow request log. A
+ *  clock read already taken can be reused, so milestones reached together
+ *  cost a single read.
+ *
+ *  @param rd : ResponceData instance.
+ *  @param milestone : Milestone reached.
+ *  @param now : Monotonic ns, 0 to read the clock.
+ *  @return monotonic ns the milestone was recorded at, 0 if untimed.
+ */
+static uint64_t record_latency(ResponceData *rd,
+        enum StatsMilestone milestone, uint64_t now);
+
+/** @brief Returns the trace of the request on a connection.
+ *
+ *  Traces are allocated a segment of connection slots at a time, on first
+ *  use.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance.
+ *  @return RequestTrace, NULL if slow requests are not logged.
+ */
+static RequestTrace *connection_trace(Handler *h, ActiveConnection *conn);
+
+/** @brief Logs the request on a connection if it was slow.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, last byte of its responce written.
+ *  @param now : Monotonic ns, 0 if the request was not timed.
+ */
+static void log_slow_request(Handler *h, ActiveConnection *conn,
+        uint64_t now);
+
+/** @brief Returns the capture state of a connection.
+ *
+ *  States are allocated a segment of connection slots at a time, on first
+ *  use.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance.
+ *  @return ConnectionCapture, NULL if requests are not captured.
+ */
+static ConnectionCapture *connection_capture(Handler *h,
+        ActiveConnection *conn);
+
+/** @brief Records the request read on a connection, if it is sampled.
+ *
+ *  Payload is referenced by the record, unless it is to be streamed.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, metadata of its request read.
+ */
+static void capture_read_request(Handler *h, ActiveConnection *conn);
+
+/** @brief Reads the request of a connection.
+ *
+ *  Read is timed as parsing once the header has been read, along with the
+ *  phases that follow until the responce is built. The trace of the request
+ *  is reset on its first read.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance.
+ *  @return request_read status.
+ */
+static int read_request(Handler *h, ActiveConnection *conn);
+
+/** @brief Writes the responce of a connection, timed as a write.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance.
+ *  @return responce_write status.
+ */
+static int write_responce(Handler *h, ActiveConnection *conn);
+
+/** @brief Appends a big endian field to a snapshot.
+ *
+ *  @param dest : Address of the write position, advanced past the field.
+ *  @param value : Field value.
+ */
+static void put_field(uint8_t **dest, uint64_t value);
+
 /** @brief Updates active request after read.
  *
  *  Checks if request is ready to be handled. If ready, payload is passed to
@@ -35,14 +133,74 @@ static ResponceData *handle_request(RequestData *rd, int fd,  Handler *h,
  *  @param comp_dict : Compression dictionary.
  *  @param decomp_tree : Decompression tree.
  *  @param ret_read : status of read (-1 (error), 0 (unfinished), 1 (finished)).
- *  @param conn_event_index : index of event in epoll events array.
  *  @param ofis : Server OpenFileInstances instance.
  *  @param main_thread : Server thread.
  */
 static void update_request(Handler *h, ActiveConnection *conn, Config *config,
         CompressionSegment *comp_dict, DecompressionTreeNode *decomp_tree,
-        int ret_read, size_t conn_event_index, OpenFileInstances *ofis,
-        pthread_t main_thread);
+        int ret_read, OpenFileInstances *ofis, pthread_t main_thread);
+
+/** @brief Moves an echo request onto a streamed responce.
+ *
+ *  Once its metadata has been read, an eligible echo request (see
+ *  echo_stream_eligible) is relayed back as it arrives, instead of being
+ *  buffered. If no stream can be created, the request is read as usual.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, reading a request.
+ */
+static void start_echo_stream(Handler *h, ActiveConnection *conn);
+
+/** @brief Advances a streamed echo.
+ *
+ *  Payload is relayed as far as possible, and watched events are updated to
+ *  those the stream is waiting on. Once the payload has been echoed the
+ *  connection is recycled, on error it is terminated.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, streaming an echo.
+ */
+static void update_echo_stream(Handler *h, ActiveConnection *conn);
+
+/** @brief Admits a request payload against the memory budgets.
+ *
+ *  Called once request metadata has been read, before the payload is
+ *  allocated. Payloads larger than the connection limit are refused with an
+ *  error responce. If the payload would exceed the handler limit, reads are
+ *  paused until responces drain (see balance_memory).
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, reading a request.
+ */
+static void admit_payload(Handler *h, ActiveConnection *conn);
+
+/** @brief Applies read backpressure against the handler memory budget.
+ *
+ *  While usage exceeds the limit, reads are paused on the heaviest reading
+ *  connections until their buffers cover the excess. Once usage falls to the
+ *  resume threshold, all paused connections are watched for reads again.
+ *  Paused connections are also resumed if the handler is idle, as the memory
+ *  may be held by the paused connections themselves.
+ *
+ *  @param h : Handler instance.
+ *  @param idle : True if no events were ready within HANDLER_THROTTLE_IDLE_MS.
+ */
+static void balance_memory(Handler *h, bool idle);
+
+/** @brief Pauses reads of a connection.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, reading a request.
+ */
+static void throttle_connection(Handler *h, ActiveConnection *conn);
+
+/** @brief Orders connections by descending footprint, for qsort.
+ *
+ *  @param a : Address of an ActiveConnection pointer.
+ *  @param b : Address of an ActiveConnection pointer.
+ *  @return comparison result.
+ */
+static int compare_footprint(const void *a, const void *b);
 
 /** @brief Updates responce post-write.
  *
@@ -52,7 +210,7 @@ static void update_request(Handler *h, ActiveConnection *conn, Config *config,
  *
  *      Error      -> connection terminated.
  *      RetFileRsp -> recycled if file has completely sent, reloads payload
- *                    with more data otherwise.
+ *                    with the next chunk otherwise (see advance_file_stream).
  *      Default    -> Recycles connection (new request).
  *
  *  @param h : Handler instance.
@@ -60,21 +218,71 @@ static void update_request(Handler *h, ActiveConnection *conn, Config *config,
  *  @param comp_dict : Compression dictionary.
  *  @param decomp_tree : Decompression tree.
  *  @param ret_write : status of write (-1 (error), 0 (unfinished), 1 (finished)).
- *  @param conn_event_index : index of event in epoll events array.
  */
 static void update_responce(Handler *h, ActiveConnection *conn,
         CompressionSegment *comp_dict, DecompressionTreeNode *decomp_tree,
-        int ret_write, size_t conn_event_index);
+        int ret_write);
+
+/** @brief Moves RetFile responce onto its next chunk.
+ *
+ *  Read ahead window of the connections file stream is refilled, and the
+ *  write buffer is loaded with the next chunk. The connection is only armed
+ *  for EPOLLOUT while a chunk is loaded, if the next chunk is still being
+ *  read the connection waits for its completion (see update_file_read). Once
+ *  all chunks have been sent, the connection is recycled.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, holding a RetFileRsp.
+ *  @param comp_dict : Compression dictionary.
+ */
+static void advance_file_stream(Handler *h, ActiveConnection *conn,
+        CompressionSegment *comp_dict);
+
+/** @brief Handles a file read completed by the IO pool.
+ *
+ *  Chunk is marked as ready. If the owning connection was waiting on the
+ *  chunk, its file stream is advanced. If the connection has since been
+ *  closed, the responce is released once its last read completes. Failed
+ *  reads terminate the connection.
+ *
+ *  @param h : Handler instance.
+ *  @param job : Completed IOJob.
+ *  @param comp_dict : Compression dictionary.
+ */
+static void update_file_read(Handler *h, IOJob *job,
+        CompressionSegment *comp_dict);
+
+/** @brief Handles a responce task completed by the executor.
+ *
+ *  Owning connection is armed for EPOLLOUT with the write buffer built by the
+ *  task. If the connection has since been closed, the task is released. If
+ *  the task failed, the connection is terminated.
+ *
+ *  @param h : Handler instance.
+ *  @param task : Completed Task, embedded in a ResponceTask.
+ */
+static void update_responce_task(Handler *h, Task *task);
+
+/** @brief Updates the events a connection is watched for.
+ *
+ *  If epoll_ctl fails, error message is printed and program exits with
+ *  status EXIT_FAILURE.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance.
+ *  @param events : epoll event mask, 0 to stop watching reads and writes.
+ */
+static void watch_connection(Handler *h, ActiveConnection *conn,
+        uint32_t events);
 
 /** @brief Recycles connection.
  *
- *  Updates connection status to Request, and connection data is
- *  updated to a new RequestData instance. EPOLL event updated to
- *  EPOLLIN.
+ *  Updates connection status to Request, and the embedded request is
+ *  reinitialised. EPOLL event updated to EPOLLIN. If a request has been
+ *  read, it is handled and the connection moves to Responce instead.
  *
  *  @param h : Handler instance.
  *  @param conn : ActiveConnection instance.
- *  @param conn_event_index : index of event in epoll events array.
  *  @param config : Server configuration.
  *  @param comp_dict : Compression dictionary.
  *  @param decomp_tree : Decompression tree.
@@ -82,32 +290,186 @@ static void update_responce(Handler *h, ActiveConnection *conn,
  *  @param main_thread : Server thread.
  */
 static void recycle_connection(Handler *h, ActiveConnection *conn,
-        size_t conn_event_index, Config *config, CompressionSegment *comp_dict,
+        Config *config, CompressionSegment *comp_dict,
         DecompressionTreeNode *decomp_tree, OpenFileInstances *ofis,
         pthread_t main_thread);
 
+/** @brief Attaches clients handed over through the accept queue.
+ *
+ *  Each queued socket is given an active connection instance and watched for
+ *  EPOLLIN. If no slot is free, or the socket cannot be watched, it is closed.
+ *
+ *  @param h : Handler instance.
+ */
+static void attach_clients(Handler *h);
+
 /** @brief Terminates connection.
  *
  *  Terminates connection. All allocated memory is released. Socket is closed.
  *
  *  @param h : Handler instance.
  *  @param conn : ActiveConnection instance.
- *  @param conn_event_index : index of event in epoll events array.
  */
-static void terminate_connection(Handler *h, ActiveConnection *conn,
-        size_t conn_event_index);
+static void terminate_connection(Handler *h, ActiveConnection *conn);
 
-int init_handler(Handler **h) {
+/** @brief Claims one connection the handler has been asked to shed.
+ *
+ *  A shed count of SIZE_MAX (parked handler) is never used up.
+ *
+ *  @param h : Handler instance.
+ *  @return true if a connection should be moved, false otherwise.
+ */
+static bool take_shed(Handler *h);
+
+/** @brief Moves a connection to another handler of the group.
+ *
+ *  Connection must be between requests, with nothing of the next request
+ *  read. It is removed from the handlers epoll instance and its slot is
+ *  released, then the open socket is handed to the least loaded handler (see
+ *  new_client), which watches it for EPOLLIN. Bytes already sent by the
+ *  client stay queued on the socket. If no other handler is awake, nothing
+ *  is done.
+ *
+ *  @param h : Handler instance.
+ *  @param conn : ActiveConnection instance, reading a request.
+ *  @return true if the connection was moved, false otherwise.
+ */
+static bool migrate_connection(Handler *h, ActiveConnection *conn);
+
+/** @brief Moves idle connections while the handler is shedding.
+ *
+ *  Connections waiting on a new request are moved until the shed count is
+ *  used up. Busy connections are moved once their responce completes (see
+ *  recycle_connection).
+ *
+ *  @param h : Handler instance.
+ */
+static void shed_idle_connections(Handler *h);
+
+/** @brief Handler group balancer thread.
+ *
+ *  Rebalances the group every HANDLER_BALANCE_INTERVAL_MS (see
+ *  balance_handlers), returning once the group is stopping.
+ *
+ *  @param arg : HandlerGroup instance.
+ */
+static void *balancer(void *arg);
+
+/** @brief Measures handler loads and acts on them.
+ *
+ *  Load is the share of the interval a handler spent handling events. If
+ *  the average load of awake handlers is high, the first parked handler is
+ *  woken. If it is low enough for one fewer handler to absorb, the last awake
+ *  handler is parked. Otherwise handlers well above the average shed part of
+ *  their connections onto the others.
+ *
+ *  @param group : HandlerGroup instance.
+ *  @param interval_ns : Nanoseconds since the last balance.
+ */
+static void balance_handlers(HandlerGroup *group, uint64_t interval_ns);
+
+/** @brief Returns the epoll_wait timeout of the handler.
+ *
+ *  Paused connections are resumed after HANDLER_THROTTLE_IDLE_MS idle, and
+ *  unpublished metrics are published after METRICS_PUBLISH_INTERVAL_MS idle.
+ *
+ *  @param h : Handler instance.
+ *  @return timeout in milliseconds, -1 to wait indefinitely.
+ */
+static int wait_timeout(Handler *h);
+
+/** @brief Publishes handler counters to its metrics slot.
+ *
+ *  Called once per batch of events. Counters are published if the interval
+ *  has passed since the last publish, otherwise they are marked stale. If
+ *  the handler has no slot, nothing is done.
+ *
+ *  @param h : Handler instance.
+ */
+static void publish_metrics(Handler *h);
+
+/** @brief Publishes handler group counters to its metrics slot.
+ *
+ *  If the group has no slot, nothing is done.
+ *
+ *  @param group : HandlerGroup instance.
+ *  @param now : Monotonic ns of the balance.
+ */
+static void publish_group_metrics(HandlerGroup *group, uint64_t now);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+int init_handler(Handler **h, IOPool *io_pool, Executor *executor,
+        MetadataCache *md_cache,
+        ListingCache *listing_cache, SlabAllocator *slab,
+        BufferPool *buffer_pool, MemoryBudget *budget, StatsRegistry *stats,
+        SlowLog *slow_log, Capture *capture, MetricsHandlerSlot *metrics) {
     if (!h) {
         return -1;
     }
 
     *h = safe_malloc(sizeof(Handler));
     (*h)->epoll_fd = epoll_create1(0);
-    (*h)->events = safe_malloc(sizeof(struct epoll_event) * EPOLL_EVENTS_SIZE_INIT);
-    (*h)->events_len = EPOLL_EVENTS_SIZE_INIT;
     (*h)->conn_manager = init_connection_manager();
+    (*h)->accept_queue = init_accept_queue();
+    (*h)->io_pool = io_pool;
+    (*h)->io_cq = init_io_completion_queue();
+    (*h)->executor = executor;
+    (*h)->task_cq = init_task_completion_queue();
+    (*h)->md_cache = md_cache;
+    (*h)->listing_cache = listing_cache;
+    (*h)->slab = slab;
+    (*h)->buffer_pool = buffer_pool;
+    (*h)->buffer_cache = NULL;
+    (*h)->budget = budget;
+    (*h)->stats = stats;
+    (*h)->n_throttled = 0;
+    (*h)->throttled_bytes = 0;
+    (*h)->group = NULL;
+    atomic_init(&(*h)->n_migrated, 0);
+    atomic_init(&(*h)->busy_ns, 0);
+    (*h)->batch_ns = 0;
+    (*h)->n_handled = 0;
+    atomic_init(&(*h)->n_shed, 0);
+    atomic_init(&(*h)->shed_scan, false);
     atomic_init(&(*h)->n_connections, 0);
+    (*h)->metrics = metrics;
+    (*h)->metrics_ns = 0;
+    // published once started, even if never given a connection
+    (*h)->metrics_stale = metrics != NULL;
+    (*h)->slow_ring = init_slow_log_ring(slow_log);
+    // segments are allocated as their connections are first traced
+    (*h)->traces = slow_log ? safe_calloc(CONNECTION_MAX_SEGMENTS,
+            sizeof(RequestTrace *)) : NULL;
+    (*h)->capture = capture;
+    (*h)->capture_ring = init_capture_ring(capture);
+    // segments are allocated as their connections are attached
+    (*h)->captures = capture ? safe_calloc(CONNECTION_MAX_SEGMENTS,
+            sizeof(ConnectionCapture *)) : NULL;
+
+    // watch for completed file reads
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = HANDLER_IO_CQ_EVENT;
+    if (epoll_ctl((*h)->epoll_fd, EPOLL_CTL_ADD, (*h)->io_cq->event_fd, &ev) < 0) {
+        return -1;
+    }
+    // watch for completed tasks
+    ev.data.u64 = HANDLER_TASK_CQ_EVENT;
+    if (epoll_ctl((*h)->epoll_fd, EPOLL_CTL_ADD, (*h)->task_cq->event_fd,
+            &ev) < 0) {
+        return -1;
+    }
+    // watch for accepted clients
+    ev.data.u64 = HANDLER_ACCEPT_EVENT;
+    if (epoll_ctl((*h)->epoll_fd, EPOLL_CTL_ADD, (*h)->accept_queue->event_fd,
+            &ev) < 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -116,128 +478,447 @@ int new_client(Handler *h, int client_sock_fd) {
         return -1;
     }
 
-    static struct epoll_event ev;
-    ev.events = EPOLLIN; // read
-    ActiveConnection *ac = new_active_connection(h->conn_manager, client_sock_fd, Request);
-    ev.data.ptr = (void *) ac;
-    // watch file descriptor
-    if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, client_sock_fd, &ev) < 0) {
-        destroy_active_connection(h->conn_manager, ac);
-        return -1;
+    // record new connection, attached by the handler thread
+    atomic_fetch_add(&h->n_connections, 1);
+    return accept_queue_push(h->accept_queue, client_sock_fd);
+}
+
+void handler_wake(Handler *h) {
+    if (!h) {
+        return;
     }
 
-    // record new connection
-    atomic_fetch_add(&h->n_connections, 1);
-    return 0;
+    // woken through the accept queue, the scan runs after the batch
+    atomic_store(&h->shed_scan, true);
+    uint64_t count = 1;
+    if (write(h->accept_queue->event_fd, &count, sizeof(count)) < 0) {
+        perror("handler wake failed");
+    }
+    return;
+}
+
+static void attach_clients(Handler *h) {
+    AcceptedClient *client = accept_queue_drain(h->accept_queue);
+    while (client) {
+        AcceptedClient *next = client->next;
+        ActiveConnection *ac = new_active_connection(h->conn_manager,
+                client->fd, Request);
+        struct epoll_event ev;
+        ev.events = EPOLLIN; // read
+        if (!ac) {
+            close(client->fd);
+            atomic_fetch_sub(&h->n_connections, 1);
+        } else {
+            ev.data.u64 = connection_epoll_data(h->conn_manager, ac);
+            // watch file descriptor
+            stats_count_syscall(StatsEpollCtl, false);
+            if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, ac->fd, &ev) < 0) {
+                destroy_active_connection(h->conn_manager, ac);
+                atomic_fetch_sub(&h->n_connections, 1);
+            } else if (h->captures) {
+                // sampled again if moved over from another handler
+                connection_capture(h, ac)->id = capture_connection(
+                        h->capture);
+            }
+        }
+        free(client);
+        client = next;
+    }
+    return;
 }
 
-static void terminate_connection(Handler *h, ActiveConnection *conn,
-        size_t conn_event_index) {
-    epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, conn->fd, &h->events[conn_event_index]);
+static void terminate_connection(Handler *h, ActiveConnection *conn) {
+    if (conn->stat == Request && conn->request.throttled) {
+        h->n_throttled--;
+        h->throttled_bytes -= connection_footprint(conn);
+    }
+    struct epoll_event ev;
+    stats_count_syscall(StatsEpollCtl, false);
+    epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, conn->fd, &ev);
     atomic_fetch_sub(&h->n_connections, 1);
     destroy_active_connection(h->conn_manager, conn);
 
     return;
 }
 
+static void watch_connection(Handler *h, ActiveConnection *conn,
+        uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = connection_epoll_data(h->conn_manager, conn);
+    stats_count_syscall(StatsEpollCtl, false);
+    if (epoll_ctl(h->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        printf("epoll failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
 static void recycle_connection(Handler *h, ActiveConnection *conn,
-        size_t conn_event_index, Config *config, CompressionSegment *comp_dict,
+        Config *config, CompressionSegment *comp_dict,
         DecompressionTreeNode *decomp_tree, OpenFileInstances *ofis,
         pthread_t main_thread) {
 
-    if (conn->stat == Responce) {
-        destroy_responce_data(conn->data);
-        epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, conn->fd,
-                  &h->events[conn_event_index]);
+    if (conn->stat == Responce || conn->stat == Stream) {
+        if (conn->stat == Responce) {
+            destroy_responce_data(&conn->responce);
+        } else {
+            destroy_echo_stream(&conn->stream);
+        }
         // update connection status
         conn->stat = Request;
-        conn->data = init_request_data();
-        // create new event
-        struct epoll_event ev;
-        ev.events = EPOLLIN; // read
-        ev.data.ptr = conn;
-        if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
-            printf("epoll failed!\n");
-            exit(EXIT_FAILURE);
+        init_request_data(&conn->request);
+        // request boundary, nothing is lost by moving the connection
+        if (take_shed(h) && migrate_connection(h, conn)) {
+            return;
         }
+        watch_connection(h, conn, EPOLLIN);
     } else {
-        ResponceData *rd = handle_request((RequestData *) conn->data, conn->fd,
-                                          h, config, comp_dict, decomp_tree,
-                                          ofis, main_thread);
-        destroy_reading_data((RequestData *) conn->data);
+        // request and responce share the slot, so build the responce aside
+        ResponceData rsp;
+        int status = handle_request(&rsp, &conn->request, conn->fd, h, config,
+                                    comp_dict, decomp_tree, ofis, main_thread);
+        if (status < 0) {
+            terminate_connection(h, conn);
+            return;
+        }
+        // timing every request costs over 1% of a small echo, so one in
+        // HANDLER_LATENCY_SAMPLE feeds the histograms. the rest are only
+        // timed if slow requests are logged
+        rsp.sampled = h->n_handled++ % HANDLER_LATENCY_SAMPLE == 0;
+        if (rsp.sampled || h->slow_ring) {
+            // request was readable from the start of the batch
+            rsp.t_read = h->batch_ns;
+        }
+        record_latency(&rsp, StatsHandled, 0);
+        destroy_reading_data(&conn->request);
         conn->stat = Responce;
-        conn->data = rd;
-        // delete old event
-        epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, conn->fd,
-                  &h->events[conn_event_index]);
-        // create new event
-        struct epoll_event ev;
-        ev.events = EPOLLOUT; // read
-        ev.data.ptr = conn;
-        if (epoll_ctl(h->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
-            // finish up
-            printf("epoll failed!\n");
-            exit(EXIT_FAILURE);
+        conn->responce = rsp;
+        if (rsp.type == RetFileRsp) {
+            // armed once the first chunk has been read
+            ((FileStream *) rsp.ptr)->owner = conn;
+            watch_connection(h, conn, 0);
+            advance_file_stream(h, conn, comp_dict);
+        } else if (rsp.ptr) {
+            // armed once the executor has built the write buffer
+            ((ResponceTask *) rsp.ptr)->owner = conn;
+            watch_connection(h, conn, 0);
+        } else {
+            watch_connection(h, conn, EPOLLOUT);
+        }
+    }
+    return;
+}
+
+static void advance_file_stream(Handler *h, ActiveConnection *conn,
+        CompressionSegment *comp_dict) {
+    ResponceData *rd = &conn->responce;
+    FileStream *fs = (FileStream *) rd->ptr;
+
+    // jobs reference the stream, which may outlive the connection
+    file_stream_schedule_reads(fs, h->io_pool, h->io_cq, fs);
+    profile_set_request(RetFileRsp, connection_trace(h, conn));
+    int status = ret_file_fill_write_buffer(rd, comp_dict);
+    // refill chunk released by the write buffer
+    file_stream_schedule_reads(fs, h->io_pool, h->io_cq, fs);
+
+    if (status < 0) {
+        // file completely sent
+        JX_PROBE3(responce__done, conn->fd, rd->type, fs->ofi->n_requested);
+        log_slow_request(h, conn, record_latency(rd, StatsLastByte, 0));
+        recycle_connection(h, conn, NULL, NULL, NULL, NULL, 0);
+    } else if (status == 0 && fs->waiting) {
+        fs->waiting = false;
+        watch_connection(h, conn, EPOLLOUT);
+    } else if (status == 1 && !fs->waiting) {
+        fs->waiting = true;
+        watch_connection(h, conn, 0);
+    }
+    return;
+}
+
+static void update_responce_task(Handler *h, Task *task) {
+    ResponceTask *rt = (ResponceTask *) task->ctx;
+    if (rt->orphaned) {
+        // connection closed while the task ran
+        destroy_responce_task(rt);
+        return;
+    }
+
+    ActiveConnection *conn = (ActiveConnection *) rt->owner;
+    if (conn->fd < 0 || conn->stat != Responce || conn->responce.ptr != rt) {
+        // task outlived its connection without being orphaned
+        destroy_responce_task(rt);
+        return;
+    }
+    // phases the task timed on the executor
+    RequestTrace *trace = connection_trace(h, conn);
+    for (size_t i = 0; trace && i < STATS_N_PHASES; ++i) {
+        trace->phase_ticks[i] += rt->phase_ticks[i];
+    }
+    if (responce_task_complete(&conn->responce) < 0) {
+        terminate_connection(h, conn);
+    } else {
+        watch_connection(h, conn, EPOLLOUT);
+    }
+    return;
+}
+
+static void update_file_read(Handler *h, IOJob *job,
+        CompressionSegment *comp_dict) {
+    FileStream *fs = (FileStream *) job->ctx;
+    file_stream_complete_read(fs, job);
+    if (job->read_ticks) {
+        stats_record_phase(RetFileRsp, StatsPhaseDiskRead, job->read_ticks);
+    }
+
+    if (fs->orphaned) {
+        // connection closed while reading, release after final read
+        if (!fs->n_pending) {
+            destroy_file_stream(fs);
         }
+        return;
+    }
+
+    ActiveConnection *conn = (ActiveConnection *) fs->owner;
+    if (conn->fd < 0 || conn->stat != Responce || conn->responce.ptr != fs) {
+        // stream outlived its connection without being orphaned
+        if (!fs->n_pending) {
+            destroy_file_stream(fs);
+        }
+        return;
+    }
+    RequestTrace *trace = connection_trace(h, conn);
+    if (trace) {
+        trace->phase_ticks[StatsPhaseDiskRead] += job->read_ticks;
+    }
+    if (job->n_read < 0) {
+        terminate_connection(h, conn);
+    } else if (fs->waiting) {
+        advance_file_stream(h, conn, comp_dict);
     }
     return;
 }
 
 static void update_responce(Handler *h, ActiveConnection *conn,
         CompressionSegment *comp_dict, DecompressionTreeNode *decomp_tree,
-        int ret_write, size_t conn_event_index) {
+        int ret_write) {
 
     // connection closed
     if (ret_write < 0) {
-        terminate_connection(h, conn, conn_event_index);
+        terminate_connection(h, conn);
         return;
     }
+    // most responces are sent by a single write, timed by a single read
+    uint64_t now = 0;
+    if (!conn->responce.started && conn->responce.n_written) {
+        conn->responce.started = true;
+        now = record_latency(&conn->responce, StatsFirstByte, 0);
+    }
     // responce not finished sending
     if (ret_write == 0) {
         return;
     }
 
     // responce finished sending
-    ResponceData *rd = (ResponceData *) conn->data;
+    ResponceData *rd = &conn->responce;
+    stats_count_message(rd->type, rd->write_buffer_len);
     if (rd->type == Error) {
         // close connection after error
-        terminate_connection(h, conn, conn_event_index);
+        terminate_connection(h, conn);
     } else if (rd->type == RetFileRsp) {
-        OpenFileInstance *ofi = (OpenFileInstance *) rd->ptr;
-        pthread_mutex_lock(&ofi->lock);
-        // file completely sent
-        if (rd->n_written == rd->write_n && ofi->n_read == ofi->n_requested)  {
-            pthread_mutex_unlock(&ofi->lock);
-            recycle_connection(h, conn, conn_event_index, NULL, NULL, NULL, NULL,
-                    0);
-        // send another packet
-        } else {
-            pthread_mutex_unlock(&ofi->lock);
-            // refill write buffer
-            ret_file_fill_write_buffer(rd, comp_dict, rd->write_buffer[0] &
-                    MSG_HEADER_REQ_COMPRESSION_MASK);
-        }
+        // send another packet, or recycle once complete
+        advance_file_stream(h, conn, comp_dict);
     } else {
         // new request
-        recycle_connection(h, conn, conn_event_index, NULL, NULL, NULL, NULL, 0);
+        JX_PROBE3(responce__done, conn->fd, rd->type, rd->write_buffer_len);
+        log_slow_request(h, conn, record_latency(rd, StatsLastByte, now));
+        recycle_connection(h, conn, NULL, NULL, NULL, NULL, 0);
     }
     return;
 }
 
 static void update_request(Handler *h, ActiveConnection *conn, Config *config,
         CompressionSegment *comp_dict, DecompressionTreeNode *decomp_tree,
-        int ret_read, size_t conn_event_index, OpenFileInstances *ofis,
-        pthread_t main_thread) {
+        int ret_read, OpenFileInstances *ofis, pthread_t main_thread) {
 
     if (ret_read < 0) {
-        terminate_connection(h, conn, conn_event_index);
+        terminate_connection(h, conn);
     } else if (ret_read == 1) {
-        recycle_connection(h, conn, conn_event_index, config, comp_dict,
-                decomp_tree, ofis, main_thread);
+        capture_read_request(h, conn);
+        recycle_connection(h, conn, config, comp_dict, decomp_tree, ofis,
+                main_thread);
+    } else if (echo_stream_eligible(&conn->request)) {
+        capture_read_request(h, conn);
+        start_echo_stream(h, conn);
+    } else if (request_payload_unread(&conn->request) &&
+            !conn->request.payload_block) {
+        admit_payload(h, conn);
+    }
+    return;
+}
+
+static void admit_payload(Handler *h, ActiveConnection *conn) {
+    uint64_t payload_len = conn->request.payload_len;
+    if (payload_len > h->budget->connection_limit) {
+        h->budget->n_rejected++;
+        stats_count_message(conn->request.metadata_buffer[0] >> 4,
+                REQUEST_METADATA_SIZE);
+        // refuse without reading the payload, connection closes after
+        destroy_reading_data(&conn->request);
+        conn->stat = Responce;
+        error(&conn->responce);
+        watch_connection(h, conn, EPOLLOUT);
+    } else if (budget_exceeds(h->budget, payload_len)) {
+        throttle_connection(h, conn);
+    }
+    return;
+}
+
+static void throttle_connection(Handler *h, ActiveConnection *conn) {
+    conn->request.throttled = true;
+    h->n_throttled++;
+    h->throttled_bytes += connection_footprint(conn);
+    h->budget->n_throttled++;
+    watch_connection(h, conn, 0);
+    return;
+}
+
+static int compare_footprint(const void *a, const void *b) {
+    size_t fa = connection_footprint(*(ActiveConnection **) a);
+    size_t fb = connection_footprint(*(ActiveConnection **) b);
+    return fa < fb ? 1 : (fa > fb ? -1 : 0);
+}
+
+static void balance_memory(Handler *h, bool idle) {
+    size_t used = atomic_load(&h->budget->n_used);
+    if (h->n_throttled && (idle || budget_can_resume(h->budget))) {
+        // responces have drained, or nothing is left to drain
+        size_t capacity = connection_capacity(h->conn_manager);
+        for (uint32_t id = 0; id < capacity && h->n_throttled; ++id) {
+            ActiveConnection *conn = connection_from_id(h->conn_manager, id);
+            if (conn->fd >= 0 && conn->stat == Request &&
+                conn->request.throttled) {
+                conn->request.throttled = false;
+                h->n_throttled--;
+                watch_connection(h, conn, EPOLLIN);
+            }
+        }
+        h->throttled_bytes = 0;
+        return;
+    }
+    if (used <= h->budget->limit ||
+        used - h->budget->limit <= h->throttled_bytes) {
+        return;
     }
+
+    // pause heaviest readers until their buffers cover the excess
+    size_t capacity = connection_capacity(h->conn_manager);
+    ActiveConnection **readers = safe_malloc(sizeof(ActiveConnection *) *
+            (capacity ? capacity : 1));
+    size_t n_readers = 0;
+    for (uint32_t id = 0; id < capacity; ++id) {
+        ActiveConnection *conn = connection_from_id(h->conn_manager, id);
+        if (conn->fd >= 0 && conn->stat == Request &&
+            !conn->request.throttled && conn->request.payload_block) {
+            readers[n_readers++] = conn;
+        }
+    }
+    qsort(readers, n_readers, sizeof(ActiveConnection *), compare_footprint);
+    for (size_t i = 0; i < n_readers &&
+            used - h->budget->limit > h->throttled_bytes; ++i) {
+        throttle_connection(h, readers[i]);
+    }
+    free(readers);
     return;
 }
 
+static bool take_shed(Handler *h) {
+    size_t n_shed = atomic_load_explicit(&h->n_shed, memory_order_relaxed);
+    while (n_shed) {
+        if (n_shed == SIZE_MAX) {
+            return true;
+        }
+        if (atomic_compare_exchange_weak_explicit(&h->n_shed, &n_shed,
+                n_shed - 1, memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool migrate_connection(Handler *h, ActiveConnection *conn) {
+    Handler *target = handler_group_route(h->group, h);
+    if (!target) {
+        // no handler to move to, keep the claim for later
+        if (atomic_load(&h->n_shed) != SIZE_MAX) {
+            atomic_fetch_add(&h->n_shed, 1);
+        }
+        return false;
+    }
+
+    struct epoll_event ev;
+    stats_count_syscall(StatsEpollCtl, false);
+    epoll_ctl(h->epoll_fd, EPOLL_CTL_DEL, conn->fd, &ev);
+    int fd = detach_active_connection(h->conn_manager, conn);
+    atomic_fetch_sub(&h->n_connections, 1);
+    new_client(target, fd);
+    atomic_fetch_add(&h->n_migrated, 1);
+    return true;
+}
+
+static void shed_idle_connections(Handler *h) {
+    size_t capacity = connection_capacity(h->conn_manager);
+    for (uint32_t id = 0; id < capacity; ++id) {
+        ActiveConnection *conn = connection_from_id(h->conn_manager, id);
+        if (conn->fd < 0 || conn->stat != Request ||
+            conn->request.metadata_buffer_n || conn->request.throttled) {
+            continue;
+        }
+        if (!take_shed(h) || !migrate_connection(h, conn)) {
+            break;
+        }
+    }
+    return;
+}
+
+static void start_echo_stream(Handler *h, ActiveConnection *conn) {
+    EchoStream es;
+    if (init_echo_stream(&es, &conn->request) < 0) {
+        // buffer the payload instead
+        return;
+    }
+
+    // streamed echoes are counted once started, both ways
+    uint8_t type = conn->request.metadata_buffer[0] >> 4;
+    uint64_t n_bytes = REQUEST_METADATA_SIZE + conn->request.payload_len;
+    stats_count_message(type, n_bytes);
+    stats_count_message(EchoRsp, n_bytes);
+
+    destroy_reading_data(&conn->request);
+    conn->stat = Stream;
+    conn->stream = es;
+    // header can be sent straight away
+    update_echo_stream(h, conn);
+    return;
+}
+
+static void update_echo_stream(Handler *h, ActiveConnection *conn) {
+    int status = echo_stream_advance(&conn->stream, conn->fd);
+    if (status < 0) {
+        terminate_connection(h, conn);
+    } else if (status == 1) {
+        recycle_connection(h, conn, NULL, NULL, NULL, NULL, 0);
+    } else {
+        // only touch epoll when the stream is waiting on something new
+        uint32_t events = echo_stream_events(&conn->stream);
+        if (events != conn->stream.events) {
+            conn->stream.events = events;
+            watch_connection(h, conn, events);
+        }
+    }
+    return;
+}
 void *handle_connections(void *arg) {
     if (!arg) {
         return NULL;
@@ -254,30 +935,76 @@ void *handle_connections(void *arg) {
     Config *config = args->config;
     free(args);
 
+    // request path allocations are served by the handlers slab
+    slab_bind_thread(h->slab);
+    h->buffer_cache = buffer_cache_bind_thread(h->buffer_pool);
+    budget_bind_thread(h->budget);
+    stats_bind_thread(h->stats);
+
     // init cleanup on thread exit
     pthread_cleanup_push(cleanup_handler, h);
 
     int fds;
     ActiveConnection *conn = NULL;
-    while ((fds = epoll_wait(h->epoll_fd, h->events, h->events_len, -1))) {
+    while ((fds = epoll_wait(h->epoll_fd, h->events, EPOLL_EVENTS_SIZE,
+            wait_timeout(h))) >= 0 || errno == EINTR) {
+        // time spent handling the batch is the handlers load
+        h->batch_ns = monotonic_ns();
         for (int i = 0; i < fds; ++i) {
-            conn = (ActiveConnection *) h->events[i].data.ptr;
+            // file reads completed
+            if (h->events[i].data.u64 == HANDLER_IO_CQ_EVENT) {
+                IOJob *job = io_completion_queue_drain(h->io_cq);
+                while (job) {
+                    IOJob *next = job->next;
+                    update_file_read(h, job, comp_dict);
+                    job = next;
+                }
+                continue;
+            } else if (h->events[i].data.u64 == HANDLER_TASK_CQ_EVENT) {
+                Task *task = task_completion_queue_drain(h->task_cq);
+                while (task) {
+                    Task *next = task->next;
+                    update_responce_task(h, task);
+                    task = next;
+                }
+                continue;
+            } else if (h->events[i].data.u64 == HANDLER_ACCEPT_EVENT) {
+                attach_clients(h);
+                continue;
+            }
+
+            conn = connection_from_epoll_data(h->conn_manager,
+                    h->events[i].data.u64);
+            if (!conn) {
+                // terminated earlier in the batch, from a completion or
+                // an event of its own. the slot may have been reused since
+                continue;
+            }
             // read ready
             if (h->events[i].events & EPOLLIN && conn->stat == Request) {
-                int ret_read = request_read((RequestData *)conn->data, conn->fd);
+                int ret_read = read_request(h, conn);
                 update_request(h, conn, config, comp_dict, decomp_tree ,ret_read,
-                               i, ofis, main_thread);
+                               ofis, main_thread);
             } else if (h->events[i].events & EPOLLOUT && conn->stat == Responce) {
-                int ret_write = responce_write((ResponceData *) conn->data,
-                                               conn->fd);
-                update_responce(h, conn, comp_dict, decomp_tree, ret_write, i);
+                int ret_write = write_responce(h, conn);
+                update_responce(h, conn, comp_dict, decomp_tree, ret_write);
+            } else if (conn->stat == Stream) {
+                // hang ups surface as a failed splice
+                update_echo_stream(h, conn);
+            } else if (h->events[i].events & (EPOLLHUP | EPOLLERR)) {
+                // closed while waiting on disk, or while paused
+                terminate_connection(h, conn);
             }
         }
-        // resize if necessary
-        if (atomic_load(&h->n_connections) >= h->events_len) {
-            h->events = safe_realloc(h->events, h->events_len * ARRAY_GROWTH_RATE);
-            h->events_len *= ARRAY_GROWTH_RATE;
+        balance_memory(h, !fds);
+        if (atomic_exchange(&h->shed_scan, false)) {
+            shed_idle_connections(h);
         }
+        uint64_t loop_ns = monotonic_ns() - h->batch_ns;
+        atomic_fetch_add_explicit(&h->busy_ns, loop_ns, memory_order_relaxed);
+        // interrupted waits returned no events
+        stats_record_loop(fds > 0 ? fds : 0, loop_ns);
+        publish_metrics(h);
     }
 
     // execute cleanup
@@ -285,52 +1012,495 @@ void *handle_connections(void *arg) {
     return NULL;
 }
 
-static ResponceData *handle_request(RequestData *rd, int fd,  Handler *h, Config *config,
-                             CompressionSegment *comp_dict,
-                             DecompressionTreeNode *decomp_tree,
-                             OpenFileInstances *ofis, pthread_t main_thread) {
+static int wait_timeout(Handler *h) {
+    if (h->n_throttled) {
+        return HANDLER_THROTTLE_IDLE_MS;
+    }
+    return h->metrics_stale ? METRICS_PUBLISH_INTERVAL_MS : -1;
+}
+
+static void publish_metrics(Handler *h) {
+    MetricsHandlerSlot *slot = h->metrics;
+    if (!slot) {
+        return;
+    }
+    // reuses the batch clock read, no syscall is made
+    if (h->batch_ns - h->metrics_ns <
+            (uint64_t) METRICS_PUBLISH_INTERVAL_MS * 1000000) {
+        h->metrics_stale = true;
+        return;
+    }
 
-    if (!rd || !comp_dict || !decomp_tree || !config->dir || !ofis) {
+    metrics_write_begin(&slot->seq);
+    slot->published_ns = h->batch_ns;
+    slot->n_connections = atomic_load(&h->n_connections);
+    slot->n_migrated = atomic_load(&h->n_migrated);
+    slot->n_budget_used = atomic_load(&h->budget->n_used);
+    slot->busy_ns = atomic_load_explicit(&h->busy_ns, memory_order_relaxed);
+    stats_read_thread(&slot->totals);
+    metrics_write_end(&slot->seq);
+
+    h->metrics_ns = h->batch_ns;
+    h->metrics_stale = false;
+    return;
+}
+
+static void publish_group_metrics(HandlerGroup *group, uint64_t now) {
+    MetricsGroupSlot *slot = group->metrics;
+    if (!slot) {
+        return;
+    }
+
+    metrics_write_begin(&slot->seq);
+    slot->published_ns = now;
+    slot->n_awake = atomic_load(&group->n_awake);
+    slot->n_parks = atomic_load(&group->n_parks);
+    slot->n_wakes = atomic_load(&group->n_wakes);
+    metrics_write_end(&slot->seq);
+    return;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+HandlerGroup *init_handler_group(Handler **handlers, size_t n_handlers,
+        MetricsGroupSlot *metrics) {
+    HandlerGroup *group = safe_malloc(sizeof(HandlerGroup));
+    group->handlers = handlers;
+    group->n_handlers = n_handlers;
+    atomic_init(&group->n_awake, n_handlers);
+    group->last_busy_ns = safe_calloc(n_handlers, sizeof(uint64_t));
+    group->load = safe_calloc(n_handlers, sizeof(uint32_t));
+    atomic_init(&group->n_parks, 0);
+    atomic_init(&group->n_wakes, 0);
+    group->stopping = false;
+    group->metrics = metrics;
+    pthread_mutex_init(&group->lock, NULL);
+
+    // balance deadlines are unaffected by wall clock changes
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&group->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (size_t i = 0; i < n_handlers; ++i) {
+        handlers[i]->group = group;
+    }
+    if (pthread_create(&group->balancer, NULL, balancer, group)) {
+        printf("unable to initialise handler balancer!\n");
+        exit(EXIT_FAILURE);
+    }
+    return group;
+}
+
+Handler *handler_group_route(HandlerGroup *group, Handler *exclude) {
+    if (!group) {
         return NULL;
     }
 
+    size_t n_awake = atomic_load(&group->n_awake);
+    Handler *target = NULL;
+    size_t n_fewest = SIZE_MAX;
+    for (size_t i = 0; i < n_awake; ++i) {
+        Handler *h = group->handlers[i];
+        size_t n = atomic_load_explicit(&h->n_connections,
+                memory_order_relaxed);
+        if (h != exclude && n < n_fewest) {
+            target = h;
+            n_fewest = n;
+        }
+    }
+    return target;
+}
+
+static void *balancer(void *arg) {
+    HandlerGroup *group = (HandlerGroup *) arg;
+
+    for (size_t i = 0; i < group->n_handlers; ++i) {
+        group->last_busy_ns[i] = atomic_load(&group->handlers[i]->busy_ns);
+    }
+    uint64_t last = monotonic_ns();
+
+    pthread_mutex_lock(&group->lock);
+    while (!group->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += HANDLER_BALANCE_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&group->cond, &group->lock, &deadline);
+        if (!group->stopping) {
+            uint64_t now = monotonic_ns();
+            balance_handlers(group, now > last ? now - last : 1);
+            publish_group_metrics(group, now);
+            last = now;
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+    return NULL;
+}
+
+static void balance_handlers(HandlerGroup *group, uint64_t interval_ns) {
+    size_t n_awake = atomic_load(&group->n_awake);
+    uint64_t total_load = 0;
+    for (size_t i = 0; i < group->n_handlers; ++i) {
+        uint64_t busy = atomic_load(&group->handlers[i]->busy_ns);
+        uint64_t load = (busy - group->last_busy_ns[i]) * 1000 / interval_ns;
+        group->load[i] = load > 1000 ? 1000 : load;
+        group->last_busy_ns[i] = busy;
+        if (i < n_awake) {
+            total_load += group->load[i];
+        }
+    }
+    uint64_t average = total_load / n_awake;
+
+    if (average > HANDLER_SCALE_UP_LOAD && n_awake < group->n_handlers) {
+        // connections not yet shed by the woken handler are kept
+        atomic_store(&group->handlers[n_awake]->n_shed, 0);
+        atomic_store(&group->n_awake, ++n_awake);
+        atomic_fetch_add(&group->n_wakes, 1);
+    } else if (n_awake > 1 && average < HANDLER_SCALE_DOWN_LOAD &&
+            total_load / (n_awake - 1) < HANDLER_SCALE_DOWN_LOAD * 2) {
+        // remaining handlers absorb the load
+        atomic_store(&group->n_awake, --n_awake);
+        atomic_fetch_add(&group->n_parks, 1);
+    } else if (n_awake > 1) {
+        for (size_t i = 0; i < n_awake; ++i) {
+            Handler *h = group->handlers[i];
+            size_t n_connections = atomic_load(&h->n_connections);
+            if (group->load[i] < HANDLER_SHED_LOAD ||
+                group->load[i] < average + HANDLER_SHED_MARGIN ||
+                n_connections < 2) {
+                atomic_store(&h->n_shed, 0);
+                continue;
+            }
+            // move half of the connections carrying the excess load
+            size_t n_shed = n_connections * (group->load[i] - average) /
+                    group->load[i] / 2;
+            atomic_store(&h->n_shed, n_shed ? n_shed : 1);
+            handler_wake(h);
+        }
+    }
+
+    // parked handlers shed everything, retried until they hold nothing
+    for (size_t i = n_awake; i < group->n_handlers; ++i) {
+        Handler *h = group->handlers[i];
+        if (atomic_load(&h->n_connections)) {
+            atomic_store(&h->n_shed, SIZE_MAX);
+            handler_wake(h);
+        }
+    }
+    return;
+}
+
+void handler_group_stats(HandlerGroup *group, HandlerGroupStats *stats) {
+    if (!group || !stats) {
+        return;
+    }
+
+    stats->n_handlers = group->n_handlers;
+    stats->n_awake = atomic_load(&group->n_awake);
+    stats->n_migrated = 0;
+    for (size_t i = 0; i < group->n_handlers; ++i) {
+        stats->n_migrated += atomic_load(&group->handlers[i]->n_migrated);
+    }
+    stats->n_parks = atomic_load(&group->n_parks);
+    stats->n_wakes = atomic_load(&group->n_wakes);
+    return;
+}
+
+void stop_handler_group(HandlerGroup *group) {
+    if (!group) {
+        return;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    bool stopped = group->stopping;
+    group->stopping = true;
+    pthread_cond_signal(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+    if (!stopped) {
+        pthread_join(group->balancer, NULL);
+    }
+    // no handler is routed connections, so none are migrated
+    atomic_store(&group->n_awake, 0);
+    return;
+}
+
+void destroy_handler_group(HandlerGroup *group) {
+    if (!group) {
+        return;
+    }
+
+    stop_handler_group(group);
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+    free(group->last_busy_ns);
+    free(group->load);
+    free(group);
+    return;
+}
+
+static int handle_request(ResponceData *rsp, RequestData *rd, int fd,
+                          Handler *h, Config *config,
+                          CompressionSegment *comp_dict,
+                          DecompressionTreeNode *decomp_tree,
+                          OpenFileInstances *ofis, pthread_t main_thread) {
+
+    if (!rsp || !rd || !comp_dict || !decomp_tree || !config->dir || !ofis) {
+        return -1;
+    }
+
     uint8_t header = rd->metadata_buffer[0];
     enum RequestType req_type = (header & MSG_HEADER_TYPE_MASK) >> 4;
     bool compressed_payload = (header & MSG_HEADER_COMPRESSION_MASK) >> 3;
     bool requires_compression = (header & MSG_HEADER_REQ_COMPRESSION_MASK) >> 2;
+    stats_count_message(req_type, REQUEST_METADATA_SIZE + rd->payload_len);
+    JX_PROBE4(request__dispatch, fd, req_type, rd->payload_len,
+            (header & (MSG_HEADER_COMPRESSION_MASK |
+            MSG_HEADER_REQ_COMPRESSION_MASK)) >> 2);
 
-    ResponceData *ret = NULL;
+    ResponceOffload offload = {
+            .executor = h->executor,
+            .cq = h->task_cq,
+            .budget = h->budget
+    };
+
+    int ret = -1;
     switch (req_type) {
         case EchoReq:
-            ret = echo(compressed_payload, requires_compression, rd->payload_buffer,
-                       rd->payload_len, comp_dict);
+            ret = echo(rsp, compressed_payload, requires_compression, rd,
+                       comp_dict, h->executor ? &offload : NULL);
             break;
         case ListDirReq:
-            ret = list_files(compressed_payload, requires_compression,
-                             rd->payload_buffer, rd->payload_len, config->dir,
-                             comp_dict);
+            ret = list_files(rsp, compressed_payload, requires_compression,
+                             rd->payload_buffer, rd->payload_len,
+                             h->listing_cache, comp_dict,
+                             h->executor ? &offload : NULL);
             break;
         case FileSizeReq:
-            ret = get_file_size(compressed_payload, requires_compression,
-                                rd->payload_buffer, rd->payload_len, config->dir,
+            ret = get_file_size(rsp, compressed_payload, requires_compression,
+                                rd->payload_buffer, rd->payload_len, h->md_cache,
                                 comp_dict, decomp_tree);
             break;
         case RetFileReq:
-            ret = ret_file(compressed_payload, requires_compression,
-                           rd->payload_buffer, rd->payload_len, config->dir,
-                           comp_dict, decomp_tree, ofis);
+            ret = ret_file(rsp, compressed_payload, requires_compression,
+                           rd->payload_buffer, rd->payload_len, config->dir_fd,
+                           h->md_cache, comp_dict, decomp_tree, ofis);
+            break;
+        case StatsReq: {
+            size_t snapshot_len = 0;
+            uint8_t *snapshot = snapshot_stats(h, ofis, &snapshot_len);
+            ret = get_stats(rsp, compressed_payload, requires_compression,
+                            rd->payload_len, snapshot, snapshot_len,
+                            comp_dict);
             break;
+        }
         case ShutdownReq:
             // shutdown server
             pthread_cancel(main_thread);
             break;
         default:
-            ret = error();
+            ret = error(rsp);
             break;
     }
     return ret;
 }
 
+static uint64_t record_latency(ResponceData *rd,
+        enum StatsMilestone milestone, uint64_t now) {
+    if (!rd->t_read || (!rd->sampled && milestone != StatsLastByte)) {
+        return 0;
+    }
+
+    now = now ? now : monotonic_ns();
+    if (rd->sampled) {
+        stats_record_latency(rd->type, milestone, now - rd->t_read);
+    }
+    return now;
+}
+
+static RequestTrace *connection_trace(Handler *h, ActiveConnection *conn) {
+    if (!h->traces) {
+        return NULL;
+    }
+
+    RequestTrace **segment = &h->traces[conn->id / CONNECTION_SEGMENT_LEN];
+    if (!*segment) {
+        *segment = safe_malloc(sizeof(RequestTrace) * CONNECTION_SEGMENT_LEN);
+    }
+    return &(*segment)[conn->id % CONNECTION_SEGMENT_LEN];
+}
+
+static void log_slow_request(Handler *h, ActiveConnection *conn,
+        uint64_t now) {
+    RequestTrace *trace = connection_trace(h, conn);
+    if (trace && now) {
+        slow_log_record(h->slow_ring, trace, now - conn->responce.t_read);
+    }
+    return;
+}
+
+static ConnectionCapture *connection_capture(Handler *h,
+        ActiveConnection *conn) {
+    if (!h->captures) {
+        return NULL;
+    }
+
+    ConnectionCapture **segment =
+            &h->captures[conn->id / CONNECTION_SEGMENT_LEN];
+    if (!*segment) {
+        *segment = safe_calloc(CONNECTION_SEGMENT_LEN,
+                sizeof(ConnectionCapture));
+    }
+    return &(*segment)[conn->id % CONNECTION_SEGMENT_LEN];
+}
+
+static void capture_read_request(Handler *h, ActiveConnection *conn) {
+    ConnectionCapture *cc = connection_capture(h, conn);
+    if (!cc || !cc->id) {
+        return;
+    }
+
+    RequestData *rd = &conn->request;
+    bool read = rd->payload_buffer_n == rd->payload_len;
+    capture_request(h->capture_ring, cc->id, cc->arrived_ns,
+            rd->metadata_buffer[0], rd->payload_len, rd->payload_block,
+            read ? rd->payload_buffer : NULL);
+    return;
+}
+
+static int read_request(Handler *h, ActiveConnection *conn) {
+    RequestData *rd = &conn->request;
+    RequestTrace *trace = connection_trace(h, conn);
+    if (trace && !rd->metadata_buffer_n) {
+        // first read of a new request
+        memset(trace, 0, offsetof(RequestTrace, name));
+        trace->name[0] = '\0';
+    }
+    ConnectionCapture *cc = connection_capture(h, conn);
+    if (cc && !rd->metadata_buffer_n) {
+        // clock already read for the batch
+        cc->arrived_ns = h->batch_ns;
+    }
+
+    uint64_t start = profile_start();
+    int ret = request_read(rd, conn->fd);
+    // charged once the type has been read
+    if (rd->metadata_buffer_n == REQUEST_METADATA_SIZE) {
+        uint8_t header = rd->metadata_buffer[0];
+        profile_set_request(header >> 4, trace);
+        profile_end(StatsPhaseParse, start);
+        if (trace) {
+            trace->type = header >> 4;
+            trace->flags = (header & (MSG_HEADER_COMPRESSION_MASK |
+                    MSG_HEADER_REQ_COMPRESSION_MASK)) >> 2;
+            trace->payload_len = rd->payload_len;
+        }
+    }
+    return ret;
+}
+
+static int write_responce(Handler *h, ActiveConnection *conn) {
+    profile_set_request(conn->responce.type, connection_trace(h, conn));
+    uint64_t start = profile_start();
+    int ret = responce_write(&conn->responce, conn->fd);
+    profile_end(StatsPhaseWrite, start);
+    return ret;
+}
+
+static void put_field(uint8_t **dest, uint64_t value) {
+    uint64_t value_be = htobe64(value);
+    memcpy(*dest, &value_be, sizeof(value_be));
+    *dest += sizeof(value_be);
+    return;
+}
+
+static uint8_t *snapshot_stats(Handler *h, OpenFileInstances *ofis,
+        size_t *len) {
+    // handlers of the group, or just this one if ungrouped
+    Handler **handlers = h->group ? h->group->handlers : &h;
+    size_t n_handlers = h->group ? h->group->n_handlers : 1;
+    HandlerGroupStats group_stats = {.n_awake = 1};
+    handler_group_stats(h->group, &group_stats);
+
+    // merged histograms are too large for the stack
+    StatsTotals *totals = safe_malloc(sizeof(StatsTotals));
+    stats_collect(h->stats, totals);
+    OpenFileInstancesStats ofis_stats = {0};
+    open_file_instances_stats(ofis, &ofis_stats);
+    ExecutorStats task_stats = {0};
+    executor_stats(h->executor, &task_stats);
+    BufferPoolStats pool_stats = {0};
+    buffer_pool_stats(h->buffer_pool, &pool_stats);
+
+    size_t n_fields = 3 + 3 * n_handlers + 2 * STATS_N_TYPES + 2 +
+            2 * STATS_N_LOOKUPS + 3 + 3 + 1 +
+            4 * STATS_N_TIMED_TYPES * STATS_N_MILESTONES +
+            2 * STATS_N_SYSCALLS + 1 + 4 + 4 + n_handlers;
+    *len = n_fields * sizeof(uint64_t);
+    uint8_t *snapshot = buffer_alloc(REQUEST_PAYLOAD_HEADROOM + *len);
+    uint8_t *field = snapshot + REQUEST_PAYLOAD_HEADROOM;
+
+    put_field(&field, STATS_SNAPSHOT_VERSION);
+    put_field(&field, n_handlers);
+    put_field(&field, group_stats.n_awake);
+    for (size_t i = 0; i < n_handlers; ++i) {
+        put_field(&field, atomic_load(&handlers[i]->n_connections));
+        put_field(&field, atomic_load(&handlers[i]->n_migrated));
+        put_field(&field, atomic_load(&handlers[i]->budget->n_used));
+    }
+    for (size_t i = 0; i < STATS_N_TYPES; ++i) {
+        put_field(&field, totals->n_messages[i]);
+        put_field(&field, totals->n_bytes[i]);
+    }
+    put_field(&field, totals->n_compress_in);
+    put_field(&field, totals->n_compress_out);
+    for (size_t i = 0; i < STATS_N_LOOKUPS; ++i) {
+        put_field(&field, totals->n_hits[i]);
+        put_field(&field, totals->n_misses[i]);
+    }
+    put_field(&field, ofis_stats.n_live);
+    put_field(&field, ofis_stats.n_retired);
+    put_field(&field, ofis_stats.n_reaped);
+    put_field(&field, task_stats.n_run);
+    put_field(&field, task_stats.n_stolen);
+    put_field(&field, task_stats.n_queued);
+    put_field(&field, pool_stats.bytes_outstanding);
+    for (size_t i = 0; i < STATS_N_TIMED_TYPES; ++i) {
+        for (size_t j = 0; j < STATS_N_MILESTONES; ++j) {
+            uint64_t *buckets = totals->latency[i][j];
+            put_field(&field, histogram_count(buckets));
+            put_field(&field, histogram_percentile(buckets, 50000));
+            put_field(&field, histogram_percentile(buckets, 99000));
+            put_field(&field, histogram_percentile(buckets, 99900));
+        }
+    }
+    for (size_t i = 0; i < STATS_N_SYSCALLS; ++i) {
+        put_field(&field, totals->n_syscalls[i]);
+        put_field(&field, totals->n_would_block[i]);
+    }
+    put_field(&field, totals->n_events);
+    uint64_t *loop_histograms[] = {totals->loop_events, totals->loop_ns};
+    for (size_t i = 0; i < 2; ++i) {
+        put_field(&field, histogram_count(loop_histograms[i]));
+        put_field(&field, histogram_percentile(loop_histograms[i], 50000));
+        put_field(&field, histogram_percentile(loop_histograms[i], 99000));
+        put_field(&field, histogram_percentile(loop_histograms[i], 99900));
+    }
+    for (size_t i = 0; i < n_handlers; ++i) {
+        put_field(&field, atomic_load_explicit(&handlers[i]->busy_ns,
+                memory_order_relaxed));
+    }
+
+    free(totals);
+    return snapshot;
+}
+
 void cleanup_handler(void *arg) {
     if (!arg) {
         return;
@@ -338,8 +1508,25 @@ void cleanup_handler(void *arg) {
 
     Handler *h = (Handler *) arg;
     destroy_connection_manager(h->conn_manager);
+    // clients not yet attached are closed
+    destroy_accept_queue(h->accept_queue);
+    // connection buffers have been released into the cache
+    destroy_buffer_cache(h->buffer_cache);
+    destroy_io_completion_queue(h->io_cq);
+    destroy_task_completion_queue(h->task_cq);
     close(h->epoll_fd);
-    free(h->events);
+    if (h->traces) {
+        for (size_t i = 0; i < CONNECTION_MAX_SEGMENTS; ++i) {
+            free(h->traces[i]);
+        }
+        free(h->traces);
+    }
+    if (h->captures) {
+        for (size_t i = 0; i < CONNECTION_MAX_SEGMENTS; ++i) {
+            free(h->captures[i]);
+        }
+        free(h->captures);
+    }
     free(h);
     return;
 }
\ No newline at end of file
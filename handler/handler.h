@@ -2,29 +2,121 @@
 #define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_HANDLER_H
 
 #include "connection.h"
+#include "accept_queue.h"
 #include "responce.h"
 #include "header_masks.h"
 #include "open_file_instance.h"
+#include "file_stream.h"
+#include "../io/io_pool.h"
+#include "../io/executor.h"
+#include "../cache/metadata_cache.h"
+#include "../cache/listing_cache.h"
+#include "../memory/slab.h"
+#include "../memory/buffer_pool.h"
+#include "../memory/memory_budget.h"
+#include "../stats/stats.h"
+#include "../stats/metrics_segment.h"
+#include "../stats/probes.h"
+#include "../stats/profile.h"
+#include "../stats/slow_log.h"
+#include "../stats/capture.h"
 #include "../config/config.h"
 #include "../data_structures/compression_dictionary/compression_dict.h"
 #include "../data_structures/decompression_tree/decompression_tree.h"
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/epoll.h>
 #include <pthread.h>
 #include <signal.h>
 
-#define EPOLL_EVENTS_SIZE_INIT 1000
+#define EPOLL_EVENTS_SIZE 256 // ready events taken per epoll_wait
+#define HANDLER_IO_CQ_EVENT UINT64_MAX // epoll data of the completion queue
+#define HANDLER_ACCEPT_EVENT (UINT64_MAX - 1) // epoll data of the accept queue
+#define HANDLER_TASK_CQ_EVENT (UINT64_MAX - 2) // epoll data of task completions
+#define HANDLER_LATENCY_SAMPLE 16 // one in this many requests is timed
+#define HANDLER_THROTTLE_IDLE_MS 100 // idle wait before paused reads resume
+#define HANDLER_BALANCE_INTERVAL_MS 250 // period of the group balancer
+// loads are permille of the balance interval spent handling events
+#define HANDLER_SCALE_UP_LOAD 700 // average load waking a parked handler
+#define HANDLER_SCALE_DOWN_LOAD 250 // average load parking a handler
+#define HANDLER_SHED_LOAD 500 // minimum load of a handler shedding connections
+#define HANDLER_SHED_MARGIN 200 // load above the average before shedding
+
+struct handler_group;
+
+// requests of a sampled connection are recorded, see capture.h
+typedef struct {
+    uint64_t id; // capture id, 0 if the connection is not recorded
+    uint64_t arrived_ns; // batch_ns the current request started arriving in
+} ConnectionCapture;
 
 typedef struct {
     atomic_size_t n_connections;
     int epoll_fd;
-    struct epoll_event *events;
-    size_t events_len;
-    ConnectionManager *conn_manager;
+    struct epoll_event events[EPOLL_EVENTS_SIZE];
+    ConnectionManager *conn_manager; // only touched by the handler thread
+    AcceptQueue *accept_queue; // sockets handed over by the server thread
+    IOPool *io_pool; // shared disk read pool
+    IOCompletionQueue *io_cq; // reads completed on behalf of this handler
+    Executor *executor; // shared CPU bound task workers
+    TaskCompletionQueue *task_cq; // tasks completed on behalf of this handler
+    MetadataCache *md_cache; // shared metadata of the served directory
+    ListingCache *listing_cache; // shared listing of the served directory
+    SlabAllocator *slab; // bound to the handler thread
+    BufferPool *buffer_pool; // shared payload and write buffers
+    BufferCache *buffer_cache; // created on the handler thread
+    MemoryBudget *budget; // charged for buffers allocated by the handler
+    StatsRegistry *stats; // handler thread counts into the registry
+    size_t n_throttled; // connections with reads paused
+    size_t throttled_bytes; // footprint of those connections
+    struct handler_group *group; // balances connections across handlers
+    atomic_uint_fast64_t n_migrated; // connections moved to other handlers
+    atomic_uint_fast64_t busy_ns; // time spent handling events
+    uint64_t batch_ns; // monotonic ns the current epoll batch was returned
+    uint64_t n_handled; // requests handled, picks the sampled ones
+    atomic_size_t n_shed; // connections to move to other handlers
+    atomic_bool shed_scan; // idle connections should also be moved
+    MetricsHandlerSlot *metrics; // published by the handler thread, may be NULL
+    uint64_t metrics_ns; // batch_ns of the last publish
+    bool metrics_stale; // events handled since the last publish
+    SlowLogRing *slow_ring; // NULL if slow requests are not logged
+    // trace of the request on each connection slot, by segment. NULL if
+    // slow requests are not logged
+    RequestTrace **traces;
+    Capture *capture; // NULL if requests are not captured
+    CaptureRing *capture_ring;
+    // capture state of each connection slot, by segment. NULL if requests
+    // are not captured
+    ConnectionCapture **captures;
 } Handler;
 
+typedef struct handler_group {
+    Handler **handlers; // not owned by the group
+    size_t n_handlers;
+    atomic_size_t n_awake; // handlers [0, n_awake) are given connections
+    uint64_t *last_busy_ns; // balancer only, busy time at the last balance
+    uint32_t *load; // balancer only, permille
+    atomic_uint_fast64_t n_parks;
+    atomic_uint_fast64_t n_wakes;
+    pthread_t balancer;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // wakes the balancer on shutdown
+    MetricsGroupSlot *metrics; // published by the balancer, may be NULL
+} HandlerGroup;
+
+typedef struct {
+    size_t n_handlers;
+    size_t n_awake;
+    uint64_t n_migrated;
+    uint64_t n_parks;
+    uint64_t n_wakes;
+} HandlerGroupStats;
+
 struct handle_connections_args {
     Handler *h;
     OpenFileInstances *ofis;
@@ -37,28 +129,130 @@ struct handle_connections_args {
 /** @brief Initialises handler instance.
  *
  *  Allocates provided address to handler instance. Handler fields are
- *  allocated and initialised to their default values.
+ *  allocated and initialised to their default values. Handler completion
+ *  and accept queues are watched by the handlers epoll instance, so file
+ *  reads finished by the IO pool, tasks finished by the executor and newly
+ *  accepted clients wake the handler.
  *
  *  @param h : Address of handler pointer.
+ *  @param io_pool : Shared IOPool instance.
+ *  @param executor : Shared Executor instance, compression and listing
+ *  serialisation of large responces are run on it.
+ *  @param md_cache : Shared MetadataCache instance.
+ *  @param listing_cache : Shared ListingCache instance.
+ *  @param slab : SlabAllocator serving request and responce objects, bound
+ *  to the handler thread once started. Not owned by the handler, as blocks
+ *  may outlive it.
+ *  @param buffer_pool : Shared BufferPool instance. Handler thread caches
+ *  buffers of the pool once started.
+ *  @param budget : MemoryBudget of the handler. Not owned by the handler, as
+ *  buffers charged to it may outlive it.
+ *  @param stats : Shared StatsRegistry, handler thread binds counters of it
+ *  once started.
+ *  @param slow_log : Shared SlowLog the handler logs slow requests to, or
+ *  NULL. Each request is then traced.
+ *  @param capture : Shared Capture the handler records requests of sampled
+ *  connections to, or NULL.
+ *  @param metrics : Shared memory slot the handler thread publishes its
+ *  counters to at most every METRICS_PUBLISH_INTERVAL_MS, or NULL.
  */
-int init_handler(Handler **h);
+int init_handler(Handler **h, IOPool *io_pool, Executor *executor,
+        MetadataCache *md_cache,
+        ListingCache *listing_cache, SlabAllocator *slab,
+        BufferPool *buffer_pool, MemoryBudget *budget, StatsRegistry *stats,
+        SlowLog *slow_log, Capture *capture, MetricsHandlerSlot *metrics);
 
-/** @brief Adds connection to those watched by the handler.
+/** @brief Hands a new connection over to the handler.
  *
- *  Adds the new connections file descriptor to the handlers epoll queue.
- *  New active connection instance is attached, with event set to EPOLLIN.
- *  If successful, handlers n_connections field is incremented, otherwise, -1
- *  is returned.
+ *  Safe to call from any thread. File descriptor is pushed onto the handlers
+ *  accept queue without locking, the handler thread then attaches a new
+ *  active connection instance and watches it for EPOLLIN. Handlers
+ *  n_connections field is incremented immediately. If h is NULL, -1 is
+ *  returned.
  *
  *  @param h : Handler instance.
  *  @param client_sock_fd : Open file descriptor of new client.
  */
 int new_client(Handler *h, int client_sock_fd);
 
+/** @brief Wakes handler to shed connections.
+ *
+ *  Safe to call from any thread. Once woken, the handler moves up to n_shed
+ *  idle connections to other handlers of its group, the remainder are moved
+ *  as their responces complete. If h is NULL, nothing is done.
+ *
+ *  @param h : Handler instance.
+ */
+void handler_wake(Handler *h);
+
+/** @brief Initialises handler group.
+ *
+ *  Group routes new connections across its handlers, and starts a balancer
+ *  thread. Every HANDLER_BALANCE_INTERVAL_MS the balancer measures the load of
+ *  each handler, then either wakes a parked handler, parks the last awake
+ *  handler, or asks handlers well above the average load to shed connections
+ *  (see handler_wake). Parked handlers shed all their connections, and are
+ *  given no new ones. All handlers start awake. If the balancer cannot be
+ *  created, error message is printed and program exits with status
+ *  EXIT_FAILURE.
+ *
+ *  @param handlers : Handlers of the group, at least 1.
+ *  @param n_handlers : Number of handlers.
+ *  @param metrics : Shared memory slot the balancer publishes the group to
+ *  after every balance, or NULL.
+ *  @return HandlerGroup instance.
+ */
+HandlerGroup *init_handler_group(Handler **handlers, size_t n_handlers,
+        MetricsGroupSlot *metrics);
+
+/** @brief Picks the handler to give a connection.
+ *
+ *  Safe to call from any thread. The awake handler with the fewest
+ *  connections is returned. If group is NULL, or exclude is the only awake
+ *  handler, NULL is returned.
+ *
+ *  @param group : HandlerGroup instance.
+ *  @param exclude : Handler to skip, or NULL.
+ *  @return Handler instance.
+ */
+Handler *handler_group_route(HandlerGroup *group, Handler *exclude);
+
+/** @brief Reports handler group counters.
+ *
+ *  If group or stats is NULL, nothing is done.
+ *
+ *  @param group : HandlerGroup instance.
+ *  @param stats : HandlerGroupStats to fill.
+ */
+void handler_group_stats(HandlerGroup *group, HandlerGroupStats *stats);
+
+/** @brief Stops balancing handler group.
+ *
+ *  Balancer thread is stopped and joined, and no handler is routed new or
+ *  migrated connections. Called before the handlers are cancelled. If group
+ *  is NULL, nothing is done.
+ *
+ *  @param group : HandlerGroup instance.
+ */
+void stop_handler_group(HandlerGroup *group);
+
+/** @brief Destroys handler group.
+ *
+ *  Group is stopped if still running (see stop_handler_group). Handlers are
+ *  not destroyed, but must no longer be running as they reference the group.
+ *  If group is NULL, nothing is done.
+ *
+ *  @param group : HandlerGroup instance.
+ */
+void destroy_handler_group(HandlerGroup *group);
+
 /** @brief Begins handling requests.
  *
  *  Starts handler. Requests will be handled indefinitly once called, only
- *  stopping when a shutdown request is recieved.
+ *  stopping when a shutdown request is recieved. If the handler has a
+ *  metrics slot, counters are published to it once a batch of events ends
+ *  METRICS_PUBLISH_INTERVAL_MS after the last publish, idle handlers wake to
+ *  publish what is left.
  *
  *  @param arg : handle_connections_args instance.
  */
@@ -1,5 +1,29 @@
 #include "open_file_instance.h"
 
+/** @brief Reaper thread.
+ *
+ *  Every OPEN_FILE_REAP_INTERVAL_MS, retired instances are reaped (see
+ *  reap_retired). Thread returns once ofis is stopping.
+ *
+ *  @param arg : OpenFileInstances instance.
+ */
+static void *reaper(void *arg);
+
+/** @brief Destroys instances retired for longer than the TTL.
+ *
+ *  Reaped slots are filled from the end of the table, and the table is
+ *  halved while at most a quarter full. Caller must hold the ofis lock.
+ *
+ *  @param ofis : OpenFileInstances instance.
+ */
+static void reap_retired(OpenFileInstances *ofis);
+
+/** @brief Returns the monotonic clock in milliseconds.
+ *
+ *  @return milliseconds.
+ */
+static uint64_t now_ms();
+
 int init_open_file_instances(OpenFileInstances **ofis) {
     if (!ofis) {
         return -1;
@@ -9,14 +33,86 @@ int init_open_file_instances(OpenFileInstances **ofis) {
             OPEN_FILE_INSTANCES_INIT_LEN);
     (*ofis)->instances_len = OPEN_FILE_INSTANCES_INIT_LEN;
     (*ofis)->n_instances = 0;
+    (*ofis)->n_reaped = 0;
+    (*ofis)->stopping = false;
     pthread_mutex_init(&(*ofis)->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*ofis)->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&(*ofis)->reaper, NULL, reaper, *ofis)) {
+        printf("unable to initialise session reaper!\n");
+        exit(EXIT_FAILURE);
+    }
     return 0;
 }
 
-int init_open_file_instance(OpenFileInstance **ofi, char *file_path,
-        uint32_t session_id, uint64_t offset, uint64_t n_requested) {
-    // error file doesnt exist
-    if (!file_path || access(file_path, F_OK) || !ofi) {
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *reaper(void *arg) {
+    OpenFileInstances *ofis = (OpenFileInstances *) arg;
+
+    pthread_mutex_lock(&ofis->lock);
+    while (!ofis->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += OPEN_FILE_REAP_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (OPEN_FILE_REAP_INTERVAL_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ofis->cond, &ofis->lock, &deadline);
+        if (!ofis->stopping) {
+            reap_retired(ofis);
+        }
+    }
+    pthread_mutex_unlock(&ofis->lock);
+    return NULL;
+}
+
+static void reap_retired(OpenFileInstances *ofis) {
+    uint64_t now = now_ms();
+    size_t i = 0;
+    while (i < ofis->n_instances) {
+        OpenFileInstance *ofi = ofis->open_file_instances[i];
+        // references are only taken under the lock, zero stays zero
+        if (atomic_load(&ofi->reference_count) ||
+            now - atomic_load(&ofi->retired_at) < OPEN_FILE_RETIRED_TTL_MS) {
+            ++i;
+            continue;
+        }
+        destroy_open_file_instance(ofi);
+        ofis->open_file_instances[i] =
+                ofis->open_file_instances[--ofis->n_instances];
+        ofis->n_reaped++;
+    }
+
+    // return memory of a table that has emptied out
+    size_t len = ofis->instances_len;
+    while (len / 2 >= OPEN_FILE_INSTANCES_INIT_LEN &&
+           ofis->n_instances <= len / 4) {
+        len /= 2;
+    }
+    if (len != ofis->instances_len) {
+        ofis->open_file_instances = safe_realloc(ofis->open_file_instances,
+                sizeof(OpenFileInstance *) * len);
+        ofis->instances_len = len;
+    }
+    return;
+}
+
+int init_open_file_instance(OpenFileInstance **ofi, int dir_fd,
+        char *file_path, uint32_t session_id, uint64_t offset,
+        uint64_t n_requested) {
+    if (!file_path || !ofi) {
         return -1;
     }
 
@@ -24,37 +120,44 @@ int init_open_file_instance(OpenFileInstance **ofi, char *file_path,
     (*ofi)->session_id = session_id;
     (*ofi)->n_requested = n_requested;
     (*ofi)->offset = offset;
-    (*ofi)->n_read = 0;
-    (*ofi)->reference_count = 1;
+    atomic_init(&(*ofi)->n_read, 0);
+    atomic_init(&(*ofi)->prefetched, offset);
+    atomic_init(&(*ofi)->reference_count, 1);
+    atomic_init(&(*ofi)->retired_at, 0);
 
-    (*ofi)->file = fopen(file_path, "rb+");
-    // adv file pointer by the offset
-    fseek((*ofi)->file, offset, SEEK_SET);
+    // reads are positional, file pointer is never advanced
+    (*ofi)->fd = open_beneath(dir_fd, file_path, O_RDONLY);
+    if ((*ofi)->fd < 0) {
+        free(*ofi);
+        *ofi = NULL;
+        return -1;
+    }
+    // requested range is streamed front to back
+    posix_fadvise((*ofi)->fd, offset, n_requested, POSIX_FADV_SEQUENTIAL);
 
     // copy file path
     (*ofi)->file_path = safe_malloc(strlen(file_path) + 1);
     memcpy((*ofi)->file_path, file_path, strlen(file_path) + 1);
-
-    pthread_mutex_init(&(*ofi)->lock, NULL);
     return 0;
 }
 
-int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, char *file_path,
-        uint32_t session_id, uint64_t offset, uint64_t n_requested) {
+int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, int dir_fd,
+        char *file_path, uint32_t session_id, uint64_t offset,
+        uint64_t n_requested) {
     if (!ofis || !file_path) {
         return -1;
     }
 
-    if (access(file_path, F_OK)) {
-        return -1;
-    }
-
     ssize_t unused_index = -1;
     for (size_t i = 0; i < ofis->n_instances; ++i) {
-        if (unused_index == -1 && !ofis->open_file_instances[i]->reference_count) {
+        // instances are only destroyed under the ofis lock, so a reference
+        // count seen as zero stays zero
+        bool referenced = atomic_load(
+                &ofis->open_file_instances[i]->reference_count);
+        if (unused_index == -1 && !referenced) {
             unused_index = i;
         }
-        if (ofis->open_file_instances[i]->reference_count &&
+        if (referenced &&
             ofis->open_file_instances[i]->session_id == session_id) {
             if (strcmp(ofis->open_file_instances[i]->file_path, file_path)) {
                 // same session id, different file paths
@@ -66,16 +169,20 @@ int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, char *file_path,
             } else {
                 // multiplex request!
                 *ofi = ofis->open_file_instances[i];
-                ofis->open_file_instances[i]->reference_count++;
+                open_file_retain(*ofi);
                 return 0;
             }
         }
     }
 
     if (unused_index == -1) {
-        if (ofis->n_instances >= ofis->instances_len) {
+        if (ofis->n_instances >= OPEN_FILE_INSTANCES_MAX) {
+            // every session is live
+            return -1;
+        } else if (ofis->n_instances >= ofis->instances_len) {
             ofis->open_file_instances = safe_realloc(ofis->open_file_instances,
-                    ARRAY_GROWTH_RATE * ofis->instances_len);
+                    sizeof(OpenFileInstance *) * ARRAY_GROWTH_RATE *
+                    ofis->instances_len);
             ofis->instances_len *= ARRAY_GROWTH_RATE;
         }
         unused_index = ofis->n_instances;
@@ -86,35 +193,147 @@ int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, char *file_path,
     }
 
     // new open file instance
-    init_open_file_instance(&ofis->open_file_instances[unused_index], file_path,
-            session_id, offset, n_requested);
+    if (init_open_file_instance(&ofis->open_file_instances[unused_index],
+            dir_fd, file_path, session_id, offset, n_requested) < 0) {
+        // release slot
+        ofis->open_file_instances[unused_index] =
+                ofis->open_file_instances[ofis->n_instances - 1];
+        ofis->n_instances--;
+        return -1;
+    }
     // initialise passed ofi addr
     *ofi = ofis->open_file_instances[unused_index];
 
     return 0;
 }
 
+uint64_t open_file_claim(OpenFileInstance *ofi, uint64_t max_len,
+        uint64_t *start) {
+    if (!ofi || !start) {
+        return 0;
+    }
+
+    if (open_file_exhausted(ofi)) {
+        // avoid advancing n_read further past the end
+        return 0;
+    }
+    uint64_t claimed = atomic_fetch_add_explicit(&ofi->n_read, max_len,
+            memory_order_relaxed);
+    if (claimed >= ofi->n_requested) {
+        return 0;
+    }
+    uint64_t n_bytes = ofi->n_requested - claimed;
+    if (n_bytes > max_len) {
+        n_bytes = max_len;
+    }
+    *start = ofi->offset + claimed;
+    return n_bytes;
+}
+
+bool open_file_exhausted(OpenFileInstance *ofi) {
+    if (!ofi) {
+        return true;
+    }
+
+    return atomic_load_explicit(&ofi->n_read, memory_order_relaxed) >=
+            ofi->n_requested;
+}
+
+void open_file_retain(OpenFileInstance *ofi) {
+    atomic_fetch_add_explicit(&ofi->reference_count, 1, memory_order_relaxed);
+    return;
+}
+
+void open_file_release(OpenFileInstance *ofi) {
+    if (!ofi) {
+        return;
+    }
+
+    // stamped before the count drops, a retired instance never has a stale time
+    atomic_store_explicit(&ofi->retired_at, now_ms(), memory_order_relaxed);
+    // orders this streams reads before reuse of the instance
+    atomic_fetch_sub_explicit(&ofi->reference_count, 1, memory_order_release);
+    return;
+}
+
+void open_file_prefetch(OpenFileInstance *ofi, uint64_t window) {
+    if (!ofi) {
+        return;
+    }
+
+    uint64_t n_read = atomic_load_explicit(&ofi->n_read, memory_order_relaxed);
+    uint64_t claimed = ofi->offset + (n_read < ofi->n_requested ?
+            n_read : ofi->n_requested);
+    uint64_t end = ofi->offset + ofi->n_requested;
+    uint64_t prefetched = atomic_load_explicit(&ofi->prefetched,
+            memory_order_relaxed);
+    // amortise, only advise once half the window has been consumed
+    if (prefetched >= end || prefetched >= claimed + window / 2) {
+        return;
+    }
+    uint64_t start = prefetched > claimed ? prefetched : claimed;
+    if (end > claimed + window) {
+        end = claimed + window;
+    }
+    // another responce advanced the window first, it advises instead
+    if (!atomic_compare_exchange_strong_explicit(&ofi->prefetched,
+            &prefetched, end, memory_order_relaxed, memory_order_relaxed)) {
+        return;
+    }
+
+    // asynchronous, populates page cache ahead of the io pool
+    posix_fadvise(ofi->fd, start, end - start, POSIX_FADV_WILLNEED);
+    return;
+}
+
 void destroy_open_file_instance(OpenFileInstance *ofi) {
     if (!ofi) {
         return;
     }
 
     free(ofi->file_path);
-    fclose(ofi->file);
-    pthread_mutex_destroy(&ofi->lock);
+    close(ofi->fd);
     free(ofi);
     return;
 }
 
+void open_file_instances_stats(OpenFileInstances *ofis,
+        OpenFileInstancesStats *stats) {
+    if (!ofis || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&ofis->lock);
+    stats->n_live = 0;
+    for (size_t i = 0; i < ofis->n_instances; ++i) {
+        if (atomic_load(&ofis->open_file_instances[i]->reference_count)) {
+            stats->n_live++;
+        }
+    }
+    stats->n_retired = ofis->n_instances - stats->n_live;
+    stats->n_reaped = ofis->n_reaped;
+    stats->instances_len = ofis->instances_len;
+    pthread_mutex_unlock(&ofis->lock);
+    return;
+}
+
 void destroy_open_file_instances(OpenFileInstances *ofis) {
     if (!ofis) {
         return;
     }
 
+    pthread_mutex_lock(&ofis->lock);
+    ofis->stopping = true;
+    pthread_cond_signal(&ofis->cond);
+    pthread_mutex_unlock(&ofis->lock);
+    pthread_join(ofis->reaper, NULL);
+
     for (size_t i = 0; i < ofis->n_instances; ++i) {
         destroy_open_file_instance(ofis->open_file_instances[i]);
     }
     free(ofis->open_file_instances);
+    pthread_mutex_destroy(&ofis->lock);
+    pthread_cond_destroy(&ofis->cond);
 
     free(ofis);
     return;
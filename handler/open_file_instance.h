@@ -2,40 +2,65 @@
 #define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_OPEN_FILE_INSTANCE_H
 
 #include "../memory/memory.h"
+#include "../io/path_resolve.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
 
 #define UNCLAIMED_WRITE_BUFF_LEN 1024
 #define OPEN_FILE_INSTANCES_INIT_LEN 10
+#define OPEN_FILE_INSTANCES_MAX 4096 // live and retired sessions
+#define OPEN_FILE_RETIRED_TTL_MS 5000 // retired instances kept for reuse
+#define OPEN_FILE_REAP_INTERVAL_MS 1000
 
+// immutable once opened, apart from the atomics. multiplexed responces on
+// different handlers claim ranges and release references without locking
 typedef struct {
     uint32_t session_id;
     uint64_t offset;
     uint64_t n_requested;
-    uint64_t n_read;
-    char *file_path;
-    FILE *file;
-    int reference_count;
-    pthread_mutex_t lock;
+    char *file_path; // relative to the served directory
+    int fd;
+    atomic_uint reference_count; // file streams attached
+    atomic_uint_fast64_t n_read; // bytes claimed, may overshoot n_requested
+    atomic_uint_fast64_t prefetched; // offset kernel readahead was requested up to
+    atomic_uint_fast64_t retired_at; // monotonic ms of the last release
 } OpenFileInstance;
 
 typedef struct {
     OpenFileInstance **open_file_instances;
     size_t n_instances;
     size_t instances_len;
+    size_t n_reaped; // retired instances destroyed by the reaper
+    pthread_t reaper;
+    bool stopping;
     pthread_mutex_t lock;
+    pthread_cond_t cond; // wakes the reaper on shutdown
 } OpenFileInstances;
 
+typedef struct {
+    size_t n_live; // instances streamed by at least one responce
+    size_t n_retired; // unreferenced, file still open
+    size_t n_reaped;
+    size_t instances_len;
+} OpenFileInstancesStats;
+
 /** @brief Initialises OpenFileInstances instance.
  *
  *  ofis is set to address of OpenFileInstances instance. Instance is
  *  dynamically allocated, and instances length is set to
- *  OPEN_FILE_INSTANCES_INIT_LEN. If ofis is NULL, nothing is done and
- *  -1 is returned.
+ *  OPEN_FILE_INSTANCES_INIT_LEN. A reaper thread is started, destroying
+ *  instances retired for longer than OPEN_FILE_RETIRED_TTL_MS and shrinking
+ *  the table. If ofis is NULL, nothing is done and -1 is returned. If the
+ *  reaper cannot be created, error message is printed and program exits with
+ *  status EXIT_FAILURE.
  *
  *  @param ofis : Address to store OpenFileInstance pointer.
  *  @return status, -1 on error, 0 otherwise.
@@ -45,36 +70,108 @@ int init_open_file_instances(OpenFileInstances **ofis);
 /** @brief Initialises OpenFileInstance instance.
  *
  *  ofi is set to address of new OpenFileInstance instance. Appropriate fields
- *  are set, file path is copied. If file path is null,
- *  file doesnt exist, or ofi is NULL, nothing is done and -1 is returned.
+ *  are set, file path is copied. File is opened beneath dir_fd. Kernel is
+ *  advised the requested range will be read sequentially. If file path is
+ *  null, file cannot be opened, or ofi is NULL, nothing is done and -1 is
+ *  returned.
  *
  *  @param ofi : Address to store OpenFileInstance pointer.
- *  @param file_path : path to target file.
+ *  @param dir_fd : Served directory fd.
+ *  @param file_path : path to target file, relative to dir_fd.
  *  @param session_id : 4 byte session id.
  *  @param offset : byte offset to begin reading from.
  *  @param n_requested : number of bytes requested from file.
  *  @return status, -1 on error, 0 otherwise.
  */
-int init_open_file_instance(OpenFileInstance **ofi, char *file_path,
-        uint32_t session_id, uint64_t offset, uint64_t n_requested);
+int init_open_file_instance(OpenFileInstance **ofi, int dir_fd,
+        char *file_path, uint32_t session_id, uint64_t offset,
+        uint64_t n_requested);
 
 /** @brief Opens a new file as OpenFileInstance in OpenFileInstances param.
  *
  *  Opens a new file as an OpenFileInstance, stored in OpenFileInstances
- *  array. -1 is returned if ofis or file path is NULL, file doesnt exist (or
- *  access is not allowed), or (session_id, file_path, offset, n_requested) tuple
- *  is invalid.
+ *  array. The slot of a retired instance is reused first. Caller must hold
+ *  the ofis lock. -1 is returned if ofis or file path is NULL, file cannot be
+ *  opened beneath dir_fd, OPEN_FILE_INSTANCES_MAX instances are live, or
+ *  (session_id, file_path, offset, n_requested) tuple is invalid.
  *
  *  @param ofi : Address to store OpenFileInstance pointer.
  *  @param ofis : OpenFileInstances instance to track new open file instance.
- *  @param file_path : path to requested file.
+ *  @param dir_fd : Served directory fd.
+ *  @param file_path : path to requested file, relative to dir_fd.
  *  @param session_id : 4 byte session id.
  *  @param offset : byte offset.
  *  @param n_requested : number of bytes requested from file.
  *  @return status, -1 on error, 0 otherwise.
  */
-int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, char *file_path,
-        uint32_t session_id, uint64_t offset, uint64_t n_requested);
+int open_file(OpenFileInstance **ofi, OpenFileInstances *ofis, int dir_fd,
+        char *file_path, uint32_t session_id, uint64_t offset,
+        uint64_t n_requested);
+
+/** @brief Claims the next byte range of the requested file.
+ *
+ *  Reserves up to max_len bytes following the last claimed range, so that
+ *  multiplexed responces never read the same bytes twice. Ranges are claimed
+ *  with a single fetch-add, without locking. start is set to the absolute
+ *  file offset of the claimed range. If ofi is NULL or all requested bytes
+ *  have already been claimed, 0 is returned.
+ *
+ *  @param ofi : OpenFileInstance instance.
+ *  @param max_len : Maximum number of bytes to claim.
+ *  @param start : Address to store starting file offset.
+ *  @return number of bytes claimed.
+ */
+uint64_t open_file_claim(OpenFileInstance *ofi, uint64_t max_len,
+        uint64_t *start);
+
+/** @brief Checks if every requested byte has been claimed.
+ *
+ *  Lock free. If ofi is NULL, true is returned.
+ *
+ *  @param ofi : OpenFileInstance instance.
+ *  @return true if no bytes are left to claim.
+ */
+bool open_file_exhausted(OpenFileInstance *ofi);
+
+/** @brief Takes a reference to an open file instance.
+ *
+ *  @param ofi : OpenFileInstance instance.
+ */
+void open_file_retain(OpenFileInstance *ofi);
+
+/** @brief Releases a reference to an open file instance.
+ *
+ *  Instance is not destroyed. Once the final reference is released it is
+ *  retired, and later reused or reaped by its OpenFileInstances owner. If ofi
+ *  is NULL, nothing is done.
+ *
+ *  @param ofi : OpenFileInstance instance.
+ */
+void open_file_release(OpenFileInstance *ofi);
+
+/** @brief Keeps the kernel reading ahead of claimed ranges.
+ *
+ *  If fewer than window / 2 bytes beyond the last claimed byte have been
+ *  prefetched, the kernel is asked (POSIX_FADV_WILLNEED) to read the
+ *  remainder of the next window bytes of the requested range into the page
+ *  cache. Shared by all responces multiplexing the instance, so each range is
+ *  only advised once, the advised offset is advanced with compare-and-swap.
+ *  If ofi is NULL, nothing is done.
+ *
+ *  @param ofi : OpenFileInstance instance.
+ *  @param window : Number of bytes to keep warm ahead of claimed ranges.
+ */
+void open_file_prefetch(OpenFileInstance *ofi, uint64_t window);
+
+/** @brief Reports live and retired session counts.
+ *
+ *  Taken under the ofis lock. If ofis or stats is NULL, nothing is done.
+ *
+ *  @param ofis : OpenFileInstances instance.
+ *  @param stats : OpenFileInstancesStats to fill.
+ */
+void open_file_instances_stats(OpenFileInstances *ofis,
+        OpenFileInstancesStats *stats);
 
 /** @brief Destroys open file instance.
  *
@@ -84,8 +181,8 @@ void destroy_open_file_instance(OpenFileInstance *ofi);
 
 /** @brief Destroys open file instances.
  *
- *  Releases all dynamically allocated memory, including fields. All open
- *  file instances are also destroyed.
+ *  Reaper thread is stopped and joined. Releases all dynamically allocated
+ *  memory, including fields. All open file instances are also destroyed.
  */
 void destroy_open_file_instances(OpenFileInstances *ofis);
 
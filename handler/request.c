@@ -1,62 +1,108 @@
 #include "request.h"
 
-RequestData *init_request_data() {
-    RequestData *rd = safe_malloc(sizeof(RequestData));
+/** @brief Allocates payload buffer of a request.
+ *
+ *  Block holds REQUEST_PAYLOAD_HEADROOM bytes ahead of the payload.
+ *
+ *  @param rd : RequestData instance, payload length decoded.
+ *  @return 0 on success, -1 if the payload can not be allocated.
+ */
+static int request_alloc_payload(RequestData *rd);
 
-    // alloc metadata buffer
-    rd->metadata_buffer = safe_malloc(HEADER_SIZE + PAYLOAD_LEN_SIZE);
-    rd->metadata_buffer_len = HEADER_SIZE + PAYLOAD_LEN_SIZE;
+void init_request_data(RequestData *rd) {
+    // metadata buffer is inline
     rd->metadata_buffer_n = 0;
+    rd->throttled = false;
 
     // set payload to null
+    rd->payload_block = NULL;
     rd->payload_buffer = NULL;
     rd->payload_len = 0;
     rd->payload_buffer_n = 0;
-    return rd;
+    return;
+}
+
+static int request_alloc_payload(RequestData *rd) {
+    if (rd->payload_len > SIZE_MAX - REQUEST_PAYLOAD_HEADROOM) {
+        return -1;
+    }
+    // length is client declared, failure closes the connection
+    rd->payload_block = buffer_try_alloc(REQUEST_PAYLOAD_HEADROOM +
+            rd->payload_len);
+    if (!rd->payload_block) {
+        return -1;
+    }
+    rd->payload_buffer = rd->payload_block + REQUEST_PAYLOAD_HEADROOM;
+    return 0;
 }
 
 int request_read(RequestData *rd, int fd) {
     ssize_t n = 0;
     // read header and payload len
-    if (rd->metadata_buffer_n < rd->metadata_buffer_len) {
+    if (rd->metadata_buffer_n < REQUEST_METADATA_SIZE) {
         errno = 0;
         ssize_t n = read(fd, rd->metadata_buffer + rd->metadata_buffer_n,
-                rd->metadata_buffer_len - rd->metadata_buffer_n);
+                REQUEST_METADATA_SIZE - rd->metadata_buffer_n);
+        stats_count_syscall(StatsSocketRead, n < 0 && errno == EWOULDBLOCK);
         if (n <= 0 && errno != EWOULDBLOCK) {
             return -1;
+        } else if (n < 0) {
+            // spurious wakeup, nothing read
+            return 0;
         }
         rd->metadata_buffer_n += n;
 
-        // initialise payload buffer if metadata has been read
-        if (rd->metadata_buffer_n == rd->metadata_buffer_len) {
+        // decode payload length if metadata has been read
+        if (rd->metadata_buffer_n == REQUEST_METADATA_SIZE) {
             for (size_t i = 0; i < PAYLOAD_LEN_SIZE; ++i) {
-                rd->payload_len |= rd->metadata_buffer[1 + i] <<
+                rd->payload_len |= (uint64_t) rd->metadata_buffer[1 + i] <<
                         ((PAYLOAD_LEN_SIZE - 1 - i) * 8);
             }
-            // allocate payload buffer
-            rd->payload_buffer = safe_malloc(rd->payload_len);
+            JX_PROBE3(request__parsed, fd, rd->metadata_buffer[0] >> 4,
+                    rd->payload_len);
+            if (!rd->payload_len && request_alloc_payload(rd) < 0) {
+                return -1;
+            }
         }
 
     } else if (rd->payload_buffer_n < rd->payload_len) {
+        // payload is allocated on its first read, so it may be streamed
+        // instead
+        if (!rd->payload_block && request_alloc_payload(rd) < 0) {
+            return -1;
+        }
         errno = 0;
         n = read(fd, rd->payload_buffer + rd->payload_buffer_n,
                 rd->payload_len - rd->payload_buffer_n);
+        stats_count_syscall(StatsSocketRead, n < 0 && errno == EWOULDBLOCK);
         if (n <= 0 && errno != EWOULDBLOCK) {
             return -1;
+        } else if (n < 0) {
+            // spurious wakeup, nothing read
+            return 0;
         }
         rd->payload_buffer_n += n;
     }
 
-    return rd->metadata_buffer_n == rd->metadata_buffer_len &&
+    return rd->metadata_buffer_n == REQUEST_METADATA_SIZE &&
            rd->payload_buffer_n == rd->payload_len;
 }
 
+bool request_payload_unread(RequestData *rd) {
+    if (!rd) {
+        return false;
+    }
+
+    return rd->metadata_buffer_n == REQUEST_METADATA_SIZE &&
+            rd->payload_len && !rd->payload_buffer_n;
+}
+
 bool request_check_complete(RequestData *rd) {
     if (!rd) {
         return false;
     }
 
-    return rd->metadata_buffer_n == rd->metadata_buffer_len &&
+    return rd->metadata_buffer_n == REQUEST_METADATA_SIZE &&
             rd->payload_buffer_n == rd->payload_len;
 }
 
@@ -65,10 +111,7 @@ void destroy_reading_data(RequestData *rd) {
         return;
     }
 
-    free(rd->metadata_buffer);
-    if (rd->payload_buffer) {
-        free(rd->payload_buffer);
-    }
-    free(rd);
+    buffer_release(rd->payload_block);
+    rd->payload_block = NULL;
     return;
 }
\ No newline at end of file
@@ -2,6 +2,10 @@
 #define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_REQUEST_H
 
 #include "../memory/memory.h"
+#include "../memory/slab.h"
+#include "../memory/buffer_pool.h"
+#include "../stats/stats.h"
+#include "../stats/probes.h"
 
 #include <unistd.h>
 #include <errno.h>
@@ -10,37 +14,48 @@
 
 #define HEADER_SIZE 1
 #define PAYLOAD_LEN_SIZE 8
+#define REQUEST_METADATA_SIZE (HEADER_SIZE + PAYLOAD_LEN_SIZE)
+// reserved ahead of the payload, so it can be echoed in place
+#define REQUEST_PAYLOAD_HEADROOM REQUEST_METADATA_SIZE
 
 enum RequestType {
     EchoReq = 0,
     ListDirReq = 2,
     FileSizeReq = 4,
     RetFileReq = 6,
-    ShutdownReq = 8
+    ShutdownReq = 8,
+    StatsReq = 10
 };
 
+// embedded in its connection, 48 bytes
 typedef struct {
-    uint8_t *metadata_buffer;
-    size_t metadata_buffer_len;
-    size_t metadata_buffer_n;
+    uint8_t metadata_buffer[REQUEST_METADATA_SIZE];
+    uint8_t metadata_buffer_n;
+    bool throttled; // reads paused by the handlers memory budget
+    uint8_t *payload_block; // pooled buffer, payload follows the headroom
     uint8_t *payload_buffer;
     uint64_t payload_len;
-    size_t payload_buffer_n;
+    uint64_t payload_buffer_n;
 } RequestData;
 
 /** @brief Initialises RequestData instance.
  *
- *  Allocates RequestData instance and sets all appropriate fields.
+ *  Sets all fields of the provided instance to their default values. No
+ *  memory is allocated until the payload length has been read.
  *
- *  @return Initialised RequestData instance.
+ *  @param rd : RequestData instance.
  */
-RequestData *init_request_data();
+void init_request_data(RequestData *rd);
 
 /** @brief Asynchronous reads request data from socket.
  *
  *  Reads request from file descriptor into buffer. Read is NON BLOCKING.
  *  If socket is closed by client, or fails, -1 is returned. Otherwise, 1 is
  *  returned if entire request has been read, otherwise, 0 is returned.
+ *  Payload is read into a pooled buffer, REQUEST_PAYLOAD_HEADROOM bytes
+ *  into the block. Buffer is allocated on the first payload read, so a caller
+ *  may take over the payload once metadata has been read. If the declared
+ *  payload length can not be allocated, -1 is returned.
  *
  *  @param rd : RequestData instance.
  *  @param fd : File descriptor to read from.
@@ -48,10 +63,17 @@ RequestData *init_request_data();
  */
 int request_read(RequestData *rd, int fd);
 
+/** @brief Checks if metadata has been read, with payload still unread.
+ *
+ *  @param rd : RequestData instance.
+ *  @return True if no payload byte has been read yet.
+ */
+bool request_payload_unread(RequestData *rd);
+
 /** @brief Releases RequestData instance.
  *
- *  RequestData instance and all dynamically allocated fields are released. If
- *  rd is NULL, nothing is done.
+ *  All dynamically allocated fields are released, the instance itself is
+ *  owned by its connection. If rd is NULL, nothing is done.
  *
  *  @param rd : RequestData instance.
  */
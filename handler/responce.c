@@ -1,88 +1,67 @@
 #include "responce.h"
 
-/** @brief Adds header and payload length to beginning of buffer.
+/** @brief Copies requested file name out of a payload.
  *
- *  Formats header and copies formatted byte to front of buffer. Payload
- *  length is also coppied to bytes 1-9.
+ *  Name ends at the first null byte, or at the end of the payload. dest must
+ *  hold NAME_MAX + 1 bytes and is always null terminated.
  *
- *  @param dest : buffer to be written too.
- *  @param rt : Responce Type (EchoRsp, ListDirRep etc).
- *  @param compressed_payload : Compressed Payload Flag.
- *  @param payload_len : Length of payload.
+ *  @param dest : Name buffer.
+ *  @param src : Payload holding the name.
+ *  @param src_n : Number of payload bytes available.
+ *  @return 0 on success, -1 if name is empty or longer than NAME_MAX.
  */
-static void write_metadata(uint8_t *dest, enum ResponceType rt,
-        bool compressed_payload, uint64_t payload_len);
+static int read_file_name(char *dest, uint8_t *src, size_t src_n);
 
-/** @brief Checks if file is regular.
+/** @brief Serialises and publishes the directory listing.
  *
- *  File given by <dir>/<name> is checked.
+ *  Listing is serialised with room for metadata, compressed if required, and
+ *  published to the listing cache.
  *
- *  @param dir : Target directory path.
- *  @param name : Target file name.
- *  @return boolean, True if regular, False otherwise.
+ *  @param listing_cache : Listing cache of the served directory.
+ *  @param req_compression : Requires Compression flag for responce data.
+ *  @param comp_dict : Compression dictionary.
+ *  @return Published snapshot, with a reference taken for the caller.
  */
-static bool is_regular_file(char *dir, char *name);
+static ListingSnapshot *serialise_listing(ListingCache *listing_cache,
+        bool req_compression, CompressionSegment *comp_dict);
 
-/** @brief Compresses data.
- *
- *  Compresses payload using provided compression dictionary. Resulting
- *  compressed data is stored in allocated array, and dest is set to the starting
- *  address. dest_size is set as the size of the allocated array.
+/** @brief Submits a ResponceTask, deferring the responce.
  *
- *  If any parameters are NULL, nothing is done and -1 is returned (error).
- *  Otherwise, data is compressed and 0 is returned.
+ *  ResponceData is initialised with no write buffer, the task attached.
  *
- *  @param comp_dict : Compression dictionary.
- *  @param uncomp_payload : Uncompressed payload.
- *  @param payload_size : size of uncompressed payload.
- *  @param dest : points to compressed array address on success.
- *  @param dest_size : set to size of compressed array on success.
- *  @param write_offset : data to the right of this address will be compressed.
- *                        This is used to easily exclude data at the beginning of
- *                        the uncompressed payload from compression.
+ *  @param rd : ResponceData instance to initialise.
+ *  @param rt : ResponceTask instance.
+ *  @param offload : Executor to run the task on.
  *  @return 0 on success, -1 on error.
  */
-static int compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
-        uint64_t payload_size, uint8_t **dest, uint64_t *dest_size,
-        size_t write_offset);
+static int defer_responce(ResponceData *rd, ResponceTask *rt,
+        ResponceOffload *offload);
 
-/** @brief Decompresses data.
- *
- *  Decompresses compressed payload using provided decompression tree.
- *  Resulting decompressed data is allocated and pointed to by dest param.
- *  dest_size is set to allocated length.
- *
- *  If any parameters are NULL, nothing is done and -1 is returned (error).
- *  Otherwise, data is decompressed and 0 is returned.
+/** @brief Builds the write buffer of a ResponceTask.
  *
+ *  Run on an executor worker.
  *
- *  @param decom_tree :  Decompression tree root node.
- *  @param compr_payload : Payload to be decompressed.
- *  @param compr_payload_n : number of bytes to be decompressed.
- *  @param decompressed_payload : points to decompressed array on success.
- *  @param decompressed_payload_n : set to decompressed array len on success.
- *  @return 0 on success, -1 on error.
+ *  @param task : Task embedded in a ResponceTask.
  */
-static int decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
-        size_t compr_payload_n, uint8_t **decompressed_payload,
-        uint64_t *decompressed_payload_n);
+static void run_responce_task(Task *task);
 
-ResponceData *init_responce_data(enum ResponceType type, uint8_t *write_buffer,
-        size_t write_buffer_len, void *ptr) {
+int init_responce_data(ResponceData *rd, enum ResponceType type,
+        uint8_t *write_buffer, size_t write_buffer_len, void *ptr) {
 
-    if (!write_buffer) {
-        return NULL;
+    if (!rd || (!write_buffer && write_buffer_len)) {
+        return -1;
     }
 
-    ResponceData *rd = safe_malloc(sizeof(ResponceData));
     rd->type = type;
+    rd->started = false;
+    rd->sampled = false;
     rd->write_buffer = write_buffer;
-    rd->write_n = write_buffer_len; // full buffer
     rd->write_buffer_len = write_buffer_len;
     rd->n_written = 0;
+    rd->t_read = 0;
     rd->ptr = ptr;
 
-    return rd;
+    return 0;
 }
 
 int responce_write(ResponceData *rd, int fd) {
@@ -91,18 +70,22 @@ int responce_write(ResponceData *rd, int fd) {
     }
 
     // async write
-    if (rd->n_written < rd->write_n) {
+    if (rd->n_written < rd->write_buffer_len) {
         errno = 0;
         ssize_t n = write(fd, rd->write_buffer + rd->n_written,
-                rd->write_n - rd->n_written);
+                rd->write_buffer_len - rd->n_written);
+        stats_count_syscall(StatsSocketWrite, n < 0 && errno == EWOULDBLOCK);
         // socket closed by client, or failed
         if (n <= 0 && errno != EWOULDBLOCK) {
             return -1;
+        } else if (n < 0) {
+            // socket buffer full
+            return 0;
         }
         rd->n_written += n;
     }
 
-    return rd->n_written == rd->write_n;
+    return rd->n_written == rd->write_buffer_len;
 }
 
 void destroy_responce_data(ResponceData *rd) {
@@ -111,18 +94,26 @@ void destroy_responce_data(ResponceData *rd) {
     }
 
     if (rd->type == RetFileRsp) {
-        OpenFileInstance *ofi = (OpenFileInstance *) rd->ptr;
-        pthread_mutex_lock(&ofi->lock);
-        ofi->reference_count--;
-        pthread_mutex_unlock(&ofi->lock);
+        FileStream *fs = (FileStream *) rd->ptr;
+        if (fs->n_pending) {
+            // released once in flight reads complete
+            fs->orphaned = true;
+        } else {
+            destroy_file_stream(fs);
+        }
+        rd->ptr = NULL;
+    } else if (rd->ptr) {
+        // released by the handler once the task completes
+        ((ResponceTask *) rd->ptr)->orphaned = true;
+        rd->ptr = NULL;
     }
 
-    free(rd->write_buffer);
-    free(rd);
+    buffer_release(rd->write_buffer);
+    rd->write_buffer = NULL;
     return;
 }
 
-static void write_metadata(uint8_t *dest, enum ResponceType rt,
+void write_metadata(uint8_t *dest, enum ResponceType rt,
         bool compressed_payload, uint64_t payload_len) {
 
     // header construction
@@ -137,154 +128,270 @@ static void write_metadata(uint8_t *dest, enum ResponceType rt,
     return;
 }
 
-ResponceData *error() {
-    uint8_t *write_buff = safe_malloc(HEADER_SIZE + PAYLOAD_LEN_SIZE);
+int error(ResponceData *rd) {
+    uint8_t *write_buff = buffer_alloc(HEADER_SIZE + PAYLOAD_LEN_SIZE);
     // init buffer
     write_metadata(write_buff, Error, false, 0);
-    ResponceData *ret = init_responce_data(Error, write_buff,
+    return init_responce_data(rd, Error, write_buff,
             HEADER_SIZE + PAYLOAD_LEN_SIZE, NULL);
-    return ret;
 }
 
-ResponceData *echo(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, CompressionSegment *comp_dict) {
-
-    ResponceData *ret = NULL;
-    // compressed and requires compression
-    if  (!compressed && req_compression) {
+int echo(ResponceData *rd, bool compressed, bool req_compression,
+        RequestData *request, CompressionSegment *comp_dict,
+        ResponceOffload *offload) {
+
+    uint8_t *payload = request->payload_buffer;
+    uint64_t payload_len = request->payload_len;
+    int ret = -1;
+    if (!compressed && req_compression && offload &&
+        payload_len >= RESPONCE_OFFLOAD_MIN_LEN) {
+        // compress off the handler thread
+        ResponceTask *rt = slab_alloc(sizeof(ResponceTask));
+        rt->type = EchoRsp;
+        rt->input = buffer_retain(request->payload_block);
+        rt->input_len = payload_len;
+        rt->listing_cache = NULL;
+        rt->comp_dict = comp_dict;
+        ret = defer_responce(rd, rt, offload);
+    } else if (!compressed && req_compression) {
+        // compressed and requires compression
         size_t len = 0;
         uint8_t *compressed_data = NULL;
-        compress(comp_dict, payload, payload_len, &compressed_data, &len,
+        jx_compress(comp_dict, payload, payload_len, &compressed_data, &len,
                 HEADER_SIZE + PAYLOAD_LEN_SIZE);
         write_metadata(compressed_data, EchoRsp, true,
                 len - HEADER_SIZE - PAYLOAD_LEN_SIZE);
-        ret = init_responce_data(EchoRsp, compressed_data, len, NULL);
+        ret = init_responce_data(rd, EchoRsp, compressed_data, len, NULL);
     } else {
-        // send back what you got
-        uint8_t *write_data =
-                safe_malloc(payload_len + HEADER_SIZE + PAYLOAD_LEN_SIZE);
+        // send back what you got, sharing the request block
+        uint8_t *write_data = buffer_retain(request->payload_block);
         write_metadata(write_data, EchoRsp, compressed, payload_len);
-        // copy in remaining payload
-        memcpy(write_data + HEADER_SIZE + PAYLOAD_LEN_SIZE, payload, payload_len);
         // initialise responce
-        ret = init_responce_data(EchoRsp, write_data,
-                payload_len + HEADER_SIZE + PAYLOAD_LEN_SIZE, NULL);
+        ret = init_responce_data(rd, EchoRsp, write_data,
+                payload_len + REQUEST_PAYLOAD_HEADROOM, NULL);
     }
 
     return ret;
 }
 
-static bool is_regular_file(char *dir, char *name) {
-    char *path = safe_malloc(strlen(name) + strlen(dir) + 2);
-    sprintf(path, "%s/%s", dir, name);
-    struct stat path_stat;
-    if (stat(path, &path_stat) < 0) {
-        return false;
-    }
-    free(path);
-    return S_ISREG(path_stat.st_mode);
-}
-
-ResponceData *list_files(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, char *dir, CompressionSegment *comp_dict) {
+int list_files(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, ListingCache *listing_cache,
+        CompressionSegment *comp_dict, ResponceOffload *offload) {
 
     // payload should be empty
     if (payload_len) {
-        return error();
-    }
-
-    uint8_t *write_buff = safe_malloc(INIT_LIST_FILES_BUFF_SIZE + HEADER_SIZE +
-            PAYLOAD_LEN_SIZE);
-    size_t write_buff_len = INIT_LIST_FILES_BUFF_SIZE;
-    uint64_t write_buff_n = HEADER_SIZE + PAYLOAD_LEN_SIZE;
-
-    DIR *d = NULL;
-    struct dirent *ent = NULL;
-    if ((d = opendir(dir))) {
-        while ((ent = readdir(d))) {
-            // file name length
-            size_t name_len = strchr(ent->d_name, 256) - ent->d_name;
-            // resize payload if necessary
-            if (write_buff_n + name_len > write_buff_len - 1) {
-                write_buff = safe_realloc(write_buff,
-                        ARRAY_GROWTH_RATE * write_buff_len);
-                write_buff_len *= ARRAY_GROWTH_RATE;
-            }
-            if (is_regular_file(dir, ent->d_name)) {
-                // write file name to directory
-                memcpy(write_buff + write_buff_n, ent->d_name, name_len);
-                write_buff_n += name_len;
-                write_buff[write_buff_n] = 0;
-                write_buff_n++;
-            }
-        }
-        closedir(d);
-    } else {
-        free(write_buff);
-        return error();
+        return error(rd);
+    }
 
+    uint64_t lookup_start = profile_start();
+    ListingSnapshot *snapshot = listing_cache_acquire(listing_cache,
+            req_compression);
+    profile_end(StatsPhaseLookup, lookup_start);
+    stats_count_lookup(StatsListingLookup, snapshot != NULL);
+    if (!snapshot && offload) {
+        // first request since the directory changed, serialise off the
+        // handler thread
+        ResponceTask *rt = slab_alloc(sizeof(ResponceTask));
+        rt->type = ListDirRsp;
+        rt->req_compression = req_compression;
+        rt->input = NULL;
+        rt->input_len = 0;
+        rt->listing_cache = listing_cache;
+        rt->comp_dict = comp_dict;
+        return defer_responce(rd, rt, offload);
+    } else if (!snapshot) {
+        snapshot = serialise_listing(listing_cache, req_compression, comp_dict);
     }
 
-    ResponceData *ret = NULL;
+    // write buffer is shared with the cache and other responces
+    int ret = init_responce_data(rd, ListDirRsp,
+            buffer_retain(snapshot->data), snapshot->len, NULL);
+    listing_snapshot_release(snapshot);
+    return ret;
+}
+
+static ListingSnapshot *serialise_listing(ListingCache *listing_cache,
+        bool req_compression, CompressionSegment *comp_dict) {
+    size_t offset = HEADER_SIZE + PAYLOAD_LEN_SIZE;
+    size_t write_buff_n = 0;
+    uint64_t version = 0;
+    uint8_t *write_buff = listing_cache_serialise(listing_cache, offset,
+            &write_buff_n, &version);
+
     if (!req_compression) {
         // write header and payload len
-        write_metadata(write_buff, ListDirRsp, req_compression,
-                write_buff_n - HEADER_SIZE - PAYLOAD_LEN_SIZE);
-        // responce buffer
-        ret = init_responce_data(ListDirRsp, write_buff, write_buff_n, NULL);
+        write_metadata(write_buff, ListDirRsp, false, write_buff_n - offset);
     } else {
         size_t len = 0;
         uint8_t *compressed_data = NULL;
         // compress payload
-        size_t offset = HEADER_SIZE + PAYLOAD_LEN_SIZE;
-        compress(comp_dict, write_buff + offset, write_buff_n - offset,
+        jx_compress(comp_dict, write_buff + offset, write_buff_n - offset,
                 &compressed_data, &len, offset);
-        free(write_buff);
+        buffer_release(write_buff);
         // write metadata
         write_metadata(compressed_data, ListDirRsp, true, len - offset);
-        // initialise responce
-        ret = init_responce_data(EchoRsp, compressed_data, len, NULL);
+        write_buff = compressed_data;
+        write_buff_n = len;
     }
-    return ret;
+    return listing_cache_publish(listing_cache, req_compression, write_buff,
+            write_buff_n, version);
+}
+
+static int defer_responce(ResponceData *rd, ResponceTask *rt,
+        ResponceOffload *offload) {
+    rt->orphaned = false;
+    rt->output = NULL;
+    rt->output_len = 0;
+    rt->owner = NULL;
+    rt->task.run = run_responce_task;
+    rt->task.ctx = rt;
+    rt->task.budget = offload->budget;
+    rt->task.cq = offload->cq;
+    if (executor_submit(offload->executor, &rt->task) < 0) {
+        destroy_responce_task(rt);
+        return -1;
+    }
+    // nothing to write until the task completes
+    return init_responce_data(rd, rt->type, NULL, 0, rt);
+}
+
+static void run_responce_task(Task *task) {
+    ResponceTask *rt = (ResponceTask *) task->ctx;
+    // handed back with the task, the connection may close meanwhile
+    RequestTrace trace;
+    memset(trace.phase_ticks, 0, sizeof(trace.phase_ticks));
+    profile_set_request(rt->type, &trace);
+    if (rt->type == EchoRsp) {
+        jx_compress(rt->comp_dict, rt->input + REQUEST_PAYLOAD_HEADROOM,
+                rt->input_len, &rt->output, &rt->output_len,
+                HEADER_SIZE + PAYLOAD_LEN_SIZE);
+        write_metadata(rt->output, EchoRsp, true,
+                rt->output_len - HEADER_SIZE - PAYLOAD_LEN_SIZE);
+    } else {
+        // publishing races other handlers, whichever snapshot is cached wins
+        ListingSnapshot *snapshot = listing_cache_acquire(rt->listing_cache,
+                rt->req_compression);
+        if (!snapshot) {
+            snapshot = serialise_listing(rt->listing_cache,
+                    rt->req_compression, rt->comp_dict);
+        }
+        rt->output = buffer_retain(snapshot->data);
+        rt->output_len = snapshot->len;
+        listing_snapshot_release(snapshot);
+    }
+    memcpy(rt->phase_ticks, trace.phase_ticks, sizeof(rt->phase_ticks));
+    profile_set_request(STATS_N_TYPES, NULL);
+    return;
+}
+
+int responce_task_complete(ResponceData *rd) {
+    if (!rd || !rd->ptr) {
+        return -1;
+    }
+
+    ResponceTask *rt = (ResponceTask *) rd->ptr;
+    rd->ptr = NULL;
+    // still timed from the read
+    uint64_t t_read = rd->t_read;
+    bool sampled = rd->sampled;
+    int ret = init_responce_data(rd, rt->type, rt->output, rt->output_len,
+            NULL);
+    rd->t_read = t_read;
+    rd->sampled = sampled;
+    // write buffer reference moves to the responce
+    rt->output = NULL;
+    destroy_responce_task(rt);
+    return rd->write_buffer ? ret : -1;
+}
+
+void destroy_responce_task(ResponceTask *rt) {
+    if (!rt) {
+        return;
+    }
+
+    buffer_release(rt->input);
+    buffer_release(rt->output);
+    slab_free(rt);
+    return;
+}
+
+int get_stats(ResponceData *rd, bool compressed, bool req_compression,
+        uint64_t payload_len, uint8_t *snapshot, size_t snapshot_len,
+        CompressionSegment *comp_dict) {
+
+    // payload should be empty
+    if (payload_len) {
+        buffer_release(snapshot);
+        return error(rd);
+    }
+
+    if (!req_compression) {
+        write_metadata(snapshot, StatsRsp, false, snapshot_len);
+        return init_responce_data(rd, StatsRsp, snapshot,
+                REQUEST_PAYLOAD_HEADROOM + snapshot_len, NULL);
+    }
+
+    size_t len = 0;
+    uint8_t *compressed_data = NULL;
+    jx_compress(comp_dict, snapshot + REQUEST_PAYLOAD_HEADROOM, snapshot_len,
+            &compressed_data, &len, HEADER_SIZE + PAYLOAD_LEN_SIZE);
+    buffer_release(snapshot);
+    write_metadata(compressed_data, StatsRsp, true,
+            len - HEADER_SIZE - PAYLOAD_LEN_SIZE);
+    return init_responce_data(rd, StatsRsp, compressed_data, len, NULL);
+}
+
+static int read_file_name(char *dest, uint8_t *src, size_t src_n) {
+    size_t len = strnlen((char *) src, src_n);
+    if (!len || len > NAME_MAX) {
+        return -1;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+    return 0;
 }
 
-ResponceData *get_file_size(bool compressed, bool req_compression,
-        uint8_t *payload, uint64_t payload_len, char *dir,
+int get_file_size(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, MetadataCache *md_cache,
         CompressionSegment *comp_dict, DecompressionTreeNode *decom_tree) {
 
-    // format file path
-    char *file_path = NULL;
+    char name[NAME_MAX + 1];
+    int status = 0;
     if (!compressed) {
-        file_path = safe_malloc(strlen((char *) payload) + strlen(dir) + 2);
-        // format file path
-        sprintf(file_path, "%s/%s", dir, payload);
+        status = read_file_name(name, payload, payload_len);
     } else {
-        // decompress file path
+        // decompress file name
         uint8_t *decompressed_payload = NULL;
         uint64_t decompressed_payload_n = 0;
-        decompress(decom_tree, payload, payload_len, &decompressed_payload,
+        jx_decompress(decom_tree, payload, payload_len, &decompressed_payload,
                 &decompressed_payload_n);
-        // format file path
-        file_path = safe_malloc(strlen((char *) payload) + strlen(dir) + 2);
-        sprintf(file_path, "%s/%s", dir, decompressed_payload);
+        status = read_file_name(name, decompressed_payload,
+                decompressed_payload_n);
+        buffer_release(decompressed_payload);
     }
 
+    profile_note_file(status < 0 ? NULL : name, 0, 0);
+
     // get file len
-    struct stat file_stat;
-    if (stat(file_path, &file_stat) < 0) {
-        free(file_path);
-        return error();
+    uint64_t lookup_start = profile_start();
+    FileMetadata md;
+    if (status >= 0) {
+        status = metadata_cache_lookup(md_cache, name, &md);
     }
-    uint64_t file_size = (uint64_t) file_stat.st_size;
-    free(file_path);
+    // charged whether or not the file exists
+    profile_end(StatsPhaseLookup, lookup_start);
+    if (status < 0) {
+        return error(rd);
+    }
+    uint64_t file_size = md.size;
 
     uint8_t *write_buff = NULL;
     size_t write_buff_n = 0;
 
-    ResponceData *ret = NULL;
+    int ret = -1;
 
     if (!req_compression) {
-        write_buff = safe_malloc(sizeof(file_size) + HEADER_SIZE +
+        write_buff = buffer_alloc(sizeof(file_size) + HEADER_SIZE +
                 PAYLOAD_LEN_SIZE);
         write_buff_n = sizeof(file_size) + HEADER_SIZE + PAYLOAD_LEN_SIZE;
         // write metadata
@@ -295,7 +402,8 @@ ResponceData *get_file_size(bool compressed, bool req_compression,
         memcpy(write_buff + HEADER_SIZE + PAYLOAD_LEN_SIZE, &file_size,
                 sizeof(file_size));
         // init responce
-        ret = init_responce_data(FileSizeRsp, write_buff, write_buff_n, NULL);
+        ret = init_responce_data(rd, FileSizeRsp, write_buff, write_buff_n,
+                NULL);
     } else {
         // convert to network byte order
         file_size = htobe64(file_size);
@@ -304,98 +412,112 @@ ResponceData *get_file_size(bool compressed, bool req_compression,
         uint8_t *compressed_data = NULL;
         size_t offset = HEADER_SIZE + PAYLOAD_LEN_SIZE;
         // compress payload
-        compress(comp_dict, (uint8_t *) &file_size, sizeof(file_size),
+        jx_compress(comp_dict, (uint8_t *) &file_size, sizeof(file_size),
                 &compressed_data, &len, offset);
         // write metadata
         write_metadata(compressed_data, FileSizeRsp, true, len - offset);
         // initialise responce
-        ret = init_responce_data(EchoRsp, compressed_data, len, NULL);
+        ret = init_responce_data(rd, FileSizeRsp, compressed_data, len, NULL);
     }
 
     return ret;
 }
 
-int ret_file_fill_write_buffer(ResponceData *rd, CompressionSegment *comp_dict,
-        bool req_compr) {
-
-    // always compress for simplicity
-    OpenFileInstance *ofi = (OpenFileInstance *) rd->ptr;
+int ret_file_fill_write_buffer(ResponceData *rd, CompressionSegment *comp_dict) {
+    FileStream *fs = (FileStream *) rd->ptr;
 
-    // lock during read
-    pthread_mutex_lock(&ofi->lock);
-
-    if (ofi->n_read >= ofi->n_requested) {
-        pthread_mutex_unlock(&ofi->lock);
+    FileChunk *chunk = file_stream_next_chunk(fs);
+    if (!chunk && !file_stream_finished(fs)) {
+        return 1;
+    }
+    if (!chunk && rd->write_buffer) {
+        // file completely sent
         return -1;
     }
 
-    // compress
-    uint8_t *compr_payload = NULL;
-    size_t len = 0;
-    size_t payload_offset = HEADER_SIZE + PAYLOAD_LEN_SIZE;
-    size_t target_file_offset = 20 + payload_offset;
-
-    // total byte offset the data begins at
-    uint64_t starting_offset = ofi->n_read + ofi->offset;
-    // read data
+    uint8_t *buffer = NULL;
+    uint64_t file_offset = 0;
     uint64_t n_bytes = 0;
-    if (rd->write_buffer_len - target_file_offset <
-            ofi->n_requested - ofi->n_read) {
-        n_bytes = fread(rd->write_buffer + target_file_offset, 1,
-                rd->write_buffer_len - target_file_offset, ofi->file);
+    if (chunk) {
+        buffer = chunk->buffer;
+        file_offset = chunk->file_offset;
+        n_bytes = chunk->n_bytes;
     } else {
-        n_bytes = fread(rd->write_buffer + target_file_offset, 1,
-                ofi->n_requested - ofi->n_read, ofi->file);
+        // joined after the range was claimed, the client still needs a reply
+        buffer = buffer_alloc(RET_FILE_HEADROOM);
+        file_offset = fs->ofi->offset + fs->ofi->n_requested;
     }
-    ofi->n_read += n_bytes;
-    size_t n_read_offset = ofi->n_read;
-    uint32_t session_id = ofi->session_id;
 
-    pthread_mutex_unlock(&ofi->lock);
+    size_t payload_offset = HEADER_SIZE + PAYLOAD_LEN_SIZE;
+    uint8_t *prefix = buffer + payload_offset;
 
     // session id
-    memcpy(rd->write_buffer + payload_offset, &session_id, 4);
+    memcpy(prefix, &fs->ofi->session_id, 4);
 
     // write 8 byte starting offset
-    uint64_t starting_offset_be = be64toh(starting_offset);
-    memcpy(rd->write_buffer + payload_offset + 4, &starting_offset_be, 8);
+    uint64_t starting_offset_be = htobe64(file_offset);
+    memcpy(prefix + 4, &starting_offset_be, 8);
 
     // remaming data length
-    uint64_t n_bytes_be = be64toh(n_bytes);
-    memcpy(rd->write_buffer + payload_offset + 12, &n_bytes_be, 8);
-
-    if (req_compr) {
+    uint64_t n_bytes_be = htobe64(n_bytes);
+    memcpy(prefix + 12, &n_bytes_be, 8);
+
+    size_t chunk_len = RET_FILE_PREFIX_SIZE + n_bytes;
+    JX_PROBE3(file__chunk, be32toh(fs->ofi->session_id), file_offset,
+            n_bytes);
+    // old write buff has been sent
+    buffer_release(rd->write_buffer);
+    if (fs->req_compression) {
+        uint8_t *compr_payload = NULL;
+        size_t len = 0;
         // compress payload
-        compress(comp_dict, rd->write_buffer + payload_offset, n_read_offset +
-            target_file_offset - payload_offset, &compr_payload, &len,
-            payload_offset);
+        jx_compress(comp_dict, prefix, chunk_len, &compr_payload, &len,
+                payload_offset);
         // write metadata
         write_metadata(compr_payload, RetFileRsp, true, len - payload_offset);
-        // swap old write buff for new one
-        free(rd->write_buffer);
         rd->write_buffer_len = len;
-        rd->write_n = len;
         rd->write_buffer = compr_payload;
+        if (!chunk) {
+            buffer_release(buffer);
+        }
     } else {
-        write_metadata(rd->write_buffer, RetFileRsp, false,
-                n_bytes + target_file_offset - payload_offset);
-        rd->write_n = target_file_offset + n_bytes;
+        // send straight out of the chunk, a new buffer backs the next read
+        write_metadata(buffer, RetFileRsp, false, chunk_len);
+        rd->write_buffer = buffer;
+        rd->write_buffer_len = payload_offset + chunk_len;
+        if (chunk) {
+            chunk->buffer = NULL;
+        }
     }
     rd->n_written = 0;
+
+    if (chunk) {
+        // chunk can be reused for read ahead
+        file_stream_release_chunk(fs);
+    }
     return 0;
 }
 
-ResponceData *ret_file(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, char *dir, CompressionSegment *comp_dict,
+int ret_file(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, int dir_fd,
+        MetadataCache *md_cache, CompressionSegment *comp_dict,
         DecompressionTreeNode *decom_tree, OpenFileInstances *ofis) {
 
     uint8_t *decompressed_payload = payload;
     uint64_t decompressed_payload_n = payload_len;
     if (compressed) {
-        decompress(decom_tree, payload, payload_len, &decompressed_payload,
+        jx_decompress(decom_tree, payload, payload_len, &decompressed_payload,
                 &decompressed_payload_n);
     }
 
+    size_t range_size = sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    if (decompressed_payload_n <= range_size) {
+        if (compressed) {
+            buffer_release(decompressed_payload);
+        }
+        return error(rd);
+    }
+
     uint32_t session_id = 0;
     memcpy(&session_id, decompressed_payload, sizeof(session_id));
 
@@ -408,44 +530,43 @@ ResponceData *ret_file(bool compressed, bool req_compression, uint8_t *payload,
             sizeof(ret_size));
     ret_size = be64toh(ret_size);
 
-    size_t f_name_len =decompressed_payload_n - sizeof(session_id) -
-            sizeof(offset) - sizeof(ret_size);
-    size_t file_path_size = strlen(dir) + f_name_len + 2;
-    char *file_path = safe_malloc(file_path_size * sizeof(char));
-    sprintf(file_path, "%s/%s", dir, decompressed_payload +
-            sizeof(session_id) + sizeof(offset) + sizeof(ret_size));
+    char name[NAME_MAX + 1];
+    int name_status = read_file_name(name, decompressed_payload + range_size,
+            decompressed_payload_n - range_size);
 
     if (compressed) {
-        free(decompressed_payload);
+        buffer_release(decompressed_payload);
     }
+    profile_note_file(name_status < 0 ? NULL : name, offset, ret_size);
 
     // check for invalid offset
-    struct stat st;
-    stat(file_path, &st);
-    if (st.st_size < (offset + ret_size)) {
-        free(file_path);
-        return error();
+    uint64_t lookup_start = profile_start();
+    FileMetadata md;
+    if (name_status < 0 || metadata_cache_lookup(md_cache, name, &md) < 0 ||
+        !ret_size || offset + ret_size < offset ||
+        md.size < offset + ret_size) {
+        // missing files and bad ranges are charged too
+        profile_end(StatsPhaseLookup, lookup_start);
+        return error(rd);
     }
 
     OpenFileInstance *ofi = NULL;
     pthread_mutex_lock(&ofis->lock);
-    int status = open_file(&ofi, ofis, file_path, session_id, offset, ret_size);
+    int status = open_file(&ofi, ofis, dir_fd, name, session_id, offset,
+            ret_size);
     pthread_mutex_unlock(&ofis->lock);
-    free(file_path);
+    profile_end(StatsPhaseLookup, lookup_start);
     if (status < 0) {
-        return error();
+        return error(rd);
     }
+    JX_PROBE3(file__open, be32toh(session_id), offset, ret_size);
 
-    uint8_t *write_buffer = safe_malloc(INIT_RET_FILE_BUFF_SIZE * sizeof(char));
-    ResponceData *rd = init_responce_data(RetFileRsp, write_buffer,
-            INIT_RET_FILE_BUFF_SIZE, ofi);
-    // fill up the buffer
-    ret_file_fill_write_buffer(rd, comp_dict, req_compression);
-
-    return rd;
+    // nothing to write until the first chunk has been read
+    return init_responce_data(rd, RetFileRsp, NULL, 0,
+            init_file_stream(ofi, req_compression));
 }
 
-static int compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
+int jx_compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
         uint64_t payload_size, uint8_t **dest, uint64_t *dest_size,
         size_t write_offset) {
 
@@ -453,6 +574,8 @@ static int compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
         return -1;
     }
 
+    JX_PROBE1(compress__start, payload_size);
+    uint64_t start = profile_start();
     // length of uncompressed
     BitVector *bv = init_bit_vector(payload_size);
 
@@ -481,17 +604,20 @@ static int compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
     if (n_padding_bits) {
         (*dest_size)++;
     }
-    *dest = safe_malloc(*dest_size);
+    *dest = buffer_alloc(*dest_size);
     // copy bit vector with offset
     memcpy(*dest + write_offset, bv->vector, *dest_size - write_offset - 1);
     // set num of padding bits at the end
     (*dest)[*dest_size - 1] = n_padding_bits;
 
     destroy_bit_vector(bv);
+    profile_end(StatsPhaseCompress, start);
+    stats_count_compression(payload_size, *dest_size - write_offset);
+    JX_PROBE2(compress__end, payload_size, *dest_size - write_offset);
     return 0;
 }
 
-static int decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
+int jx_decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
         size_t compr_payload_n, uint8_t **decompressed_payload,
         uint64_t *decompressed_payload_n) {
 
@@ -500,8 +626,10 @@ static int decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
         return -1;
     }
 
+    JX_PROBE1(decompress__start, compr_payload_n);
+    uint64_t start = profile_start();
     // return data
-    *decompressed_payload = safe_malloc(INIT_DECOMPRESSED_PAYLOAD_LEN);
+    *decompressed_payload = buffer_alloc(INIT_DECOMPRESSED_PAYLOAD_LEN);
     uint64_t decompressed_payload_len = INIT_DECOMPRESSED_PAYLOAD_LEN;
     *decompressed_payload_n = 0;
 
@@ -534,7 +662,7 @@ static int decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
         if (!cur_node->left && !cur_node->right) {
             // resize if full
             if (*decompressed_payload_n >= decompressed_payload_len) {
-                *decompressed_payload = safe_realloc(*decompressed_payload,
+                *decompressed_payload = buffer_realloc(*decompressed_payload,
                         decompressed_payload_len * ARRAY_GROWTH_RATE);
                 decompressed_payload_len *= ARRAY_GROWTH_RATE;
             }
@@ -546,5 +674,7 @@ static int decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
         }
 
     }
+    profile_end(StatsPhaseDecompress, start);
+    JX_PROBE2(decompress__end, compr_payload_n, *decompressed_payload_n);
     return 0;
 }
@@ -2,8 +2,18 @@
 #define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_RESPONCE_H
 
 #include "../memory/memory.h"
+#include "../memory/slab.h"
+#include "../memory/buffer_pool.h"
+#include "../memory/memory_budget.h"
+#include "../io/executor.h"
 #include "request.h"
 #include "open_file_instance.h"
+#include "file_stream.h"
+#include "../cache/metadata_cache.h"
+#include "../cache/listing_cache.h"
+#include "../stats/stats.h"
+#include "../stats/probes.h"
+#include "../stats/profile.h"
 #include "../data_structures/compression_dictionary/compression_dict.h"
 #include "../data_structures/decompression_tree/decompression_tree.h"
 #include "../data_structures/bit_vector/bit_vector.h"
@@ -16,44 +26,75 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <limits.h>
 
-#define INIT_LIST_FILES_BUFF_SIZE 64
-#define INIT_RET_FILE_BUFF_SIZE 512
 #define INIT_DECOMPRESSED_PAYLOAD_LEN 64
 #define ARRAY_GROWTH_RATE 2
+#define RESPONCE_OFFLOAD_MIN_LEN 16384 // smaller payloads are compressed inline
 
 enum ResponceType {
     EchoRsp = 1,
     ListDirRsp = 3,
     FileSizeRsp = 5,
     RetFileRsp = 7,
+    StatsRsp = 11,
     Error = 15
 };
 
+// embedded in its connection, 48 bytes
 typedef struct {
     enum ResponceType type;
-    uint8_t *write_buffer;
+    bool started; // a byte of the responce has been written
+    bool sampled; // milestones are recorded to the latency histograms
+    uint8_t *write_buffer; // pooled, may be shared with other responces
     size_t write_buffer_len;
-    size_t write_n;
     size_t n_written;
-    void *ptr;
+    uint64_t t_read; // monotonic ns the request was read by, 0 if untimed
+    void *ptr; // FileStream for RetFileRsp, otherwise pending ResponceTask
 } ResponceData;
 
+// where CPU bound responce work is run, instead of the handler thread
+typedef struct {
+    Executor *executor;
+    TaskCompletionQueue *cq; // completions are drained by the handler
+    MemoryBudget *budget; // charged for buffers allocated by tasks
+} ResponceOffload;
+
+// responce built on an executor worker, attached to its ResponceData until
+// completed. allocated and released on the handler thread
+typedef struct {
+    Task task;
+    enum ResponceType type;
+    bool req_compression;
+    bool orphaned; // responce was destroyed before completion
+    uint8_t *input; // EchoRsp, retained request block
+    uint64_t input_len;
+    ListingCache *listing_cache; // ListDirRsp
+    CompressionSegment *comp_dict;
+    uint8_t *output; // write buffer, set once run
+    size_t output_len;
+    void *owner; // connection waiting on the task, untouched
+    // timed on the executor, added to the trace of the request on completion
+    uint64_t phase_ticks[STATS_N_PHASES];
+} ResponceTask;
+
 /** @brief Initialises Response Data Object.
  *
- *  Allocates a response data object, and sets the corresponding fields
- *  based on the arguments provided. If provided write buffer is NULL,
- *  nothing is done and NULL is returned.
+ *  Sets the fields of the provided response data object based on the
+ *  arguments provided. Write buffer is allocated with buffer_alloc, and the
+ *  callers reference is taken. If rd is NULL, or provided write buffer is NULL
+ *  and write_buffer_len is not 0, nothing is done and -1 is returned.
  *
+ *  @param rd : ResponceData instance.
  *  @param type : Type of responce (Echo, RetFile etc).
  *  @param write_buffer : Array of data to be sent.
  *  @param write_buffer_len : Length of write buffer.
- *  @param ptr : Optional data to be attached. This is exclusively used for
- *  retrieving files, where an OpenFileInstance is attached.
- *  @return ResponseData object.
+ *  @param ptr : Optional data to be attached. Retrieving files attaches a
+ *  FileStream.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *init_responce_data(enum ResponceType type, uint8_t *write_buffer,
-        size_t write_buffer_len, void *ptr);
+int init_responce_data(ResponceData *rd, enum ResponceType type,
+        uint8_t *write_buffer, size_t write_buffer_len, void *ptr);
 
 /** @brief Asynchronous write from buffer to file descriptor.
  *
@@ -69,85 +110,109 @@ ResponceData *init_responce_data(enum ResponceType type, uint8_t *write_buffer,
  */
 int responce_write(ResponceData *rd, int fd);
 
-/** @brief Deallocates ResponceData instance.
+/** @brief Releases ResponceData instance.
  *
- *  Frees ResponceData instance and all dynamically allocated fields. If
- *  ResponceData is NULL, nothing is done. If ResponceData type is RetFileRsp,
- *  open file instance reference counter is decremented. Write buffer is
- *  deallocated. ResponceData instance is deallocated.
+ *  Releases all dynamically allocated fields, the instance itself is owned
+ *  by its connection. If ResponceData is NULL, nothing is done. If ResponceData type is RetFileRsp,
+ *  its file stream is destroyed, decrementing the open file instance reference
+ *  counter. If file reads are still in flight, the stream is marked orphaned
+ *  instead and release is deferred until the final read completes. A pending
+ *  ResponceTask is similarly marked orphaned, and released by the handler once
+ *  completed. Write buffer reference is released.
  *
- *  @param rd : ResponceData instance to be deallocated.
+ *  @param rd : ResponceData instance to be released.
  */
 void destroy_responce_data(ResponceData *rd);
 
 /** @brief Handles echo request.
  *
- *  Creates a ResponceData instance, with write buffer containing an echo
+ *  Initialises a ResponceData instance, with write buffer containing an echo
  *  responce to be written back to the client. Appropriate header, payload
- *  length and compression is handled. If error occurs, NULL is returned.
+ *  length and compression is handled. If payload is sent back as is, metadata
+ *  is written into the request headroom and the request block is shared as the
+ *  write buffer, without copying. Payloads of at least RESPONCE_OFFLOAD_MIN_LEN
+ *  bytes that require compression are compressed on the executor if offload
+ *  is provided, the responce then waits on a ResponceTask with no write
+ *  buffer. If error occurs, -1 is returned.
  *
+ *  @param rd : ResponceData instance to initialise.
  *  @param compressed : Compression flag for payload. True if data is compressed.
  *  @param req_compression : Requires Compression flag for responce data.
- *  @param payload : Request payload.
- *  @param payload_len : Length of payload.
+ *  @param request : Completely read request.
  *  @param comp_dict : Compression dictionary (CompressionSegment *) instance.
- *  @return ResponceData instance.
+ *  @param offload : Executor to compress on, NULL to compress inline.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *echo(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, CompressionSegment *comp_dict);
+int echo(ResponceData *rd, bool compressed, bool req_compression,
+        RequestData *request, CompressionSegment *comp_dict,
+        ResponceOffload *offload);
 
 /** @brief Handles error.
  *
- *  Creates a ResponceData instance for error responce. Write buffer is allocated
- *  and contents set appropriatly. Type is set to Error, and payload length
- *  set to 0. No compression flags are set.
+ *  Initialises a ResponceData instance for error responce. Write buffer is
+ *  allocated and contents set appropriatly. Type is set to Error, and payload
+ *  length set to 0. No compression flags are set.
  *
- *  @return ResponceData instance.
+ *  @param rd : ResponceData instance to initialise.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *error();
+int error(ResponceData *rd);
 
 /** @brief Handles List Directory Request.
  *
- *  Creates a ResponceData instance for ListDir request. If directory provided
+ *  Initialises a ResponceData instance for ListDir request. If directory provided
  *  in payload is invalid, error responce is created. Successful request will
  *  contain a responce payload with null terminated file names, seperated by
  *  null bytes. ONLY regular files are returned. All directories and files in
  *  sub directories are not included.
  *
+ *  Serialised responces are cached by the listing cache, so repeated requests
+ *  share a single write buffer until the directory changes. If the listing
+ *  is not cached and offload is provided, it is serialised and compressed on
+ *  the executor, the responce then waits on a ResponceTask.
+ *
+ *  @param rd : ResponceData instance to initialise.
  *  @param compressed : Compression flag for payload. True if data is compressed.
  *  @param req_compression : Requires Compression flag for responce data.
  *  @param payload : Request payload.
  *  @param payload_len : Length of payload.
- *  @param dir : directory path.
+ *  @param listing_cache : Listing cache of the served directory.
  *  @param comp_dict : Compression dictionary (CompressionSegment *) instance.
- *  @return ResponceData instance.
+ *  @param offload : Executor to serialise on, NULL to serialise inline.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *list_files(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, char *dir, CompressionSegment *comp_dict);
+int list_files(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, ListingCache *listing_cache,
+        CompressionSegment *comp_dict, ResponceOffload *offload);
 
 /** @brief Handles FileSize request.
  *
- *  Creates a ResponceData instance, with write buffer containing size of
- *  requested file. Appropriate header, payload length and compression is handled.
- *  If error occurs (file does not exist), error responce is created instead.
+ *  Initialises a ResponceData instance, with write buffer containing size of
+ *  requested file. Size is served from the metadata cache. Appropriate header,
+ *  payload length and compression is handled. If error occurs (file does not
+ *  exist), error responce is created instead.
  *
+ *  @param rd : ResponceData instance to initialise.
  *  @param compressed : Compression flag for payload. True if data is compressed.
  *  @param req_compression : Requires Compression flag for responce data.
  *  @param payload : Request payload.
  *  @param payload_len : Length of payload.
- *  @param dir : directory path.
+ *  @param md_cache : Metadata cache of the served directory.
  *  @param comp_dict : Compression dictionary (CompressionSegment *) instance.
  *  @param decom_tree : Decompression tree (DecompressionTreeNode *) instance.
- *  @return ResponceData instance.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *get_file_size(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, char *dir, CompressionSegment *comp_dict,
-        DecompressionTreeNode *decom_tree);
+int get_file_size(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, MetadataCache *md_cache,
+        CompressionSegment *comp_dict, DecompressionTreeNode *decom_tree);
 
 /** @brief Handles RetFile request.
  *
- *  Creates a ResponceData instance, with write buffer containing either a
- *  subset or entierty of the requested file contents.
+ *  Initialises a ResponceData instance streaming the requested file contents.
+ *  No file data is read here, the attached FileStream is expected to be
+ *  scheduled on the IO pool by the caller, with each chunk sent as a
+ *  seperate responce once read. Write buffer is empty until the first chunk
+ *  is filled.
  *
  *  Responce payload is structured as follows:
  *      4 bytes - session ID.
@@ -160,38 +225,171 @@ ResponceData *get_file_size(bool compressed, bool req_compression, uint8_t *payl
  *  across both this request and the existing requests. If session id
  *  is already being used, and the file requested is differet, error occurs.
  *  Concurrent request for a file with different session ids will be treated
- *  independently. If error occurs, error responce is created instead.
+ *  independently. Requested range is validated against the metadata cache, and
+ *  must not be empty. If error occurs, error responce is created instead.
  *
+ *  @param rd : ResponceData instance to initialise.
  *  @param compressed : Compression flag for payload. True if data is compressed.
  *  @param req_compression : Requires Compression flag for responce data.
  *  @param payload : Request payload.
  *  @param payload_len : Length of payload.
- *  @param dir : directory path.
+ *  @param dir_fd : Served directory fd.
+ *  @param md_cache : Metadata cache of the served directory.
  *  @param comp_dict : Compression dictionary (CompressionSegment *) instance.
  *  @param decom_tree : Decompression tree (DecompressionTreeNode *) instance.
  *  @param ofis : Current OpenFileInstances (shared between requests).
- *  @return ResponceData instance.
+ *  @return 0 on success, -1 on error.
  */
-ResponceData *ret_file(bool compressed, bool req_compression, uint8_t *payload,
-        uint64_t payload_len, char *dir, CompressionSegment *comp_dict,
+int ret_file(ResponceData *rd, bool compressed, bool req_compression,
+        uint8_t *payload, uint64_t payload_len, int dir_fd,
+        MetadataCache *md_cache, CompressionSegment *comp_dict,
         DecompressionTreeNode *decom_tree, OpenFileInstances *ofis);
 
+/** @brief Handles Stats request.
+ *
+ *  Initialises a ResponceData instance sending a snapshot of server metrics,
+ *  taken by the caller. Snapshot is a pooled buffer with
+ *  REQUEST_PAYLOAD_HEADROOM bytes ahead of the payload, and its reference
+ *  moves to the responce. Payload should be empty, otherwise an error
+ *  responce is created instead and the snapshot released. Snapshot is
+ *  compressed if required.
+ *
+ *  Responce payload is a sequence of 8 byte big endian fields:
+ *      version (STATS_SNAPSHOT_VERSION).
+ *      number of handlers, number of handlers awake.
+ *      per handler - connections, connections migrated away, bytes of
+ *          memory charged to its budget.
+ *      per header type (16) - messages, bytes. Even types count requests
+ *          received, odd types responces sent.
+ *      payload bytes compressed, and their compressed size.
+ *      metadata cache hits, misses, listing cache hits, misses.
+ *      sessions live, retired, reaped.
+ *      executor tasks run, run after being stolen, queued.
+ *      pooled buffer bytes outstanding.
+ *      per timed type (Echo, ListDir, FileSize, RetFile), per milestone
+ *          (handled, first byte written, last byte written) - requests
+ *          timed (one in HANDLER_LATENCY_SAMPLE), then p50, p99 and p99.9
+ *          nanoseconds since the request was read. Streamed echoes and
+ *          error responces are not timed.
+ *      client socket reads, of which failed with EAGAIN, client socket
+ *          writes, of which failed with EAGAIN, epoll_ctl calls, 0.
+ *      events returned by epoll_wait.
+ *      events per epoll_wait - wakeups, then p50, p99 and p99.9.
+ *      nanoseconds handling each batch of events - batches, then p50, p99
+ *          and p99.9.
+ *      per handler - nanoseconds spent handling events, its duty cycle over
+ *          an interval is the difference between two snapshots.
+ *
+ *  @param rd : ResponceData instance to initialise.
+ *  @param compressed : Compression flag for payload. True if data is compressed.
+ *  @param req_compression : Requires Compression flag for responce data.
+ *  @param payload_len : Length of payload.
+ *  @param snapshot : Pooled buffer holding the snapshot.
+ *  @param snapshot_len : Length of snapshot, excluding headroom.
+ *  @param comp_dict : Compression dictionary (CompressionSegment *) instance.
+ *  @return 0 on success, -1 on error.
+ */
+int get_stats(ResponceData *rd, bool compressed, bool req_compression,
+        uint64_t payload_len, uint8_t *snapshot, size_t snapshot_len,
+        CompressionSegment *comp_dict);
+
+/** @brief Loads the write buffer built by a completed ResponceTask.
+ *
+ *  Task attached to the responce is released. If rd has no task attached, or
+ *  the task failed to build a write buffer, -1 is returned.
+ *
+ *  @param rd : ResponceData instance, waiting on a task.
+ *  @return 0 on success, -1 on error.
+ */
+int responce_task_complete(ResponceData *rd);
+
+/** @brief Releases a ResponceTask.
+ *
+ *  Input and output buffers are released. Must be called on the handler
+ *  thread which created the task, once drained from its completion queue. If
+ *  rt is NULL, nothing is done.
+ *
+ *  @param rt : ResponceTask instance.
+ */
+void destroy_responce_task(ResponceTask *rt);
 
 /** @brief Refills write buffer for RetFile request.
  *
  *  File data is sent over multiple responces for large files. Once a subset
  *  of the data has been sent, this function will refill the write buffer
- *  of the responce instance, for reuse.
+ *  of the responce instance with the next chunk read by its file stream.
+ *  Chunk is compressed if the stream requires compression, otherwise the
+ *  chunk buffer itself becomes the write buffer.
+ *
+ *  If other requests of the session claimed the whole range before any chunk
+ *  was read for this one, a single responce with an empty range, starting at
+ *  the end of the requested range, is filled instead.
  *
- *  If no data is left, -1 is returned. Otherwise, 0 is returned and write buffer
- *  contains data to be transmitted.
+ *  If no data is left, -1 is returned. If the next chunk is still being read
+ *  from disk, 1 is returned and the write buffer is untouched. Otherwise, 0
+ *  is returned and write buffer contains data to be transmitted.
  *
  *  @param rd : ResponceData instance.
  *  @param comp_dict : Compression dictionary instance.
- *  @param req_compr : Requires compression payload (if true, write buffer is
- *  compressed).
+ *  @return status, -1 (finished), 0 (filled), 1 (waiting on disk).
+ */
+int ret_file_fill_write_buffer(ResponceData *rd, CompressionSegment *comp_dict);
+
+/** @brief Adds header and payload length to beginning of buffer.
+ *
+ *  Formats header and copies formatted byte to front of buffer. Payload
+ *  length is also coppied to bytes 1-9.
+ *
+ *  @param dest : buffer to be written too.
+ *  @param rt : Responce Type (EchoRsp, ListDirRep etc).
+ *  @param compressed_payload : Compressed Payload Flag.
+ *  @param payload_len : Length of payload.
+ */
+void write_metadata(uint8_t *dest, enum ResponceType rt,
+        bool compressed_payload, uint64_t payload_len);
+
+/** @brief Compresses data.
+ *
+ *  Compresses payload using provided compression dictionary. Resulting
+ *  compressed data is stored in a pooled buffer, and dest is set to the starting
+ *  address. dest_size is set as the size of the allocated array.
+ *
+ *  If any parameters are NULL, nothing is done and -1 is returned (error).
+ *  Otherwise, data is compressed and 0 is returned.
+ *
+ *  @param comp_dict : Compression dictionary.
+ *  @param uncomp_payload : Uncompressed payload.
+ *  @param payload_size : size of uncompressed payload.
+ *  @param dest : points to compressed array address on success.
+ *  @param dest_size : set to size of compressed array on success.
+ *  @param write_offset : data to the right of this address will be compressed.
+ *                        This is used to easily exclude data at the beginning of
+ *                        the uncompressed payload from compression.
+ *  @return 0 on success, -1 on error.
+ */
+int jx_compress(CompressionSegment *comp_dict, uint8_t *uncomp_payload,
+        uint64_t payload_size, uint8_t **dest, uint64_t *dest_size,
+        size_t write_offset);
+
+/** @brief Decompresses data.
+ *
+ *  Decompresses compressed payload using provided decompression tree.
+ *  Resulting decompressed data is stored in a pooled buffer and pointed to by
+ *  dest param. dest_size is set to allocated length.
+ *
+ *  If any parameters are NULL, nothing is done and -1 is returned (error).
+ *  Otherwise, data is decompressed and 0 is returned.
+ *
+ *
+ *  @param decom_tree :  Decompression tree root node.
+ *  @param compr_payload : Payload to be decompressed.
+ *  @param compr_payload_n : number of bytes to be decompressed.
+ *  @param decompressed_payload : points to decompressed array on success.
+ *  @param decompressed_payload_n : set to decompressed array len on success.
+ *  @return 0 on success, -1 on error.
  */
-int ret_file_fill_write_buffer(ResponceData *rd, CompressionSegment *comp_dict,
-        bool req_compr);
+int jx_decompress(DecompressionTreeNode *decom_tree, uint8_t *compr_payload,
+        size_t compr_payload_n, uint8_t **decompressed_payload,
+        uint64_t *decompressed_payload_n);
 
 #endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_RESPONCE_H
@@ -0,0 +1,387 @@
+#include "executor.h"
+
+/** @brief Executor worker thread.
+ *
+ *  Runs tasks from its own deque, refilled from its inbox, and steals from
+ *  other workers once both are empty. Sleeps while no task is queued, thread
+ *  returns once the executor is stopping.
+ *
+ *  @param arg : ExecutorWorker instance.
+ */
+static void *executor_worker(void *arg);
+
+/** @brief Finds the next task for a worker to run.
+ *
+ *  @param worker : ExecutorWorker instance.
+ *  @param stolen : Set to true if the task was taken from another worker.
+ *  @return Task instance, NULL if none was found.
+ */
+static Task *next_task(ExecutorWorker *worker, bool *stolen);
+
+/** @brief Moves an inbox onto the deque of a worker.
+ *
+ *  Inbox is taken whole. If the deque fills up, the remaining tasks are run
+ *  by the worker immediately.
+ *
+ *  @param worker : ExecutorWorker receiving the tasks.
+ *  @param inbox : Inbox to take.
+ */
+static void take_inbox(ExecutorWorker *worker, _Atomic(Task *) *inbox);
+
+/** @brief Runs a task and completes it.
+ *
+ *  Buffers allocated by the task are charged to its budget.
+ *
+ *  @param task : Task instance.
+ */
+static void run_task(Task *task);
+
+/** @brief Pushes a task onto the bottom of a deque.
+ *
+ *  Must only be called by the owning worker.
+ *
+ *  @param deque : TaskDeque instance.
+ *  @param task : Task instance.
+ *  @return 0 on success, -1 if the deque is full.
+ */
+static int deque_push(TaskDeque *deque, Task *task);
+
+/** @brief Pops a task from the bottom of a deque.
+ *
+ *  Must only be called by the owning worker.
+ *
+ *  @param deque : TaskDeque instance.
+ *  @return Task instance, NULL if empty or lost to a thief.
+ */
+static Task *deque_pop(TaskDeque *deque);
+
+/** @brief Steals a task from the top of a deque.
+ *
+ *  @param deque : TaskDeque instance.
+ *  @return Task instance, NULL if empty or lost to another thief.
+ */
+static Task *deque_steal(TaskDeque *deque);
+
+Executor *init_executor(size_t n_workers, BufferPool *buffer_pool,
+        StatsRegistry *stats) {
+    Executor *executor = safe_malloc(sizeof(Executor));
+    executor->n_workers = n_workers ? n_workers : 1;
+    atomic_init(&executor->next_worker, 0);
+    atomic_init(&executor->n_queued, 0);
+    atomic_init(&executor->n_sleeping, 0);
+    executor->stopping = false;
+    executor->buffer_pool = buffer_pool;
+    executor->stats = stats;
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->cond, NULL);
+
+    executor->workers = safe_malloc(sizeof(ExecutorWorker) *
+            executor->n_workers);
+    for (size_t i = 0; i < executor->n_workers; ++i) {
+        ExecutorWorker *worker = &executor->workers[i];
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        atomic_init(&worker->inbox, NULL);
+        atomic_init(&worker->n_run, 0);
+        atomic_init(&worker->n_stolen, 0);
+        worker->executor = executor;
+        worker->index = i;
+    }
+    // workers steal from each other, so start them once all are initialised
+    for (size_t i = 0; i < executor->n_workers; ++i) {
+        if (pthread_create(&executor->workers[i].thread, NULL,
+                executor_worker, &executor->workers[i])) {
+            printf("unable to initialise executor!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return executor;
+}
+
+int executor_submit(Executor *executor, Task *task) {
+    if (!executor || !task || !task->run || !task->cq) {
+        return -1;
+    }
+
+    // counted before it is visible, a worker taking it never underflows the
+    // count. pairs with the sleeping count of a worker about to wait
+    atomic_fetch_add(&executor->n_queued, 1);
+    size_t index = atomic_fetch_add_explicit(&executor->next_worker, 1,
+            memory_order_relaxed) % executor->n_workers;
+    _Atomic(Task *) *inbox = &executor->workers[index].inbox;
+    Task *head = atomic_load_explicit(inbox, memory_order_relaxed);
+    do {
+        task->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(inbox, &head, task,
+            memory_order_release, memory_order_relaxed));
+
+    if (atomic_load(&executor->n_sleeping)) {
+        pthread_mutex_lock(&executor->lock);
+        pthread_cond_signal(&executor->cond);
+        pthread_mutex_unlock(&executor->lock);
+    }
+    return 0;
+}
+
+static void *executor_worker(void *arg) {
+    ExecutorWorker *worker = (ExecutorWorker *) arg;
+    Executor *executor = worker->executor;
+    BufferCache *buffer_cache = buffer_cache_bind_thread(executor->buffer_pool);
+    stats_bind_thread(executor->stats);
+
+    while (true) {
+        bool stolen = false;
+        Task *task = next_task(worker, &stolen);
+        if (task) {
+            atomic_fetch_sub(&executor->n_queued, 1);
+            atomic_fetch_add_explicit(&worker->n_run, 1, memory_order_relaxed);
+            if (stolen) {
+                atomic_fetch_add_explicit(&worker->n_stolen, 1,
+                        memory_order_relaxed);
+            }
+            run_task(task);
+            continue;
+        } else if (atomic_load(&executor->n_queued)) {
+            // task is in transit between an inbox and a deque
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&executor->lock);
+        atomic_fetch_add(&executor->n_sleeping, 1);
+        while (!executor->stopping && !atomic_load(&executor->n_queued)) {
+            pthread_cond_wait(&executor->cond, &executor->lock);
+        }
+        atomic_fetch_sub(&executor->n_sleeping, 1);
+        bool stopping = executor->stopping;
+        pthread_mutex_unlock(&executor->lock);
+        if (stopping) {
+            break;
+        }
+    }
+
+    destroy_buffer_cache(buffer_cache);
+    return NULL;
+}
+
+static Task *next_task(ExecutorWorker *worker, bool *stolen) {
+    Task *task = deque_pop(&worker->deque);
+    if (task) {
+        return task;
+    }
+    take_inbox(worker, &worker->inbox);
+    if ((task = deque_pop(&worker->deque))) {
+        return task;
+    }
+
+    // steal, starting from the next worker so thieves spread out
+    Executor *executor = worker->executor;
+    for (size_t i = 1; i < executor->n_workers; ++i) {
+        ExecutorWorker *victim =
+                &executor->workers[(worker->index + i) % executor->n_workers];
+        if ((task = deque_steal(&victim->deque))) {
+            *stolen = true;
+            return task;
+        }
+        // victim is busy, its inbox has not been taken yet
+        if (atomic_load_explicit(&victim->inbox, memory_order_relaxed)) {
+            take_inbox(worker, &victim->inbox);
+            if ((task = deque_pop(&worker->deque))) {
+                *stolen = true;
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void take_inbox(ExecutorWorker *worker, _Atomic(Task *) *inbox) {
+    Task *task = atomic_exchange_explicit(inbox, NULL, memory_order_acquire);
+    // inbox is newest first, so the oldest task ends up at the bottom and
+    // is popped first, newer tasks are left on top for thieves
+    while (task) {
+        Task *next = task->next;
+        if (deque_push(&worker->deque, task) < 0) {
+            atomic_fetch_sub(&worker->executor->n_queued, 1);
+            atomic_fetch_add_explicit(&worker->n_run, 1, memory_order_relaxed);
+            run_task(task);
+        }
+        task = next;
+    }
+    return;
+}
+
+static void run_task(Task *task) {
+    budget_bind_thread(task->budget);
+    task->run(task);
+    budget_bind_thread(NULL);
+
+    // complete, waking the owner on the empty to non empty transition
+    // task may be released by its owner once pushed, only locals are read
+    TaskCompletionQueue *cq = task->cq;
+    Task *head = atomic_load_explicit(&cq->head, memory_order_relaxed);
+    do {
+        task->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&cq->head, &head, task,
+            memory_order_release, memory_order_relaxed));
+    if (!head) {
+        uint64_t count = 1;
+        if (write(cq->event_fd, &count, sizeof(count)) < 0) {
+            perror("task completion signal failed");
+        }
+    }
+    return;
+}
+
+static int deque_push(TaskDeque *deque, Task *task) {
+    int_fast64_t bottom = atomic_load_explicit(&deque->bottom,
+            memory_order_relaxed);
+    int_fast64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= EXECUTOR_DEQUE_LEN) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->tasks[bottom % EXECUTOR_DEQUE_LEN], task,
+            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+static Task *deque_pop(TaskDeque *deque) {
+    int_fast64_t bottom = atomic_load_explicit(&deque->bottom,
+            memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_fast64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Task *task = atomic_load_explicit(&deque->tasks[bottom % EXECUTOR_DEQUE_LEN],
+            memory_order_relaxed);
+    if (top == bottom) {
+        // last task, race thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+                top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static Task *deque_steal(TaskDeque *deque) {
+    int_fast64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_fast64_t bottom = atomic_load_explicit(&deque->bottom,
+            memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    Task *task = atomic_load_explicit(&deque->tasks[top % EXECUTOR_DEQUE_LEN],
+            memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+void executor_stats(Executor *executor, ExecutorStats *stats) {
+    if (!executor || !stats) {
+        return;
+    }
+
+    stats->n_workers = executor->n_workers;
+    stats->n_queued = atomic_load(&executor->n_queued);
+    stats->n_run = 0;
+    stats->n_stolen = 0;
+    for (size_t i = 0; i < executor->n_workers; ++i) {
+        stats->n_run += atomic_load_explicit(&executor->workers[i].n_run,
+                memory_order_relaxed);
+        stats->n_stolen += atomic_load_explicit(&executor->workers[i].n_stolen,
+                memory_order_relaxed);
+    }
+    return;
+}
+
+void stop_executor(Executor *executor) {
+    if (!executor) {
+        return;
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    bool stopped = executor->stopping;
+    executor->stopping = true;
+    pthread_cond_broadcast(&executor->cond);
+    pthread_mutex_unlock(&executor->lock);
+    if (stopped) {
+        return;
+    }
+
+    for (size_t i = 0; i < executor->n_workers; ++i) {
+        pthread_join(executor->workers[i].thread, NULL);
+    }
+    return;
+}
+
+void destroy_executor(Executor *executor) {
+    if (!executor) {
+        return;
+    }
+
+    stop_executor(executor);
+    pthread_mutex_destroy(&executor->lock);
+    pthread_cond_destroy(&executor->cond);
+    free(executor->workers);
+    free(executor);
+    return;
+}
+
+TaskCompletionQueue *init_task_completion_queue() {
+    TaskCompletionQueue *cq = safe_malloc(sizeof(TaskCompletionQueue));
+    atomic_init(&cq->head, NULL);
+    cq->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (cq->event_fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    return cq;
+}
+
+Task *task_completion_queue_drain(TaskCompletionQueue *cq) {
+    if (!cq) {
+        return NULL;
+    }
+
+    // reset counter before taking the stack, so later completions signal
+    uint64_t count = 0;
+    if (read(cq->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("task completion read failed");
+    }
+
+    Task *stack = atomic_exchange_explicit(&cq->head, NULL,
+            memory_order_acquire);
+    // stack is newest first, reverse into completion order
+    Task *tasks = NULL;
+    while (stack) {
+        Task *next = stack->next;
+        stack->next = tasks;
+        tasks = stack;
+        stack = next;
+    }
+    return tasks;
+}
+
+void destroy_task_completion_queue(TaskCompletionQueue *cq) {
+    if (!cq) {
+        return;
+    }
+
+    close(cq->event_fd);
+    free(cq);
+    return;
+}
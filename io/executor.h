@@ -0,0 +1,166 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_EXECUTOR_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_EXECUTOR_H
+
+#include "../memory/memory.h"
+#include "../memory/buffer_pool.h"
+#include "../memory/memory_budget.h"
+#include "../stats/stats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define EXECUTOR_DEQUE_LEN 1024 // tasks a worker holds before running inline
+
+struct task_completion_queue;
+
+typedef struct task {
+    void (*run)(struct task *task); // called on a worker thread
+    void *ctx; // owner of the task, untouched by the executor
+    MemoryBudget *budget; // charged for buffers allocated by run, or NULL
+    struct task_completion_queue *cq; // completion destination
+    struct task *next;
+} Task;
+
+// multi producer, single consumer, taken whole by the owner (see AcceptQueue)
+typedef struct task_completion_queue {
+    _Atomic(Task *) head; // most recently completed
+    int event_fd; // readable while completions are queued
+} TaskCompletionQueue;
+
+// chase-lev deque. the owning worker pushes and pops at the bottom, other
+// workers steal from the top
+typedef struct {
+    atomic_int_fast64_t top;
+    atomic_int_fast64_t bottom;
+    _Atomic(Task *) tasks[EXECUTOR_DEQUE_LEN];
+} TaskDeque;
+
+struct executor;
+
+typedef struct {
+    TaskDeque deque;
+    _Atomic(Task *) inbox; // submitted tasks, taken whole by any worker
+    struct executor *executor;
+    size_t index;
+    pthread_t thread;
+    atomic_uint_fast64_t n_run;
+    atomic_uint_fast64_t n_stolen; // run after being taken from another worker
+} ExecutorWorker;
+
+typedef struct executor {
+    ExecutorWorker *workers;
+    size_t n_workers;
+    atomic_size_t next_worker; // round robin submission
+    atomic_size_t n_queued; // submitted, not yet taken by a worker
+    atomic_size_t n_sleeping;
+    bool stopping;
+    BufferPool *buffer_pool; // workers cache buffers of the pool
+    StatsRegistry *stats; // workers count compression into the registry
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Executor;
+
+typedef struct {
+    size_t n_workers;
+    size_t n_queued;
+    uint64_t n_run;
+    uint64_t n_stolen;
+} ExecutorStats;
+
+/** @brief Initialises executor.
+ *
+ *  Creates n_workers worker threads which run CPU bound tasks on behalf of
+ *  the handler threads. Each worker keeps a deque of tasks, idle workers
+ *  steal from the deques and inboxes of busy workers. If a thread cannot be
+ *  created, error message is printed and program exits with status
+ *  EXIT_FAILURE.
+ *
+ *  @param n_workers : Number of worker threads, at least 1.
+ *  @param buffer_pool : BufferPool tasks allocate from.
+ *  @param stats : StatsRegistry workers bind counters of, or NULL.
+ *  @return Executor instance.
+ */
+Executor *init_executor(size_t n_workers, BufferPool *buffer_pool,
+        StatsRegistry *stats);
+
+/** @brief Queues a task.
+ *
+ *  Task is pushed onto the inbox of the next worker without locking, and
+ *  pushed onto its completion queue once run. Task memory is owned by the
+ *  caller and must remain valid until it has been drained from the
+ *  completion queue. If executor, task, task->run or task->cq is NULL,
+ *  nothing is done and -1 is returned.
+ *
+ *  @param executor : Executor instance.
+ *  @param task : Task to run.
+ *  @return status, -1 on error, 0 otherwise.
+ */
+int executor_submit(Executor *executor, Task *task);
+
+/** @brief Reports executor counters.
+ *
+ *  If executor or stats is NULL, nothing is done.
+ *
+ *  @param executor : Executor instance.
+ *  @param stats : ExecutorStats to fill.
+ */
+void executor_stats(Executor *executor, ExecutorStats *stats);
+
+/** @brief Stops executor.
+ *
+ *  Workers finish their current task and are joined, no completion is
+ *  pushed after. Tasks still queued, or submitted later, are dropped without
+ *  completion. Executor memory stays valid, so threads may still submit
+ *  until destroy_executor. If executor is NULL or already stopped, nothing
+ *  is done.
+ *
+ *  @param executor : Executor instance.
+ */
+void stop_executor(Executor *executor);
+
+/** @brief Stops and destroys executor.
+ *
+ *  Executor is stopped if still running (see stop_executor). No thread may
+ *  submit after.
+ *
+ *  @param executor : Executor instance.
+ */
+void destroy_executor(Executor *executor);
+
+/** @brief Initialises a task completion queue.
+ *
+ *  The event_fd field can be watched with epoll to be notified of
+ *  completions. If the eventfd cannot be created, error message is printed and
+ *  program exits with status EXIT_FAILURE.
+ *
+ *  @return TaskCompletionQueue instance.
+ */
+TaskCompletionQueue *init_task_completion_queue();
+
+/** @brief Removes all completed tasks from completion queue.
+ *
+ *  Must only be called by the queue owner. Event fd is reset. Returned tasks
+ *  are linked through their next field, in order of completion. If cq is NULL
+ *  or empty, NULL is returned.
+ *
+ *  @param cq : TaskCompletionQueue instance.
+ *  @return Linked list of completed tasks.
+ */
+Task *task_completion_queue_drain(TaskCompletionQueue *cq);
+
+/** @brief Destroys completion queue.
+ *
+ *  Event fd is closed. Tasks still queued are not released, as they are
+ *  owned by the submitter.
+ *
+ *  @param cq : TaskCompletionQueue instance.
+ */
+void destroy_task_completion_queue(TaskCompletionQueue *cq);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_EXECUTOR_H
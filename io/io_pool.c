@@ -0,0 +1,200 @@
+#include "io_pool.h"
+
+/** @brief IO worker thread.
+ *
+ *  Pops jobs from the pool queue, reads them with pread, and pushes them
+ *  onto their completion queue. Thread returns once the pool is stopping.
+ *
+ *  @param arg : IOPool instance.
+ */
+static void *io_worker(void *arg);
+
+/** @brief Pushes finished job onto completion queue.
+ *
+ *  Owner is woken through the queues event fd.
+ *
+ *  @param cq : IOCompletionQueue instance.
+ *  @param job : Finished job.
+ */
+static void io_complete(IOCompletionQueue *cq, IOJob *job);
+
+IOPool *init_io_pool(size_t n_threads) {
+    IOPool *pool = safe_malloc(sizeof(IOPool));
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->n_threads = n_threads;
+    pool->threads = safe_malloc(sizeof(pthread_t) * n_threads);
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, io_worker, pool)) {
+            printf("unable to initialise io pool!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+int io_pool_submit(IOPool *pool, IOJob *job) {
+    if (!pool || !job || !job->cq) {
+        return -1;
+    }
+
+    job->next = NULL;
+    job->n_read = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static void *io_worker(void *arg) {
+    IOPool *pool = (IOPool *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        // pop
+        IOJob *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        // blocking read, retried until len or eof
+        uint64_t start = profile_start();
+        size_t n = 0;
+        while (n < job->len) {
+            ssize_t ret = pread(job->fd, job->buffer + n, job->len - n,
+                    job->offset + n);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            n += ret;
+        }
+        job->n_read = (n || job->len == 0) ? (ssize_t) n : -1;
+        // charged by the owner, which knows what the read was for
+        job->read_ticks = profile_elapsed(start);
+        io_complete(job->cq, job);
+    }
+    return NULL;
+}
+
+static void io_complete(IOCompletionQueue *cq, IOJob *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&cq->lock);
+    if (cq->tail) {
+        cq->tail->next = job;
+    } else {
+        cq->head = job;
+    }
+    cq->tail = job;
+    pthread_mutex_unlock(&cq->lock);
+
+    // wake owner
+    uint64_t one = 1;
+    if (write(cq->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("io completion notify failed");
+    }
+    return;
+}
+
+void stop_io_pool(IOPool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    bool stopped = pool->stopping;
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    if (stopped) {
+        return;
+    }
+
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    return;
+}
+
+void destroy_io_pool(IOPool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    stop_io_pool(pool);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+    return;
+}
+
+IOCompletionQueue *init_io_completion_queue() {
+    IOCompletionQueue *cq = safe_malloc(sizeof(IOCompletionQueue));
+    cq->head = NULL;
+    cq->tail = NULL;
+    cq->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (cq->event_fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&cq->lock, NULL);
+    return cq;
+}
+
+IOJob *io_completion_queue_drain(IOCompletionQueue *cq) {
+    if (!cq) {
+        return NULL;
+    }
+
+    // reset counter
+    uint64_t count = 0;
+    if (read(cq->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("io completion read failed");
+    }
+
+    pthread_mutex_lock(&cq->lock);
+    IOJob *jobs = cq->head;
+    cq->head = NULL;
+    cq->tail = NULL;
+    pthread_mutex_unlock(&cq->lock);
+    return jobs;
+}
+
+void destroy_io_completion_queue(IOCompletionQueue *cq) {
+    if (!cq) {
+        return;
+    }
+
+    close(cq->event_fd);
+    pthread_mutex_destroy(&cq->lock);
+    free(cq);
+    return;
+}
@@ -0,0 +1,122 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_IO_POOL_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_IO_POOL_H
+
+#include "../memory/memory.h"
+#include "../stats/profile.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#define IO_POOL_N_THREADS 4
+
+struct io_completion_queue;
+
+typedef struct io_job {
+    int fd; // file to read from
+    uint8_t *buffer; // destination
+    size_t len; // number of bytes requested
+    uint64_t offset; // absolute file offset
+    ssize_t n_read; // set on completion, -1 on error
+    uint64_t read_ticks; // profile ticks spent reading, 0 unless profiling
+    void *ctx; // owner of the job, untouched by the pool
+    struct io_completion_queue *cq; // completion destination
+    struct io_job *next;
+} IOJob;
+
+typedef struct io_completion_queue {
+    IOJob *head;
+    IOJob *tail;
+    int event_fd; // readable while completions are queued
+    pthread_mutex_t lock;
+} IOCompletionQueue;
+
+typedef struct {
+    pthread_t *threads;
+    size_t n_threads;
+    IOJob *head;
+    IOJob *tail;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} IOPool;
+
+/** @brief Initialises IO pool.
+ *
+ *  Creates n_threads worker threads which perform blocking disk reads on
+ *  behalf of the handler threads. If a thread cannot be created, error message
+ *  is printed and program exits with status EXIT_FAILURE.
+ *
+ *  @param n_threads : Number of worker threads.
+ *  @return IOPool instance.
+ */
+IOPool *init_io_pool(size_t n_threads);
+
+/** @brief Queues a read job.
+ *
+ *  Job is read asynchronously with pread, and pushed onto the job's
+ *  completion queue once finished. Job memory is owned by the caller and
+ *  must remain valid until it has been drained from the completion queue.
+ *  If pool, job or job->cq is NULL, or the pool is stopping, nothing is
+ *  done and -1 is returned.
+ *
+ *  @param pool : IOPool instance.
+ *  @param job : Read job.
+ *  @return status, -1 on error, 0 otherwise.
+ */
+int io_pool_submit(IOPool *pool, IOJob *job);
+
+/** @brief Stops IO pool.
+ *
+ *  Worker threads finish their current job and are joined, no completion is
+ *  pushed after. Jobs still queued are dropped without completion, and later
+ *  jobs are rejected. Pool memory stays valid, so threads may still submit
+ *  until destroy_io_pool. If pool is NULL or already stopped, nothing is
+ *  done.
+ *
+ *  @param pool : IOPool instance.
+ */
+void stop_io_pool(IOPool *pool);
+
+/** @brief Stops and destroys IO pool.
+ *
+ *  Pool is stopped if still running (see stop_io_pool). No thread may
+ *  submit after.
+ *
+ *  @param pool : IOPool instance.
+ */
+void destroy_io_pool(IOPool *pool);
+
+/** @brief Initialises a completion queue.
+ *
+ *  Completion queue holds finished jobs until drained by its owner. The
+ *  event_fd field can be watched with epoll to be notified of completions.
+ *
+ *  @return IOCompletionQueue instance.
+ */
+IOCompletionQueue *init_io_completion_queue();
+
+/** @brief Removes all finished jobs from completion queue.
+ *
+ *  Event fd is reset. Returned jobs are linked through their next field, in
+ *  order of completion. If cq is NULL or empty, NULL is returned.
+ *
+ *  @param cq : IOCompletionQueue instance.
+ *  @return Linked list of completed jobs.
+ */
+IOJob *io_completion_queue_drain(IOCompletionQueue *cq);
+
+/** @brief Destroys completion queue.
+ *
+ *  Event fd is closed. Jobs still queued are not released, as they are owned
+ *  by the submitter.
+ *
+ *  @param cq : IOCompletionQueue instance.
+ */
+void destroy_io_completion_queue(IOCompletionQueue *cq);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_IO_POOL_H
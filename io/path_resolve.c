@@ -0,0 +1,69 @@
+#include "path_resolve.h"
+
+/** @brief Checks path for components which could leave the directory.
+ *
+ *  @param name : Relative path.
+ *  @return True if path is absolute or has a '..' component.
+ */
+static bool escapes_dir(const char *name);
+
+bool is_direct_entry(const char *name) {
+    return name && *name && strcmp(name, ".") && strcmp(name, "..") &&
+           !strchr(name, '/');
+}
+
+static bool escapes_dir(const char *name) {
+    if (*name == '/') {
+        return true;
+    }
+    for (const char *p = name; *p; ) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return true;
+        }
+        p += end ? len + 1 : len;
+    }
+    return false;
+}
+
+int open_beneath(int dir_fd, const char *name, int flags) {
+    if (!name || !*name) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (is_direct_entry(name)) {
+        return openat(dir_fd, name, flags | O_CLOEXEC);
+    }
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int fd = syscall(SYS_openat2, dir_fd, name, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+
+    // kernel predates openat2
+    if (escapes_dir(name)) {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(dir_fd, name, flags | O_CLOEXEC);
+}
+
+int stat_beneath(int dir_fd, const char *name, struct stat *st) {
+    if (is_direct_entry(name)) {
+        return fstatat(dir_fd, name, st, 0);
+    }
+
+    int fd = open_beneath(dir_fd, name, O_PATH);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
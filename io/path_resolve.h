@@ -0,0 +1,55 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PATH_RESOLVE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PATH_RESOLVE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_PATH
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+/** @brief Checks if name is a direct entry of a directory.
+ *
+ *  Direct entries are non empty, contain no '/', and are not '.' or '..'.
+ *  They can be resolved relative to a directory fd in a single lookup.
+ *
+ *  @param name : NULL terminated name.
+ *  @return True if name is a direct entry.
+ */
+bool is_direct_entry(const char *name);
+
+/** @brief Opens a path relative to a directory, without leaving it.
+ *
+ *  Direct entries are opened with a single openat, following links as stat
+ *  (and so ListDir) does. Other paths are restricted to dir_fd with
+ *  openat2(RESOLVE_BENEATH), so '..' components, absolute paths and symbolic
+ *  links out of the directory fail without a lookup outside of it. On kernels
+ *  without openat2, paths containing '..' components or beginning with '/'
+ *  are rejected before falling back to openat.
+ *
+ *  @param dir_fd : Open directory fd.
+ *  @param name : Path relative to dir_fd.
+ *  @param flags : open flags.
+ *  @return file descriptor, or -1 on error.
+ */
+int open_beneath(int dir_fd, const char *name, int flags);
+
+/** @brief Stats a path relative to a directory, without leaving it.
+ *
+ *  Direct entries are resolved with a single fstatat. Other paths are
+ *  opened with open_beneath (O_PATH) and stat'd through the descriptor.
+ *
+ *  @param dir_fd : Open directory fd.
+ *  @param name : Path relative to dir_fd.
+ *  @param st : Address to store file status.
+ *  @return 0 on success, -1 on error.
+ */
+int stat_beneath(int dir_fd, const char *name, struct stat *st);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PATH_RESOLVE_H
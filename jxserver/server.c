@@ -16,6 +16,18 @@
  *  Handler threads are NOT detached.
  *
  *  @param open_file_instances : OpenFileInstances object.
+ *  @param io_pool : IOPool shared by all handlers.
+ *  @param executor : Executor shared by all handlers.
+ *  @param md_cache : MetadataCache shared by all handlers.
+ *  @param listing_cache : ListingCache shared by all handlers.
+ *  @param buffer_pool : BufferPool shared by all handlers.
+ *  @param stats : StatsRegistry shared by all handlers.
+ *  @param slow_log : SlowLog shared by all handlers, or NULL.
+ *  @param capture : Capture shared by all handlers, or NULL.
+ *  @param metrics : Address to store the metrics segment, NULL if config
+ *  names none or it cannot be created.
+ *  @param slabs : Address to initialise array of per handler slabs.
+ *  @param budgets : Address to initialise array of per handler budgets.
  *  @param handlers : Address to initialise handlers array.
  *  @param handler_threads : Address to initialise handler_threads array.
  *  @param n_handlers : Address to store number of handler threads created.
@@ -24,23 +36,47 @@
  *  @param config : Server configuration parameters.
  */
 static void init_handlers(OpenFileInstances *open_file_instances,
+                          IOPool *io_pool, Executor *executor,
+                          MetadataCache *md_cache, ListingCache *listing_cache,
+                          BufferPool *buffer_pool, StatsRegistry *stats,
+                          SlowLog *slow_log, Capture *capture,
+                          MetricsSegment **metrics, SlabAllocator ***slabs,
+                          MemoryBudget **budgets,
                           Handler ***handlers, pthread_t **handler_threads,
                           size_t *n_handlers, CompressionSegment *comp_dict,
                           DecompressionTreeNode *decomp_tree, Config *config);
 
 static void init_handlers(OpenFileInstances *open_file_instances,
+                          IOPool *io_pool, Executor *executor,
+                          MetadataCache *md_cache, ListingCache *listing_cache,
+                          BufferPool *buffer_pool, StatsRegistry *stats,
+                          SlowLog *slow_log, Capture *capture,
+                          MetricsSegment **metrics, SlabAllocator ***slabs,
+                          MemoryBudget **budgets,
                           Handler ***handlers, pthread_t **handler_threads,
                           size_t *n_handlers, CompressionSegment *comp_dict,
                           DecompressionTreeNode *decomp_tree, Config *config) {
 
     // allocate return arrays
-    *n_handlers = get_nprocs() - 1;
+    // one processor is left to the server thread, if there is one to spare
+    *n_handlers = get_nprocs() > 1 ? get_nprocs() - 1 : 1;
     *handlers = safe_malloc(sizeof(Handler *) * *n_handlers);
     *handler_threads = safe_malloc(sizeof(pthread_t) * *n_handlers);
+    *slabs = safe_malloc(sizeof(SlabAllocator *) * *n_handlers);
+    *budgets = safe_malloc(sizeof(MemoryBudget) * *n_handlers);
+    // one slot per handler, read without touching the serving sockets
+    *metrics = config->metrics_segment ?
+            init_metrics_segment(config->metrics_segment, *n_handlers) : NULL;
 
     // init handler threads
     for (size_t i = 0; i < *n_handlers; ++i) {
-        if (init_handler(&(*handlers)[i]) < 0) {
+        (*slabs)[i] = init_slab_allocator();
+        init_memory_budget(&(*budgets)[i], config->handler_memory_budget,
+                config->connection_memory_budget);
+        if (init_handler(&(*handlers)[i], io_pool, executor, md_cache,
+                listing_cache, (*slabs)[i], buffer_pool, &(*budgets)[i],
+                stats, slow_log, capture, metrics_segment_handler(*metrics, i))
+                < 0) {
             printf("unable to initialise handler!\n");
             exit(EXIT_FAILURE);
         }
@@ -65,6 +101,13 @@ void listen_and_serve(Config *config, CompressionSegment *comp_dict,
         exit(EXIT_FAILURE);
     }
 
+    // one descriptor per connection, allow as many as permitted
+    struct rlimit fd_limit;
+    if (!getrlimit(RLIMIT_NOFILE, &fd_limit)) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
     int server_sock_fd = -1;
     server_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock_fd < 0) {
@@ -100,49 +143,100 @@ void listen_and_serve(Config *config, CompressionSegment *comp_dict,
         exit(EXIT_FAILURE);
     }
 
+    // per thread counters, merged when a snapshot is requested
+    StatsRegistry *stats = init_stats_registry();
+    // before any thread is created, they inherit its signal mask
+    Profiler *profiler = config->profile ? init_profiler(stats) : NULL;
+    // requests slower than the threshold, written out by a drainer thread
+    SlowLog *slow_log = config->slow_request_us ?
+            init_slow_log(config->slow_request_log, config->slow_request_us) :
+            NULL;
+    // requests of sampled connections, written out by a drainer thread
+    Capture *capture = config->capture ? init_capture(config->capture,
+            config->capture_sample, config->capture_max_payload) : NULL;
+
     // initialise shared open file instances memory
     OpenFileInstances *open_file_instances = safe_malloc(sizeof(OpenFileInstances));
     init_open_file_instances(&open_file_instances);
 
+    // disk reads are performed off the handler threads
+    IOPool *io_pool = init_io_pool(IO_POOL_N_THREADS);
+
+    // directory metadata and listing, kept current by inotify
+    DirWatcher *dir_watcher = init_dir_watcher(config->dir);
+    MetadataCache *md_cache = init_metadata_cache(config->dir_fd, dir_watcher);
+    ListingCache *listing_cache = init_listing_cache(config->dir_fd,
+            dir_watcher);
+    if (dir_watcher_start(dir_watcher) < 0) {
+        printf("unable to watch %s\n", config->dir);
+        exit(EXIT_FAILURE);
+    }
+
+    // payload and write buffers, recycled across handlers
+    BufferPool *buffer_pool = init_buffer_pool();
+
+    // compression and listing serialisation are run off the handler threads
+    Executor *executor = init_executor(get_nprocs(), buffer_pool, stats);
+
     // init handler threads
+    SlabAllocator **slabs = NULL;
+    MemoryBudget *budgets = NULL;
     Handler **handlers = NULL;
     pthread_t *handler_threads = NULL;
     size_t n_handlers = 0;
-    init_handlers(open_file_instances, &handlers, &handler_threads, &n_handlers,
-                  comp_dict, decomp_tree, config);
+    MetricsSegment *metrics = NULL;
+    init_handlers(open_file_instances, io_pool, executor, md_cache,
+                  listing_cache, buffer_pool, stats, slow_log, capture, &metrics, &slabs, &budgets, &handlers, &handler_threads,
+                  &n_handlers, comp_dict, decomp_tree, config);
+    // handlers are woken, parked and rebalanced as load changes
+    HandlerGroup *handler_group = init_handler_group(handlers, n_handlers,
+            metrics_segment_group(metrics));
 
     // init cleanup on thread termination
     struct cleanup_server_thread_args args = {
             .handlers = handlers,
+            .handler_group = handler_group,
             .handler_threads = handler_threads,
             .n_handlers = n_handlers,
             .config = config,
             .comp_dict = comp_dict,
             .decomp_tree = decomp_tree,
             .server_socket_fd = server_sock_fd,
-            .open_file_instances = open_file_instances
+            .open_file_instances = open_file_instances,
+            .io_pool = io_pool,
+            .executor = executor,
+            .dir_watcher = dir_watcher,
+            .md_cache = md_cache,
+            .listing_cache = listing_cache,
+            .slabs = slabs,
+            .buffer_pool = buffer_pool,
+            .budgets = budgets,
+            .stats = stats,
+            .metrics = metrics,
+            .profiler = profiler,
+            .slow_log = slow_log,
+            .capture = capture
     };
     pthread_cleanup_push(cleanup_server_thread, &args);
 
     // accept new connections
     uint32_t addr_len = sizeof(struct sockaddr_in);
-    size_t thread_index = 0;
     while (1) {
         int client_sock_fd = accept(server_sock_fd,
                                     (struct sockaddr *) &server_addr, &addr_len);
         if (client_sock_fd >= 0) {
+            JX_PROBE1(accept, client_sock_fd);
             // non blocking io
             fcntl(client_sock_fd, F_SETFL, fcntl(client_sock_fd, F_GETFL, 0)|O_NONBLOCK);
-            // create req
-            if (new_client(handlers[thread_index], client_sock_fd) < 0) {
+            // create req on the least loaded handler
+            if (new_client(handler_group_route(handler_group, NULL),
+                    client_sock_fd) < 0) {
                 break;
             }
         } else {
             perror("accept failed");
             exit(EXIT_FAILURE);
         }
-        // round robbin
-        thread_index = (thread_index + 1) % n_handlers;
     }
 
     // reap handler threads
@@ -155,6 +249,12 @@ void cleanup_server_thread(void *arg) {
     struct cleanup_server_thread_args *args =
             (struct cleanup_server_thread_args *) arg;
 
+    // no completion may be pushed once handlers destroy their queues, but
+    // handlers may still submit until they are joined
+    stop_io_pool(args->io_pool);
+    stop_executor(args->executor);
+    stop_handler_group(args->handler_group);
+
     // cancel handler threads
     for (size_t i = 0; i < args->n_handlers; ++i) {
         pthread_cancel(args->handler_threads[i]);
@@ -163,7 +263,19 @@ void cleanup_server_thread(void *arg) {
     for (size_t i = 0; i < args->n_handlers; ++i) {
         pthread_join(args->handler_threads[i], NULL);
     }
+    destroy_io_pool(args->io_pool);
+    destroy_executor(args->executor);
+    destroy_handler_group(args->handler_group);
+    destroy_metrics_segment(args->metrics);
+    // every thread counting phases has stopped
+    destroy_profiler(args->profiler);
+    destroy_slow_log(args->slow_log);
+    // payloads still referenced are returned to the pool
+    destroy_capture(args->capture);
 
+    destroy_dir_watcher(args->dir_watcher);
+    destroy_metadata_cache(args->md_cache);
+    destroy_listing_cache(args->listing_cache);
     destroy_config(args->config);
     destroy_decompression_tree(args->decomp_tree);
     destroy_compression_dict(args->comp_dict);
@@ -171,7 +283,15 @@ void cleanup_server_thread(void *arg) {
 
     close(args->server_socket_fd);
 
+    for (size_t i = 0; i < args->n_handlers; ++i) {
+        destroy_slab_allocator(args->slabs[i]);
+    }
+    destroy_buffer_pool(args->buffer_pool);
+
     free(args->handlers);
     free(args->handler_threads);
+    free(args->slabs);
+    free(args->budgets);
+    destroy_stats_registry(args->stats);
     return;
 }
@@ -4,6 +4,14 @@
 #include "../config/config.h"
 #include "../handler/handler.h"
 #include "../handler/open_file_instance.h"
+#include "../io/io_pool.h"
+#include "../io/executor.h"
+#include "../cache/dir_watcher.h"
+#include "../cache/metadata_cache.h"
+#include "../cache/listing_cache.h"
+#include "../stats/probes.h"
+#include "../stats/profile.h"
+#include "../stats/slow_log.h"
 #include "../data_structures/compression_dictionary/compression_dict.h"
 #include "../data_structures/decompression_tree/decompression_tree.h"
 
@@ -15,15 +23,30 @@
 #include <stdatomic.h>
 #include <fcntl.h>
 #include <sys/sysinfo.h>
+#include <sys/resource.h>
 
 struct cleanup_server_thread_args {
     Handler **handlers;
+    HandlerGroup *handler_group;
     pthread_t *handler_threads;
     size_t n_handlers;
     Config *config;
     CompressionSegment *comp_dict;
     DecompressionTreeNode *decomp_tree;
     OpenFileInstances *open_file_instances;
+    IOPool *io_pool;
+    Executor *executor;
+    DirWatcher *dir_watcher;
+    MetadataCache *md_cache;
+    ListingCache *listing_cache;
+    SlabAllocator **slabs; // one per handler
+    BufferPool *buffer_pool;
+    MemoryBudget *budgets; // one per handler
+    StatsRegistry *stats;
+    MetricsSegment *metrics; // NULL if not published
+    Profiler *profiler; // NULL if not profiling
+    SlowLog *slow_log; // NULL if slow requests are not logged
+    Capture *capture; // NULL if requests are not captured
     int server_socket_fd;
 };
 
@@ -35,7 +58,11 @@ struct cleanup_server_thread_args {
  *
  *  Socket is binded to IP and port provided in config. Address is reused.
  *  If bind or listen fail, error is printed to stdout and program exits with
- *  status EXIT_FAILURE. New connections are routed to one of the handler threads.
+ *  status EXIT_FAILURE. New connections are routed to the least loaded awake
+ *  handler thread (see handler_group_route). Handler and group counters are
+ *  published to the shared memory segment named in config, if any. If
+ *  profiling, a phase report is printed on each SIGUSR1 and at shutdown.
+ *  Requests slower than the configured threshold are logged with their phases.
  *
  *  All arguments are owned by the function, and will be released when a shutdown
  *  request is received.
@@ -50,7 +77,16 @@ void listen_and_serve(Config *config, CompressionSegment *comp_dict,
 /** @brief Releases all memory provided to and allocated by listen and serve.
  *
  *  Destroys config, comp_dict, and decomp_tree provided to listen and serve.
- *  All handler threads are closed and cleaned. Any open connections are closed.
+ *  IO pool is stopped before the handler threads, so no read completes into a
+ *  destroyed handler. Handler group is stopped before the handler threads, so
+ *  no connection migrates into a destroyed handler. Directory watcher is stopped before the caches it
+ *  maintains. Handler slabs, budgets and the buffer pool are destroyed last,
+ *  as cached listings may hold blocks allocated from and charged to them.
+ *  Metrics segment is removed once its handlers and balancer have stopped.
+ *  Final profile report is printed, and the slow request log flushed, once
+ *  every profiled thread has stopped.
+ *  All handler threads are closed and cleaned. Any open
+ *  connections are closed.
  *
  *  Intended for use with pthread_cleanup methods.
  *
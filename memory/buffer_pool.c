@@ -0,0 +1,425 @@
+#include "buffer_pool.h"
+
+// cache of the calling thread
+static __thread BufferCache *thread_cache = NULL;
+
+/** @brief Maps a size onto its size class.
+ *
+ *  @param size : requested bytes.
+ *  @return size class index, BUFFER_POOL_UNPOOLED if too large to pool.
+ */
+static uint32_t size_class(size_t size);
+
+/** @brief Returns usable size of a size class.
+ *
+ *  @param class : size class index.
+ *  @return class size in bytes.
+ */
+static size_t class_size(uint32_t class);
+
+/** @brief Number of buffers a thread cache holds per class.
+ *
+ *  @param class : size class index.
+ *  @return cache depth, at least 1.
+ */
+static size_t cache_depth(uint32_t class);
+
+/** @brief Number of free buffers the depot holds per class.
+ *
+ *  @param class : size class index.
+ *  @return depot depth, at least 1.
+ */
+static size_t depot_depth(uint32_t class);
+
+/** @brief Moves up to n buffers of a class from the depot into a cache.
+ *
+ *  @param bc : BufferCache instance.
+ *  @param class : size class index.
+ *  @param n : maximum number of buffers moved.
+ */
+static void depot_take(BufferCache *bc, uint32_t class, size_t n);
+
+/** @brief Returns a free buffer to the depot, freeing it if depot is full.
+ *
+ *  @param pool : BufferPool instance.
+ *  @param header : Free buffer header.
+ */
+static void depot_give(BufferPool *pool, BufferHeader *header);
+
+/** @brief Increments a counter that only one thread writes.
+ *
+ *  Avoids a locked instruction, readers may observe a stale value.
+ *
+ *  @param counter : Counter address.
+ */
+static void counter_increment(atomic_uint_fast64_t *counter);
+
+/** @brief Mirrors the depth of a cache class for readers on other threads.
+ *
+ *  @param bc : BufferCache instance, owned by the calling thread.
+ *  @param class : size class index.
+ */
+static void publish_depth(BufferCache *bc, uint32_t class);
+
+/** @brief Allocates a reference counted buffer.
+ *
+ *  @param size : number of bytes required.
+ *  @param fatal : exit on allocation failure, otherwise NULL is returned.
+ *  @return address of buffer, or NULL.
+ */
+static uint8_t *alloc_buffer(size_t size, bool fatal);
+
+/** @brief Returns header of a buffer.
+ *
+ *  @param buffer : Buffer returned by buffer_alloc.
+ *  @return header address.
+ */
+static BufferHeader *header_of(uint8_t *buffer);
+
+BufferPool *init_buffer_pool() {
+    BufferPool *pool = safe_malloc(sizeof(BufferPool));
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        pool->depot[i].head = NULL;
+        pool->depot[i].n_buffers = 0;
+        pthread_mutex_init(&pool->depot[i].lock, NULL);
+        atomic_init(&pool->counters[i].n_allocs, 0);
+        atomic_init(&pool->counters[i].n_cache_hits, 0);
+        atomic_init(&pool->counters[i].n_depot_hits, 0);
+        atomic_init(&pool->counters[i].n_releases, 0);
+    }
+    for (size_t i = 0; i <= BUFFER_POOL_N_CLASSES; ++i) {
+        atomic_init(&pool->n_outstanding[i], 0);
+    }
+    pool->caches = NULL;
+    pthread_mutex_init(&pool->caches_lock, NULL);
+    return pool;
+}
+
+BufferCache *buffer_cache_bind_thread(BufferPool *pool) {
+    if (!pool) {
+        return NULL;
+    }
+
+    BufferCache *bc = safe_malloc(sizeof(BufferCache));
+    bc->pool = pool;
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        bc->n_cached[i] = 0;
+        atomic_init(&bc->counters[i].n_allocs, 0);
+        atomic_init(&bc->counters[i].n_cache_hits, 0);
+        atomic_init(&bc->counters[i].n_depot_hits, 0);
+        atomic_init(&bc->counters[i].n_releases, 0);
+        atomic_init(&bc->counters[i].n_cached, 0);
+    }
+
+    pthread_mutex_lock(&pool->caches_lock);
+    bc->next = pool->caches;
+    pool->caches = bc;
+    pthread_mutex_unlock(&pool->caches_lock);
+
+    thread_cache = bc;
+    return bc;
+}
+
+static uint32_t size_class(size_t size) {
+    if (size > BUFFER_POOL_MAX_CLASS_SIZE) {
+        return BUFFER_POOL_UNPOOLED;
+    }
+    uint32_t class = 0;
+    size_t class_size = BUFFER_POOL_MIN_CLASS_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        class++;
+    }
+    return class;
+}
+
+static size_t class_size(uint32_t class) {
+    return (size_t) BUFFER_POOL_MIN_CLASS_SIZE << class;
+}
+
+static size_t cache_depth(uint32_t class) {
+    size_t depth = BUFFER_CACHE_BYTES / class_size(class);
+    if (depth > BUFFER_CACHE_MAX_DEPTH) {
+        depth = BUFFER_CACHE_MAX_DEPTH;
+    }
+    return depth ? depth : 1;
+}
+
+static size_t depot_depth(uint32_t class) {
+    size_t depth = BUFFER_DEPOT_BYTES / class_size(class);
+    return depth ? depth : 1;
+}
+
+static void counter_increment(atomic_uint_fast64_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter,
+            memory_order_relaxed) + 1, memory_order_relaxed);
+    return;
+}
+
+static void publish_depth(BufferCache *bc, uint32_t class) {
+    atomic_store_explicit(&bc->counters[class].n_cached, bc->n_cached[class],
+            memory_order_relaxed);
+    return;
+}
+
+static BufferHeader *header_of(uint8_t *buffer) {
+    return (BufferHeader *) buffer - 1;
+}
+
+static void depot_take(BufferCache *bc, uint32_t class, size_t n) {
+    BufferDepotClass *depot = &bc->pool->depot[class];
+    pthread_mutex_lock(&depot->lock);
+    while (n-- && depot->head) {
+        BufferHeader *header = depot->head;
+        depot->head = header->next;
+        depot->n_buffers--;
+        bc->stacks[class][bc->n_cached[class]++] = header;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    publish_depth(bc, class);
+    return;
+}
+
+static void depot_give(BufferPool *pool, BufferHeader *header) {
+    BufferDepotClass *depot = &pool->depot[header->size_class];
+    pthread_mutex_lock(&depot->lock);
+    if (depot->n_buffers < depot_depth(header->size_class)) {
+        header->next = depot->head;
+        depot->head = header;
+        depot->n_buffers++;
+        header = NULL;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    // depot is full
+    free(header);
+    return;
+}
+
+uint8_t *buffer_alloc(size_t size) {
+    return alloc_buffer(size, true);
+}
+
+uint8_t *buffer_try_alloc(size_t size) {
+    return alloc_buffer(size, false);
+}
+
+static uint8_t *alloc_buffer(size_t size, bool fatal) {
+    uint32_t class = size_class(size);
+    BufferCache *bc = thread_cache;
+    BufferHeader *header = NULL;
+
+    if (class != BUFFER_POOL_UNPOOLED && bc) {
+        counter_increment(&bc->counters[class].n_allocs);
+        if (bc->n_cached[class]) {
+            counter_increment(&bc->counters[class].n_cache_hits);
+        } else {
+            // refill half the cache in one depot visit
+            depot_take(bc, class, (cache_depth(class) + 1) / 2);
+            if (bc->n_cached[class]) {
+                counter_increment(&bc->counters[class].n_depot_hits);
+            }
+        }
+        if (bc->n_cached[class]) {
+            header = bc->stacks[class][--bc->n_cached[class]];
+            publish_depth(bc, class);
+        }
+    }
+
+    if (!header) {
+        size_t capacity = class == BUFFER_POOL_UNPOOLED ? size :
+                class_size(class);
+        if (capacity > SIZE_MAX - sizeof(BufferHeader)) {
+            // no allocator can satisfy this
+            capacity = SIZE_MAX - sizeof(BufferHeader);
+        }
+        if (fatal) {
+            header = safe_malloc(sizeof(BufferHeader) + capacity);
+        } else if (!(header = malloc(sizeof(BufferHeader) + capacity))) {
+            return NULL;
+        }
+        header->pool = class == BUFFER_POOL_UNPOOLED || !bc ? NULL : bc->pool;
+        header->size_class = header->pool ? class : BUFFER_POOL_UNPOOLED;
+        header->capacity = capacity;
+    }
+    if (header->pool) {
+        atomic_fetch_add_explicit(&header->pool->n_outstanding[class], 1,
+                memory_order_relaxed);
+    }
+    atomic_init(&header->reference_count, 1);
+    header->budget = budget_of_thread();
+    budget_charge(header->budget, header->capacity);
+    return (uint8_t *) (header + 1);
+}
+
+uint8_t *buffer_realloc(uint8_t *buffer, size_t size) {
+    if (buffer && header_of(buffer)->capacity >= size) {
+        return buffer;
+    }
+
+    uint8_t *grown = buffer_alloc(size);
+    if (buffer) {
+        memcpy(grown, buffer, header_of(buffer)->capacity);
+        buffer_release(buffer);
+    }
+    return grown;
+}
+
+uint8_t *buffer_retain(uint8_t *buffer) {
+    if (!buffer) {
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&header_of(buffer)->reference_count, 1,
+            memory_order_relaxed);
+    return buffer;
+}
+
+void buffer_release(uint8_t *buffer) {
+    if (!buffer) {
+        return;
+    }
+
+    BufferHeader *header = header_of(buffer);
+    if (atomic_fetch_sub_explicit(&header->reference_count, 1,
+            memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    budget_discharge(header->budget, header->capacity);
+    BufferPool *pool = header->pool;
+    if (!pool) {
+        free(header);
+        return;
+    }
+
+    uint32_t class = header->size_class;
+    atomic_fetch_sub_explicit(&pool->n_outstanding[class], 1,
+            memory_order_relaxed);
+    BufferCache *bc = thread_cache;
+    if (!bc || bc->pool != pool) {
+        // any thread without a cache may release here
+        atomic_fetch_add_explicit(&pool->counters[class].n_releases, 1,
+                memory_order_relaxed);
+        depot_give(pool, header);
+        return;
+    }
+
+    counter_increment(&bc->counters[class].n_releases);
+    size_t depth = cache_depth(class);
+    if (bc->n_cached[class] >= depth) {
+        // overflow, hand the older half back in one depot visit
+        size_t n_keep = depth / 2;
+        for (size_t i = 0; i < bc->n_cached[class] - n_keep; ++i) {
+            depot_give(pool, bc->stacks[class][i]);
+        }
+        memmove(bc->stacks[class], bc->stacks[class] + bc->n_cached[class] -
+                n_keep, n_keep * sizeof(BufferHeader *));
+        bc->n_cached[class] = n_keep;
+    }
+    bc->stacks[class][bc->n_cached[class]++] = header;
+    publish_depth(bc, class);
+    return;
+}
+
+size_t buffer_capacity(uint8_t *buffer) {
+    if (!buffer) {
+        return 0;
+    }
+    return header_of(buffer)->capacity;
+}
+
+void buffer_pool_stats(BufferPool *pool, BufferPoolStats *stats) {
+    if (!pool || !stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(BufferPoolStats));
+    pthread_mutex_lock(&pool->caches_lock);
+    for (uint32_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        BufferClassStats *cs = &stats->classes[i];
+        cs->capacity = class_size(i);
+        cs->n_allocs = atomic_load(&pool->counters[i].n_allocs);
+        cs->n_cache_hits = atomic_load(&pool->counters[i].n_cache_hits);
+        cs->n_depot_hits = atomic_load(&pool->counters[i].n_depot_hits);
+        cs->n_releases = atomic_load(&pool->counters[i].n_releases);
+        for (BufferCache *bc = pool->caches; bc; bc = bc->next) {
+            cs->n_allocs += atomic_load(&bc->counters[i].n_allocs);
+            cs->n_cache_hits += atomic_load(&bc->counters[i].n_cache_hits);
+            cs->n_depot_hits += atomic_load(&bc->counters[i].n_depot_hits);
+            cs->n_releases += atomic_load(&bc->counters[i].n_releases);
+            // other threads caches may have moved on, approximate
+            stats->bytes_cached += atomic_load_explicit(
+                    &bc->counters[i].n_cached, memory_order_relaxed) *
+                    cs->capacity;
+        }
+        cs->n_outstanding = atomic_load(&pool->n_outstanding[i]);
+
+        pthread_mutex_lock(&pool->depot[i].lock);
+        cs->n_depot = pool->depot[i].n_buffers;
+        pthread_mutex_unlock(&pool->depot[i].lock);
+
+        stats->bytes_outstanding += cs->n_outstanding * cs->capacity;
+        stats->bytes_cached += cs->n_depot * cs->capacity;
+    }
+    pthread_mutex_unlock(&pool->caches_lock);
+    return;
+}
+
+void destroy_buffer_cache(BufferCache *bc) {
+    if (!bc) {
+        return;
+    }
+
+    BufferPool *pool = bc->pool;
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        for (size_t j = 0; j < bc->n_cached[i]; ++j) {
+            depot_give(pool, bc->stacks[i][j]);
+        }
+    }
+
+    // fold counters into the pool before unregistering
+    pthread_mutex_lock(&pool->caches_lock);
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        atomic_fetch_add(&pool->counters[i].n_allocs,
+                atomic_load(&bc->counters[i].n_allocs));
+        atomic_fetch_add(&pool->counters[i].n_cache_hits,
+                atomic_load(&bc->counters[i].n_cache_hits));
+        atomic_fetch_add(&pool->counters[i].n_depot_hits,
+                atomic_load(&bc->counters[i].n_depot_hits));
+        atomic_fetch_add(&pool->counters[i].n_releases,
+                atomic_load(&bc->counters[i].n_releases));
+    }
+    BufferCache **link = &pool->caches;
+    while (*link && *link != bc) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = bc->next;
+    }
+    pthread_mutex_unlock(&pool->caches_lock);
+
+    if (thread_cache == bc) {
+        thread_cache = NULL;
+    }
+    free(bc);
+    return;
+}
+
+void destroy_buffer_pool(BufferPool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    for (size_t i = 0; i < BUFFER_POOL_N_CLASSES; ++i) {
+        BufferHeader *header = pool->depot[i].head;
+        while (header) {
+            BufferHeader *next = header->next;
+            free(header);
+            header = next;
+        }
+        pthread_mutex_destroy(&pool->depot[i].lock);
+    }
+    pthread_mutex_destroy(&pool->caches_lock);
+    free(pool);
+    return;
+}
@@ -0,0 +1,189 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_BUFFER_POOL_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_BUFFER_POOL_H
+
+#include "memory.h"
+#include "memory_budget.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define BUFFER_POOL_MIN_CLASS_SIZE 64
+#define BUFFER_POOL_N_CLASSES 19 // 64 bytes to 16 MiB, powers of two
+#define BUFFER_POOL_MAX_CLASS_SIZE \
+        ((size_t) BUFFER_POOL_MIN_CLASS_SIZE << (BUFFER_POOL_N_CLASSES - 1))
+#define BUFFER_POOL_UNPOOLED BUFFER_POOL_N_CLASSES
+#define BUFFER_CACHE_BYTES (2 * 1024 * 1024) // per thread, per class
+#define BUFFER_CACHE_MAX_DEPTH 32
+#define BUFFER_DEPOT_BYTES (32 * 1024 * 1024) // per class
+
+struct buffer_pool;
+
+// precedes every buffer, 32 bytes keeps data 16 byte aligned
+typedef struct buffer_header {
+    struct buffer_pool *pool; // NULL if unpooled
+    atomic_uint reference_count;
+    uint32_t size_class;
+    size_t capacity; // usable bytes following the header
+    union {
+        struct buffer_header *next; // depot link, only valid while free
+        MemoryBudget *budget; // charged while referenced, may be NULL
+    };
+} BufferHeader;
+
+typedef struct {
+    BufferHeader *head;
+    size_t n_buffers;
+    pthread_mutex_t lock;
+} BufferDepotClass;
+
+typedef struct {
+    atomic_uint_fast64_t n_allocs;
+    atomic_uint_fast64_t n_cache_hits; // served by a thread cache
+    atomic_uint_fast64_t n_depot_hits; // served by the global depot
+    atomic_uint_fast64_t n_releases;
+    atomic_size_t n_cached; // cache depth, mirrored for other threads
+} BufferClassCounters;
+
+typedef struct buffer_cache {
+    struct buffer_pool *pool;
+    BufferHeader *stacks[BUFFER_POOL_N_CLASSES][BUFFER_CACHE_MAX_DEPTH];
+    size_t n_cached[BUFFER_POOL_N_CLASSES];
+    // written by the owning thread only
+    BufferClassCounters counters[BUFFER_POOL_N_CLASSES];
+    struct buffer_cache *next; // pool registry link
+} BufferCache;
+
+typedef struct buffer_pool {
+    BufferDepotClass depot[BUFFER_POOL_N_CLASSES];
+    // buffers of each class currently handed out
+    atomic_size_t n_outstanding[BUFFER_POOL_N_CLASSES + 1];
+    // counters of threads without a cache, written by several threads
+    BufferClassCounters counters[BUFFER_POOL_N_CLASSES];
+    BufferCache *caches;
+    pthread_mutex_t caches_lock;
+} BufferPool;
+
+typedef struct {
+    uint64_t capacity; // size of the class, 0 for unpooled
+    uint64_t n_allocs;
+    uint64_t n_cache_hits;
+    uint64_t n_depot_hits;
+    uint64_t n_releases;
+    uint64_t n_outstanding;
+    uint64_t n_depot; // free buffers held by the depot
+} BufferClassStats;
+
+typedef struct {
+    BufferClassStats classes[BUFFER_POOL_N_CLASSES + 1];
+    uint64_t bytes_outstanding;
+    uint64_t bytes_cached; // depot and thread caches
+} BufferPoolStats;
+
+/** @brief Initialises buffer pool.
+ *
+ *  Buffer pool recycles payload and write buffers in power of two size
+ *  classes. Each thread serves buffers from its own cache, and exchanges
+ *  batches with a global depot, locked per class, on cache miss or overflow.
+ *
+ *  @return BufferPool instance.
+ */
+BufferPool *init_buffer_pool();
+
+/** @brief Creates a thread cache and binds it to the calling thread.
+ *
+ *  Cache is registered with the pool, so it is included in statistics.
+ *
+ *  @param pool : BufferPool instance.
+ *  @return BufferCache instance.
+ */
+BufferCache *buffer_cache_bind_thread(BufferPool *pool);
+
+/** @brief Allocates a reference counted buffer.
+ *
+ *  Buffer holds at least size bytes and has a reference count of 1. Sizes
+ *  above BUFFER_POOL_MAX_CLASS_SIZE, or calls from threads with no cache, are
+ *  served by malloc. Capacity is charged to the budget of the calling thread
+ *  until the final release. If allocation fails, perror is called and program exits
+ *  with status EXIT_FAILURE.
+ *
+ *  @param size : number of bytes required.
+ *  @return address of buffer.
+ */
+uint8_t *buffer_alloc(size_t size);
+
+/** @brief Allocates a reference counted buffer, tolerating failure.
+ *
+ *  As buffer_alloc, except NULL is returned if memory is exhausted. Intended
+ *  for sizes chosen by clients.
+ *
+ *  @param size : number of bytes required.
+ *  @return address of buffer, or NULL.
+ */
+uint8_t *buffer_try_alloc(size_t size);
+
+/** @brief Grows an unshared buffer.
+ *
+ *  If capacity already suffices, buffer is returned. Otherwise contents are
+ *  moved to a new buffer and the old one is released. If buffer is NULL, a new
+ *  buffer is allocated.
+ *
+ *  @param buffer : Buffer returned by buffer_alloc, with a single reference.
+ *  @param size : number of bytes required.
+ *  @return address of buffer.
+ */
+uint8_t *buffer_realloc(uint8_t *buffer, size_t size);
+
+/** @brief Adds a reference to a buffer.
+ *
+ *  @param buffer : Buffer returned by buffer_alloc.
+ *  @return buffer.
+ */
+uint8_t *buffer_retain(uint8_t *buffer);
+
+/** @brief Drops a reference to a buffer.
+ *
+ *  Once unreferenced, buffer is returned to the calling threads cache, to
+ *  the depot, or freed. If buffer is NULL, nothing is done.
+ *
+ *  @param buffer : Buffer returned by buffer_alloc.
+ */
+void buffer_release(uint8_t *buffer);
+
+/** @brief Returns usable size of a buffer.
+ *
+ *  @param buffer : Buffer returned by buffer_alloc.
+ *  @return usable bytes.
+ */
+size_t buffer_capacity(uint8_t *buffer);
+
+/** @brief Collects pool occupancy and hit rate statistics.
+ *
+ *  Counters of all thread caches are merged. Values are approximate while
+ *  other threads are running.
+ *
+ *  @param pool : BufferPool instance.
+ *  @param stats : Address to store statistics.
+ */
+void buffer_pool_stats(BufferPool *pool, BufferPoolStats *stats);
+
+/** @brief Destroys thread cache, returning its buffers to the depot.
+ *
+ *  Cache is unbound if bound to the calling thread.
+ *
+ *  @param bc : BufferCache instance.
+ */
+void destroy_buffer_cache(BufferCache *bc);
+
+/** @brief Destroys buffer pool.
+ *
+ *  All depot buffers are freed. Caches must be destroyed and all buffers
+ *  released first.
+ *
+ *  @param pool : BufferPool instance.
+ */
+void destroy_buffer_pool(BufferPool *pool);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_BUFFER_POOL_H
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define ARRAY_GROWTH_RATE 2
 
@@ -39,4 +40,16 @@ void *safe_realloc(void *old, size_t size);
  */
 void *safe_calloc(size_t nmeb, size_t size);
 
+/** @brief Wraps aligned_alloc, calls perror and exits on error.
+ *
+ *  Memory is zeroed. Size is rounded up to a multiple of alignment. If
+ *  aligned_alloc returns null, perror is called and program exits with
+ *  status EXIT_FAILURE.
+ *
+ *  @param alignment : alignment of allocated memory, a power of two.
+ *  @param size : number of bytes to be allocated.
+ *  @return address of allocated memory.
+ */
+void *safe_aligned_calloc(size_t alignment, size_t size);
+
 #endif //COMP2017_ASSIGNMENT_3_MEMORY_H
@@ -0,0 +1,65 @@
+#include "memory_budget.h"
+
+// budget of the calling thread
+static __thread MemoryBudget *thread_budget = NULL;
+
+void init_memory_budget(MemoryBudget *mb, size_t limit,
+        size_t connection_limit) {
+    atomic_init(&mb->n_used, 0);
+    mb->limit = limit;
+    mb->connection_limit = connection_limit;
+    atomic_init(&mb->n_peak, 0);
+    mb->n_throttled = 0;
+    mb->n_rejected = 0;
+    return;
+}
+
+void budget_bind_thread(MemoryBudget *mb) {
+    thread_budget = mb;
+    return;
+}
+
+MemoryBudget *budget_of_thread() {
+    return thread_budget;
+}
+
+void budget_charge(MemoryBudget *mb, size_t n) {
+    if (!mb) {
+        return;
+    }
+
+    size_t used = atomic_fetch_add_explicit(&mb->n_used, n,
+            memory_order_relaxed) + n;
+    size_t peak = atomic_load_explicit(&mb->n_peak, memory_order_relaxed);
+    while (used > peak && !atomic_compare_exchange_weak_explicit(&mb->n_peak,
+            &peak, used, memory_order_relaxed, memory_order_relaxed));
+    return;
+}
+
+void budget_discharge(MemoryBudget *mb, size_t n) {
+    if (!mb) {
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&mb->n_used, n, memory_order_relaxed);
+    return;
+}
+
+bool budget_exceeds(MemoryBudget *mb, size_t n) {
+    if (!mb) {
+        return false;
+    }
+
+    size_t used = atomic_load_explicit(&mb->n_used, memory_order_relaxed);
+    return used > mb->limit || n > mb->limit - used;
+}
+
+bool budget_can_resume(MemoryBudget *mb) {
+    if (!mb) {
+        return true;
+    }
+
+    size_t used = atomic_load_explicit(&mb->n_used, memory_order_relaxed);
+    return used <= mb->limit / MEMORY_BUDGET_RESUME_DEN *
+            MEMORY_BUDGET_RESUME_NUM;
+}
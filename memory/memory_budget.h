@@ -0,0 +1,84 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_MEMORY_BUDGET_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_MEMORY_BUDGET_H
+
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define MEMORY_BUDGET_HANDLER_DEFAULT ((size_t) 256 * 1024 * 1024)
+#define MEMORY_BUDGET_CONNECTION_DEFAULT ((size_t) 64 * 1024 * 1024)
+// reads resume once usage falls to this share of the limit
+#define MEMORY_BUDGET_RESUME_NUM 3
+#define MEMORY_BUDGET_RESUME_DEN 4
+
+typedef struct {
+    // bytes of buffers charged, released buffers may be discharged by any
+    // thread
+    atomic_size_t n_used;
+    size_t limit; // per handler
+    size_t connection_limit; // largest buffered payload of one connection
+    // charged by the owning handler, and executor tasks run on its behalf
+    atomic_size_t n_peak;
+    uint64_t n_throttled; // connections paused for exceeding the limit
+    uint64_t n_rejected; // requests refused for exceeding connection_limit
+} MemoryBudget;
+
+/** @brief Initialises memory budget.
+ *
+ *  @param mb : MemoryBudget instance.
+ *  @param limit : Handler limit in bytes.
+ *  @param connection_limit : Connection limit in bytes.
+ */
+void init_memory_budget(MemoryBudget *mb, size_t limit,
+        size_t connection_limit);
+
+/** @brief Binds a budget to the calling thread.
+ *
+ *  Buffers allocated by the thread are charged to the budget until released.
+ *
+ *  @param mb : MemoryBudget instance, NULL to unbind.
+ */
+void budget_bind_thread(MemoryBudget *mb);
+
+/** @brief Returns budget bound to the calling thread.
+ *
+ *  @return MemoryBudget instance, or NULL.
+ */
+MemoryBudget *budget_of_thread();
+
+/** @brief Charges bytes to a budget.
+ *
+ *  If mb is NULL, nothing is done.
+ *
+ *  @param mb : MemoryBudget instance.
+ *  @param n : bytes charged.
+ */
+void budget_charge(MemoryBudget *mb, size_t n);
+
+/** @brief Returns charged bytes to a budget.
+ *
+ *  If mb is NULL, nothing is done.
+ *
+ *  @param mb : MemoryBudget instance.
+ *  @param n : bytes discharged.
+ */
+void budget_discharge(MemoryBudget *mb, size_t n);
+
+/** @brief Checks if charging more bytes would exceed the limit.
+ *
+ *  @param mb : MemoryBudget instance.
+ *  @param n : bytes about to be charged.
+ *  @return True if limit would be exceeded.
+ */
+bool budget_exceeds(MemoryBudget *mb, size_t n);
+
+/** @brief Checks if usage has fallen enough for paused reads to resume.
+ *
+ *  @param mb : MemoryBudget instance.
+ *  @return True if usage is at most the resume threshold.
+ */
+bool budget_can_resume(MemoryBudget *mb);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_MEMORY_BUDGET_H
@@ -25,4 +25,15 @@ void *safe_realloc(void *old, size_t size) {
         exit(EXIT_FAILURE);
     }
     return p;
+}
+
+void *safe_aligned_calloc(size_t alignment, size_t size) {
+    size = (size + alignment - 1) / alignment * alignment;
+    void *p = aligned_alloc(alignment, size ? size : alignment);
+    if (!p) {
+        perror("aligned_alloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, size);
+    return p;
 }
\ No newline at end of file
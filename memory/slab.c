@@ -0,0 +1,193 @@
+#include "slab.h"
+
+// allocator of the calling thread
+static __thread SlabAllocator *thread_slab = NULL;
+
+/** @brief Free list link of a free block.
+ *
+ *  Link is stored in the first bytes of the (unused) block body.
+ *
+ *  @param header : Free block header.
+ *  @return Address of the link.
+ */
+static SlabHeader **next_free(SlabHeader *header);
+
+/** @brief Maps a size onto its size class.
+ *
+ *  @param size : requested bytes, at most SLAB_MAX_CLASS_SIZE.
+ *  @return size class index.
+ */
+static size_t size_class(size_t size);
+
+/** @brief Carves a new page into blocks of a size class.
+ *
+ *  @param sa : SlabAllocator instance.
+ *  @param class : size class index.
+ */
+static void refill(SlabAllocator *sa, size_t class);
+
+/** @brief Moves blocks freed by other threads onto the free lists.
+ *
+ *  @param sa : SlabAllocator instance.
+ */
+static void drain_remote(SlabAllocator *sa);
+
+SlabAllocator *init_slab_allocator() {
+    SlabAllocator *sa = safe_malloc(sizeof(SlabAllocator));
+    for (size_t i = 0; i < SLAB_N_CLASSES; ++i) {
+        sa->free_lists[i] = NULL;
+    }
+    atomic_init(&sa->remote_free, NULL);
+    sa->pages = NULL;
+    sa->n_pages = 0;
+    sa->n_allocs = 0;
+    sa->n_fallbacks = 0;
+    return sa;
+}
+
+void slab_bind_thread(SlabAllocator *sa) {
+    thread_slab = sa;
+    return;
+}
+
+static SlabHeader **next_free(SlabHeader *header) {
+    return (SlabHeader **) (header + 1);
+}
+
+static size_t size_class(size_t size) {
+    size_t class = 0;
+    size_t class_size = SLAB_MIN_CLASS_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        class++;
+    }
+    return class;
+}
+
+static void refill(SlabAllocator *sa, size_t class) {
+    size_t capacity = (size_t) SLAB_MIN_CLASS_SIZE << class;
+    size_t block_size = sizeof(SlabHeader) + capacity;
+    size_t n_blocks = (SLAB_PAGE_SIZE - sizeof(SlabHeader)) / block_size;
+
+    // page link occupies a header sized slot, keeping blocks aligned
+    SlabPage *page = safe_malloc(SLAB_PAGE_SIZE);
+    page->next = sa->pages;
+    sa->pages = page;
+    sa->n_pages++;
+
+    uint8_t *block = (uint8_t *) page + sizeof(SlabHeader);
+    for (size_t i = 0; i < n_blocks; ++i) {
+        SlabHeader *header = (SlabHeader *) (block + i * block_size);
+        header->owner = sa;
+        header->capacity = capacity;
+        *next_free(header) = sa->free_lists[class];
+        sa->free_lists[class] = header;
+    }
+    return;
+}
+
+static void drain_remote(SlabAllocator *sa) {
+    SlabHeader *header = atomic_exchange(&sa->remote_free, NULL);
+    while (header) {
+        SlabHeader *next = *next_free(header);
+        size_t class = size_class(header->capacity);
+        *next_free(header) = sa->free_lists[class];
+        sa->free_lists[class] = header;
+        header = next;
+    }
+    return;
+}
+
+void *slab_alloc(size_t size) {
+    SlabAllocator *sa = thread_slab;
+    if (!sa || size > SLAB_MAX_CLASS_SIZE) {
+        SlabHeader *header = safe_malloc(sizeof(SlabHeader) + size);
+        header->owner = NULL;
+        header->capacity = size;
+        if (sa) {
+            sa->n_fallbacks++;
+        }
+        return header + 1;
+    }
+
+    size_t class = size_class(size);
+    if (!sa->free_lists[class]) {
+        drain_remote(sa);
+        if (!sa->free_lists[class]) {
+            refill(sa, class);
+        }
+    }
+
+    SlabHeader *header = sa->free_lists[class];
+    sa->free_lists[class] = *next_free(header);
+    sa->n_allocs++;
+    return header + 1;
+}
+
+void *slab_realloc(void *old, size_t size) {
+    if (!old) {
+        return slab_alloc(size);
+    }
+
+    SlabHeader *header = (SlabHeader *) old - 1;
+    if (header->capacity >= size) {
+        return old;
+    }
+    if (!header->owner) {
+        header = safe_realloc(header, sizeof(SlabHeader) + size);
+        header->capacity = size;
+        return header + 1;
+    }
+
+    void *p = slab_alloc(size);
+    memcpy(p, old, header->capacity);
+    slab_free(old);
+    return p;
+}
+
+void slab_free(void *p) {
+    if (!p) {
+        return;
+    }
+
+    SlabHeader *header = (SlabHeader *) p - 1;
+    SlabAllocator *owner = header->owner;
+    if (!owner) {
+        free(header);
+    } else if (owner == thread_slab) {
+        size_t class = size_class(header->capacity);
+        *next_free(header) = owner->free_lists[class];
+        owner->free_lists[class] = header;
+    } else {
+        // lock free push onto owners remote stack
+        SlabHeader *head = atomic_load(&owner->remote_free);
+        do {
+            *next_free(header) = head;
+        } while (!atomic_compare_exchange_weak(&owner->remote_free, &head,
+                header));
+    }
+    return;
+}
+
+size_t slab_capacity(void *p) {
+    return ((SlabHeader *) p - 1)->capacity;
+}
+
+void destroy_slab_allocator(SlabAllocator *sa) {
+    if (!sa) {
+        return;
+    }
+
+    if (thread_slab == sa) {
+        thread_slab = NULL;
+    }
+
+    SlabPage *page = sa->pages;
+    while (page) {
+        SlabPage *next = page->next;
+        free(page);
+        page = next;
+    }
+    free(sa);
+    return;
+}
@@ -0,0 +1,107 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLAB_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLAB_H
+
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define SLAB_MIN_CLASS_SIZE 16
+#define SLAB_N_CLASSES 9 // 16 bytes to 4 KiB, powers of two
+#define SLAB_MAX_CLASS_SIZE (SLAB_MIN_CLASS_SIZE << (SLAB_N_CLASSES - 1))
+#define SLAB_PAGE_SIZE 65536
+
+struct slab_allocator;
+
+// precedes every block handed out by slab_alloc, 16 bytes keeps alignment
+typedef struct slab_header {
+    struct slab_allocator *owner; // NULL if block was allocated by malloc
+    size_t capacity; // usable bytes following the header
+} SlabHeader;
+
+typedef struct slab_page {
+    struct slab_page *next;
+} SlabPage;
+
+typedef struct slab_allocator {
+    SlabHeader *free_lists[SLAB_N_CLASSES];
+    // blocks freed by other threads, drained by the owner
+    _Atomic(SlabHeader *) remote_free;
+    SlabPage *pages;
+    size_t n_pages;
+    // owner thread only
+    uint64_t n_allocs;
+    uint64_t n_fallbacks; // served by malloc (too large or no thread slab)
+} SlabAllocator;
+
+/** @brief Initialises slab allocator.
+ *
+ *  Slab allocator serves small allocations from per size class free lists,
+ *  carved from SLAB_PAGE_SIZE pages. Allocator is owned by one thread, bound
+ *  with slab_bind_thread, and is never locked.
+ *
+ *  @return SlabAllocator instance.
+ */
+SlabAllocator *init_slab_allocator();
+
+/** @brief Binds allocator to the calling thread.
+ *
+ *  Subsequent slab_alloc calls from the thread are served by sa. Threads
+ *  with no bound allocator fall back to malloc.
+ *
+ *  @param sa : SlabAllocator instance, or NULL to unbind.
+ */
+void slab_bind_thread(SlabAllocator *sa);
+
+/** @brief Allocates memory from the calling threads slab.
+ *
+ *  Sizes above SLAB_MAX_CLASS_SIZE, or calls from threads with no bound
+ *  allocator, are served by malloc. Either way, memory must be released
+ *  with slab_free. If allocation fails, perror is called and program exits
+ *  with status EXIT_FAILURE.
+ *
+ *  @param size : number of bytes to be allocated.
+ *  @return address of allocated memory.
+ */
+void *slab_alloc(size_t size);
+
+/** @brief Resizes memory allocated by slab_alloc.
+ *
+ *  If the block already holds size bytes it is returned unchanged. If old is
+ *  NULL, behaves as slab_alloc.
+ *
+ *  @param old : address of memory to be reallocated.
+ *  @param size : number of bytes to be allocated.
+ *  @return address of reallocated memory.
+ */
+void *slab_realloc(void *old, size_t size);
+
+/** @brief Releases memory allocated by slab_alloc.
+ *
+ *  Blocks freed by their owning thread are pushed onto its free list. Blocks
+ *  freed by any other thread are pushed onto the owners remote free stack
+ *  without locking. If p is NULL, nothing is done.
+ *
+ *  @param p : address of memory to be released.
+ */
+void slab_free(void *p);
+
+/** @brief Returns usable size of a block allocated by slab_alloc.
+ *
+ *  @param p : address of allocated memory.
+ *  @return usable bytes.
+ */
+size_t slab_capacity(void *p);
+
+/** @brief Destroys slab allocator.
+ *
+ *  All pages are released. Blocks still in use become invalid, so the
+ *  allocator must outlive every block it served.
+ *
+ *  @param sa : SlabAllocator instance.
+ */
+void destroy_slab_allocator(SlabAllocator *sa);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLAB_H
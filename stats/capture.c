@@ -0,0 +1,266 @@
+#include "capture.h"
+
+static const char base64_digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/** @brief Drainer thread.
+ *
+ *  Writes the records of every ring each CAPTURE_DRAIN_INTERVAL_MS. Thread
+ *  returns once cap is stopping.
+ *
+ *  @param arg : Capture instance.
+ */
+static void *drainer(void *arg);
+
+/** @brief Writes and removes the records of every ring.
+ *
+ *  Caller must hold cap->lock.
+ *
+ *  @param cap : Capture instance.
+ */
+static void drain_rings(Capture *cap);
+
+/** @brief Writes a record as a single line, and releases its payload.
+ *
+ *  @param cap : Capture instance.
+ *  @param record : Record.
+ */
+static void write_record(Capture *cap, CaptureRecord *record);
+
+/** @brief Encodes bytes as base64, null terminated.
+ *
+ *  @param src : Bytes to encode.
+ *  @param n : Number of bytes.
+ *  @param dest : At least 4 * ((n + 2) / 3) + 1 bytes.
+ */
+static void encode_base64(const uint8_t *src, size_t n, char *dest);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+Capture *init_capture(const char *path, uint64_t sample, size_t max_payload) {
+    FILE *out = path ? fopen(path, "w") : NULL;
+    if (!out) {
+        perror("unable to open capture trace");
+        return NULL;
+    }
+
+    Capture *cap = safe_malloc(sizeof(Capture));
+    cap->out = out;
+    cap->sample = sample ? sample : 1;
+    cap->max_payload = max_payload;
+    atomic_init(&cap->n_connections, 0);
+    cap->rings = NULL;
+    cap->n_dropped = 0;
+    cap->line = safe_malloc(4 * ((max_payload + 2) / 3) + 1);
+    cap->stopping = false;
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cap->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cap->start_ns = monotonic_ns();
+    struct tm tm;
+    gmtime_r(&ts.tv_sec, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    fprintf(out, "{\"capture\": %d, \"started\": \"%s.%06luZ\", "
+            "\"sample\": %lu, \"max_payload\": %lu}\n", CAPTURE_VERSION, when,
+            (unsigned long) (ts.tv_nsec / 1000), (unsigned long) cap->sample,
+            (unsigned long) max_payload);
+    fflush(out);
+
+    if (pthread_create(&cap->drainer, NULL, drainer, cap)) {
+        printf("unable to initialise capture!\n");
+        exit(EXIT_FAILURE);
+    }
+    return cap;
+}
+
+CaptureRing *init_capture_ring(Capture *cap) {
+    if (!cap) {
+        return NULL;
+    }
+
+    // zeroed, and padded to whole cache lines
+    CaptureRing *ring = safe_aligned_calloc(STATS_CACHE_LINE,
+            sizeof(CaptureRing));
+
+    pthread_mutex_lock(&cap->lock);
+    ring->next = cap->rings;
+    cap->rings = ring;
+    pthread_mutex_unlock(&cap->lock);
+    return ring;
+}
+
+uint64_t capture_connection(Capture *cap) {
+    if (!cap) {
+        return 0;
+    }
+
+    uint64_t n = atomic_fetch_add_explicit(&cap->n_connections, 1,
+            memory_order_relaxed);
+    return n % cap->sample ? 0 : n + 1;
+}
+
+void capture_request(CaptureRing *ring, uint64_t connection,
+        uint64_t arrived_ns, uint8_t header, uint64_t payload_len,
+        uint8_t *block, const uint8_t *payload) {
+    if (!ring || !connection) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == CAPTURE_RING_LEN) {
+        atomic_store_explicit(&ring->n_dropped, atomic_load_explicit(
+                &ring->n_dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    CaptureRecord *record = &ring->records[head & (CAPTURE_RING_LEN - 1)];
+    record->arrived_ns = arrived_ns;
+    record->connection = connection;
+    record->payload_len = payload_len;
+    record->block = payload ? buffer_retain(block) : NULL;
+    record->payload = payload;
+    record->header = header;
+    // record may not be seen before the head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return;
+}
+
+static void *drainer(void *arg) {
+    Capture *cap = (Capture *) arg;
+
+    pthread_mutex_lock(&cap->lock);
+    while (!cap->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += CAPTURE_DRAIN_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&cap->cond, &cap->lock, &deadline);
+        if (!cap->stopping) {
+            drain_rings(cap);
+        }
+    }
+    pthread_mutex_unlock(&cap->lock);
+    return NULL;
+}
+
+static void drain_rings(Capture *cap) {
+    uint64_t n_dropped = 0;
+    bool written = false;
+    // handlers are drained in turn, so lines are ordered per connection only
+    for (CaptureRing *ring = cap->rings; ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            write_record(cap, &ring->records[tail & (CAPTURE_RING_LEN - 1)]);
+            ++tail;
+            written = true;
+        }
+        // slots may not be reused before they are written out
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        n_dropped += atomic_load_explicit(&ring->n_dropped,
+                memory_order_relaxed);
+    }
+
+    if (n_dropped != cap->n_dropped) {
+        fprintf(cap->out, "{\"dropped\": %lu}\n",
+                (unsigned long) (n_dropped - cap->n_dropped));
+        cap->n_dropped = n_dropped;
+        written = true;
+    }
+    if (written) {
+        fflush(cap->out);
+    }
+    return;
+}
+
+static void write_record(Capture *cap, CaptureRecord *record) {
+    size_t n_kept = 0;
+    if (record->payload) {
+        n_kept = record->payload_len < cap->max_payload ?
+                record->payload_len : cap->max_payload;
+    }
+    encode_base64(record->payload, n_kept, cap->line);
+
+    uint64_t t_us = record->arrived_ns > cap->start_ns ?
+            (record->arrived_ns - cap->start_ns) / 1000 : 0;
+    fprintf(cap->out, "{\"t_us\": %lu, \"conn\": %lu, \"type\": %d, "
+            "\"compressed\": %s, \"requires_compression\": %s, "
+            "\"payload_len\": %lu, \"payload\": \"%s\"%s}\n",
+            (unsigned long) t_us, (unsigned long) record->connection,
+            record->header >> 4, record->header & 0x08 ? "true" : "false",
+            record->header & 0x04 ? "true" : "false",
+            (unsigned long) record->payload_len, cap->line,
+            n_kept < record->payload_len ? ", \"truncated\": true" : "");
+    buffer_release(record->block);
+    record->block = NULL;
+    return;
+}
+
+static void encode_base64(const uint8_t *src, size_t n, char *dest) {
+    size_t i = 0;
+    for (; i + 2 < n; i += 3) {
+        uint32_t v = (uint32_t) src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+        *dest++ = base64_digits[v >> 18];
+        *dest++ = base64_digits[(v >> 12) & 0x3f];
+        *dest++ = base64_digits[(v >> 6) & 0x3f];
+        *dest++ = base64_digits[v & 0x3f];
+    }
+    if (i < n) {
+        // one or two bytes left, padded to a whole group
+        uint32_t v = (uint32_t) src[i] << 16 |
+                (i + 1 < n ? src[i + 1] << 8 : 0);
+        *dest++ = base64_digits[v >> 18];
+        *dest++ = base64_digits[(v >> 12) & 0x3f];
+        *dest++ = i + 1 < n ? base64_digits[(v >> 6) & 0x3f] : '=';
+        *dest++ = '=';
+    }
+    *dest = '\0';
+    return;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void destroy_capture(Capture *cap) {
+    if (!cap) {
+        return;
+    }
+
+    pthread_mutex_lock(&cap->lock);
+    cap->stopping = true;
+    pthread_cond_broadcast(&cap->cond);
+    pthread_mutex_unlock(&cap->lock);
+    pthread_join(cap->drainer, NULL);
+
+    // handlers have stopped, so the rings are final
+    drain_rings(cap);
+    CaptureRing *ring = cap->rings;
+    while (ring) {
+        CaptureRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    fclose(cap->out);
+    free(cap->line);
+    pthread_mutex_destroy(&cap->lock);
+    pthread_cond_destroy(&cap->cond);
+    free(cap);
+    return;
+}
@@ -0,0 +1,123 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_CAPTURE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_CAPTURE_H
+
+#include "stats.h"
+#include "../memory/memory.h"
+#include "../memory/buffer_pool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define CAPTURE_VERSION 1 // trace format, see init_capture
+#define CAPTURE_RING_LEN 1024 // records per handler, a power of two
+#define CAPTURE_DRAIN_INTERVAL_MS 100
+
+// a request of a sampled connection. payload is referenced, not copied
+typedef struct {
+    uint64_t arrived_ns; // monotonic ns the first byte was read
+    uint64_t connection; // capture id of the connection
+    uint64_t payload_len; // declared length
+    uint8_t *block; // retained pooled buffer holding the payload, may be NULL
+    const uint8_t *payload; // NULL if the payload was streamed
+    uint8_t header;
+} CaptureRecord;
+
+// single producer, single consumer, as SlowLogRing
+typedef struct capture_ring {
+    _Alignas(STATS_CACHE_LINE)
+    atomic_size_t head; // records pushed, written by the handler thread
+    atomic_uint_fast64_t n_dropped; // pushed while full
+    _Alignas(STATS_CACHE_LINE)
+    atomic_size_t tail; // records drained, written by the drainer
+    CaptureRecord records[CAPTURE_RING_LEN];
+    struct capture_ring *next; // capture link
+} CaptureRing;
+
+typedef struct {
+    FILE *out;
+    uint64_t sample; // one in this many connections is recorded
+    size_t max_payload; // payload bytes written per request
+    atomic_uint_fast64_t n_connections; // connections seen, sampled or not
+    CaptureRing *rings;
+    uint64_t n_dropped; // drainer only, drops already written
+    uint64_t start_ns; // monotonic ns request times are relative to
+    char *line; // drainer only, base64 of a payload
+    pthread_t drainer;
+    bool stopping;
+    pthread_mutex_t lock; // guards rings and stopping
+    pthread_cond_t cond; // wakes the drainer on shutdown
+} Capture;
+
+/** @brief Starts recording requests to a trace file.
+ *
+ *  Trace is JSON lines, truncating the file. The first line describes the
+ *  capture, {"capture": CAPTURE_VERSION, "started": <utc>, "sample": n,
+ *  "max_payload": n}, each following line is a request, {"t_us": <us since
+ *  start>, "conn": <id>, "type": n, "compressed": b, "requires_compression":
+ *  b, "payload_len": n, "payload": <base64>}, with "truncated": true if
+ *  fewer than payload_len bytes were kept. Lines of the form {"dropped": n}
+ *  count requests lost while a ring was full. A drainer thread writes
+ *  records pushed by the handlers every CAPTURE_DRAIN_INTERVAL_MS. If the
+ *  file cannot be opened, error is printed and NULL is returned, the server
+ *  runs without it.
+ *
+ *  @param path : Trace file path.
+ *  @param sample : One in this many connections is recorded.
+ *  @param max_payload : Payload bytes kept per request.
+ *  @return Capture instance, NULL on error.
+ */
+Capture *init_capture(const char *path, uint64_t sample, size_t max_payload);
+
+/** @brief Creates a ring for a handler to push records onto.
+ *
+ *  Ring is owned by the capture. If cap is NULL, NULL is returned.
+ *
+ *  @param cap : Capture instance.
+ *  @return CaptureRing instance.
+ */
+CaptureRing *init_capture_ring(Capture *cap);
+
+/** @brief Decides whether a new connection is recorded.
+ *
+ *  Connections are sampled in the order they are seen, by any thread. If
+ *  cap is NULL, 0 is returned.
+ *
+ *  @param cap : Capture instance.
+ *  @return capture id of the connection, 0 if it is not recorded.
+ */
+uint64_t capture_connection(Capture *cap);
+
+/** @brief Records a request of a sampled connection.
+ *
+ *  A reference to block is taken, released once written out, so the
+ *  payload must not be changed after. If the ring is full, the request is
+ *  dropped and counted. If ring is NULL or connection is 0, nothing is done.
+ *  Only the owning handler thread may record.
+ *
+ *  @param ring : CaptureRing of the calling handler.
+ *  @param connection : Capture id of the connection.
+ *  @param arrived_ns : Monotonic ns the request started arriving.
+ *  @param header : Header byte of the request.
+ *  @param payload_len : Declared payload length.
+ *  @param block : Pooled buffer holding the payload, may be NULL.
+ *  @param payload : Payload within block, NULL if it was not kept.
+ */
+void capture_request(CaptureRing *ring, uint64_t connection,
+        uint64_t arrived_ns, uint8_t header, uint64_t payload_len,
+        uint8_t *block, const uint8_t *payload);
+
+/** @brief Stops recording.
+ *
+ *  Drainer is stopped, and records still on the rings are written. No
+ *  handler may record after. If cap is NULL, nothing is done.
+ *
+ *  @param cap : Capture instance.
+ */
+void destroy_capture(Capture *cap);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_CAPTURE_H
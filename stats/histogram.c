@@ -0,0 +1,78 @@
+#include "histogram.h"
+
+/** @brief Returns the bucket of a value.
+ *
+ *  @param value : Recorded value.
+ *  @return bucket index.
+ */
+static size_t bucket_of(uint64_t value);
+
+/** @brief Returns the largest value held by a bucket.
+ *
+ *  @param bucket : Bucket index.
+ *  @return upper bound of the bucket.
+ */
+static uint64_t bucket_upper_bound(size_t bucket);
+
+static size_t bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_LEN) {
+        return value;
+    }
+    // power of two, then the linear step within it
+    unsigned exponent = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) &
+            (HISTOGRAM_SUB_LEN - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_LEN + sub;
+}
+
+static uint64_t bucket_upper_bound(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_LEN) {
+        return bucket;
+    }
+    unsigned shift = bucket / HISTOGRAM_SUB_LEN - 1;
+    uint64_t lower = (uint64_t) (HISTOGRAM_SUB_LEN + bucket %
+            HISTOGRAM_SUB_LEN) << shift;
+    return lower + (((uint64_t) 1 << shift) - 1);
+}
+
+void histogram_record(Histogram *hist, uint64_t value) {
+    atomic_uint_fast64_t *bucket = &hist->buckets[bucket_of(value)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket,
+            memory_order_relaxed) + 1, memory_order_relaxed);
+    return;
+}
+
+void histogram_merge(uint64_t *dest, Histogram *hist) {
+    for (size_t i = 0; i < HISTOGRAM_LEN; ++i) {
+        dest[i] += atomic_load_explicit(&hist->buckets[i],
+                memory_order_relaxed);
+    }
+    return;
+}
+
+uint64_t histogram_count(const uint64_t *buckets) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < HISTOGRAM_LEN; ++i) {
+        count += buckets[i];
+    }
+    return count;
+}
+
+uint64_t histogram_percentile(const uint64_t *buckets, uint64_t per_100k) {
+    uint64_t count = histogram_count(buckets);
+    if (!count) {
+        return 0;
+    }
+
+    // rank of the value at the percentile, rounded up
+    uint64_t rank = (count * per_100k + 99999) / 100000;
+    rank = rank ? rank : 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_LEN; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return bucket_upper_bound(i);
+        }
+    }
+    return bucket_upper_bound(HISTOGRAM_LEN - 1);
+}
@@ -0,0 +1,54 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_HISTOGRAM_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// log linear buckets, each power of two is split into 2^HISTOGRAM_SUB_BITS
+// linear buckets, so recorded values are within 12.5% of their bucket
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_LEN (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_LEN ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_LEN)
+
+// written by a single thread, read by any
+typedef struct {
+    atomic_uint_fast64_t buckets[HISTOGRAM_LEN];
+} Histogram;
+
+/** @brief Records a value.
+ *
+ *  Must only be called by the thread owning the histogram. Costs one bit
+ *  scan and a relaxed load and store.
+ *
+ *  @param hist : Histogram instance.
+ *  @param value : Value to record.
+ */
+void histogram_record(Histogram *hist, uint64_t value);
+
+/** @brief Adds the buckets of a histogram into a merged view.
+ *
+ *  @param dest : HISTOGRAM_LEN buckets to add into.
+ *  @param hist : Histogram instance.
+ */
+void histogram_merge(uint64_t *dest, Histogram *hist);
+
+/** @brief Returns the number of values held by merged buckets.
+ *
+ *  @param buckets : HISTOGRAM_LEN buckets.
+ *  @return number of values.
+ */
+uint64_t histogram_count(const uint64_t *buckets);
+
+/** @brief Returns a percentile of merged buckets.
+ *
+ *  Result is the upper bound of the bucket holding the percentile. If no
+ *  values are held, 0 is returned.
+ *
+ *  @param buckets : HISTOGRAM_LEN buckets.
+ *  @param per_100k : Percentile, in thousandths of a percent (99900 is p99.9).
+ *  @return value at the percentile.
+ */
+uint64_t histogram_percentile(const uint64_t *buckets, uint64_t per_100k);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_HISTOGRAM_H
@@ -0,0 +1,130 @@
+#include "metrics_segment.h"
+
+MetricsSegment *init_metrics_segment(const char *name, size_t n_handlers) {
+    if (!name || strlen(name) >= METRICS_SEGMENT_NAME_LEN) {
+        return NULL;
+    }
+
+    size_t size = sizeof(MetricsSegment) +
+            n_handlers * sizeof(MetricsHandlerSlot);
+    int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("unable to create metrics segment");
+        return NULL;
+    }
+    // truncated segments read as zeroes
+    if (ftruncate(fd, size) < 0) {
+        perror("unable to size metrics segment");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    MetricsSegment *ms = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (ms == MAP_FAILED) {
+        perror("unable to map metrics segment");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ms->version = METRICS_SEGMENT_VERSION;
+    ms->size = size;
+    ms->pid = getpid();
+    ms->n_handlers = n_handlers;
+    ms->histogram_len = HISTOGRAM_LEN;
+    strcpy(ms->name, name);
+    atomic_store_explicit(&ms->magic, METRICS_SEGMENT_MAGIC,
+            memory_order_release);
+    return ms;
+}
+
+MetricsHandlerSlot *metrics_segment_handler(MetricsSegment *ms, size_t i) {
+    if (!ms || i >= ms->n_handlers) {
+        return NULL;
+    }
+    return &ms->handlers[i];
+}
+
+MetricsGroupSlot *metrics_segment_group(MetricsSegment *ms) {
+    return ms ? &ms->group : NULL;
+}
+
+void metrics_write_begin(atomic_uint_fast64_t *seq) {
+    uint64_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    // slot writes may not be seen before the odd sequence
+    atomic_thread_fence(memory_order_release);
+    return;
+}
+
+void metrics_write_end(atomic_uint_fast64_t *seq) {
+    uint64_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_release);
+    return;
+}
+
+int metrics_read(atomic_uint_fast64_t *seq, void *dest,
+        const void *slot, size_t n) {
+    for (size_t i = 0; i < METRICS_READ_ATTEMPTS; ++i) {
+        uint64_t before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(dest, slot, n);
+        // copy may not be seen after the sequence is checked again
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+MetricsSegment *open_metrics_segment(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(MetricsSegment)) {
+        close(fd);
+        return NULL;
+    }
+    MetricsSegment *ms = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ms == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&ms->magic, memory_order_acquire) !=
+            METRICS_SEGMENT_MAGIC || ms->version != METRICS_SEGMENT_VERSION ||
+            ms->size != (uint64_t) st.st_size || ms->size !=
+            sizeof(MetricsSegment) + ms->n_handlers *
+            sizeof(MetricsHandlerSlot) ||
+            ms->histogram_len != HISTOGRAM_LEN) {
+        munmap(ms, st.st_size);
+        return NULL;
+    }
+    return ms;
+}
+
+void close_metrics_segment(MetricsSegment *ms) {
+    if (!ms) {
+        return;
+    }
+
+    munmap(ms, ms->size);
+    return;
+}
+
+void destroy_metrics_segment(MetricsSegment *ms) {
+    if (!ms) {
+        return;
+    }
+
+    shm_unlink(ms->name);
+    munmap(ms, ms->size);
+    return;
+}
@@ -0,0 +1,144 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METRICS_SEGMENT_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METRICS_SEGMENT_H
+
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define METRICS_SEGMENT_MAGIC 0x4a584d4554524943 // "JXMETRIC"
+#define METRICS_SEGMENT_VERSION 3 // bumped whenever the layout changes
+#define METRICS_SEGMENT_NAME_LEN 64
+#define METRICS_PUBLISH_INTERVAL_MS 100 // handler slots refreshed at most this often
+#define METRICS_READ_ATTEMPTS 64 // reads retried while a slot is being written
+
+// every slot is written by a single thread under a seqlock, the sequence is
+// odd while a write is in progress. slots are aligned so no two writers
+// share a cache line
+
+typedef struct {
+    _Alignas(STATS_CACHE_LINE)
+    atomic_uint_fast64_t seq;
+    uint64_t published_ns; // monotonic ns of the last publish, 0 if never
+    uint64_t n_awake; // handlers [0, n_awake) are given connections
+    uint64_t n_parks;
+    uint64_t n_wakes;
+} MetricsGroupSlot;
+
+typedef struct {
+    _Alignas(STATS_CACHE_LINE)
+    atomic_uint_fast64_t seq;
+    uint64_t published_ns; // monotonic ns of the last publish, 0 if never
+    uint64_t n_connections;
+    uint64_t n_migrated;
+    uint64_t n_budget_used; // bytes charged to the handler memory budget
+    uint64_t busy_ns; // time spent handling events
+    StatsTotals totals; // counters and latency histograms of the handler thread
+} MetricsHandlerSlot;
+
+// layout of the shared memory segment, the header is written once before
+// any slot is published
+typedef struct {
+    _Alignas(STATS_CACHE_LINE)
+    atomic_uint_fast64_t magic; // stored last, once the header is valid
+    uint64_t version;
+    uint64_t size; // bytes of the segment
+    uint64_t pid; // publishing server
+    uint64_t n_handlers;
+    uint64_t histogram_len; // buckets per latency histogram
+    char name[METRICS_SEGMENT_NAME_LEN];
+    MetricsGroupSlot group; // written by the handler group balancer
+    MetricsHandlerSlot handlers[]; // written by each handler thread
+} MetricsSegment;
+
+/** @brief Creates and maps a shared memory metrics segment.
+ *
+ *  Segment is created with shm_open, replacing any segment left under the
+ *  same name, and is readable by other users. Slots are zeroed until first
+ *  published. If the segment cannot be created, error is printed and NULL
+ *  is returned, the server runs without it.
+ *
+ *  @param name : Segment name, a leading slash and no others.
+ *  @param n_handlers : Number of handler slots.
+ *  @return MetricsSegment instance, NULL on error.
+ */
+MetricsSegment *init_metrics_segment(const char *name, size_t n_handlers);
+
+/** @brief Returns the slot of a handler.
+ *
+ *  @param ms : MetricsSegment instance, may be NULL.
+ *  @param i : Handler index.
+ *  @return slot, NULL if ms is NULL or i is out of range.
+ */
+MetricsHandlerSlot *metrics_segment_handler(MetricsSegment *ms, size_t i);
+
+/** @brief Returns the handler group slot.
+ *
+ *  @param ms : MetricsSegment instance, may be NULL.
+ *  @return slot, NULL if ms is NULL.
+ */
+MetricsGroupSlot *metrics_segment_group(MetricsSegment *ms);
+
+/** @brief Opens a slot for writing.
+ *
+ *  Readers retry until metrics_write_end is called. Only the owner of the
+ *  slot may write it.
+ *
+ *  @param seq : Sequence of the slot.
+ */
+void metrics_write_begin(atomic_uint_fast64_t *seq);
+
+/** @brief Publishes a slot opened with metrics_write_begin.
+ *
+ *  @param seq : Sequence of the slot.
+ */
+void metrics_write_end(atomic_uint_fast64_t *seq);
+
+/** @brief Copies a consistent view of a slot.
+ *
+ *  Copy is retried while the slot is being written, up to
+ *  METRICS_READ_ATTEMPTS times. Never blocks the writer.
+ *
+ *  @param seq : Sequence of the slot.
+ *  @param dest : Buffer of n bytes.
+ *  @param slot : Slot to copy.
+ *  @param n : Size of the slot.
+ *  @return 0 on success, -1 if no consistent copy was made.
+ */
+int metrics_read(atomic_uint_fast64_t *seq, void *dest,
+        const void *slot, size_t n);
+
+/** @brief Maps an existing metrics segment read only.
+ *
+ *  Segment must have a matching magic, version and layout.
+ *
+ *  @param name : Segment name.
+ *  @return MetricsSegment instance, NULL on error.
+ */
+MetricsSegment *open_metrics_segment(const char *name);
+
+/** @brief Unmaps a segment opened with open_metrics_segment.
+ *
+ *  If ms is NULL, nothing is done.
+ *
+ *  @param ms : MetricsSegment instance.
+ */
+void close_metrics_segment(MetricsSegment *ms);
+
+/** @brief Unmaps and removes a segment created with init_metrics_segment.
+ *
+ *  Readers holding the segment mapped keep their view. If ms is NULL,
+ *  nothing is done.
+ *
+ *  @param ms : MetricsSegment instance.
+ */
+void destroy_metrics_segment(MetricsSegment *ms);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_METRICS_SEGMENT_H
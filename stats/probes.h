@@ -0,0 +1,48 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROBES_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROBES_H
+
+// static tracepoints of the jxserver provider. each probe is a single nop
+// until a tracer attaches, e.g.
+//
+//     bpftrace -e 'usdt:./jxserver:jxserver:request__dispatch
+//             { @types[arg1] = count(); }'
+//
+// probes (arguments in order):
+//     accept - fd.
+//     request__parsed - fd, type, payload bytes. header read.
+//     request__dispatch - fd, type, payload bytes, compressed (bit 1) and
+//         requires compression (bit 0) flags.
+//     compress__start - bytes in.
+//     compress__end - bytes in, bytes out.
+//     decompress__start - bytes in.
+//     decompress__end - bytes in, bytes out.
+//     file__open - session id, offset, bytes requested.
+//     file__chunk - session id, offset, bytes. chunk loaded for writing.
+//     responce__done - fd, type, bytes. last byte written.
+//
+// built without <sys/sdt.h> (systemtap-sdt-dev), or with JX_NO_PROBES
+// defined, probes compile to nothing
+
+#if !defined(JX_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define JX_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef JX_PROBES_ENABLED
+#define JX_PROBE1(name, a) DTRACE_PROBE1(jxserver, name, a)
+#define JX_PROBE2(name, a, b) DTRACE_PROBE2(jxserver, name, a, b)
+#define JX_PROBE3(name, a, b, c) DTRACE_PROBE3(jxserver, name, a, b, c)
+#define JX_PROBE4(name, a, b, c, d) DTRACE_PROBE4(jxserver, name, a, b, c, d)
+#else
+// arguments are still type checked, and optimised out
+#define JX_PROBE1(name, a) do { (void) (a); } while (0)
+#define JX_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define JX_PROBE3(name, a, b, c) \
+        do { (void) (a); (void) (b); (void) (c); } while (0)
+#define JX_PROBE4(name, a, b, c, d) \
+        do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#endif
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROBES_H
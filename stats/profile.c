@@ -0,0 +1,204 @@
+#include "profile.h"
+
+static atomic_bool profiling = false;
+static __thread uint8_t thread_type = STATS_N_TYPES;
+static __thread RequestTrace *thread_trace = NULL;
+
+static const char *type_names[STATS_N_TIMED_TYPES] = {
+        "echo", "listdir", "filesize", "retfile"
+};
+
+static const char *phase_names[STATS_N_PHASES] = {
+        "parse", "decompress", "lookup", "disk read", "compress", "write"
+};
+
+/** @brief Reads the profile clock.
+ *
+ *  @return ticks.
+ */
+static uint64_t read_ticks();
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+/** @brief Reporter thread.
+ *
+ *  Waits for PROFILE_REPORT_SIGNAL, printing a report to stdout on each.
+ *  Thread returns once cancelled.
+ *
+ *  @param arg : Profiler instance.
+ */
+static void *report_on_signal(void *arg);
+
+Profiler *init_profiler(StatsRegistry *sr) {
+    if (!sr) {
+        return NULL;
+    }
+
+    Profiler *p = safe_malloc(sizeof(Profiler));
+    p->stats = sr;
+    p->start_ticks = read_ticks();
+    p->start_ns = monotonic_ns();
+
+    // taken by the reporter only, threads created later inherit the mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, PROFILE_REPORT_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&p->reporter, NULL, report_on_signal, p)) {
+        printf("unable to initialise profiler!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    profile_enable();
+    return p;
+}
+
+void profile_enable() {
+    atomic_store_explicit(&profiling, true, memory_order_relaxed);
+    return;
+}
+
+void profile_set_request(uint8_t type, RequestTrace *trace) {
+    thread_type = type;
+    thread_trace = trace;
+    return;
+}
+
+void profile_note_file(const char *name, uint64_t offset, uint64_t length) {
+    RequestTrace *trace = thread_trace;
+    if (!trace || !name) {
+        return;
+    }
+
+    strncpy(trace->name, name, NAME_MAX);
+    trace->name[NAME_MAX] = '\0';
+    trace->offset = offset;
+    trace->length = length;
+    return;
+}
+
+uint64_t profile_start() {
+    if (!atomic_load_explicit(&profiling, memory_order_relaxed)) {
+        return 0;
+    }
+    return read_ticks();
+}
+
+uint64_t profile_elapsed(uint64_t start) {
+    return start ? read_ticks() - start : 0;
+}
+
+void profile_end(enum StatsPhase phase, uint64_t start) {
+    if (!start) {
+        return;
+    }
+
+    uint64_t ticks = read_ticks() - start;
+    stats_record_phase(thread_type, phase, ticks);
+    if (thread_trace && phase < STATS_N_PHASES) {
+        thread_trace->phase_ticks[phase] += ticks;
+    }
+    return;
+}
+
+static uint64_t read_ticks() {
+#ifdef PROFILE_TSC
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profiler_report(Profiler *p, FILE *out) {
+    if (!p || !out) {
+        return;
+    }
+
+    StatsTotals *totals = safe_malloc(sizeof(StatsTotals));
+    stats_collect(p->stats, totals);
+
+    // tsc rate measured over the whole run
+    uint64_t elapsed_ns = monotonic_ns() - p->start_ns;
+    double ticks_per_ns = elapsed_ns ?
+            (double) (read_ticks() - p->start_ticks) / elapsed_ns : 1;
+#ifdef PROFILE_TSC
+    fprintf(out, "profile over %.1f s, ticks are tsc cycles, %.3f per ns\n",
+            elapsed_ns / 1e9, ticks_per_ns);
+#else
+    fprintf(out, "profile over %.1f s, ticks are nanoseconds\n",
+            elapsed_ns / 1e9);
+#endif
+    fprintf(out, "%-9s %-10s %10s %10s %11s %10s %10s %6s\n", "TYPE", "PHASE",
+            "CALLS", "REQUESTS", "TICKS/REQ", "NS/REQ", "NS/CALL", "SHARE");
+
+    for (size_t t = 0; t < STATS_N_TIMED_TYPES; ++t) {
+        uint64_t n_requests = totals->n_messages[t << 1];
+        uint64_t type_ticks = 0;
+        for (size_t ph = 0; ph < STATS_N_PHASES; ++ph) {
+            type_ticks += totals->phase_ticks[t][ph];
+        }
+        if (!type_ticks) {
+            continue;
+        }
+
+        for (size_t ph = 0; ph < STATS_N_PHASES; ++ph) {
+            uint64_t ticks = totals->phase_ticks[t][ph];
+            uint64_t n_calls = totals->phase_calls[t][ph];
+            if (!n_calls) {
+                continue;
+            }
+            double per_request = n_requests ? (double) ticks / n_requests : 0;
+            fprintf(out, "%-9s %-10s %10lu %10lu %11.0f %10.0f %10.0f "
+                    "%5.1f%%\n", type_names[t], phase_names[ph],
+                    (unsigned long) n_calls, (unsigned long) n_requests,
+                    per_request, per_request / ticks_per_ns,
+                    (double) ticks / n_calls / ticks_per_ns,
+                    100.0 * ticks / type_ticks);
+        }
+    }
+    fflush(out);
+    free(totals);
+    return;
+}
+
+static void *report_on_signal(void *arg) {
+    Profiler *p = (Profiler *) arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, PROFILE_REPORT_SIGNAL);
+    int sig = 0;
+    // cancelled while waiting only, never part way through a report
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (1) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int ret = sigwait(&set, &sig);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (ret == 0) {
+            profiler_report(p, stdout);
+        }
+    }
+    return NULL;
+}
+
+void destroy_profiler(Profiler *p) {
+    if (!p) {
+        return;
+    }
+
+    pthread_cancel(p->reporter);
+    pthread_join(p->reporter, NULL);
+    profiler_report(p, stdout);
+    free(p);
+    return;
+}
@@ -0,0 +1,126 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROFILE_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROFILE_H
+
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+// ticks are read from the time stamp counter where there is one, and are
+// nanoseconds of the monotonic clock otherwise
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_TSC 1
+#endif
+
+#define PROFILE_REPORT_SIGNAL SIGUSR1
+
+// a single request, followed across the threads it is handled on. only
+// touched by the thread handling the request at the time
+typedef struct {
+    uint64_t phase_ticks[STATS_N_PHASES];
+    uint64_t payload_len; // bytes of the request payload
+    uint64_t offset; // RetFile byte range
+    uint64_t length;
+    uint64_t latency_ns; // request read to last byte written
+    uint64_t finished_ns; // realtime ns the last byte was written
+    uint8_t type; // header type of the request
+    uint8_t flags; // compressed (bit 1) and requires compression (bit 0)
+    char name[NAME_MAX + 1]; // FileSize and RetFile, empty otherwise
+} RequestTrace;
+
+typedef struct {
+    StatsRegistry *stats; // phases are counted with the other stats
+    pthread_t reporter; // prints a report on each PROFILE_REPORT_SIGNAL
+    uint64_t start_ticks; // clock at init, to convert ticks to nanoseconds
+    uint64_t start_ns;
+} Profiler;
+
+/** @brief Starts profiling.
+ *
+ *  Phases timed by any thread are counted from now on. PROFILE_REPORT_SIGNAL
+ *  is blocked in the calling thread and taken by a reporter thread, so this
+ *  must be called before any other thread is created, as they inherit the
+ *  mask. If sr is NULL, NULL is returned.
+ *
+ *  @param sr : StatsRegistry the phases are counted in.
+ *  @return Profiler instance.
+ */
+Profiler *init_profiler(StatsRegistry *sr);
+
+/** @brief Turns phase timing on.
+ *
+ *  Phases are timed while profiling or logging slow requests.
+ */
+void profile_enable();
+
+/** @brief Sets the request later phases of the calling thread are charged
+ *  to.
+ *
+ *  @param type : Header type of the request or its responce.
+ *  @param trace : RequestTrace phases are also added to, may be NULL.
+ */
+void profile_set_request(uint8_t type, RequestTrace *trace);
+
+/** @brief Notes the file requested by the current request of the calling
+ *  thread.
+ *
+ *  Name is truncated to NAME_MAX. If the request has no trace, nothing is
+ *  done.
+ *
+ *  @param name : File name.
+ *  @param offset : First byte requested.
+ *  @param length : Bytes requested.
+ */
+void profile_note_file(const char *name, uint64_t offset, uint64_t length);
+
+/** @brief Reads the clock at the start of a phase.
+ *
+ *  Costs a single branch while phases are not timed.
+ *
+ *  @return ticks, 0 if phases are not timed.
+ */
+uint64_t profile_start();
+
+/** @brief Returns the ticks since a phase started.
+ *
+ *  @param start : Ticks returned by profile_start.
+ *  @return ticks, 0 if start is 0.
+ */
+uint64_t profile_elapsed(uint64_t start);
+
+/** @brief Charges a phase to the current request of the calling thread.
+ *
+ *  If start is 0, nothing is done (see profile_set_request).
+ *
+ *  @param phase : Phase ended.
+ *  @param start : Ticks returned by profile_start.
+ */
+void profile_end(enum StatsPhase phase, uint64_t start);
+
+/** @brief Prints the ticks of each phase per request type.
+ *
+ *  Totals are merged from every thread, without stopping them. Per request
+ *  costs divide by the requests of the type received.
+ *
+ *  @param p : Profiler instance.
+ *  @param out : Stream the report is printed to.
+ */
+void profiler_report(Profiler *p, FILE *out);
+
+/** @brief Stops profiling and prints a final report to stdout.
+ *
+ *  If p is NULL, nothing is done.
+ *
+ *  @param p : Profiler instance.
+ */
+void destroy_profiler(Profiler *p);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_PROFILE_H
@@ -0,0 +1,237 @@
+#include "slow_log.h"
+
+static const char *type_names[STATS_N_TIMED_TYPES] = {
+        "echo", "listdir", "filesize", "retfile"
+};
+
+static const char *phase_names[STATS_N_PHASES] = {
+        "parse", "decompress", "lookup", "disk_read", "compress", "write"
+};
+
+/** @brief Drainer thread.
+ *
+ *  Writes the records of every ring each SLOW_LOG_DRAIN_INTERVAL_MS. Thread
+ *  returns once sl is stopping.
+ *
+ *  @param arg : SlowLog instance.
+ */
+static void *drainer(void *arg);
+
+/** @brief Writes and removes the records of every ring.
+ *
+ *  Caller must hold sl->lock.
+ *
+ *  @param sl : SlowLog instance.
+ */
+static void drain_rings(SlowLog *sl);
+
+/** @brief Writes a record as a single line.
+ *
+ *  @param sl : SlowLog instance.
+ *  @param trace : Record.
+ *  @param ticks_per_ns : Rate of the profile clock.
+ */
+static void write_record(SlowLog *sl, RequestTrace *trace,
+        double ticks_per_ns);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+SlowLog *init_slow_log(const char *path, uint64_t threshold_us) {
+    FILE *out = path ? fopen(path, "a") : NULL;
+    if (!out) {
+        perror("unable to open slow request log");
+        return NULL;
+    }
+
+    SlowLog *sl = safe_malloc(sizeof(SlowLog));
+    sl->out = out;
+    sl->threshold_ns = threshold_us * 1000;
+    sl->rings = NULL;
+    sl->n_dropped = 0;
+    sl->stopping = false;
+    pthread_mutex_init(&sl->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sl->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // requests are only traced while phases are timed
+    profile_enable();
+    sl->start_ticks = profile_start();
+    sl->start_ns = monotonic_ns();
+    if (pthread_create(&sl->drainer, NULL, drainer, sl)) {
+        printf("unable to initialise slow request log!\n");
+        exit(EXIT_FAILURE);
+    }
+    return sl;
+}
+
+SlowLogRing *init_slow_log_ring(SlowLog *sl) {
+    if (!sl) {
+        return NULL;
+    }
+
+    // zeroed, and padded to whole cache lines
+    SlowLogRing *ring = safe_aligned_calloc(STATS_CACHE_LINE,
+            sizeof(SlowLogRing));
+    ring->threshold_ns = sl->threshold_ns;
+
+    pthread_mutex_lock(&sl->lock);
+    ring->next = sl->rings;
+    sl->rings = ring;
+    pthread_mutex_unlock(&sl->lock);
+    return ring;
+}
+
+void slow_log_record(SlowLogRing *ring, RequestTrace *trace,
+        uint64_t latency_ns) {
+    if (!ring || !trace || latency_ns < ring->threshold_ns) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == SLOW_LOG_RING_LEN) {
+        atomic_store_explicit(&ring->n_dropped, atomic_load_explicit(
+                &ring->n_dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    RequestTrace *record = &ring->records[head & (SLOW_LOG_RING_LEN - 1)];
+    *record = *trace;
+    record->latency_ns = latency_ns;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->finished_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    // record may not be seen before the head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return;
+}
+
+static void *drainer(void *arg) {
+    SlowLog *sl = (SlowLog *) arg;
+
+    pthread_mutex_lock(&sl->lock);
+    while (!sl->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += SLOW_LOG_DRAIN_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&sl->cond, &sl->lock, &deadline);
+        if (!sl->stopping) {
+            drain_rings(sl);
+        }
+    }
+    pthread_mutex_unlock(&sl->lock);
+    return NULL;
+}
+
+static void drain_rings(SlowLog *sl) {
+    // tsc rate measured over the whole run
+    uint64_t elapsed_ns = monotonic_ns() - sl->start_ns;
+    double ticks_per_ns = elapsed_ns ?
+            (double) (profile_start() - sl->start_ticks) / elapsed_ns : 1;
+
+    uint64_t n_dropped = 0;
+    bool written = false;
+    for (SlowLogRing *ring = sl->rings; ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            write_record(sl, &ring->records[tail & (SLOW_LOG_RING_LEN - 1)],
+                    ticks_per_ns);
+            ++tail;
+            written = true;
+        }
+        // slots may not be reused before they are written out
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        n_dropped += atomic_load_explicit(&ring->n_dropped,
+                memory_order_relaxed);
+    }
+
+    if (n_dropped != sl->n_dropped) {
+        fprintf(sl->out, "dropped %lu slow requests, rings were full\n",
+                (unsigned long) (n_dropped - sl->n_dropped));
+        sl->n_dropped = n_dropped;
+        written = true;
+    }
+    if (written) {
+        fflush(sl->out);
+    }
+    return;
+}
+
+static void write_record(SlowLog *sl, RequestTrace *trace,
+        double ticks_per_ns) {
+    time_t seconds = trace->finished_ns / 1000000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    fprintf(sl->out, "%s.%06luZ %s %.3fms payload=%lu compressed=%d "
+            "requires_compression=%d", when,
+            (unsigned long) (trace->finished_ns % 1000000000 / 1000),
+            (trace->type >> 1) < STATS_N_TIMED_TYPES ?
+            type_names[trace->type >> 1] : "other",
+            trace->latency_ns / 1e6, (unsigned long) trace->payload_len,
+            (trace->flags >> 1) & 1, trace->flags & 1);
+    if (trace->name[0]) {
+        // names may hold any byte but a slash, so escape to keep one line
+        fprintf(sl->out, " file=\"");
+        for (const char *c = trace->name; *c; ++c) {
+            if (isprint((unsigned char) *c) && *c != '"' && *c != '\\') {
+                fputc(*c, sl->out);
+            } else {
+                fprintf(sl->out, "\\x%02x", (unsigned char) *c);
+            }
+        }
+        fprintf(sl->out, "\" offset=%lu length=%lu",
+                (unsigned long) trace->offset, (unsigned long) trace->length);
+    }
+    for (size_t i = 0; i < STATS_N_PHASES; ++i) {
+        fprintf(sl->out, " %s=%.1fus", phase_names[i],
+                trace->phase_ticks[i] / ticks_per_ns / 1e3);
+    }
+    fputc('\n', sl->out);
+    return;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void destroy_slow_log(SlowLog *sl) {
+    if (!sl) {
+        return;
+    }
+
+    pthread_mutex_lock(&sl->lock);
+    sl->stopping = true;
+    pthread_cond_broadcast(&sl->cond);
+    pthread_mutex_unlock(&sl->lock);
+    pthread_join(sl->drainer, NULL);
+
+    // handlers have stopped, so the rings are final
+    drain_rings(sl);
+    SlowLogRing *ring = sl->rings;
+    while (ring) {
+        SlowLogRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    fclose(sl->out);
+    pthread_mutex_destroy(&sl->lock);
+    pthread_cond_destroy(&sl->cond);
+    free(sl);
+    return;
+}
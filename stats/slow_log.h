@@ -0,0 +1,89 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLOW_LOG_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLOW_LOG_H
+
+#include "profile.h"
+#include "../memory/memory.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SLOW_LOG_RING_LEN 256 // records per handler, a power of two
+#define SLOW_LOG_DRAIN_INTERVAL_MS 100
+
+// single producer, single consumer. records are copied in by the handler
+// thread and out by the drainer, neither blocks the other
+typedef struct slow_log_ring {
+    _Alignas(STATS_CACHE_LINE)
+    atomic_size_t head; // records pushed, written by the handler thread
+    atomic_uint_fast64_t n_dropped; // pushed while full
+    uint64_t threshold_ns; // requests slower than this are logged
+    _Alignas(STATS_CACHE_LINE)
+    atomic_size_t tail; // records drained, written by the drainer
+    RequestTrace records[SLOW_LOG_RING_LEN];
+    struct slow_log_ring *next; // log link
+} SlowLogRing;
+
+typedef struct {
+    FILE *out;
+    uint64_t threshold_ns;
+    SlowLogRing *rings;
+    uint64_t n_dropped; // drainer only, drops already reported
+    uint64_t start_ticks; // profile clock at init, to convert ticks to ns
+    uint64_t start_ns;
+    pthread_t drainer;
+    bool stopping;
+    pthread_mutex_t lock; // guards rings and stopping
+    pthread_cond_t cond; // wakes the drainer on shutdown
+} SlowLog;
+
+/** @brief Opens the slow request log.
+ *
+ *  Log file is appended to. Phase timing is turned on (see profile_enable),
+ *  and a drainer thread writes records pushed by the handlers every
+ *  SLOW_LOG_DRAIN_INTERVAL_MS. If the file cannot be opened, error is
+ *  printed and NULL is returned, the server runs without it.
+ *
+ *  @param path : Log file path.
+ *  @param threshold_us : Requests slower than this are logged.
+ *  @return SlowLog instance, NULL on error.
+ */
+SlowLog *init_slow_log(const char *path, uint64_t threshold_us);
+
+/** @brief Creates a ring for a handler to push records onto.
+ *
+ *  Ring is owned by the log. If sl is NULL, NULL is returned.
+ *
+ *  @param sl : SlowLog instance.
+ *  @return SlowLogRing instance.
+ */
+SlowLogRing *init_slow_log_ring(SlowLog *sl);
+
+/** @brief Logs a finished request if it was slow.
+ *
+ *  Trace is copied onto the ring, nothing is allocated. If the ring is full,
+ *  the record is dropped and counted. If ring or trace is NULL, nothing is
+ *  done. Only the owning handler thread may record.
+ *
+ *  @param ring : SlowLogRing of the calling handler.
+ *  @param trace : RequestTrace of the request.
+ *  @param latency_ns : Nanoseconds from request read to last byte written.
+ */
+void slow_log_record(SlowLogRing *ring, RequestTrace *trace,
+        uint64_t latency_ns);
+
+/** @brief Closes the slow request log.
+ *
+ *  Drainer is stopped, and records still on the rings are written. No
+ *  handler may record after. If sl is NULL, nothing is done.
+ *
+ *  @param sl : SlowLog instance.
+ */
+void destroy_slow_log(SlowLog *sl);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_SLOW_LOG_H
@@ -0,0 +1,216 @@
+#include "stats.h"
+
+static __thread StatsCounters *thread_counters = NULL;
+
+/** @brief Adds to a counter written by a single thread.
+ *
+ *  Relaxed load and store, no read modify write is needed as only the owning
+ *  thread writes the counter.
+ *
+ *  @param counter : Counter address.
+ *  @param n : Amount to add.
+ */
+static void counter_add(atomic_uint_fast64_t *counter, uint64_t n);
+
+/** @brief Adds the counters of one thread into totals.
+ *
+ *  @param totals : StatsTotals to add into.
+ *  @param sc : StatsCounters of the thread.
+ */
+static void totals_add(StatsTotals *totals, StatsCounters *sc);
+
+StatsRegistry *init_stats_registry() {
+    StatsRegistry *sr = safe_malloc(sizeof(StatsRegistry));
+    sr->counters = NULL;
+    pthread_mutex_init(&sr->lock, NULL);
+    return sr;
+}
+
+StatsCounters *stats_bind_thread(StatsRegistry *sr) {
+    if (!sr) {
+        return NULL;
+    }
+
+    // zeroed, and padded to whole cache lines
+    StatsCounters *sc = safe_aligned_calloc(STATS_CACHE_LINE,
+            sizeof(StatsCounters));
+
+    pthread_mutex_lock(&sr->lock);
+    sc->next = sr->counters;
+    sr->counters = sc;
+    pthread_mutex_unlock(&sr->lock);
+
+    thread_counters = sc;
+    return sc;
+}
+
+static void counter_add(atomic_uint_fast64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter,
+            memory_order_relaxed) + n, memory_order_relaxed);
+    return;
+}
+
+void stats_count_message(uint8_t type, uint64_t n_bytes) {
+    StatsCounters *sc = thread_counters;
+    if (!sc || type >= STATS_N_TYPES) {
+        return;
+    }
+
+    counter_add(&sc->n_messages[type], 1);
+    counter_add(&sc->n_bytes[type], n_bytes);
+    return;
+}
+
+void stats_count_compression(uint64_t n_in, uint64_t n_out) {
+    StatsCounters *sc = thread_counters;
+    if (!sc) {
+        return;
+    }
+
+    counter_add(&sc->n_compress_in, n_in);
+    counter_add(&sc->n_compress_out, n_out);
+    return;
+}
+
+void stats_count_lookup(enum StatsLookup lookup, bool hit) {
+    StatsCounters *sc = thread_counters;
+    if (!sc || lookup >= STATS_N_LOOKUPS) {
+        return;
+    }
+
+    counter_add(hit ? &sc->n_hits[lookup] : &sc->n_misses[lookup], 1);
+    return;
+}
+
+void stats_record_latency(uint8_t type, enum StatsMilestone milestone,
+        uint64_t latency_ns) {
+    StatsCounters *sc = thread_counters;
+    if (!sc || (type >> 1) >= STATS_N_TIMED_TYPES ||
+        milestone >= STATS_N_MILESTONES) {
+        return;
+    }
+
+    histogram_record(&sc->latency[type >> 1][milestone], latency_ns);
+    return;
+}
+
+void stats_count_syscall(enum StatsSyscall syscall, bool would_block) {
+    StatsCounters *sc = thread_counters;
+    if (!sc || syscall >= STATS_N_SYSCALLS) {
+        return;
+    }
+
+    counter_add(&sc->n_syscalls[syscall], 1);
+    if (would_block) {
+        counter_add(&sc->n_would_block[syscall], 1);
+    }
+    return;
+}
+
+void stats_record_loop(uint64_t n_events, uint64_t loop_ns) {
+    StatsCounters *sc = thread_counters;
+    if (!sc) {
+        return;
+    }
+
+    counter_add(&sc->n_events, n_events);
+    histogram_record(&sc->loop_events, n_events);
+    histogram_record(&sc->loop_ns, loop_ns);
+    return;
+}
+
+void stats_record_phase(uint8_t type, enum StatsPhase phase, uint64_t ticks) {
+    StatsCounters *sc = thread_counters;
+    if (!sc || (type >> 1) >= STATS_N_TIMED_TYPES || phase >= STATS_N_PHASES) {
+        return;
+    }
+
+    counter_add(&sc->phase_ticks[type >> 1][phase], ticks);
+    counter_add(&sc->phase_calls[type >> 1][phase], 1);
+    return;
+}
+
+void stats_collect(StatsRegistry *sr, StatsTotals *totals) {
+    if (!sr || !totals) {
+        return;
+    }
+
+    memset(totals, 0, sizeof(StatsTotals));
+    pthread_mutex_lock(&sr->lock);
+    for (StatsCounters *sc = sr->counters; sc; sc = sc->next) {
+        totals_add(totals, sc);
+    }
+    pthread_mutex_unlock(&sr->lock);
+    return;
+}
+
+void stats_read_thread(StatsTotals *totals) {
+    if (!totals) {
+        return;
+    }
+
+    memset(totals, 0, sizeof(StatsTotals));
+    if (thread_counters) {
+        totals_add(totals, thread_counters);
+    }
+    return;
+}
+
+static void totals_add(StatsTotals *totals, StatsCounters *sc) {
+    for (size_t i = 0; i < STATS_N_TYPES; ++i) {
+        totals->n_messages[i] += atomic_load_explicit(&sc->n_messages[i],
+                memory_order_relaxed);
+        totals->n_bytes[i] += atomic_load_explicit(&sc->n_bytes[i],
+                memory_order_relaxed);
+    }
+    totals->n_compress_in += atomic_load_explicit(&sc->n_compress_in,
+            memory_order_relaxed);
+    totals->n_compress_out += atomic_load_explicit(&sc->n_compress_out,
+            memory_order_relaxed);
+    for (size_t i = 0; i < STATS_N_LOOKUPS; ++i) {
+        totals->n_hits[i] += atomic_load_explicit(&sc->n_hits[i],
+                memory_order_relaxed);
+        totals->n_misses[i] += atomic_load_explicit(&sc->n_misses[i],
+                memory_order_relaxed);
+    }
+    for (size_t i = 0; i < STATS_N_TIMED_TYPES; ++i) {
+        for (size_t j = 0; j < STATS_N_MILESTONES; ++j) {
+            histogram_merge(totals->latency[i][j], &sc->latency[i][j]);
+        }
+    }
+    for (size_t i = 0; i < STATS_N_SYSCALLS; ++i) {
+        totals->n_syscalls[i] += atomic_load_explicit(&sc->n_syscalls[i],
+                memory_order_relaxed);
+        totals->n_would_block[i] += atomic_load_explicit(
+                &sc->n_would_block[i], memory_order_relaxed);
+    }
+    totals->n_events += atomic_load_explicit(&sc->n_events,
+            memory_order_relaxed);
+    histogram_merge(totals->loop_events, &sc->loop_events);
+    histogram_merge(totals->loop_ns, &sc->loop_ns);
+    for (size_t i = 0; i < STATS_N_TIMED_TYPES; ++i) {
+        for (size_t j = 0; j < STATS_N_PHASES; ++j) {
+            totals->phase_ticks[i][j] += atomic_load_explicit(
+                    &sc->phase_ticks[i][j], memory_order_relaxed);
+            totals->phase_calls[i][j] += atomic_load_explicit(
+                    &sc->phase_calls[i][j], memory_order_relaxed);
+        }
+    }
+    return;
+}
+
+void destroy_stats_registry(StatsRegistry *sr) {
+    if (!sr) {
+        return;
+    }
+
+    StatsCounters *sc = sr->counters;
+    while (sc) {
+        StatsCounters *next = sc->next;
+        free(sc);
+        sc = next;
+    }
+    pthread_mutex_destroy(&sr->lock);
+    free(sr);
+    return;
+}
@@ -0,0 +1,206 @@
+#ifndef ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_STATS_H
+#define ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_STATS_H
+
+#include "../memory/memory.h"
+#include "histogram.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define STATS_N_TYPES 16 // one per message header type
+#define STATS_CACHE_LINE 64
+#define STATS_SNAPSHOT_VERSION 3 // bumped whenever the snapshot layout changes
+// Echo, ListDir, FileSize and RetFile latencies, indexed by header type >> 1
+#define STATS_N_TIMED_TYPES 4
+
+enum StatsLookup {
+    StatsMetadataLookup = 0,
+    StatsListingLookup = 1,
+    STATS_N_LOOKUPS = 2
+};
+
+// syscalls made by handler threads on client sockets and their epoll
+// instance. splices count as reads from, or writes to, the client
+enum StatsSyscall {
+    StatsSocketRead = 0,
+    StatsSocketWrite = 1,
+    StatsEpollCtl = 2,
+    STATS_N_SYSCALLS = 3
+};
+
+// points a request passes once read. latency is measured from the start of
+// the epoll batch its read completed in, so time queued behind other events
+// of the batch is included
+enum StatsMilestone {
+    StatsHandled = 0, // responce created
+    StatsFirstByte = 1, // first byte of the responce written
+    StatsLastByte = 2, // last byte of the responce written
+    STATS_N_MILESTONES = 3
+};
+
+// work done for a request, in ticks of the profile clock (see profile.h).
+// only counted while profiling
+enum StatsPhase {
+    StatsPhaseParse = 0, // request read and framed, including its reads
+    StatsPhaseDecompress = 1,
+    StatsPhaseLookup = 2, // path resolved and stat, or listing looked up
+    StatsPhaseDiskRead = 3, // file chunks read by the io pool
+    StatsPhaseCompress = 4,
+    StatsPhaseWrite = 5, // responce written to the socket
+    STATS_N_PHASES = 6
+};
+
+// written by the owning thread only, read when a snapshot is taken. aligned
+// so no two threads share a cache line
+typedef struct stats_counters {
+    _Alignas(STATS_CACHE_LINE)
+    // indexed by header type, requests received and responces sent
+    atomic_uint_fast64_t n_messages[STATS_N_TYPES];
+    atomic_uint_fast64_t n_bytes[STATS_N_TYPES];
+    atomic_uint_fast64_t n_compress_in; // payload bytes before compression
+    atomic_uint_fast64_t n_compress_out; // and after
+    atomic_uint_fast64_t n_hits[STATS_N_LOOKUPS];
+    atomic_uint_fast64_t n_misses[STATS_N_LOOKUPS];
+    // nanoseconds from request read to each milestone
+    Histogram latency[STATS_N_TIMED_TYPES][STATS_N_MILESTONES];
+    atomic_uint_fast64_t n_syscalls[STATS_N_SYSCALLS];
+    atomic_uint_fast64_t n_would_block[STATS_N_SYSCALLS]; // failed with EAGAIN
+    atomic_uint_fast64_t n_events; // returned by epoll_wait
+    Histogram loop_events; // events returned per epoll_wait
+    Histogram loop_ns; // nanoseconds handling each batch of events
+    // indexed by header type >> 1, as latency
+    atomic_uint_fast64_t phase_ticks[STATS_N_TIMED_TYPES][STATS_N_PHASES];
+    atomic_uint_fast64_t phase_calls[STATS_N_TIMED_TYPES][STATS_N_PHASES];
+    struct stats_counters *next; // registry link
+} StatsCounters;
+
+typedef struct {
+    StatsCounters *counters;
+    pthread_mutex_t lock;
+} StatsRegistry;
+
+typedef struct {
+    uint64_t n_messages[STATS_N_TYPES];
+    uint64_t n_bytes[STATS_N_TYPES];
+    uint64_t n_compress_in;
+    uint64_t n_compress_out;
+    uint64_t n_hits[STATS_N_LOOKUPS];
+    uint64_t n_misses[STATS_N_LOOKUPS];
+    uint64_t latency[STATS_N_TIMED_TYPES][STATS_N_MILESTONES][HISTOGRAM_LEN];
+    uint64_t n_syscalls[STATS_N_SYSCALLS];
+    uint64_t n_would_block[STATS_N_SYSCALLS];
+    uint64_t n_events;
+    uint64_t loop_events[HISTOGRAM_LEN];
+    uint64_t loop_ns[HISTOGRAM_LEN];
+    uint64_t phase_ticks[STATS_N_TIMED_TYPES][STATS_N_PHASES];
+    uint64_t phase_calls[STATS_N_TIMED_TYPES][STATS_N_PHASES];
+} StatsTotals;
+
+/** @brief Initialises stats registry.
+ *
+ *  Registry owns the counters of every thread bound to it.
+ *
+ *  @return StatsRegistry instance.
+ */
+StatsRegistry *init_stats_registry();
+
+/** @brief Creates counters for the calling thread.
+ *
+ *  Counters are registered with the registry and bound to the calling
+ *  thread, which counts into them without locking or atomic read modify
+ *  writes. Counts made on threads without counters are dropped. If sr is
+ *  NULL, NULL is returned.
+ *
+ *  @param sr : StatsRegistry instance.
+ *  @return StatsCounters of the thread.
+ */
+StatsCounters *stats_bind_thread(StatsRegistry *sr);
+
+/** @brief Counts a message received or sent by the calling thread.
+ *
+ *  @param type : Header type of the message.
+ *  @param n_bytes : Bytes of the message, including its header.
+ */
+void stats_count_message(uint8_t type, uint64_t n_bytes);
+
+/** @brief Counts a payload compressed by the calling thread.
+ *
+ *  @param n_in : Bytes before compression.
+ *  @param n_out : Bytes after compression.
+ */
+void stats_count_compression(uint64_t n_in, uint64_t n_out);
+
+/** @brief Counts a cache lookup made by the calling thread.
+ *
+ *  @param lookup : Cache looked up.
+ *  @param hit : True if the lookup was served from the cache.
+ */
+void stats_count_lookup(enum StatsLookup lookup, bool hit);
+
+/** @brief Records the latency of a request made by the calling thread.
+ *
+ *  Responces other than those of STATS_N_TIMED_TYPES are ignored.
+ *
+ *  @param type : Header type of the responce.
+ *  @param milestone : Point the request has reached.
+ *  @param latency_ns : Nanoseconds since the request was read.
+ */
+void stats_record_latency(uint8_t type, enum StatsMilestone milestone,
+        uint64_t latency_ns);
+
+/** @brief Counts a syscall made by the calling thread.
+ *
+ *  @param syscall : Kind of syscall.
+ *  @param would_block : True if it failed with EAGAIN.
+ */
+void stats_count_syscall(enum StatsSyscall syscall, bool would_block);
+
+/** @brief Records an event loop iteration of the calling thread.
+ *
+ *  @param n_events : Events returned by epoll_wait, 0 if it timed out.
+ *  @param loop_ns : Nanoseconds spent handling them.
+ */
+void stats_record_loop(uint64_t n_events, uint64_t loop_ns);
+
+/** @brief Charges work of a phase to a request type on the calling thread.
+ *
+ *  Types other than those of STATS_N_TIMED_TYPES are ignored.
+ *
+ *  @param type : Header type of the request or its responce.
+ *  @param phase : Phase the work was done in.
+ *  @param ticks : Profile clock ticks spent.
+ */
+void stats_record_phase(uint8_t type, enum StatsPhase phase, uint64_t ticks);
+
+/** @brief Sums the counters of all threads.
+ *
+ *  Counters are read without stopping their threads, so totals may be
+ *  slightly behind. Latency histograms are merged bucket by bucket. If sr or
+ *  totals is NULL, nothing is done.
+ *
+ *  @param sr : StatsRegistry instance.
+ *  @param totals : StatsTotals to fill.
+ */
+void stats_collect(StatsRegistry *sr, StatsTotals *totals);
+
+/** @brief Copies the counters of the calling thread.
+ *
+ *  If the thread has no counters, totals are zeroed. If totals is NULL,
+ *  nothing is done.
+ *
+ *  @param totals : StatsTotals to fill.
+ */
+void stats_read_thread(StatsTotals *totals);
+
+/** @brief Destroys stats registry.
+ *
+ *  Counters of all threads are released, no bound thread may count after.
+ *  If sr is NULL, nothing is done.
+ *
+ *  @param sr : StatsRegistry instance.
+ */
+void destroy_stats_registry(StatsRegistry *sr);
+
+#endif //ASSIGNMENT_3_JXSERVER_FINAL_SUBMISSION_STATS_H
@@ -0,0 +1,1059 @@
+//
+// Load generator speaking the JX protocol. Drives a weighted mix of Echo,
+// ListDir, FileSize and RetFile requests over many connections, and reports
+// throughput and latency percentiles per type. Build and run with
+//
+//     gcc -O2 -pthread -o jxload tools/jxload.c stats/histogram.c
+//             data_structures/compression_dictionary/compression_dict.c
+//             data_structures/decompression_tree/decompression_tree.c
+//             memory/safe_alloc.c
+//     ./jxload [options] <ip> <port>
+//
+// Options:
+//     -c n    connections (default 64)
+//     -t n    threads (default 4)
+//     -d s    seconds to run for (default 10)
+//     -R n    requests per second, open loop. 0 is closed loop (default 0)
+//     -m mix  type:weight pairs, e.g. echo:4,filesize:1,retfile:2. types are
+//             echo, listdir, filesize and retfile (default echo:1)
+//     -s n    Echo payload bytes (default 64)
+//     -f name file for FileSize and RetFile, within the served directory
+//     -o n    RetFile offset (default 0)
+//     -l n    RetFile length (default rest of the file from the offset)
+//     -x k    connections sharing each RetFile session (default 1)
+//     -z pct  share of requests requiring compression (default 0)
+//     -Z pct  share of requests sent compressed (default 0)
+//
+// Connections are grouped k to a slot, each slot has one request in flight.
+// RetFile requests are sent on every connection of the slot under one
+// session id, and complete once the whole range has arrived across them.
+// Other types use the first connection of the slot. Compression needs
+// compression.dict in the working directory.
+//
+// Closed loop, a slot sends its next request as soon as the last completes,
+// and latency is service time. Open loop, requests are scheduled at a fixed
+// rate whether or not the server keeps up. Requests wait for a free slot,
+// and latency is measured from the scheduled start, so a stalled server is
+// not hidden by the client backing off with it (coordinated omission).
+// Service time, from the request being sent, is reported alongside.
+//
+
+#include "../stats/histogram.h"
+#include "../data_structures/decompression_tree/decompression_tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_N_CONNECTIONS 64
+#define DEFAULT_N_THREADS 4
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_ECHO_LEN 64
+
+#define N_TYPES 4 // request types driven, header type is index << 1
+#define HEADER_LEN 9 // type byte and big endian payload length
+#define ERROR_TYPE 0xf
+#define RET_FILE_RSP_TYPE 0x7
+#define RET_FILE_PREFIX_LEN 20 // session id, offset, length
+#define MAX_CODE_BITS 32 // longest code of a compression dictionary
+// compressed bytes holding at least the RetFile prefix
+#define PREFIX_KEEP_LEN (RET_FILE_PREFIX_LEN * MAX_CODE_BITS / 8)
+// FileSize or RetFile request, compressed at worst
+#define FRAME_LEN (HEADER_LEN + \
+        (RET_FILE_PREFIX_LEN + NAME_MAX + 1) * MAX_CODE_BITS / 8 + 1)
+
+#define READ_BUFFER_LEN 65536
+#define MAX_EVENTS 256
+#define MAX_WAIT_MS 100
+#define TIMER_ID UINT64_MAX // epoll data of the schedule timer
+
+enum RequestIndex {
+    Echo,
+    ListDir,
+    FileSize,
+    RetFile
+};
+
+static const char *type_names[N_TYPES] = {
+        "echo", "listdir", "filesize", "retfile"
+};
+
+typedef struct {
+    struct sockaddr_in addr;
+    size_t n_connections;
+    size_t n_threads;
+    size_t multiplex; // connections per slot
+    double duration_s;
+    double rate; // requests per second, 0 is closed loop
+    unsigned weights[N_TYPES];
+    unsigned total_weight;
+    unsigned compress_pct; // requests with the requires compression bit
+    unsigned compressed_pct; // requests sent compressed
+    size_t echo_len;
+    const char *file;
+    uint64_t offset;
+    uint64_t length;
+    CompressionSegment *dict;
+    DecompressionTreeNode *tree;
+    uint8_t *echo_frames[2][2]; // by compressed and requires compression
+    size_t echo_frame_len[2];
+    uint32_t session_base;
+} Options;
+
+typedef struct {
+    int fd;
+    size_t slot;
+    const uint8_t *out; // request being sent, not owned
+    size_t out_len;
+    size_t out_n;
+    bool want_write; // EPOLLOUT registered
+    uint8_t header[HEADER_LEN]; // responce being read
+    size_t header_n;
+    uint64_t payload_len;
+    uint64_t payload_n;
+    uint8_t prefix[PREFIX_KEEP_LEN]; // start of a RetFile responce
+    uint8_t frame[FRAME_LEN]; // built FileSize, ListDir or RetFile request
+} Conn;
+
+typedef struct {
+    size_t first_conn;
+    bool busy;
+    enum RequestIndex type;
+    uint32_t session;
+    uint64_t remaining; // RetFile bytes not yet received
+    uint64_t intended_ns; // scheduled start, sent_ns in closed loop
+    uint64_t sent_ns;
+} Slot;
+
+typedef struct {
+    Options *opt;
+    size_t id;
+    pthread_t thread;
+    pthread_barrier_t *ready; // every thread connected
+    int epoll_fd;
+    int timer_fd;
+    Conn *conns;
+    size_t n_conns;
+    Slot *slots;
+    size_t n_slots;
+    size_t *idle; // stack of free slots
+    size_t n_idle;
+    uint64_t rng;
+    uint32_t next_session;
+    // open loop schedule, request k is due at start_ns + k * interval_ns
+    double interval_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t n_started;
+    uint64_t timer_armed; // request the timer is set for, +1
+    // results, read once the thread has returned
+    Histogram latency[N_TYPES]; // from the scheduled start
+    Histogram service[N_TYPES]; // from the request being sent
+    uint64_t max_latency[N_TYPES];
+    uint64_t max_service[N_TYPES];
+    uint64_t n_completed[N_TYPES];
+    uint64_t n_errors[N_TYPES];
+    uint64_t n_in_flight; // abandoned at the end
+    uint64_t n_behind; // due but never started
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+} Worker;
+
+/** @brief Prints usage and exits with EXIT_FAILURE.
+ *
+ *  @param name : Program name.
+ */
+static void usage(const char *name);
+
+/** @brief Parses a request mix into weights.
+ *
+ *  @param opt : Options to set weights of.
+ *  @param mix : Comma separated type:weight pairs.
+ *  @return 0 on success, -1 on error.
+ */
+static int parse_mix(Options *opt, char *mix);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+/** @brief Returns the next pseudo random number of a worker.
+ *
+ *  @param w : Worker instance.
+ *  @return random number.
+ */
+static uint64_t next_random(Worker *w);
+
+/** @brief Opens a connection to the server.
+ *
+ *  Connection is blocking unless nonblocking is set. Exits on error, the
+ *  server is expected to be up for the whole run.
+ *
+ *  @param opt : Options instance.
+ *  @param nonblocking : Whether the socket is made non blocking.
+ *  @return socket file descriptor.
+ */
+static int open_connection(Options *opt, bool nonblocking);
+
+/** @brief Compresses data with the compression dictionary.
+ *
+ *  Output is in the format of the server, codes followed by the number of
+ *  padding bits, and holds at most n * MAX_CODE_BITS / 8 + 1 bytes.
+ *
+ *  @param dict : Compression dictionary.
+ *  @param in : Data to compress.
+ *  @param n : Bytes of data.
+ *  @param out : Compressed data.
+ *  @return compressed bytes.
+ */
+static size_t compress_payload(CompressionSegment *dict, const uint8_t *in,
+        size_t n, uint8_t *out);
+
+/** @brief Decompresses the start of compressed data.
+ *
+ *  @param tree : Decompression tree.
+ *  @param in : Compressed data.
+ *  @param n : Bytes of compressed data available.
+ *  @param out : Decompressed data.
+ *  @param out_n : Bytes to decompress.
+ *  @return bytes decompressed.
+ */
+static size_t decompress_prefix(DecompressionTreeNode *tree,
+        const uint8_t *in, size_t n, uint8_t *out, size_t out_n);
+
+/** @brief Writes a request frame.
+ *
+ *  @param opt : Options instance.
+ *  @param frame : At least FRAME_LEN bytes.
+ *  @param type : Header type.
+ *  @param compressed : Whether payload is compressed.
+ *  @param req_compression : Whether the responce is to be compressed.
+ *  @param payload : Uncompressed payload.
+ *  @param n : Bytes of payload.
+ *  @return bytes of the frame.
+ */
+static size_t build_frame(Options *opt, uint8_t *frame, uint8_t type,
+        bool compressed, bool req_compression, const uint8_t *payload,
+        size_t n);
+
+/** @brief Asks the server for the size of a file, on a blocking connection.
+ *
+ *  Exits if the server replies with an error.
+ *
+ *  @param opt : Options instance.
+ *  @param name : File name.
+ *  @return file size.
+ */
+static uint64_t query_file_size(Options *opt, const char *name);
+
+/** @brief Worker thread.
+ *
+ *  Connects, waits for every other worker, then runs the event loop until
+ *  the duration has passed.
+ *
+ *  @param arg : Worker instance.
+ */
+static void *run_worker(void *arg);
+
+/** @brief Starts requests on free slots.
+ *
+ *  Closed loop, every free slot is started. Open loop, requests due by now
+ *  are started while slots are free, and the timer is set for the next.
+ *
+ *  @param w : Worker instance.
+ *  @param now : Current monotonic ns.
+ */
+static void start_requests(Worker *w, uint64_t now);
+
+/** @brief Sends a request on a slot.
+ *
+ *  @param w : Worker instance.
+ *  @param slot_i : Free slot.
+ *  @param intended_ns : Scheduled start.
+ */
+static void issue_request(Worker *w, size_t slot_i, uint64_t intended_ns);
+
+/** @brief Writes as much of the pending request of a connection as fits.
+ *
+ *  @param w : Worker instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 if the connection failed.
+ */
+static int flush_conn(Worker *w, Conn *c);
+
+/** @brief Reads every available byte of a connection.
+ *
+ *  @param w : Worker instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 if the connection failed or sent an error.
+ */
+static int read_conn(Worker *w, Conn *c);
+
+/** @brief Parses responce bytes of a connection.
+ *
+ *  @param w : Worker instance.
+ *  @param c : Connection.
+ *  @param buf : Bytes read.
+ *  @param n : Number of bytes.
+ *  @return 0 on success, -1 on an error responce.
+ */
+static int consume(Worker *w, Conn *c, const uint8_t *buf, size_t n);
+
+/** @brief Handles a fully read responce.
+ *
+ *  @param w : Worker instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 on an error or unexpected responce.
+ */
+static int responce_done(Worker *w, Conn *c);
+
+/** @brief Finishes the request of a slot, and frees the slot.
+ *
+ *  @param w : Worker instance.
+ *  @param s : Slot.
+ *  @param ok : Whether the request succeeded.
+ */
+static void complete(Worker *w, Slot *s, bool ok);
+
+/** @brief Reconnects every connection of a slot, failing its request.
+ *
+ *  Partly sent or read messages are dropped with the old connections.
+ *
+ *  @param w : Worker instance.
+ *  @param slot_i : Slot.
+ */
+static void reset_slot(Worker *w, size_t slot_i);
+
+/** @brief Prints percentiles per type of merged histograms.
+ *
+ *  @param workers : Finished workers.
+ *  @param n_workers : Number of workers.
+ *  @param service : Whether service time or latency is printed.
+ */
+static void print_latency(Worker *workers, size_t n_workers, bool service);
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c connections] [-t threads] [-d seconds] "
+            "[-R rate] [-m mix] [-s echo_bytes] [-f file] [-o offset] "
+            "[-l length] [-x sessions_per_slot] [-z compress_pct] "
+            "[-Z compressed_pct] <ip> <port>\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_mix(Options *opt, char *mix) {
+    memset(opt->weights, 0, sizeof(opt->weights));
+    opt->total_weight = 0;
+    char *save = NULL;
+    for (char *pair = strtok_r(mix, ",", &save); pair;
+            pair = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(pair, ':');
+        unsigned weight = colon ? strtoul(colon + 1, NULL, 10) : 1;
+        if (colon) {
+            *colon = '\0';
+        }
+        size_t t = 0;
+        while (t < N_TYPES && strcmp(pair, type_names[t])) {
+            ++t;
+        }
+        if (t == N_TYPES) {
+            fprintf(stderr, "unknown request type %s\n", pair);
+            return -1;
+        }
+        opt->weights[t] += weight;
+        opt->total_weight += weight;
+    }
+    return opt->total_weight ? 0 : -1;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(Worker *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int open_connection(Options *opt, bool nonblocking) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &opt->addr,
+            sizeof(opt->addr))) {
+        perror("unable to connect");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (nonblocking) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+static size_t compress_payload(CompressionSegment *dict, const uint8_t *in,
+        size_t n, uint8_t *out) {
+    size_t n_bits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t code = dict[in[i]].compressed;
+        for (int b = dict[in[i]].compressed_len - 1; b >= 0; --b) {
+            if (!(n_bits % 8)) {
+                out[n_bits / 8] = 0;
+            }
+            // most significant bit first, as the server reads them
+            out[n_bits / 8] |= ((code >> b) & 0x1) << (7 - n_bits % 8);
+            ++n_bits;
+        }
+    }
+    size_t len = (n_bits + 7) / 8;
+    out[len] = (8 - n_bits % 8) % 8;
+    return len + 1;
+}
+
+static size_t decompress_prefix(DecompressionTreeNode *tree,
+        const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    DecompressionTreeNode *node = tree;
+    size_t n_out = 0;
+    for (size_t i = 0; i < n * 8 && n_out < out_n; ++i) {
+        node = (in[i / 8] >> (7 - i % 8)) & 0x1 ? node->right : node->left;
+        if (!node) {
+            break;
+        }
+        if (!node->left && !node->right) {
+            out[n_out++] = node->data;
+            node = tree;
+        }
+    }
+    return n_out;
+}
+
+static size_t build_frame(Options *opt, uint8_t *frame, uint8_t type,
+        bool compressed, bool req_compression, const uint8_t *payload,
+        size_t n) {
+    frame[0] = type << 4 | compressed << 3 | req_compression << 2;
+    uint64_t len = n;
+    if (compressed) {
+        len = compress_payload(opt->dict, payload, n, frame + HEADER_LEN);
+    } else {
+        memcpy(frame + HEADER_LEN, payload, n);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        frame[1 + i] = len >> (56 - 8 * i);
+    }
+    return HEADER_LEN + len;
+}
+
+static uint64_t query_file_size(Options *opt, const char *name) {
+    uint8_t frame[FRAME_LEN];
+    size_t len = build_frame(opt, frame, FileSize << 1, false, false,
+            (const uint8_t *) name, strlen(name) + 1);
+    int fd = open_connection(opt, false);
+    uint8_t rsp[HEADER_LEN + 8];
+    size_t n = 0;
+    if (write(fd, frame, len) != (ssize_t) len) {
+        perror("unable to send file size request");
+        exit(EXIT_FAILURE);
+    }
+    while (n < sizeof(rsp)) {
+        ssize_t r = read(fd, rsp + n, sizeof(rsp) - n);
+        if (r <= 0) {
+            break;
+        }
+        n += r;
+    }
+    close(fd);
+    if (n < sizeof(rsp) || rsp[0] >> 4 == ERROR_TYPE) {
+        fprintf(stderr, "unable to get size of %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t size = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        size = size << 8 | rsp[HEADER_LEN + i];
+    }
+    return size;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = (Worker *) arg;
+    Options *opt = w->opt;
+
+    w->epoll_fd = epoll_create1(0);
+    w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = TIMER_ID};
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev);
+    for (size_t i = 0; i < w->n_conns; ++i) {
+        w->conns[i].fd = open_connection(opt, true);
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->conns[i].fd, &ev);
+    }
+
+    // connection setup is not part of the run
+    pthread_barrier_wait(w->ready);
+    w->start_ns = monotonic_ns();
+    w->end_ns = w->start_ns + (uint64_t) (opt->duration_s * 1e9);
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now = w->start_ns;
+    while (now < w->end_ns) {
+        start_requests(w, now);
+        uint64_t wait_ms = (w->end_ns - now) / 1000000 + 1;
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS,
+                wait_ms < MAX_WAIT_MS ? wait_ms : MAX_WAIT_MS);
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 == TIMER_ID) {
+                uint64_t expirations;
+                read(w->timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+            Conn *c = &w->conns[events[i].data.u64];
+            int ret = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                // reads the whole socket through one buffer
+                ret = read_conn(w, c);
+            }
+            if (!ret && events[i].events & EPOLLOUT) {
+                ret = flush_conn(w, c);
+            }
+            if (ret) {
+                reset_slot(w, c->slot);
+            }
+        }
+        now = monotonic_ns();
+    }
+
+    for (size_t i = 0; i < w->n_slots; ++i) {
+        w->n_in_flight += w->slots[i].busy;
+    }
+    if (opt->rate) {
+        // due strictly before the end
+        uint64_t n_due = (w->end_ns - w->start_ns - 1) / w->interval_ns + 1;
+        w->n_behind = n_due > w->n_started ? n_due - w->n_started : 0;
+    }
+    for (size_t i = 0; i < w->n_conns; ++i) {
+        close(w->conns[i].fd);
+    }
+    close(w->timer_fd);
+    close(w->epoll_fd);
+    return NULL;
+}
+
+static void start_requests(Worker *w, uint64_t now) {
+    if (!w->opt->rate) {
+        while (w->n_idle) {
+            issue_request(w, w->idle[--w->n_idle], now);
+        }
+        return;
+    }
+
+    uint64_t intended = w->start_ns + (uint64_t) (w->n_started *
+            w->interval_ns);
+    while (w->n_idle && intended <= now) {
+        issue_request(w, w->idle[--w->n_idle], intended);
+        ++w->n_started;
+        intended = w->start_ns + (uint64_t) (w->n_started * w->interval_ns);
+    }
+    // waiting on a slot otherwise, woken by its responce
+    if (intended > now && w->timer_armed != w->n_started + 1) {
+        struct itimerspec its = {
+                .it_value = {intended / 1000000000, intended % 1000000000}
+        };
+        timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        w->timer_armed = w->n_started + 1;
+    }
+    return;
+}
+
+static void issue_request(Worker *w, size_t slot_i, uint64_t intended_ns) {
+    Options *opt = w->opt;
+    Slot *s = &w->slots[slot_i];
+
+    uint64_t pick = next_random(w) % opt->total_weight;
+    enum RequestIndex type = Echo;
+    while (pick >= opt->weights[type]) {
+        pick -= opt->weights[type++];
+    }
+    bool req_compression = next_random(w) % 100 < opt->compress_pct;
+    // empty payloads have nothing to compress
+    bool compressed = type != ListDir &&
+            next_random(w) % 100 < opt->compressed_pct;
+
+    s->busy = true;
+    s->type = type;
+    s->intended_ns = intended_ns;
+    s->sent_ns = monotonic_ns();
+    Conn *first = &w->conns[s->first_conn];
+    size_t n_conns = 1;
+    if (type == Echo) {
+        first->out = opt->echo_frames[compressed][req_compression];
+        first->out_len = opt->echo_frame_len[compressed];
+    } else if (type == ListDir) {
+        first->out = first->frame;
+        first->out_len = build_frame(opt, first->frame, ListDir << 1, false,
+                req_compression, NULL, 0);
+    } else if (type == FileSize) {
+        first->out = first->frame;
+        first->out_len = build_frame(opt, first->frame, FileSize << 1,
+                compressed, req_compression, (const uint8_t *) opt->file,
+                strlen(opt->file) + 1);
+    } else {
+        uint8_t payload[RET_FILE_PREFIX_LEN + NAME_MAX + 1];
+        s->session = w->next_session++;
+        s->remaining = opt->length;
+        for (size_t i = 0; i < 4; ++i) {
+            payload[i] = s->session >> (24 - 8 * i);
+        }
+        for (size_t i = 0; i < 8; ++i) {
+            payload[4 + i] = opt->offset >> (56 - 8 * i);
+            payload[12 + i] = opt->length >> (56 - 8 * i);
+        }
+        size_t name_len = strlen(opt->file) + 1;
+        memcpy(payload + RET_FILE_PREFIX_LEN, opt->file, name_len);
+        // every connection of the slot joins the session
+        n_conns = opt->multiplex;
+        for (size_t i = 0; i < n_conns; ++i) {
+            first[i].out = first[i].frame;
+            first[i].out_len = build_frame(opt, first[i].frame, RetFile << 1,
+                    compressed, req_compression, payload,
+                    RET_FILE_PREFIX_LEN + name_len);
+        }
+    }
+
+    for (size_t i = 0; i < n_conns; ++i) {
+        first[i].out_n = 0;
+        if (flush_conn(w, &first[i])) {
+            reset_slot(w, slot_i);
+            return;
+        }
+    }
+    return;
+}
+
+static int flush_conn(Worker *w, Conn *c) {
+    while (c->out_n < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_n, c->out_len - c->out_n);
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n <= 0) {
+            return -1;
+        }
+        c->out_n += n;
+        w->tx_bytes += n;
+    }
+
+    // only waits on writes while part of a request is left
+    bool want_write = c->out_n < c->out_len;
+    if (want_write != c->want_write) {
+        struct epoll_event ev = {
+                .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                .data.u64 = c - w->conns
+        };
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+    return 0;
+}
+
+static int read_conn(Worker *w, Conn *c) {
+    uint8_t buf[READ_BUFFER_LEN];
+    while (1) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        } else if (n <= 0) {
+            return -1;
+        }
+        w->rx_bytes += n;
+        if (consume(w, c, buf, n)) {
+            return -1;
+        }
+        if ((size_t) n < sizeof(buf)) {
+            return 0;
+        }
+    }
+}
+
+static int consume(Worker *w, Conn *c, const uint8_t *buf, size_t n) {
+    while (n) {
+        if (c->header_n < HEADER_LEN) {
+            size_t take = HEADER_LEN - c->header_n < n ?
+                    HEADER_LEN - c->header_n : n;
+            memcpy(c->header + c->header_n, buf, take);
+            c->header_n += take;
+            buf += take;
+            n -= take;
+            if (c->header_n < HEADER_LEN) {
+                break;
+            }
+            c->payload_len = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                c->payload_len = c->payload_len << 8 | c->header[1 + i];
+            }
+            c->payload_n = 0;
+        } else {
+            // payloads are discarded, bar the start of RetFile chunks
+            uint64_t left = c->payload_len - c->payload_n;
+            size_t take = left < n ? left : n;
+            if (c->payload_n < PREFIX_KEEP_LEN) {
+                size_t keep = PREFIX_KEEP_LEN - c->payload_n < take ?
+                        PREFIX_KEEP_LEN - c->payload_n : take;
+                memcpy(c->prefix + c->payload_n, buf, keep);
+            }
+            c->payload_n += take;
+            buf += take;
+            n -= take;
+        }
+
+        if (c->header_n == HEADER_LEN && c->payload_n == c->payload_len) {
+            c->header_n = 0;
+            if (responce_done(w, c)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int responce_done(Worker *w, Conn *c) {
+    uint8_t type = c->header[0] >> 4;
+    Slot *s = &w->slots[c->slot];
+    if (type == ERROR_TYPE) {
+        // server closes the connection after an error
+        return -1;
+    } else if (type != RET_FILE_RSP_TYPE) {
+        if (!s->busy || type != (s->type << 1 | 1)) {
+            return -1;
+        }
+        complete(w, s, true);
+        return 0;
+    }
+
+    uint8_t prefix[RET_FILE_PREFIX_LEN];
+    size_t kept = c->payload_len < PREFIX_KEEP_LEN ?
+            c->payload_len : PREFIX_KEEP_LEN;
+    if (c->header[0] & 0x08) {
+        if (decompress_prefix(w->opt->tree, c->prefix, kept, prefix,
+                RET_FILE_PREFIX_LEN) < RET_FILE_PREFIX_LEN) {
+            return -1;
+        }
+    } else if (kept < RET_FILE_PREFIX_LEN) {
+        return -1;
+    } else {
+        memcpy(prefix, c->prefix, RET_FILE_PREFIX_LEN);
+    }
+
+    uint32_t session = 0;
+    uint64_t n_bytes = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        session = session << 8 | prefix[i];
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        n_bytes = n_bytes << 8 | prefix[12 + i];
+    }
+    // connections joining a session late may be sent chunks after the range
+    // is complete, and chunks of a failed session may still arrive
+    if (!s->busy || s->type != RetFile || session != s->session) {
+        return 0;
+    }
+    s->remaining -= n_bytes < s->remaining ? n_bytes : s->remaining;
+    if (!s->remaining) {
+        complete(w, s, true);
+    }
+    return 0;
+}
+
+static void complete(Worker *w, Slot *s, bool ok) {
+    uint64_t now = monotonic_ns();
+    if (ok) {
+        uint64_t latency = now - s->intended_ns;
+        histogram_record(&w->latency[s->type], latency);
+        histogram_record(&w->service[s->type], now - s->sent_ns);
+        if (latency > w->max_latency[s->type]) {
+            w->max_latency[s->type] = latency;
+        }
+        if (now - s->sent_ns > w->max_service[s->type]) {
+            w->max_service[s->type] = now - s->sent_ns;
+        }
+        ++w->n_completed[s->type];
+    } else {
+        ++w->n_errors[s->type];
+    }
+    s->busy = false;
+    w->idle[w->n_idle++] = s - w->slots;
+    return;
+}
+
+static void reset_slot(Worker *w, size_t slot_i) {
+    Slot *s = &w->slots[slot_i];
+    for (size_t i = 0; i < w->opt->multiplex; ++i) {
+        Conn *c = &w->conns[s->first_conn + i];
+        close(c->fd);
+        c->fd = open_connection(w->opt, true);
+        c->out_len = 0;
+        c->out_n = 0;
+        c->want_write = false;
+        c->header_n = 0;
+        struct epoll_event ev = {
+                .events = EPOLLIN, .data.u64 = s->first_conn + i
+        };
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    if (s->busy) {
+        complete(w, s, false);
+    }
+    return;
+}
+
+static void print_latency(Worker *workers, size_t n_workers, bool service) {
+    static const uint64_t percentiles[] = {50000, 90000, 99000, 99900};
+    printf("%-9s %10s %8s %10s %10s %10s %10s %10s\n", "TYPE", "COUNT",
+            "ERRORS", "P50 us", "P90 us", "P99 us", "P99.9 us", "MAX us");
+
+    uint64_t *buckets = safe_malloc(HISTOGRAM_LEN * sizeof(uint64_t));
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        memset(buckets, 0, HISTOGRAM_LEN * sizeof(uint64_t));
+        uint64_t n_errors = 0;
+        uint64_t max = 0;
+        for (size_t i = 0; i < n_workers; ++i) {
+            histogram_merge(buckets, service ? &workers[i].service[t] :
+                    &workers[i].latency[t]);
+            n_errors += workers[i].n_errors[t];
+            uint64_t worker_max = service ? workers[i].max_service[t] :
+                    workers[i].max_latency[t];
+            max = worker_max > max ? worker_max : max;
+        }
+        uint64_t count = histogram_count(buckets);
+        if (!count && !n_errors) {
+            continue;
+        }
+
+        printf("%-9s %10lu %8lu", type_names[t], (unsigned long) count,
+                (unsigned long) n_errors);
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(uint64_t); ++p) {
+            // bucket bounds may lie past the largest value recorded
+            uint64_t value = histogram_percentile(buckets, percentiles[p]);
+            printf(" %10.1f", (value < max ? value : max) / 1e3);
+        }
+        printf(" %10.1f\n", max / 1e3);
+    }
+    free(buckets);
+    return;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    memset(&opt, 0, sizeof(Options));
+    opt.n_connections = DEFAULT_N_CONNECTIONS;
+    opt.n_threads = DEFAULT_N_THREADS;
+    opt.duration_s = DEFAULT_DURATION_S;
+    opt.echo_len = DEFAULT_ECHO_LEN;
+    opt.multiplex = 1;
+    opt.weights[Echo] = 1;
+    opt.total_weight = 1;
+    bool whole_file = true;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:t:d:R:m:s:f:o:l:x:z:Z:")) != -1) {
+        switch (c) {
+            case 'c': opt.n_connections = strtoul(optarg, NULL, 10); break;
+            case 't': opt.n_threads = strtoul(optarg, NULL, 10); break;
+            case 'd': opt.duration_s = strtod(optarg, NULL); break;
+            case 'R': opt.rate = strtod(optarg, NULL); break;
+            case 'm':
+                if (parse_mix(&opt, optarg)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's': opt.echo_len = strtoul(optarg, NULL, 10); break;
+            case 'f': opt.file = optarg; break;
+            case 'o': opt.offset = strtoull(optarg, NULL, 10); break;
+            case 'l':
+                opt.length = strtoull(optarg, NULL, 10);
+                whole_file = false;
+                break;
+            case 'x': opt.multiplex = strtoul(optarg, NULL, 10); break;
+            case 'z': opt.compress_pct = strtoul(optarg, NULL, 10); break;
+            case 'Z': opt.compressed_pct = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || inet_pton(AF_INET, argv[optind],
+            &opt.addr.sin_addr) != 1) {
+        usage(argv[0]);
+    }
+    opt.addr.sin_family = AF_INET;
+    opt.addr.sin_port = htons(strtoul(argv[optind + 1], NULL, 10));
+
+    if (!opt.multiplex || opt.n_connections < opt.multiplex ||
+        opt.duration_s <= 0 || opt.rate < 0) {
+        usage(argv[0]);
+    }
+    if ((opt.weights[FileSize] || opt.weights[RetFile]) &&
+        (!opt.file || strlen(opt.file) > NAME_MAX)) {
+        fprintf(stderr, "filesize and retfile requests need a file (-f)\n");
+        return EXIT_FAILURE;
+    }
+    if (opt.compress_pct || opt.compressed_pct) {
+        // read from the working directory, as the server does
+        opt.dict = parse_compression_dictionary();
+        opt.tree = init_decompression_tree(opt.dict);
+    }
+    if (opt.weights[RetFile] && whole_file) {
+        uint64_t size = query_file_size(&opt, opt.file);
+        opt.length = size > opt.offset ? size - opt.offset : 0;
+    }
+    if (opt.weights[RetFile] && !opt.length) {
+        fprintf(stderr, "retfile range is empty\n");
+        return EXIT_FAILURE;
+    }
+
+    // echo payloads are the same for every request, so are built once
+    uint8_t *echo_payload = safe_malloc(opt.echo_len + 1);
+    for (size_t i = 0; i < opt.echo_len; ++i) {
+        echo_payload[i] = 'a' + i % 26;
+    }
+    for (size_t cmp = 0; cmp < 2; ++cmp) {
+        if (cmp && !opt.dict) {
+            continue;
+        }
+        size_t cap = HEADER_LEN + opt.echo_len * (cmp ? MAX_CODE_BITS / 8 :
+                1) + 1;
+        for (size_t req = 0; req < 2; ++req) {
+            opt.echo_frames[cmp][req] = safe_malloc(cap);
+            opt.echo_frame_len[cmp] = build_frame(&opt,
+                    opt.echo_frames[cmp][req], Echo << 1, cmp, req,
+                    echo_payload, opt.echo_len);
+        }
+    }
+
+    srand(time(NULL) ^ getpid());
+    opt.session_base = (uint32_t) rand() << 1 ^ rand();
+    size_t n_slots = opt.n_connections / opt.multiplex;
+    if (opt.n_threads > n_slots) {
+        opt.n_threads = n_slots;
+    }
+    if (!opt.n_threads) {
+        usage(argv[0]);
+    }
+
+    pthread_barrier_t ready;
+    pthread_barrier_init(&ready, NULL, opt.n_threads + 1);
+    Worker *workers = safe_calloc(opt.n_threads, sizeof(Worker));
+    for (size_t i = 0; i < opt.n_threads; ++i) {
+        Worker *w = &workers[i];
+        w->opt = &opt;
+        w->id = i;
+        w->ready = &ready;
+        w->n_slots = (i + 1) * n_slots / opt.n_threads -
+                i * n_slots / opt.n_threads;
+        w->n_conns = w->n_slots * opt.multiplex;
+        w->slots = safe_calloc(w->n_slots, sizeof(Slot));
+        w->conns = safe_calloc(w->n_conns, sizeof(Conn));
+        w->idle = safe_malloc(w->n_slots * sizeof(size_t));
+        for (size_t s = 0; s < w->n_slots; ++s) {
+            w->slots[s].first_conn = s * opt.multiplex;
+            for (size_t k = 0; k < opt.multiplex; ++k) {
+                w->conns[s * opt.multiplex + k].slot = s;
+            }
+            // first slots are started first
+            w->idle[w->n_slots - 1 - s] = s;
+        }
+        w->n_idle = w->n_slots;
+        w->rng = (opt.session_base | 1) * (i + 1) * 0x9e3779b97f4a7c15ULL;
+        // sessions of threads stay apart for 2^24 requests
+        w->next_session = opt.session_base + ((uint32_t) i << 24);
+        w->interval_ns = opt.rate ? 1e9 * opt.n_threads / opt.rate : 0;
+        if (pthread_create(&w->thread, NULL, run_worker, w)) {
+            perror("unable to start worker");
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_barrier_wait(&ready);
+    uint64_t start_ns = monotonic_ns();
+    for (size_t i = 0; i < opt.n_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = (monotonic_ns() - start_ns) / 1e9;
+
+    uint64_t n_completed = 0;
+    uint64_t n_errors = 0;
+    uint64_t n_in_flight = 0;
+    uint64_t n_behind = 0;
+    uint64_t rx_bytes = 0;
+    uint64_t tx_bytes = 0;
+    for (size_t i = 0; i < opt.n_threads; ++i) {
+        for (size_t t = 0; t < N_TYPES; ++t) {
+            n_completed += workers[i].n_completed[t];
+            n_errors += workers[i].n_errors[t];
+        }
+        n_in_flight += workers[i].n_in_flight;
+        n_behind += workers[i].n_behind;
+        rx_bytes += workers[i].rx_bytes;
+        tx_bytes += workers[i].tx_bytes;
+    }
+
+    printf("%s:%s, %zu threads, %zu connections (%zu per session), "
+            "%.1f s, ", argv[optind], argv[optind + 1], opt.n_threads,
+            n_slots * opt.multiplex, opt.multiplex, seconds);
+    if (opt.rate) {
+        printf("open loop at %.0f requests/s\n", opt.rate);
+    } else {
+        printf("closed loop\n");
+    }
+    printf("requests %lu (%.1f/s), errors %lu, in flight at end %lu",
+            (unsigned long) n_completed, n_completed / seconds,
+            (unsigned long) n_errors, (unsigned long) n_in_flight);
+    if (opt.rate) {
+        printf(", behind schedule %lu", (unsigned long) n_behind);
+    }
+    printf("\nrx %.2f MiB/s, tx %.2f MiB/s\n\n", rx_bytes / seconds / 1048576,
+            tx_bytes / seconds / 1048576);
+
+    if (opt.rate) {
+        printf("latency from scheduled start\n");
+        print_latency(workers, opt.n_threads, false);
+        printf("\nservice time, uncorrected\n");
+        print_latency(workers, opt.n_threads, true);
+    } else {
+        printf("latency\n");
+        print_latency(workers, opt.n_threads, false);
+    }
+
+    for (size_t i = 0; i < opt.n_threads; ++i) {
+        free(workers[i].slots);
+        free(workers[i].conns);
+        free(workers[i].idle);
+    }
+    free(workers);
+    for (size_t cmp = 0; cmp < 2; ++cmp) {
+        free(opt.echo_frames[cmp][0]);
+        free(opt.echo_frames[cmp][1]);
+    }
+    free(echo_payload);
+    if (opt.dict) {
+        destroy_decompression_tree(opt.tree);
+        destroy_compression_dict(opt.dict);
+    }
+    pthread_barrier_destroy(&ready);
+    return EXIT_SUCCESS;
+}
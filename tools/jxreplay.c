@@ -0,0 +1,1406 @@
+//
+// Replays a trace recorded by the server (JX_CAPTURE) against a server, and
+// compares the results of two replays, e.g. of the same trace against two
+// builds. Build and run with
+//
+//     gcc -O2 -o jxreplay tools/jxreplay.c stats/histogram.c
+//             data_structures/compression_dictionary/compression_dict.c
+//             data_structures/decompression_tree/decompression_tree.c
+//             memory/safe_alloc.c
+//     ./jxreplay [options] <trace> <ip> <port>
+//     ./jxreplay -C <before.json> <after.json>
+//
+// Options:
+//     -s x    speed, trace times are divided by x. 0 sends each request as
+//             soon as its connection is free, and every request is due at
+//             the start (default 1)
+//     -w s    seconds to wait for responces once the last request is due
+//             (default 10)
+//     -o path writes the result as JSON lines, to be compared with -C
+//     -S n    first RetFile session id (default 0x4a580000)
+//     -C      compares two results, printing the change of each figure
+//
+// Each captured connection is replayed on a connection of its own, opened
+// when its first request is due and closed after its last is answered.
+// Requests of a connection are sent in order, each once it is due and the
+// one before has been answered. Latency is measured from when a request was
+// due, so a stalled server delays the rest of the connection without hiding
+// the stall. Service time, from the request being sent, is reported
+// alongside. A replay is deterministic bar the server: the schedule and every
+// byte sent follow from the trace and options alone.
+//
+// Payloads the capture did not keep, streamed or past its limit, are filled
+// in by repeating the kept bytes, or a fixed pattern if none were kept.
+// RetFile requests need their whole payload, and are skipped otherwise.
+// RetFile session ids are replaced with fresh ones, shared by the requests
+// that joined the captured session while it is in progress, so the replay
+// does not join sessions of other clients. Shutdown requests are skipped.
+// Compressed RetFile requests and responces need compression.dict in the
+// working directory.
+//
+
+#include "../stats/histogram.h"
+#include "../data_structures/decompression_tree/decompression_tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define CAPTURE_VERSION 1 // trace format read, see stats/capture.h
+#define RESULT_VERSION 1
+#define DEFAULT_WAIT_S 10
+#define DEFAULT_SESSION_BASE 0x4a580000
+
+#define N_TYPES 16 // by header type
+#define HEADER_LEN 9 // type byte and big endian payload length
+#define RET_FILE_TYPE 0x6
+#define RET_FILE_RSP_TYPE 0x7
+#define SHUTDOWN_TYPE 0x8
+#define ERROR_TYPE 0xf
+#define RET_FILE_PREFIX_LEN 20 // session id, offset, length
+#define MAX_CODE_BITS 32 // longest code of a compression dictionary
+// compressed bytes holding at least the RetFile prefix
+#define PREFIX_KEEP_LEN (RET_FILE_PREFIX_LEN * MAX_CODE_BITS / 8)
+
+#define WRITE_CHUNK_LEN 65536
+#define READ_BUFFER_LEN 65536
+#define MAX_EVENTS 256
+#define MAX_WAIT_MS 100
+#define TIMER_ID UINT64_MAX // epoll data of the schedule timer
+#define NO_REQUEST SIZE_MAX
+
+#define N_PERCENTILES 4
+#define N_SUMMARY_KEYS 4
+#define N_TYPE_KEYS 7
+
+static const char *type_names[N_TYPES] = {
+        "echo", "type1", "listdir", "type3", "filesize", "type5", "retfile",
+        "type7", "shutdown", "type9", "stats", "type11", "type12", "type13",
+        "type14", "type15"
+};
+
+static const uint64_t percentiles[N_PERCENTILES] = {50000, 90000, 99000, 99900};
+
+// figures compared by -C, as written by write_result
+static const char *summary_keys[N_SUMMARY_KEYS] = {
+        "requests_per_s", "rx_mib_per_s", "errors", "unfinished"
+};
+static const char *type_keys[N_TYPE_KEYS] = {
+        "count", "errors", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us"
+};
+
+typedef struct {
+    uint64_t t_us; // captured arrival
+    uint64_t due_ns; // since the start of the replay
+    uint64_t captured_conn;
+    size_t line; // of the trace, orders requests arriving together
+    size_t conn;
+    size_t next_on_conn; // NO_REQUEST if last of its connection
+    uint8_t header; // type and flags
+    uint64_t payload_len; // bytes sent
+    uint8_t *kept; // payload bytes kept by the capture, may be NULL
+    size_t n_kept;
+    // uncompressed RetFile payload, session id replaced on send. kept if
+    // the request is not compressed. NULL for other types
+    uint8_t *plain;
+    size_t plain_len;
+} Request;
+
+// request in order of being due
+typedef struct {
+    uint64_t due_ns; // since the start of the replay
+    size_t request;
+} Due;
+
+typedef struct {
+    uint32_t captured; // session id of the trace
+    uint32_t id; // session id sent
+    uint64_t remaining; // bytes not yet received
+    size_t n_waiting; // requests in flight on it
+    size_t first_waiting; // connection, linked by next_waiting
+} Session;
+
+typedef struct {
+    int fd; // -1 until its first request is due, and once closed
+    bool dead; // failed, its remaining requests are errors
+    size_t head; // first request not sent
+    size_t in_flight; // NO_REQUEST if none
+    uint32_t session; // of a RetFile request in flight
+    size_t next_waiting; // connection waiting on the same session
+    uint64_t sent_ns;
+    uint64_t out_n; // bytes of the request in flight written
+    bool want_write; // EPOLLOUT registered
+    uint8_t header[HEADER_LEN]; // responce being read
+    size_t header_n;
+    uint64_t payload_len;
+    uint64_t payload_n;
+    uint8_t prefix[PREFIX_KEEP_LEN]; // start of a RetFile responce
+} Conn;
+
+typedef struct {
+    struct sockaddr_in addr;
+    double speed;
+    double wait_s;
+    uint32_t next_session;
+    CompressionSegment *dict;
+    DecompressionTreeNode *tree;
+    Request *requests;
+    size_t n_requests;
+    Due *due;
+    Conn *conns;
+    size_t n_conns;
+    Session *sessions; // in progress
+    size_t n_sessions;
+    size_t sessions_len;
+    int epoll_fd;
+    int timer_fd;
+    uint64_t start_ns;
+    uint64_t now_ns; // since the start, read once per loop
+    // results
+    uint64_t n_skipped; // not replayable
+    uint64_t n_dropped; // lost by the capture
+    uint64_t n_finished; // answered or failed
+    Histogram latency[N_TYPES]; // from being due
+    Histogram service[N_TYPES]; // from being sent
+    uint64_t max_latency[N_TYPES];
+    uint64_t max_service[N_TYPES];
+    uint64_t n_completed[N_TYPES];
+    uint64_t n_errors[N_TYPES];
+    uint64_t n_unfinished; // in flight or not sent at the end
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+} Replay;
+
+// figures of a result file
+typedef struct {
+    double speed;
+    double summary[N_SUMMARY_KEYS];
+    bool has_type[N_TYPES];
+    double types[N_TYPES][N_TYPE_KEYS];
+} Result;
+
+/** @brief Prints usage and exits with EXIT_FAILURE.
+ *
+ *  @param name : Program name.
+ */
+static void usage(const char *name);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+/** @brief Finds the value of a key on a JSON line.
+ *
+ *  Lines are flat objects, as written by the capture and write_result.
+ *
+ *  @param line : Null terminated line.
+ *  @param key : Key, without quotes.
+ *  @return start of the value, NULL if the key is not on the line.
+ */
+static const char *json_value(const char *line, const char *key);
+
+/** @brief Reads a number from a JSON line.
+ *
+ *  @param line : Null terminated line.
+ *  @param key : Key, without quotes.
+ *  @param value : Address to store the number.
+ *  @return 0 on success, -1 if the key is not on the line.
+ */
+static int json_number(const char *line, const char *key, double *value);
+
+/** @brief Reads a boolean from a JSON line.
+ *
+ *  @param line : Null terminated line.
+ *  @param key : Key, without quotes.
+ *  @return true if the value is true, false otherwise.
+ */
+static bool json_true(const char *line, const char *key);
+
+/** @brief Decodes base64 up to the closing quote of a JSON string.
+ *
+ *  @param src : Start of the string, past the opening quote.
+ *  @param n : Address to store the number of bytes decoded.
+ *  @return decoded bytes, NULL if there are none.
+ */
+static uint8_t *decode_base64(const char *src, size_t *n);
+
+/** @brief Loads the compression dictionary, once.
+ *
+ *  @param r : Replay instance.
+ */
+static void load_dictionary(Replay *r);
+
+/** @brief Reads the requests of a trace.
+ *
+ *  Exits if the trace cannot be read.
+ *
+ *  @param r : Replay instance.
+ *  @param path : Trace file path.
+ */
+static void load_trace(Replay *r, const char *path);
+
+/** @brief Prepares a RetFile request for its session id to be replaced.
+ *
+ *  If the payload was not kept whole, or the range is empty, the request is
+ *  skipped. If the payload is too short to hold a session, it is sent as
+ *  captured.
+ *
+ *  @param r : Replay instance.
+ *  @param req : RetFile request.
+ *  @return 0 on success, -1 if the request is to be skipped.
+ */
+static int load_ret_file(Replay *r, Request *req);
+
+/** @brief Orders requests by connection, and then by when they are due.
+ *
+ *  @param r : Replay instance.
+ */
+static void schedule(Replay *r);
+
+/** @brief Compares requests by captured connection and arrival.
+ *
+ *  @return comparison, as qsort expects.
+ */
+static int compare_by_conn(const void *a, const void *b);
+
+/** @brief Compares requests by when they are due.
+ *
+ *  @return comparison, as qsort expects.
+ */
+static int compare_by_due(const void *a, const void *b);
+
+/** @brief Compresses data with the compression dictionary.
+ *
+ *  Output is in the format of the server, codes followed by the number of
+ *  padding bits, and holds at most n * MAX_CODE_BITS / 8 + 2 bytes.
+ *
+ *  @param dict : Compression dictionary.
+ *  @param in : Data to compress.
+ *  @param n : Bytes of data.
+ *  @param out : Compressed data.
+ *  @return compressed bytes.
+ */
+static size_t compress_payload(CompressionSegment *dict, const uint8_t *in,
+        size_t n, uint8_t *out);
+
+/** @brief Decompresses bits of compressed data.
+ *
+ *  @param tree : Decompression tree.
+ *  @param in : Compressed data.
+ *  @param n_bits : Bits of compressed data to read at most.
+ *  @param out : Decompressed data.
+ *  @param out_n : Bytes to decompress at most.
+ *  @return bytes decompressed.
+ */
+static size_t decompress_bits(DecompressionTreeNode *tree, const uint8_t *in,
+        uint64_t n_bits, uint8_t *out, size_t out_n);
+
+/** @brief Runs the replay until every request is answered, or the wait
+ *  after the last is due has passed.
+ *
+ *  @param r : Replay instance.
+ */
+static void run(Replay *r);
+
+/** @brief Sends the next request of a connection, connecting first if
+ *  needed.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Idle connection, with a request due.
+ */
+static void send_request(Replay *r, Conn *c);
+
+/** @brief Joins the RetFile request of a connection to a session, and
+ *  replaces its session id.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ *  @param req : RetFile request.
+ */
+static void join_session(Replay *r, Conn *c, Request *req);
+
+/** @brief Returns a session in progress by the id sent.
+ *
+ *  @param r : Replay instance.
+ *  @param id : Session id.
+ *  @return Session, NULL if none.
+ */
+static Session *find_session(Replay *r, uint32_t id);
+
+/** @brief Ends a session, completing every request waiting on it.
+ *
+ *  @param r : Replay instance.
+ *  @param s : Session.
+ *  @param ok : Whether the requests succeeded.
+ */
+static void end_session(Replay *r, Session *s, bool ok);
+
+/** @brief Writes bytes of a request frame.
+ *
+ *  @param req : Request.
+ *  @param pos : Offset within the frame.
+ *  @param buf : Destination.
+ *  @param n : Bytes of buf.
+ *  @return bytes written to buf.
+ */
+static size_t fill_frame(Request *req, uint64_t pos, uint8_t *buf, size_t n);
+
+/** @brief Writes as much of the request in flight on a connection as fits.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 if the connection failed.
+ */
+static int flush_conn(Replay *r, Conn *c);
+
+/** @brief Reads every available byte of a connection.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 if the connection failed or sent an error.
+ */
+static int read_conn(Replay *r, Conn *c);
+
+/** @brief Handles a fully read responce.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ *  @return 0 on success, -1 on an error or unexpected responce.
+ */
+static int responce_done(Replay *r, Conn *c);
+
+/** @brief Finishes the request in flight on a connection, and sends the
+ *  next if it is due.
+ *
+ *  The connection is closed after its last request.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ *  @param ok : Whether the request succeeded.
+ */
+static void finish(Replay *r, Conn *c, bool ok);
+
+/** @brief Closes a failed connection, failing its remaining requests.
+ *
+ *  @param r : Replay instance.
+ *  @param c : Connection.
+ */
+static void fail_conn(Replay *r, Conn *c);
+
+/** @brief Returns percentiles of a histogram.
+ *
+ *  @param hist : Histogram.
+ *  @param max : Largest value recorded, bucket bounds may lie past it.
+ *  @param values : N_PERCENTILES values, in order of percentiles.
+ */
+static void read_percentiles(Histogram *hist, uint64_t max,
+        uint64_t *values);
+
+/** @brief Prints percentiles per type.
+ *
+ *  @param r : Finished replay.
+ *  @param service : Whether service time or latency is printed.
+ */
+static void print_latency(Replay *r, bool service);
+
+/** @brief Writes the result of a replay as JSON lines.
+ *
+ *  @param r : Finished replay.
+ *  @param path : Result file path.
+ *  @param trace : Trace file path.
+ *  @param seconds : Length of the replay.
+ */
+static void write_result(Replay *r, const char *path, const char *trace,
+        double seconds);
+
+/** @brief Reads a result written by write_result.
+ *
+ *  Exits if the result cannot be read.
+ *
+ *  @param path : Result file path.
+ *  @param result : Result to fill.
+ */
+static void read_result(const char *path, Result *result);
+
+/** @brief Prints a figure of two results and its change.
+ *
+ *  @param label : Name of the figure.
+ *  @param key : Key of the figure.
+ *  @param before : Value of the first result.
+ *  @param after : Value of the second result.
+ */
+static void print_change(const char *label, const char *key, double before,
+        double after);
+
+/** @brief Compares two results.
+ *
+ *  @param before : First result file path.
+ *  @param after : Second result file path.
+ *  @return exit status.
+ */
+static int compare(const char *before, const char *after);
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s speed] [-w seconds] [-o result] "
+            "[-S session] <trace> <ip> <port>\n"
+            "       %s -C <before> <after>\n", name, name);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *json_value(const char *line, const char *key) {
+    size_t key_len = strlen(key);
+    for (const char *p = strchr(line, '"'); p; p = strchr(p + 1, '"')) {
+        if (!strncmp(p + 1, key, key_len) && p[key_len + 1] == '"' &&
+            p[key_len + 2] == ':') {
+            p += key_len + 3;
+            while (*p == ' ') {
+                ++p;
+            }
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int json_number(const char *line, const char *key, double *value) {
+    const char *p = json_value(line, key);
+    if (!p) {
+        return -1;
+    }
+    *value = strtod(p, NULL);
+    return 0;
+}
+
+static bool json_true(const char *line, const char *key) {
+    const char *p = json_value(line, key);
+    return p && !strncmp(p, "true", 4);
+}
+
+static uint8_t *decode_base64(const char *src, size_t *n) {
+    size_t len = strcspn(src, "\"");
+    *n = 0;
+    if (!len) {
+        return NULL;
+    }
+
+    uint8_t *out = safe_malloc(len / 4 * 3 + 3);
+    uint32_t v = 0;
+    size_t n_digits = 0;
+    for (size_t i = 0; i < len && src[i] != '='; ++i) {
+        const char d = src[i];
+        uint32_t bits = d >= 'A' && d <= 'Z' ? d - 'A' :
+                d >= 'a' && d <= 'z' ? d - 'a' + 26 :
+                d >= '0' && d <= '9' ? d - '0' + 52 : d == '+' ? 62 : 63;
+        v = v << 6 | bits;
+        if (++n_digits == 4) {
+            out[(*n)++] = v >> 16;
+            out[(*n)++] = v >> 8;
+            out[(*n)++] = v;
+            n_digits = 0;
+            v = 0;
+        }
+    }
+    // a padded group holds one or two bytes
+    if (n_digits == 2) {
+        out[(*n)++] = v >> 4;
+    } else if (n_digits == 3) {
+        out[(*n)++] = v >> 10;
+        out[(*n)++] = v >> 2;
+    }
+    return out;
+}
+
+static void load_dictionary(Replay *r) {
+    if (!r->dict) {
+        // read from the working directory, as the server does
+        r->dict = parse_compression_dictionary();
+        r->tree = init_decompression_tree(r->dict);
+    }
+    return;
+}
+
+static void load_trace(Replay *r, const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("unable to open trace");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t requests_len = 1024;
+    r->requests = safe_malloc(requests_len * sizeof(Request));
+    char *line = NULL;
+    size_t line_len = 0;
+    size_t line_n = 0;
+    double value = 0;
+    while (getline(&line, &line_len, in) > 0) {
+        ++line_n;
+        if (!json_number(line, "capture", &value)) {
+            if (value != CAPTURE_VERSION) {
+                fprintf(stderr, "unknown trace version %.0f\n", value);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        } else if (!json_number(line, "dropped", &value)) {
+            r->n_dropped += value;
+            continue;
+        }
+
+        double t_us = 0;
+        double conn = 0;
+        double type = 0;
+        double payload_len = 0;
+        const char *payload = json_value(line, "payload");
+        if (json_number(line, "t_us", &t_us) ||
+            json_number(line, "conn", &conn) ||
+            json_number(line, "type", &type) ||
+            json_number(line, "payload_len", &payload_len) ||
+            !payload || *payload != '"') {
+            fprintf(stderr, "malformed trace line %zu\n", line_n);
+            exit(EXIT_FAILURE);
+        }
+        if ((uint8_t) type == SHUTDOWN_TYPE) {
+            ++r->n_skipped;
+            continue;
+        }
+
+        if (r->n_requests == requests_len) {
+            requests_len *= 2;
+            r->requests = safe_realloc(r->requests,
+                    requests_len * sizeof(Request));
+        }
+        Request *req = &r->requests[r->n_requests];
+        memset(req, 0, sizeof(Request));
+        req->t_us = t_us;
+        req->captured_conn = conn;
+        req->line = line_n;
+        req->header = (uint8_t) type << 4 |
+                json_true(line, "compressed") << 3 |
+                json_true(line, "requires_compression") << 2;
+        req->payload_len = payload_len;
+        req->kept = decode_base64(payload + 1, &req->n_kept);
+        if (req->n_kept > req->payload_len) {
+            req->n_kept = req->payload_len;
+        }
+        if ((uint8_t) type == RET_FILE_TYPE && load_ret_file(r, req) < 0) {
+            free(req->kept);
+            ++r->n_skipped;
+            continue;
+        }
+        ++r->n_requests;
+    }
+    free(line);
+    fclose(in);
+    return;
+}
+
+static int load_ret_file(Replay *r, Request *req) {
+    if (req->n_kept < req->payload_len) {
+        return -1;
+    }
+    if (req->header & 0x04) {
+        // chunk prefixes are compressed
+        load_dictionary(r);
+    }
+    if (!(req->header & 0x08)) {
+        req->plain = req->kept;
+        req->plain_len = req->n_kept;
+    } else if (req->n_kept && req->kept[req->n_kept - 1] < 8) {
+        load_dictionary(r);
+        uint64_t n_bits = (req->n_kept - 1) * 8 - req->kept[req->n_kept - 1];
+        // codes are a bit long at least
+        req->plain = safe_malloc(n_bits + 1);
+        req->plain_len = decompress_bits(r->tree, req->kept, n_bits,
+                req->plain, n_bits);
+    }
+
+    uint64_t length = 0;
+    for (size_t i = 0; req->plain && i < 8 &&
+            req->plain_len >= RET_FILE_PREFIX_LEN; ++i) {
+        length = length << 8 | req->plain[12 + i];
+    }
+    if (req->plain && req->plain_len >= RET_FILE_PREFIX_LEN && !length) {
+        // nothing is sent for an empty range, so it cannot be timed
+        if (req->plain != req->kept) {
+            free(req->plain);
+        }
+        return -1;
+    } else if (req->plain && req->plain_len < RET_FILE_PREFIX_LEN) {
+        // answered with an error, as it was when captured
+        if (req->plain != req->kept) {
+            free(req->plain);
+        }
+        req->plain = NULL;
+    }
+    return 0;
+}
+
+static void schedule(Replay *r) {
+    qsort(r->requests, r->n_requests, sizeof(Request), compare_by_conn);
+
+    // replay starts with the first request captured
+    uint64_t first_us = UINT64_MAX;
+    for (size_t i = 0; i < r->n_requests; ++i) {
+        first_us = r->requests[i].t_us < first_us ? r->requests[i].t_us :
+                first_us;
+    }
+
+    r->due = safe_malloc((r->n_requests + 1) * sizeof(Due));
+    r->conns = safe_calloc(r->n_requests + 1, sizeof(Conn));
+    for (size_t i = 0; i < r->n_requests; ++i) {
+        Request *req = &r->requests[i];
+        if (!i || req->captured_conn != req[-1].captured_conn) {
+            Conn *c = &r->conns[r->n_conns++];
+            c->fd = -1;
+            c->head = i;
+            c->in_flight = NO_REQUEST;
+        } else {
+            req[-1].next_on_conn = i;
+        }
+        req->conn = r->n_conns - 1;
+        req->next_on_conn = NO_REQUEST;
+        req->due_ns = r->speed ?
+                (uint64_t) ((req->t_us - first_us) * 1000 / r->speed) : 0;
+        r->due[i].due_ns = req->due_ns;
+        r->due[i].request = i;
+    }
+    qsort(r->due, r->n_requests, sizeof(Due), compare_by_due);
+    return;
+}
+
+static int compare_by_conn(const void *a, const void *b) {
+    const Request *x = (const Request *) a;
+    const Request *y = (const Request *) b;
+    if (x->captured_conn != y->captured_conn) {
+        return x->captured_conn < y->captured_conn ? -1 : 1;
+    } else if (x->t_us != y->t_us) {
+        return x->t_us < y->t_us ? -1 : 1;
+    }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int compare_by_due(const void *a, const void *b) {
+    const Due *x = (const Due *) a;
+    const Due *y = (const Due *) b;
+    if (x->due_ns != y->due_ns) {
+        return x->due_ns < y->due_ns ? -1 : 1;
+    }
+    return x->request < y->request ? -1 : x->request > y->request;
+}
+
+static size_t compress_payload(CompressionSegment *dict, const uint8_t *in,
+        size_t n, uint8_t *out) {
+    size_t n_bits = 0;
+    out[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t code = dict[in[i]].compressed;
+        for (int b = dict[in[i]].compressed_len - 1; b >= 0; --b) {
+            if (!(n_bits % 8)) {
+                out[n_bits / 8] = 0;
+            }
+            // most significant bit first, as the server reads them
+            out[n_bits / 8] |= ((code >> b) & 0x1) << (7 - n_bits % 8);
+            ++n_bits;
+        }
+    }
+    size_t len = (n_bits + 7) / 8;
+    out[len] = (8 - n_bits % 8) % 8;
+    return len + 1;
+}
+
+static size_t decompress_bits(DecompressionTreeNode *tree, const uint8_t *in,
+        uint64_t n_bits, uint8_t *out, size_t out_n) {
+    DecompressionTreeNode *node = tree;
+    size_t n_out = 0;
+    for (uint64_t i = 0; i < n_bits && n_out < out_n; ++i) {
+        node = (in[i / 8] >> (7 - i % 8)) & 0x1 ? node->right : node->left;
+        if (!node) {
+            break;
+        }
+        if (!node->left && !node->right) {
+            out[n_out++] = node->data;
+            node = tree;
+        }
+    }
+    return n_out;
+}
+
+static void run(Replay *r) {
+    r->epoll_fd = epoll_create1(0);
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = TIMER_ID};
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->timer_fd, &ev);
+
+    uint64_t last_due = r->n_requests ? r->due[r->n_requests - 1].due_ns : 0;
+    uint64_t end_ns = last_due + (uint64_t) (r->wait_s * 1e9);
+    size_t next_due = 0;
+    uint64_t timer_armed = UINT64_MAX;
+    struct epoll_event events[MAX_EVENTS];
+    r->start_ns = monotonic_ns();
+    r->now_ns = 0;
+    while (r->n_finished < r->n_requests && r->now_ns < end_ns) {
+        while (next_due < r->n_requests &&
+               r->due[next_due].due_ns <= r->now_ns) {
+            size_t i = r->due[next_due++].request;
+            Conn *c = &r->conns[r->requests[i].conn];
+            // sent once the request before is answered otherwise
+            if (c->in_flight == NO_REQUEST && c->head == i) {
+                send_request(r, c);
+            }
+        }
+        if (next_due < r->n_requests && timer_armed != next_due) {
+            uint64_t at = r->start_ns + r->due[next_due].due_ns;
+            struct itimerspec its = {
+                    .it_value = {at / 1000000000, at % 1000000000}
+            };
+            timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+            timer_armed = next_due;
+        }
+
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, MAX_WAIT_MS);
+        r->now_ns = monotonic_ns() - r->start_ns;
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 == TIMER_ID) {
+                uint64_t expirations;
+                read(r->timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+            Conn *c = &r->conns[events[i].data.u64];
+            // closed by an earlier event of the batch
+            if (c->fd < 0) {
+                continue;
+            }
+            int ret = 0;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ret = read_conn(r, c);
+            }
+            if (!ret && c->fd >= 0 && events[i].events & EPOLLOUT) {
+                ret = flush_conn(r, c);
+            }
+            if (ret) {
+                fail_conn(r, c);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < r->n_conns; ++i) {
+        Conn *c = &r->conns[i];
+        for (size_t j = c->in_flight != NO_REQUEST ? c->in_flight : c->head;
+                j != NO_REQUEST; j = r->requests[j].next_on_conn) {
+            ++r->n_unfinished;
+        }
+        if (c->fd >= 0) {
+            close(c->fd);
+        }
+    }
+    close(r->timer_fd);
+    close(r->epoll_fd);
+    return;
+}
+
+static void send_request(Replay *r, Conn *c) {
+    Request *req = &r->requests[c->head];
+    if (c->fd < 0) {
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr *) &r->addr,
+                sizeof(r->addr))) {
+            perror("unable to connect");
+            exit(EXIT_FAILURE);
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {
+                .events = EPOLLIN, .data.u64 = c - r->conns
+        };
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    c->in_flight = c->head;
+    c->head = req->next_on_conn;
+    c->out_n = 0;
+    c->sent_ns = monotonic_ns();
+    if (req->plain) {
+        join_session(r, c, req);
+    }
+    if (flush_conn(r, c)) {
+        fail_conn(r, c);
+    }
+    return;
+}
+
+static void join_session(Replay *r, Conn *c, Request *req) {
+    uint32_t captured = 0;
+    uint64_t length = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        captured = captured << 8 | req->plain[i];
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        length = length << 8 | req->plain[12 + i];
+    }
+
+    Session *s = NULL;
+    for (size_t i = 0; i < r->n_sessions && !s; ++i) {
+        s = r->sessions[i].captured == captured ? &r->sessions[i] : NULL;
+    }
+    if (!s) {
+        if (r->n_sessions == r->sessions_len) {
+            r->sessions_len = r->sessions_len ? 2 * r->sessions_len : 64;
+            r->sessions = safe_realloc(r->sessions,
+                    r->sessions_len * sizeof(Session));
+        }
+        s = &r->sessions[r->n_sessions++];
+        s->captured = captured;
+        s->id = r->next_session++;
+        s->remaining = length;
+        s->n_waiting = 0;
+        s->first_waiting = NO_REQUEST;
+    }
+    ++s->n_waiting;
+    c->session = s->id;
+    c->next_waiting = s->first_waiting;
+    s->first_waiting = c - r->conns;
+
+    for (size_t i = 0; i < 4; ++i) {
+        req->plain[i] = s->id >> (24 - 8 * i);
+    }
+    if (req->plain != req->kept) {
+        free(req->kept);
+        req->kept = safe_malloc(req->plain_len * MAX_CODE_BITS / 8 + 2);
+        req->n_kept = compress_payload(r->dict, req->plain, req->plain_len,
+                req->kept);
+        req->payload_len = req->n_kept;
+    }
+    return;
+}
+
+static Session *find_session(Replay *r, uint32_t id) {
+    for (size_t i = 0; i < r->n_sessions; ++i) {
+        if (r->sessions[i].id == id) {
+            return &r->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static void end_session(Replay *r, Session *s, bool ok) {
+    uint32_t id = s->id;
+    size_t next = s->first_waiting;
+    // requests sent from now on start a new session
+    *s = r->sessions[--r->n_sessions];
+
+    while (next != NO_REQUEST) {
+        Conn *c = &r->conns[next];
+        next = c->next_waiting;
+        // failed connections are left linked
+        if (c->in_flight != NO_REQUEST && r->requests[c->in_flight].plain &&
+            c->session == id) {
+            finish(r, c, ok);
+        }
+    }
+    return;
+}
+
+static size_t fill_frame(Request *req, uint64_t pos, uint8_t *buf, size_t n) {
+    uint64_t frame_len = HEADER_LEN + req->payload_len;
+    if (n > frame_len - pos) {
+        n = frame_len - pos;
+    }
+
+    size_t i = 0;
+    for (; i < n && pos < HEADER_LEN; ++i, ++pos) {
+        buf[i] = pos ? req->payload_len >> (8 * (HEADER_LEN - 1 - pos)) :
+                req->header;
+    }
+    uint64_t p = pos - HEADER_LEN;
+    if (p < req->n_kept) {
+        size_t take = req->n_kept - p < n - i ? req->n_kept - p : n - i;
+        memcpy(buf + i, req->kept + p, take);
+        i += take;
+        p += take;
+    }
+    // payload not kept by the capture
+    for (; i < n; ++i, ++p) {
+        buf[i] = req->n_kept ? req->kept[p % req->n_kept] : 'a' + p % 26;
+    }
+    return n;
+}
+
+static int flush_conn(Replay *r, Conn *c) {
+    if (c->in_flight == NO_REQUEST) {
+        return 0;
+    }
+
+    Request *req = &r->requests[c->in_flight];
+    uint64_t frame_len = HEADER_LEN + req->payload_len;
+    uint8_t buf[WRITE_CHUNK_LEN];
+    while (c->out_n < frame_len) {
+        size_t len = fill_frame(req, c->out_n, buf, sizeof(buf));
+        ssize_t n = write(c->fd, buf, len);
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n <= 0) {
+            return -1;
+        }
+        c->out_n += n;
+        r->tx_bytes += n;
+    }
+
+    // only waits on writes while part of a request is left
+    bool want_write = c->out_n < frame_len;
+    if (want_write != c->want_write) {
+        struct epoll_event ev = {
+                .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+                .data.u64 = c - r->conns
+        };
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+    return 0;
+}
+
+static int read_conn(Replay *r, Conn *c) {
+    uint8_t buf[READ_BUFFER_LEN];
+    while (c->fd >= 0) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        } else if (n <= 0) {
+            return -1;
+        }
+        r->rx_bytes += n;
+
+        const uint8_t *p = buf;
+        while (n) {
+            if (c->header_n < HEADER_LEN) {
+                size_t take = HEADER_LEN - c->header_n < (size_t) n ?
+                        HEADER_LEN - c->header_n : (size_t) n;
+                memcpy(c->header + c->header_n, p, take);
+                c->header_n += take;
+                p += take;
+                n -= take;
+                if (c->header_n < HEADER_LEN) {
+                    break;
+                }
+                c->payload_len = 0;
+                for (size_t i = 0; i < 8; ++i) {
+                    c->payload_len = c->payload_len << 8 | c->header[1 + i];
+                }
+                c->payload_n = 0;
+            } else {
+                // payloads are discarded, bar the start of RetFile chunks
+                uint64_t left = c->payload_len - c->payload_n;
+                size_t take = left < (uint64_t) n ? left : (size_t) n;
+                if (c->payload_n < PREFIX_KEEP_LEN) {
+                    size_t keep = PREFIX_KEEP_LEN - c->payload_n < take ?
+                            PREFIX_KEEP_LEN - c->payload_n : take;
+                    memcpy(c->prefix + c->payload_n, p, keep);
+                }
+                c->payload_n += take;
+                p += take;
+                n -= take;
+            }
+
+            if (c->header_n == HEADER_LEN && c->payload_n == c->payload_len) {
+                c->header_n = 0;
+                if (responce_done(r, c)) {
+                    return -1;
+                } else if (c->fd < 0) {
+                    // closed after its last request
+                    return 0;
+                }
+            }
+        }
+    }
+    // closed after its last request
+    return 0;
+}
+
+static int responce_done(Replay *r, Conn *c) {
+    uint8_t type = c->header[0] >> 4;
+    if (type == ERROR_TYPE) {
+        // server closes the connection after an error
+        return -1;
+    } else if (type != RET_FILE_RSP_TYPE) {
+        if (c->in_flight == NO_REQUEST ||
+            type != (r->requests[c->in_flight].header >> 4 | 1)) {
+            return -1;
+        }
+        finish(r, c, true);
+        return 0;
+    }
+
+    uint8_t prefix[RET_FILE_PREFIX_LEN];
+    size_t kept = c->payload_len < PREFIX_KEEP_LEN ?
+            c->payload_len : PREFIX_KEEP_LEN;
+    if (c->header[0] & 0x08) {
+        if (!r->tree || decompress_bits(r->tree, c->prefix, kept * 8, prefix,
+                RET_FILE_PREFIX_LEN) < RET_FILE_PREFIX_LEN) {
+            return -1;
+        }
+    } else if (kept < RET_FILE_PREFIX_LEN) {
+        return -1;
+    } else {
+        memcpy(prefix, c->prefix, RET_FILE_PREFIX_LEN);
+    }
+
+    uint32_t id = 0;
+    uint64_t n_bytes = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        id = id << 8 | prefix[i];
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        n_bytes = n_bytes << 8 | prefix[12 + i];
+    }
+    // connections joining a session late may be sent chunks after the range
+    // is complete
+    Session *s = find_session(r, id);
+    if (!s) {
+        return 0;
+    }
+    s->remaining -= n_bytes < s->remaining ? n_bytes : s->remaining;
+    if (!s->remaining) {
+        end_session(r, s, true);
+    }
+    return 0;
+}
+
+static void finish(Replay *r, Conn *c, bool ok) {
+    Request *req = &r->requests[c->in_flight];
+    uint8_t type = req->header >> 4;
+    uint64_t now = monotonic_ns();
+    if (ok) {
+        uint64_t latency = now - r->start_ns - req->due_ns;
+        uint64_t service = now - c->sent_ns;
+        histogram_record(&r->latency[type], latency);
+        histogram_record(&r->service[type], service);
+        if (latency > r->max_latency[type]) {
+            r->max_latency[type] = latency;
+        }
+        if (service > r->max_service[type]) {
+            r->max_service[type] = service;
+        }
+        ++r->n_completed[type];
+    } else {
+        ++r->n_errors[type];
+    }
+    ++r->n_finished;
+    c->in_flight = NO_REQUEST;
+
+    if (c->dead) {
+        return;
+    } else if (c->head == NO_REQUEST) {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    r->now_ns = now - r->start_ns;
+    // sent by the run loop once due otherwise
+    if (r->requests[c->head].due_ns <= r->now_ns) {
+        send_request(r, c);
+    }
+    return;
+}
+
+static void fail_conn(Replay *r, Conn *c) {
+    if (c->dead) {
+        return;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->dead = true;
+    c->header_n = 0;
+    if (c->in_flight != NO_REQUEST) {
+        Session *s = r->requests[c->in_flight].plain ?
+                find_session(r, c->session) : NULL;
+        if (s && !--s->n_waiting) {
+            // nothing is left to receive it
+            end_session(r, s, false);
+        }
+        if (c->in_flight != NO_REQUEST) {
+            finish(r, c, false);
+        }
+    }
+    for (; c->head != NO_REQUEST; c->head =
+            r->requests[c->head].next_on_conn) {
+        ++r->n_errors[r->requests[c->head].header >> 4];
+        ++r->n_finished;
+    }
+    return;
+}
+
+static void read_percentiles(Histogram *hist, uint64_t max,
+        uint64_t *values) {
+    uint64_t *buckets = safe_calloc(HISTOGRAM_LEN, sizeof(uint64_t));
+    histogram_merge(buckets, hist);
+    for (size_t p = 0; p < N_PERCENTILES; ++p) {
+        // bucket bounds may lie past the largest value recorded
+        values[p] = histogram_percentile(buckets, percentiles[p]);
+        values[p] = values[p] < max ? values[p] : max;
+    }
+    free(buckets);
+    return;
+}
+
+static void print_latency(Replay *r, bool service) {
+    printf("%-9s %10s %8s %10s %10s %10s %10s %10s\n", "TYPE", "COUNT",
+            "ERRORS", "P50 us", "P90 us", "P99 us", "P99.9 us", "MAX us");
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        if (!r->n_completed[t] && !r->n_errors[t]) {
+            continue;
+        }
+        uint64_t max = service ? r->max_service[t] : r->max_latency[t];
+        uint64_t values[N_PERCENTILES];
+        read_percentiles(service ? &r->service[t] : &r->latency[t], max,
+                values);
+        printf("%-9s %10lu %8lu", type_names[t],
+                (unsigned long) r->n_completed[t],
+                (unsigned long) r->n_errors[t]);
+        for (size_t p = 0; p < N_PERCENTILES; ++p) {
+            printf(" %10.1f", values[p] / 1e3);
+        }
+        printf(" %10.1f\n", max / 1e3);
+    }
+    return;
+}
+
+static void write_result(Replay *r, const char *path, const char *trace,
+        double seconds) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror("unable to write result");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t n_completed = 0;
+    uint64_t n_errors = 0;
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        n_completed += r->n_completed[t];
+        n_errors += r->n_errors[t];
+    }
+    fprintf(out, "{\"replay\": %d, \"trace\": \"", RESULT_VERSION);
+    for (const char *p = trace; *p; ++p) {
+        fprintf(out, *p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+    }
+    fprintf(out, "\", \"speed\": %g, \"seconds\": %.3f, \"requests\": %lu, "
+            "\"errors\": %lu, \"unfinished\": %lu, \"skipped\": %lu, "
+            "\"requests_per_s\": %.1f, \"rx_mib_per_s\": %.3f, "
+            "\"tx_mib_per_s\": %.3f}\n", r->speed, seconds,
+            (unsigned long) n_completed, (unsigned long) n_errors,
+            (unsigned long) r->n_unfinished, (unsigned long) r->n_skipped,
+            n_completed / seconds, r->rx_bytes / seconds / 1048576,
+            r->tx_bytes / seconds / 1048576);
+
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        if (!r->n_completed[t] && !r->n_errors[t]) {
+            continue;
+        }
+        uint64_t latency[N_PERCENTILES];
+        uint64_t service[N_PERCENTILES];
+        read_percentiles(&r->latency[t], r->max_latency[t], latency);
+        read_percentiles(&r->service[t], r->max_service[t], service);
+        fprintf(out, "{\"type\": \"%s\", \"count\": %lu, \"errors\": %lu, "
+                "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+                "\"p99.9_us\": %.1f, \"max_us\": %.1f, "
+                "\"service_p50_us\": %.1f, \"service_p99_us\": %.1f, "
+                "\"service_max_us\": %.1f}\n", type_names[t],
+                (unsigned long) r->n_completed[t],
+                (unsigned long) r->n_errors[t], latency[0] / 1e3,
+                latency[1] / 1e3, latency[2] / 1e3, latency[3] / 1e3,
+                r->max_latency[t] / 1e3, service[0] / 1e3, service[2] / 1e3,
+                r->max_service[t] / 1e3);
+    }
+    fclose(out);
+    return;
+}
+
+static void read_result(const char *path, Result *result) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror("unable to open result");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(result, 0, sizeof(Result));
+    bool has_summary = false;
+    char *line = NULL;
+    size_t line_len = 0;
+    double version = 0;
+    while (getline(&line, &line_len, in) > 0) {
+        if (!json_number(line, "replay", &version)) {
+            if (version != RESULT_VERSION) {
+                fprintf(stderr, "%s: unknown result version %.0f\n", path,
+                        version);
+                exit(EXIT_FAILURE);
+            }
+            has_summary = true;
+            json_number(line, "speed", &result->speed);
+            for (size_t k = 0; k < N_SUMMARY_KEYS; ++k) {
+                json_number(line, summary_keys[k], &result->summary[k]);
+            }
+            continue;
+        }
+
+        const char *name = json_value(line, "type");
+        size_t t = 0;
+        while (name && t < N_TYPES && (strncmp(name + 1, type_names[t],
+                strlen(type_names[t])) || name[strlen(type_names[t]) + 1] !=
+                '"')) {
+            ++t;
+        }
+        if (!name || t == N_TYPES) {
+            continue;
+        }
+        result->has_type[t] = true;
+        for (size_t k = 0; k < N_TYPE_KEYS; ++k) {
+            json_number(line, type_keys[k], &result->types[t][k]);
+        }
+    }
+    free(line);
+    fclose(in);
+    if (!has_summary) {
+        fprintf(stderr, "%s is not a replay result\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return;
+}
+
+static void print_change(const char *label, const char *key, double before,
+        double after) {
+    printf("%-9s %-16s %12.1f %12.1f", label, key, before, after);
+    if (before) {
+        printf(" %+9.1f%%\n", (after - before) / before * 100);
+    } else {
+        printf(" %10s\n", after ? "new" : "-");
+    }
+    return;
+}
+
+static int compare(const char *before, const char *after) {
+    Result *results = safe_malloc(2 * sizeof(Result));
+    read_result(before, &results[0]);
+    read_result(after, &results[1]);
+    if (results[0].speed != results[1].speed) {
+        // schedules differ, so latencies are not comparable
+        printf("warning: replayed at speed %g and %g\n\n", results[0].speed,
+                results[1].speed);
+    }
+
+    printf("%-9s %-16s %12s %12s %10s\n", "TYPE", "FIGURE", "BEFORE",
+            "AFTER", "CHANGE");
+    for (size_t k = 0; k < N_SUMMARY_KEYS; ++k) {
+        print_change("all", summary_keys[k], results[0].summary[k],
+                results[1].summary[k]);
+    }
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        if (!results[0].has_type[t] && !results[1].has_type[t]) {
+            continue;
+        }
+        for (size_t k = 0; k < N_TYPE_KEYS; ++k) {
+            print_change(type_names[t], type_keys[k], results[0].types[t][k],
+                    results[1].types[t][k]);
+        }
+    }
+    free(results);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    Replay *r = safe_calloc(1, sizeof(Replay));
+    r->speed = 1;
+    r->wait_s = DEFAULT_WAIT_S;
+    r->next_session = DEFAULT_SESSION_BASE;
+    const char *result_path = NULL;
+    bool comparing = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:w:o:S:C")) != -1) {
+        switch (c) {
+            case 's': r->speed = strtod(optarg, NULL); break;
+            case 'w': r->wait_s = strtod(optarg, NULL); break;
+            case 'o': result_path = optarg; break;
+            case 'S': r->next_session = strtoul(optarg, NULL, 0); break;
+            case 'C': comparing = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (comparing) {
+        free(r);
+        if (argc - optind != 2) {
+            usage(argv[0]);
+        }
+        return compare(argv[optind], argv[optind + 1]);
+    }
+    if (argc - optind != 3 || inet_pton(AF_INET, argv[optind + 1],
+            &r->addr.sin_addr) != 1 || r->speed < 0 || r->wait_s < 0) {
+        usage(argv[0]);
+    }
+    r->addr.sin_family = AF_INET;
+    r->addr.sin_port = htons(strtoul(argv[optind + 2], NULL, 10));
+
+    const char *trace = argv[optind];
+    load_trace(r, trace);
+    schedule(r);
+    run(r);
+    double seconds = (monotonic_ns() - r->start_ns) / 1e9;
+
+    uint64_t n_completed = 0;
+    uint64_t n_errors = 0;
+    for (size_t t = 0; t < N_TYPES; ++t) {
+        n_completed += r->n_completed[t];
+        n_errors += r->n_errors[t];
+    }
+    printf("%s against %s:%s, %zu requests on %zu connections, speed %g, "
+            "%.1f s\n", trace, argv[optind + 1], argv[optind + 2],
+            r->n_requests, r->n_conns, r->speed, seconds);
+    printf("requests %lu (%.1f/s), errors %lu, unfinished %lu, skipped %lu, "
+            "dropped by the capture %lu\n", (unsigned long) n_completed,
+            n_completed / seconds, (unsigned long) n_errors,
+            (unsigned long) r->n_unfinished, (unsigned long) r->n_skipped,
+            (unsigned long) r->n_dropped);
+    printf("rx %.2f MiB/s, tx %.2f MiB/s\n\n", r->rx_bytes / seconds / 1048576,
+            r->tx_bytes / seconds / 1048576);
+    printf("latency from due\n");
+    print_latency(r, false);
+    printf("\nservice time\n");
+    print_latency(r, true);
+    if (result_path) {
+        write_result(r, result_path, trace, seconds);
+    }
+
+    for (size_t i = 0; i < r->n_requests; ++i) {
+        if (r->requests[i].plain != r->requests[i].kept) {
+            free(r->requests[i].plain);
+        }
+        free(r->requests[i].kept);
+    }
+    free(r->requests);
+    free(r->due);
+    free(r->conns);
+    free(r->sessions);
+    if (r->dict) {
+        destroy_decompression_tree(r->tree);
+        destroy_compression_dict(r->dict);
+    }
+    free(r);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+//
+// Live view of a running server, read from its shared memory metrics
+// segment. Nothing is sent over the servers sockets, and the server is never
+// blocked by a reader. Build and run with
+//
+//     gcc -O2 -o jxtop tools/jxtop.c stats/metrics_segment.c stats/histogram.c
+//     ./jxtop [segment] [delay_ms] [iterations]
+//
+// Segment defaults to JX_METRICS_SEGMENT, as read by the server. Rates and
+// latency percentiles cover the time since the previous refresh. Iterations
+// of 0 refresh until interrupted.
+//
+
+#include "../stats/metrics_segment.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#define DEFAULT_DELAY_MS 1000
+
+static const char *type_names[STATS_N_TIMED_TYPES] = {
+        "echo", "listdir", "filesize", "retfile"
+};
+
+static const char *milestone_names[STATS_N_MILESTONES] = {
+        "handled", "first", "last"
+};
+
+static const char *syscall_names[STATS_N_SYSCALLS] = {
+        "RD", "WR", "CTL"
+};
+
+typedef struct {
+    MetricsGroupSlot group;
+    MetricsHandlerSlot *handlers;
+    uint64_t taken_ns; // monotonic ns the view was read
+} View;
+
+/** @brief Copies every slot of the segment.
+ *
+ *  Slots still being written after METRICS_READ_ATTEMPTS are left as in the
+ *  previous view.
+ *
+ *  @param ms : MetricsSegment instance.
+ *  @param view : View to fill.
+ */
+static void read_view(MetricsSegment *ms, View *view);
+
+/** @brief Prints a byte count with a binary unit.
+ *
+ *  @param n : Bytes.
+ *  @param out : Buffer of at least 16 bytes.
+ */
+static void format_bytes(double n, char *out);
+
+/** @brief Prints the event loop of each handler.
+ *
+ *  Syscalls are per request handled, with the share that would block.
+ *
+ *  @param ms : MetricsSegment instance.
+ *  @param now : Current view.
+ *  @param prev : Previous view.
+ *  @param seconds : Time between the views.
+ */
+static void render_loops(MetricsSegment *ms, View *now, View *prev,
+        double seconds);
+
+/** @brief Prints one refresh.
+ *
+ *  @param ms : MetricsSegment instance.
+ *  @param now : Current view.
+ *  @param prev : Previous view.
+ */
+static void render(MetricsSegment *ms, View *now, View *prev);
+
+/** @brief Returns the monotonic clock in nanoseconds.
+ *
+ *  @return nanoseconds.
+ */
+static uint64_t monotonic_ns();
+
+static void read_view(MetricsSegment *ms, View *view) {
+    metrics_read(&ms->group.seq, &view->group, &ms->group,
+            sizeof(MetricsGroupSlot));
+    for (size_t i = 0; i < ms->n_handlers; ++i) {
+        metrics_read(&ms->handlers[i].seq, &view->handlers[i],
+                &ms->handlers[i], sizeof(MetricsHandlerSlot));
+    }
+    view->taken_ns = monotonic_ns();
+    return;
+}
+
+static void format_bytes(double n, char *out) {
+    const char *units = "BKMGT";
+    size_t unit = 0;
+    while (n >= 1024 && unit < 4) {
+        n /= 1024;
+        ++unit;
+    }
+    snprintf(out, 16, unit ? "%.1f%c" : "%.0f%c", n, units[unit]);
+    return;
+}
+
+static void render_loops(MetricsSegment *ms, View *now, View *prev,
+        double seconds) {
+    printf("\n%4s %9s %7s %9s %9s", "HND", "WAKE/S", "EV/WAKE", "LOOP50US",
+            "LOOP99US");
+    for (size_t s = 0; s < STATS_N_SYSCALLS; ++s) {
+        printf(" %5s/REQ %6s", syscall_names[s], "EAGAIN");
+    }
+    printf("\n");
+
+    uint64_t delta[HISTOGRAM_LEN];
+    for (size_t i = 0; i < ms->n_handlers; ++i) {
+        StatsTotals *cur = &now->handlers[i].totals;
+        StatsTotals *old = &prev->handlers[i].totals;
+        for (size_t b = 0; b < HISTOGRAM_LEN; ++b) {
+            delta[b] = cur->loop_ns[b] - old->loop_ns[b];
+        }
+        uint64_t n_wakeups = histogram_count(delta);
+        uint64_t n_events = cur->n_events - old->n_events;
+        uint64_t n_requests = 0;
+        for (size_t t = 0; t < STATS_N_TYPES; t += 2) {
+            n_requests += cur->n_messages[t] - old->n_messages[t];
+        }
+
+        printf("%4zu %9.0f %7.1f %9.1f %9.1f", i,
+                n_wakeups / (seconds > 0 ? seconds : 1),
+                n_wakeups ? (double) n_events / n_wakeups : 0,
+                histogram_percentile(delta, 50000) / 1e3,
+                histogram_percentile(delta, 99000) / 1e3);
+        for (size_t s = 0; s < STATS_N_SYSCALLS; ++s) {
+            uint64_t n_calls = cur->n_syscalls[s] - old->n_syscalls[s];
+            uint64_t n_blocked = cur->n_would_block[s] - old->n_would_block[s];
+            printf(" %9.2f %5.1f%%",
+                    n_requests ? (double) n_calls / n_requests : 0,
+                    n_calls ? 100.0 * n_blocked / n_calls : 0);
+        }
+        printf("\n");
+    }
+    return;
+}
+
+static void render(MetricsSegment *ms, View *now, View *prev) {
+    double seconds = (double) (now->taken_ns - prev->taken_ns) / 1e9;
+
+    // segments of servers killed by a signal are left until the next start
+    bool exited = kill((pid_t) ms->pid, 0) < 0 && errno == ESRCH;
+    printf("jxserver pid %lu%s  %s  handlers %lu  awake %lu  parks %lu  "
+           "wakes %lu\n\n", (unsigned long) ms->pid, exited ? " (exited)" : "",
+            ms->name,
+            (unsigned long) ms->n_handlers,
+            (unsigned long) now->group.n_awake,
+            (unsigned long) now->group.n_parks,
+            (unsigned long) now->group.n_wakes);
+    printf("%4s %-7s %7s %6s %6s %9s %8s %8s %8s %8s\n", "HND", "STATE",
+            "CONNS", "MIGR", "BUSY%", "REQ/S", "RX/S", "TX/S", "BUDGET",
+            "AGE MS");
+
+    static uint64_t merged[STATS_N_TIMED_TYPES][STATS_N_MILESTONES]
+            [HISTOGRAM_LEN];
+    memset(merged, 0, sizeof(merged));
+    for (size_t i = 0; i < ms->n_handlers; ++i) {
+        MetricsHandlerSlot *cur = &now->handlers[i];
+        MetricsHandlerSlot *old = &prev->handlers[i];
+        uint64_t n_requests = 0;
+        uint64_t n_rx = 0;
+        uint64_t n_tx = 0;
+        // even types are requests, odd are responces
+        for (size_t t = 0; t < STATS_N_TYPES; ++t) {
+            uint64_t bytes = cur->totals.n_bytes[t] - old->totals.n_bytes[t];
+            if (t & 1) {
+                n_tx += bytes;
+            } else {
+                n_requests += cur->totals.n_messages[t] -
+                        old->totals.n_messages[t];
+                n_rx += bytes;
+            }
+        }
+        for (size_t t = 0; t < STATS_N_TIMED_TYPES; ++t) {
+            for (size_t m = 0; m < STATS_N_MILESTONES; ++m) {
+                for (size_t b = 0; b < HISTOGRAM_LEN; ++b) {
+                    merged[t][m][b] += cur->totals.latency[t][m][b] -
+                            old->totals.latency[t][m][b];
+                }
+            }
+        }
+
+        // busy share of the time between the slots publishes
+        uint64_t span = cur->published_ns - old->published_ns;
+        double busy = span && old->published_ns ?
+                100.0 * (cur->busy_ns - old->busy_ns) / span : 0;
+        double rate = seconds > 0 ? seconds : 1;
+        // idle handlers publish nothing new
+        uint64_t age_ms = (now->taken_ns - cur->published_ns) / 1000000;
+        char rx[16];
+        char tx[16];
+        char budget[16];
+        format_bytes(n_rx / rate, rx);
+        format_bytes(n_tx / rate, tx);
+        format_bytes(cur->n_budget_used, budget);
+        printf("%4zu %-7s %7lu %6lu %5.1f%% %9.0f %8s %8s %8s %8lu\n", i,
+                i < now->group.n_awake ? "awake" : "parked",
+                (unsigned long) cur->n_connections,
+                (unsigned long) cur->n_migrated, busy > 100 ? 100 : busy,
+                n_requests / rate, rx, tx, budget, (unsigned long) age_ms);
+    }
+
+    printf("\n%-9s %-8s %9s %11s %11s %11s\n", "TYPE", "AT", "COUNT",
+            "P50 US", "P99 US", "P99.9 US");
+    for (size_t t = 0; t < STATS_N_TIMED_TYPES; ++t) {
+        for (size_t m = 0; m < STATS_N_MILESTONES; ++m) {
+            uint64_t *buckets = merged[t][m];
+            uint64_t count = histogram_count(buckets);
+            if (!count) {
+                continue;
+            }
+            printf("%-9s %-8s %9lu %11.1f %11.1f %11.1f\n", type_names[t],
+                    milestone_names[m], (unsigned long) count,
+                    histogram_percentile(buckets, 50000) / 1e3,
+                    histogram_percentile(buckets, 99000) / 1e3,
+                    histogram_percentile(buckets, 99900) / 1e3);
+        }
+    }
+    render_loops(ms, now, prev, seconds);
+    return;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : getenv("JX_METRICS_SEGMENT");
+    if (!name || !*name) {
+        fprintf(stderr, "usage: %s [segment] [delay_ms] [iterations]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    long delay_ms = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_DELAY_MS;
+    long iterations = argc > 3 ? strtol(argv[3], NULL, 10) : 0;
+    delay_ms = delay_ms > 0 ? delay_ms : DEFAULT_DELAY_MS;
+
+    MetricsSegment *ms = open_metrics_segment(name);
+    if (!ms) {
+        fprintf(stderr, "unable to open metrics segment %s\n", name);
+        return EXIT_FAILURE;
+    }
+
+    View views[2];
+    size_t handlers_size = ms->n_handlers * sizeof(MetricsHandlerSlot);
+    for (size_t i = 0; i < 2; ++i) {
+        memset(&views[i], 0, sizeof(View));
+        // slots are cache line aligned, and so a multiple of it in size
+        views[i].handlers = aligned_alloc(STATS_CACHE_LINE, handlers_size);
+        if (!views[i].handlers) {
+            perror("aligned_alloc");
+            return EXIT_FAILURE;
+        }
+        memset(views[i].handlers, 0, handlers_size);
+    }
+
+    bool clear = isatty(STDOUT_FILENO);
+    struct timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000};
+    size_t cur = 0;
+    read_view(ms, &views[!cur]);
+    memcpy(views[cur].handlers, views[!cur].handlers, handlers_size);
+    for (long i = 0; !iterations || i < iterations; ++i) {
+        nanosleep(&delay, NULL);
+        read_view(ms, &views[cur]);
+        if (clear) {
+            printf("\033[H\033[2J");
+        }
+        render(ms, &views[cur], &views[!cur]);
+        printf("\n");
+        fflush(stdout);
+
+        // next view starts from this one, so unreadable slots keep values
+        memcpy(views[!cur].handlers, views[cur].handlers, handlers_size);
+        views[!cur].group = views[cur].group;
+        views[!cur].taken_ns = views[cur].taken_ns;
+        cur = !cur;
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        free(views[i].handlers);
+    }
+    close_metrics_segment(ms);
+    return EXIT_SUCCESS;
+}